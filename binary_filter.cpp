@@ -0,0 +1,347 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+#include <errno.h>
+#include <string>
+#include <vector>
+#include "binary_filter.hpp"
+#include "mvt.hpp"
+#include "protozero/varint.hpp"
+#include "protozero/pbf_reader.hpp"
+#include "protozero/pbf_writer.hpp"
+
+bool filter_reader::next(std::string &message) {
+	while (1) {
+		// Is there a complete length and record in the buffer?
+		unsigned long long len = 0;
+		size_t i;
+		int shift = 0;
+		bool have_len = false;
+
+		for (i = off; i < buf.size() && shift < 64; i++) {
+			len |= (unsigned long long) (buf[i] & 0x7F) << shift;
+			shift += 7;
+			if ((buf[i] & 0x80) == 0) {
+				have_len = true;
+				i++;
+				break;
+			}
+		}
+
+		if (shift >= 64 && !have_len) {
+			fprintf(stderr, "Filter output: record length is too long\n");
+			exit(EXIT_FAILURE);
+		}
+
+		if (have_len && buf.size() - i >= len) {
+			message.assign(buf, i, len);
+			off = i + len;
+			return true;
+		}
+
+		// If not, read some more
+		if (off > 0) {
+			buf.erase(0, off);
+			off = 0;
+		}
+
+		char tmp[65536];
+		ssize_t n;
+		while ((n = read(fd, tmp, sizeof(tmp))) < 0 && errno == EINTR) {
+		}
+		if (n < 0) {
+			perror("read from filter");
+			exit(EXIT_FAILURE);
+		}
+		if (n == 0) {
+			if (buf.size() != 0) {
+				fprintf(stderr, "Filter output: incomplete record at end of input\n");
+				exit(EXIT_FAILURE);
+			}
+			return false;
+		}
+
+		buf.append(tmp, n);
+	}
+}
+
+// The stringified form of a value that the rest of Tippecanoe uses
+serial_val mvt_value_to_serial_val(mvt_value const &v) {
+	serial_val sv;
+
+	if (v.type == mvt_string) {
+		sv.type = mvt_string;
+		sv.s = v.string_value;
+	} else if (v.type == mvt_bool) {
+		sv.type = mvt_bool;
+		sv.s = v.numeric_value.bool_value ? "true" : "false";
+	} else if (v.type == mvt_null) {
+		sv.type = mvt_null;
+		sv.s = "null";
+	} else {
+		sv.type = mvt_double;
+		sv.s = mvt_value(v).toString();
+	}
+
+	return sv;
+}
+
+static void write_value(protozero::pbf_writer &writer, serial_val const &sv) {
+	std::string value_string;
+	protozero::pbf_writer value_writer(value_string);
+
+	if (sv.type == mvt_string) {
+		value_writer.add_string(1, sv.s);
+	} else if (sv.type == mvt_bool) {
+		value_writer.add_bool(7, sv.s == "true");
+	} else {
+		mvt_value v = stringified_to_mvt_value(sv.type, sv.s.c_str());
+
+		if (v.type == mvt_float) {
+			value_writer.add_float(2, v.numeric_value.float_value);
+		} else if (v.type == mvt_double) {
+			value_writer.add_double(3, v.numeric_value.double_value);
+		} else if (v.type == mvt_int) {
+			value_writer.add_int64(4, v.numeric_value.int_value);
+		} else if (v.type == mvt_uint) {
+			value_writer.add_uint64(5, v.numeric_value.uint_value);
+		} else if (v.type == mvt_sint) {
+			value_writer.add_sint64(6, v.numeric_value.sint_value);
+		} else {
+			value_writer.add_string(1, sv.s);
+		}
+	}
+
+	writer.add_message(6, value_string);
+}
+
+static serial_val read_value(protozero::pbf_reader value_reader) {
+	mvt_value v;
+	v.type = mvt_null;
+
+	while (value_reader.next()) {
+		switch (value_reader.tag()) {
+		case 1: /* string */
+			v.type = mvt_string;
+			v.string_value = value_reader.get_string();
+			break;
+
+		case 2: /* float */
+			v.type = mvt_float;
+			v.numeric_value.float_value = value_reader.get_float();
+			break;
+
+		case 3: /* double */
+			v.type = mvt_double;
+			v.numeric_value.double_value = value_reader.get_double();
+			break;
+
+		case 4: /* int */
+			v.type = mvt_int;
+			v.numeric_value.int_value = value_reader.get_int64();
+			break;
+
+		case 5: /* uint */
+			v.type = mvt_uint;
+			v.numeric_value.uint_value = value_reader.get_uint64();
+			break;
+
+		case 6: /* sint */
+			v.type = mvt_sint;
+			v.numeric_value.sint_value = value_reader.get_sint64();
+			break;
+
+		case 7: /* bool */
+			v.type = mvt_bool;
+			v.numeric_value.bool_value = value_reader.get_bool();
+			break;
+
+		default:
+			value_reader.skip();
+			break;
+		}
+	}
+
+	return mvt_value_to_serial_val(v);
+}
+
+std::string encode_filter_feature(filter_feature const &ff) {
+	std::string message;
+	protozero::pbf_writer writer(message);
+
+	if (ff.marker != 0) {
+		unsigned zxy[3] = {ff.z, ff.x, ff.y};
+		writer.add_packed_uint32(ff.marker == FILTER_TILE_START ? 15 : 16, zxy, zxy + 3);
+		return message;
+	}
+
+	writer.add_string(1, ff.layer);
+	writer.add_uint32(2, ff.type);
+	if (ff.has_id) {
+		writer.add_uint64(3, ff.id);
+	}
+
+	// ClosePath becomes an explicit LineTo back to the start of the ring
+	std::vector<long long> geometry;
+	long long px = 0, py = 0;
+	long long startx = 0, starty = 0;
+	for (size_t i = 0; i < ff.geometry.size(); i++) {
+		long long x = ff.geometry[i].x, y = ff.geometry[i].y;
+		int op = ff.geometry[i].op;
+
+		if (op == VT_MOVETO) {
+			startx = x;
+			starty = y;
+		} else if (op == VT_CLOSEPATH) {
+			op = VT_LINETO;
+			x = startx;
+			y = starty;
+		} else if (op != VT_LINETO) {
+			continue;
+		}
+
+		geometry.push_back(op);
+		geometry.push_back(x - px);
+		geometry.push_back(y - py);
+		px = x;
+		py = y;
+	}
+	writer.add_packed_sint64(4, geometry.begin(), geometry.end());
+
+	for (size_t i = 0; i < ff.keys.size(); i++) {
+		writer.add_string(5, ff.keys[i]);
+	}
+	for (size_t i = 0; i < ff.values.size(); i++) {
+		write_value(writer, ff.values[i]);
+	}
+
+	if (ff.index != 0) {
+		writer.add_uint64(7, ff.index);
+	}
+	if (ff.sequence != 0) {
+		writer.add_sint64(8, ff.sequence);
+	}
+	if (ff.extent != 0) {
+		writer.add_sint64(9, ff.extent);
+	}
+	if (ff.dropped) {
+		writer.add_bool(10, true);
+	}
+
+	return message;
+}
+
+void decode_filter_feature(std::string const &message, filter_feature &ff) {
+	ff = filter_feature();
+
+	try {
+		protozero::pbf_reader reader(message);
+
+		while (reader.next()) {
+			switch (reader.tag()) {
+			case 1: /* layer */
+				ff.layer = reader.get_string();
+				break;
+
+			case 2: /* type */
+				ff.type = reader.get_uint32();
+				break;
+
+			case 3: /* id */
+				ff.id = reader.get_uint64();
+				ff.has_id = true;
+				break;
+
+			case 4: /* geometry */
+			{
+				auto pi = reader.get_packed_sint64();
+				std::vector<long long> geometry(pi.first, pi.second);
+				long long px = 0, py = 0;
+
+				for (size_t i = 0; i + 2 < geometry.size(); i += 3) {
+					px += geometry[i + 1];
+					py += geometry[i + 2];
+					ff.geometry.push_back(draw(geometry[i] == VT_MOVETO ? VT_MOVETO : VT_LINETO, px, py));
+				}
+				break;
+			}
+
+			case 5: /* key */
+				ff.keys.push_back(reader.get_string());
+				break;
+
+			case 6: /* value */
+				ff.values.push_back(read_value(reader.get_message()));
+				break;
+
+			case 7: /* index */
+				ff.index = reader.get_uint64();
+				break;
+
+			case 8: /* sequence */
+				ff.sequence = reader.get_sint64();
+				break;
+
+			case 9: /* extent */
+				ff.extent = reader.get_sint64();
+				break;
+
+			case 10: /* dropped */
+				ff.dropped = reader.get_bool();
+				break;
+
+			case 15: /* tile start */
+			case 16: /* tile end */
+			{
+				ff.marker = reader.tag() == 15 ? FILTER_TILE_START : FILTER_TILE_END;
+				auto pi = reader.get_packed_uint32();
+				std::vector<unsigned> zxy(pi.first, pi.second);
+				if (zxy.size() != 3) {
+					fprintf(stderr, "Filter output: tile marker does not have a zoom, x, and y\n");
+					exit(EXIT_FAILURE);
+				}
+				ff.z = zxy[0];
+				ff.x = zxy[1];
+				ff.y = zxy[2];
+				break;
+			}
+
+			default:
+				reader.skip();
+				break;
+			}
+		}
+	} catch (protozero::exception const &e) {
+		fprintf(stderr, "Filter output: malformed feature: %s\n", e.what());
+		exit(EXIT_FAILURE);
+	}
+
+	if (ff.keys.size() != ff.values.size()) {
+		fprintf(stderr, "Filter output: feature has %zu keys but %zu values\n", ff.keys.size(), ff.values.size());
+		exit(EXIT_FAILURE);
+	}
+}
+
+void write_filter_feature(FILE *fp, filter_feature const &ff) {
+	std::string message = encode_filter_feature(ff);
+
+	char len[protozero::max_varint_length];
+	int n = protozero::write_varint(len, message.size());
+
+	if (fwrite(len, 1, n, fp) != (size_t) n ||
+	    fwrite(message.c_str(), 1, message.size(), fp) != message.size()) {
+		// A filter that stops reading early is only warned about, as with GeoJSON
+		if (errno == EPIPE) {
+			static bool warned = false;
+			if (!warned) {
+				fprintf(stderr, "Warning: broken pipe in filter\n");
+				warned = true;
+			}
+			return;
+		}
+
+		fprintf(stderr, "Write of filter feature failed: %s\n", strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
@@ -0,0 +1,70 @@
+#ifndef BINARY_FILTER_HPP
+#define BINARY_FILTER_HPP
+
+#include <stdio.h>
+#include <string>
+#include <vector>
+#include "geometry.hpp"
+#include "serial.hpp"
+#include "mvt.hpp"
+
+// Record markers that bracket each tile for --persistent-filters
+#define FILTER_TILE_START 1
+#define FILTER_TILE_END 2
+
+// One feature as exchanged with a filter under --binary-filters.
+// The wire format is a series of records, each a varint length followed
+// by a protocol buffer message with these fields:
+//
+//	1: layer (string)
+//	2: type (uint32: 1 point, 2 linestring, 3 polygon)
+//	3: id (uint64)
+//	4: geometry (packed sint64: command, dx, dy, with 1 MoveTo and 2 LineTo,
+//	   in world coordinates, each point relative to the one before)
+//	5: keys (repeated string)
+//	6: values (repeated message, the same as a vector tile Value)
+//	7: index (uint64), 8: sequence (sint64), 9: extent (sint64), 10: dropped (bool)
+//	15: tile start, 16: tile end (packed uint32: z, x, y)
+struct filter_feature {
+	std::string layer = "";
+	int type = 0;
+	bool has_id = false;
+	unsigned long long id = 0;
+	drawvec geometry{};
+
+	std::vector<std::string> keys{};
+	std::vector<serial_val> values{};
+
+	unsigned long long index = 0;
+	long long sequence = 0;
+	long long extent = 0;
+	bool dropped = false;
+
+	// If nonzero, this record is a tile marker rather than a feature
+	int marker = 0;
+	unsigned z = 0;
+	unsigned x = 0;
+	unsigned y = 0;
+};
+
+// Reads length-delimited records from a pipe, returning each as soon as
+// it is complete rather than waiting for a full buffer
+struct filter_reader {
+	int fd = -1;
+	std::string buf = "";
+	size_t off = 0;
+
+	filter_reader(int f)
+	    : fd(f) {
+	}
+
+	// Returns false at the end of the input
+	bool next(std::string &message);
+};
+
+std::string encode_filter_feature(filter_feature const &ff);
+void decode_filter_feature(std::string const &message, filter_feature &ff);
+void write_filter_feature(FILE *fp, filter_feature const &ff);
+serial_val mvt_value_to_serial_val(mvt_value const &v);
+
+#endif
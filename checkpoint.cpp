@@ -0,0 +1,394 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <dirent.h>
+#include <sys/stat.h>
+#include <string>
+#include <vector>
+#include <map>
+#include "checkpoint.hpp"
+#include "store.hpp"
+#include "write_json.hpp"
+#include "jsonpull/jsonpull.h"
+
+#define CHECKPOINT_VERSION 1
+
+static void remove_dir(std::string const &dir) {
+	DIR *d = opendir(dir.c_str());
+	if (d == NULL) {
+		if (errno == ENOENT) {
+			return;
+		}
+		perror(dir.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	struct dirent *dp;
+	while ((dp = readdir(d)) != NULL) {
+		if (strcmp(dp->d_name, ".") == 0 || strcmp(dp->d_name, "..") == 0) {
+			continue;
+		}
+
+		std::string fname = dir + "/" + dp->d_name;
+		if (unlink(fname.c_str()) != 0) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	closedir(d);
+	if (rmdir(dir.c_str()) != 0) {
+		perror(dir.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Make a file's contents, or a directory's entries, reach the disk
+static void sync_path(std::string const &path) {
+	int fd = open(path.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(path.c_str());
+		exit(EXIT_FAILURE);
+	}
+	if (fsync(fd) != 0) {
+		perror(path.c_str());
+		exit(EXIT_FAILURE);
+	}
+	if (close(fd) != 0) {
+		perror(path.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void remove_file(std::string const &fname) {
+	if (unlink(fname.c_str()) != 0 && errno != ENOENT) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+// The state goes first, so that nothing can be resumed from what is left
+// if this is interrupted too
+static void clear(std::string const &dir) {
+	remove_file(dir + "/state.json");
+
+	DIR *d = opendir(dir.c_str());
+	if (d == NULL) {
+		perror(dir.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	std::vector<std::string> passes;
+	struct dirent *dp;
+	while ((dp = readdir(d)) != NULL) {
+		if (strncmp(dp->d_name, "pass", 4) == 0) {
+			passes.push_back(dir + "/" + dp->d_name);
+		}
+	}
+	closedir(d);
+
+	for (auto const &pass : passes) {
+		remove_dir(pass);
+	}
+
+	remove_file(dir + "/meta");
+	remove_file(dir + "/pool");
+}
+
+void checkpoint_start(checkpoint const &ck, char *meta, long long metasize, char *stringpool, long long poolsize) {
+	if (mkdir(ck.dir.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) != 0 && errno != EEXIST) {
+		perror(ck.dir.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	clear(ck.dir);
+	store_write(ck.dir.c_str(), "meta", meta, metasize);
+	store_write(ck.dir.c_str(), "pool", stringpool, poolsize);
+	sync_path(ck.dir + "/meta");
+	sync_path(ck.dir + "/pool");
+}
+
+static std::string pass_dir(checkpoint const &ck, size_t pass) {
+	return ck.dir + "/pass" + std::to_string(pass);
+}
+
+std::string checkpoint_shard(checkpoint const &ck, size_t pass, size_t shard) {
+	return pass_dir(ck, pass) + "/" + std::to_string(shard);
+}
+
+void checkpoint_begin_pass(checkpoint const &ck, size_t pass) {
+	std::string dir = pass_dir(ck, pass);
+	if (mkdir(dir.c_str(), S_IRWXU | S_IRWXG | S_IRWXO) != 0 && errno != EEXIST) {
+		perror(dir.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+static void write_offsets(json_writer &state, std::vector<long long> const &offsets) {
+	state.json_write_array();
+	for (auto off : offsets) {
+		state.json_write_signed(off);
+	}
+	state.json_end_array();
+}
+
+static void write_initial(json_writer &state, std::vector<unsigned> const &initial) {
+	state.json_write_array();
+	for (auto i : initial) {
+		state.json_write_unsigned(i);
+	}
+	state.json_end_array();
+}
+
+void checkpoint_write(checkpoint const &ck) {
+	std::string fname = ck.dir + "/state.json";
+	std::string tmpname = fname + ".tmp";
+
+	FILE *f = fopen(tmpname.c_str(), "w");
+	if (f == NULL) {
+		perror(tmpname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	{
+		json_writer state(f);
+
+		state.json_write_hash();
+
+		state.json_write_string("version");
+		state.json_write_signed(CHECKPOINT_VERSION);
+		state.json_write_string("minzoom");
+		state.json_write_signed(ck.minzoom);
+		state.json_write_string("maxzoom");
+		state.json_write_signed(ck.maxzoom);
+		state.json_write_string("full_detail");
+		state.json_write_signed(ck.full_detail);
+		state.json_write_string("low_detail");
+		state.json_write_signed(ck.low_detail);
+		state.json_write_string("min_detail");
+		state.json_write_signed(ck.min_detail);
+		state.json_write_string("geometry_scale");
+		state.json_write_signed(ck.geometry_scale);
+		state.json_write_string("buffer");
+		state.json_write_signed(ck.buffer);
+		state.json_write_string("gamma");
+		state.json_write_number(ck.gamma);
+		state.json_write_string("midx");
+		state.json_write_unsigned(ck.midx);
+		state.json_write_string("midy");
+		state.json_write_unsigned(ck.midy);
+		state.json_write_string("shards");
+		state.json_write_unsigned(ck.shards);
+		state.json_write_string("commandline");
+		state.json_write_string(ck.commandline);
+
+		state.json_write_string("file_bbox");
+		state.json_write_array();
+		for (size_t i = 0; i < 4; i++) {
+			state.json_write_signed(ck.file_bbox[i]);
+		}
+		state.json_end_array();
+
+		state.json_write_newline();
+		state.json_write_string("initial_x");
+		write_initial(state, ck.initial_x);
+		state.json_write_string("initial_y");
+		write_initial(state, ck.initial_y);
+		state.json_write_string("meta_off");
+		write_offsets(state, ck.meta_off);
+		state.json_write_string("pool_off");
+		write_offsets(state, ck.pool_off);
+
+		state.json_write_newline();
+		state.json_write_string("zooms");
+		state.json_write_array();
+		for (auto const &zs : ck.zooms) {
+			state.json_write_newline();
+			state.json_write_hash();
+			state.json_write_string("z");
+			state.json_write_signed(zs.z);
+			state.json_write_string("maxzoom");
+			state.json_write_signed(zs.maxzoom);
+			state.json_write_string("child_shards");
+			state.json_write_unsigned(zs.child_shards);
+			state.json_write_string("gamma");
+			state.json_write_number(zs.gamma);
+			state.json_write_string("mingap");
+			state.json_write_unsigned(zs.mingap);
+			state.json_write_string("minextent");
+			state.json_write_signed(zs.minextent);
+			state.json_write_string("fraction");
+			state.json_write_number(zs.fraction);
+			state.json_end_hash();
+		}
+		state.json_end_array();
+
+		state.json_write_newline();
+		state.json_write_string("layermaps");
+		state.json_write_array();
+		for (auto const &layermap : ck.layermaps) {
+			state.json_write_newline();
+			write_layermap(state, layermap);
+		}
+		state.json_end_array();
+
+		state.json_write_newline();
+		state.json_end_hash();
+		state.json_write_newline();
+	}
+
+	if (fflush(f) != 0 || fsync(fileno(f)) != 0) {
+		perror(tmpname.c_str());
+		exit(EXIT_FAILURE);
+	}
+	if (fclose(f) != 0) {
+		perror(tmpname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	// The shards have to reach the disk before the state that says
+	// they are there
+	for (size_t j = 0; j < ck.shards; j++) {
+		sync_path(checkpoint_shard(ck, ck.zooms.size(), j));
+	}
+	sync_path(pass_dir(ck, ck.zooms.size()));
+	sync_path(ck.dir);
+
+	if (rename(tmpname.c_str(), fname.c_str()) != 0) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	// And the new state has to replace the old one before the old
+	// shards are gone
+	sync_path(ck.dir);
+
+	if (ck.zooms.size() > 0) {
+		remove_dir(pass_dir(ck, ck.zooms.size() - 1));
+	}
+}
+
+static json_object *get(std::string const &fname, json_object *o, const char *key, json_type type) {
+	json_object *v = json_hash_get(o, key);
+	if (v == NULL || v->type != type) {
+		fprintf(stderr, "%s: missing or malformed \"%s\"\n", fname.c_str(), key);
+		exit(EXIT_FAILURE);
+	}
+	return v;
+}
+
+// Numbers are read from their text so that 64-bit values come through exactly
+static long long get_signed(std::string const &fname, json_object *o, const char *key) {
+	return strtoll(get(fname, o, key, JSON_NUMBER)->string, NULL, 10);
+}
+
+static unsigned long long get_unsigned(std::string const &fname, json_object *o, const char *key) {
+	return strtoull(get(fname, o, key, JSON_NUMBER)->string, NULL, 10);
+}
+
+static double get_double(std::string const &fname, json_object *o, const char *key) {
+	return strtod(get(fname, o, key, JSON_NUMBER)->string, NULL);
+}
+
+bool checkpoint_read(const char *dir, checkpoint &ck) {
+	std::string fname = std::string(dir) + "/state.json";
+	FILE *f = fopen(fname.c_str(), "r");
+	if (f == NULL) {
+		if (errno == ENOENT) {
+			return false;
+		}
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	json_pull *jp = json_begin_file(f);
+	json_object *o = json_read_tree(jp);
+	if (o == NULL || o->type != JSON_HASH) {
+		fprintf(stderr, "%s: checkpoint state parsing error: %s\n", fname.c_str(), jp->error != NULL ? jp->error : "not a JSON object");
+		exit(EXIT_FAILURE);
+	}
+
+	if (get_signed(fname, o, "version") != CHECKPOINT_VERSION) {
+		fprintf(stderr, "%s: checkpoint is version %lld, not %d\n", fname.c_str(), get_signed(fname, o, "version"), CHECKPOINT_VERSION);
+		exit(EXIT_FAILURE);
+	}
+
+	ck.dir = dir;
+	ck.minzoom = get_signed(fname, o, "minzoom");
+	ck.maxzoom = get_signed(fname, o, "maxzoom");
+	ck.full_detail = get_signed(fname, o, "full_detail");
+	ck.low_detail = get_signed(fname, o, "low_detail");
+	ck.min_detail = get_signed(fname, o, "min_detail");
+	ck.geometry_scale = get_signed(fname, o, "geometry_scale");
+	ck.buffer = get_signed(fname, o, "buffer");
+	ck.gamma = get_double(fname, o, "gamma");
+	ck.midx = get_unsigned(fname, o, "midx");
+	ck.midy = get_unsigned(fname, o, "midy");
+	ck.shards = get_unsigned(fname, o, "shards");
+	ck.commandline = get(fname, o, "commandline", JSON_STRING)->string;
+
+	json_object *bbox = get(fname, o, "file_bbox", JSON_ARRAY);
+	if (bbox->length != 4) {
+		fprintf(stderr, "%s: malformed \"file_bbox\"\n", fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < 4; i++) {
+		ck.file_bbox[i] = strtoll(bbox->array[i]->string, NULL, 10);
+	}
+
+	json_object *initial_x = get(fname, o, "initial_x", JSON_ARRAY);
+	json_object *initial_y = get(fname, o, "initial_y", JSON_ARRAY);
+	json_object *meta_off = get(fname, o, "meta_off", JSON_ARRAY);
+	json_object *pool_off = get(fname, o, "pool_off", JSON_ARRAY);
+	if (initial_y->length != initial_x->length || meta_off->length != initial_x->length || pool_off->length != initial_x->length) {
+		fprintf(stderr, "%s: segment counts do not match\n", fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < initial_x->length; i++) {
+		ck.initial_x.push_back(strtoul(initial_x->array[i]->string, NULL, 10));
+		ck.initial_y.push_back(strtoul(initial_y->array[i]->string, NULL, 10));
+		ck.meta_off.push_back(strtoll(meta_off->array[i]->string, NULL, 10));
+		ck.pool_off.push_back(strtoll(pool_off->array[i]->string, NULL, 10));
+	}
+
+	json_object *zooms = get(fname, o, "zooms", JSON_ARRAY);
+	for (size_t i = 0; i < zooms->length; i++) {
+		json_object *zo = zooms->array[i];
+		zoom_state zs;
+
+		zs.z = get_signed(fname, zo, "z");
+		zs.maxzoom = get_signed(fname, zo, "maxzoom");
+		zs.child_shards = get_unsigned(fname, zo, "child_shards");
+		zs.gamma = get_double(fname, zo, "gamma");
+		zs.mingap = get_unsigned(fname, zo, "mingap");
+		zs.minextent = get_signed(fname, zo, "minextent");
+		zs.fraction = get_double(fname, zo, "fraction");
+
+		ck.zooms.push_back(zs);
+	}
+
+	json_object *layermaps = get(fname, o, "layermaps", JSON_ARRAY);
+	for (size_t i = 0; i < layermaps->length; i++) {
+		ck.layermaps.push_back(read_layermap(fname, layermaps->array[i]));
+	}
+
+	json_end(jp);
+	if (fclose(f) != 0) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	return true;
+}
+
+void checkpoint_remove(checkpoint const &ck) {
+	clear(ck.dir);
+
+	// Unless something else has been put there too
+	if (rmdir(ck.dir.c_str()) != 0 && errno != ENOTEMPTY && errno != EEXIST) {
+		perror(ck.dir.c_str());
+	}
+}
@@ -0,0 +1,63 @@
+#ifndef CHECKPOINT_HPP
+#define CHECKPOINT_HPP
+
+#include <map>
+#include <string>
+#include <vector>
+#include "mbtiles.hpp"
+#include "tile.hpp"
+
+// A checkpoint, written by --checkpoint, keeps what a tiling run needs to
+// carry on from the last zoom level that it finished: the attribute
+// metadata and string pool, the features that traverse_zooms() sharded for
+// the next zoom level, and the state of the run up to then.
+
+struct checkpoint {
+	std::string dir = "";
+
+	// How tiling was started, which does not change along the way
+	int minzoom = 0;
+	int full_detail = 0;
+	int low_detail = 0;
+	int min_detail = 0;
+	int geometry_scale = 0;
+	int buffer = 0;
+	double gamma = 0;
+	long long file_bbox[4] = {0, 0, 0, 0};
+	std::string commandline = "";
+
+	// For each segment
+	std::vector<unsigned> initial_x{};
+	std::vector<unsigned> initial_y{};
+	std::vector<long long> meta_off{};
+	std::vector<long long> pool_off{};
+
+	// How far it has gotten
+	int maxzoom = 0;  // which --extend-zooms-if-still-dropping may have raised
+	unsigned midx = 0;
+	unsigned midy = 0;
+	size_t shards = 0;
+	std::vector<zoom_state> zooms{};  // one for each pass that has finished
+	std::vector<std::map<std::string, layermap_entry>> layermaps{};
+};
+
+// Remove any earlier checkpoint in ck.dir, and write the metadata and
+// string pool that the new one will use
+void checkpoint_start(checkpoint const &ck, char *meta, long long metasize, char *stringpool, long long poolsize);
+
+// Where to put one shard of the features that come out of the pass
+// that finishes with ck.zooms.size() == pass
+std::string checkpoint_shard(checkpoint const &ck, size_t pass, size_t shard);
+void checkpoint_begin_pass(checkpoint const &ck, size_t pass);
+
+// Record that the pass that ck.zooms ends with is done, and remove the
+// shards that it started from
+void checkpoint_write(checkpoint const &ck);
+
+// Returns false if there is nothing in dir to resume from
+bool checkpoint_read(const char *dir, checkpoint &ck);
+
+// Once the tileset is finished
+void checkpoint_remove(checkpoint const &ck);
+
+#endif
@@ -1,5 +1,11 @@
+#include <string.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
 #include "csv.hpp"
 #include "text.hpp"
+#include "mvt.hpp"
 
 std::vector<std::string> csv_split(const char *s) {
 	std::vector<std::string> ret;
@@ -64,13 +70,199 @@ std::string csv_getline(FILE *f) {
 	return out;
 }
 
-void readcsv(const char *fn, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping) {
+static unsigned long long csv_hash(const char *s) {
+	// FNV-1a
+	unsigned long long h = 14695981039346656037ULL;
+
+	for (; *s != '\0'; s++) {
+		h ^= (unsigned char) *s;
+		h *= 1099511628211ULL;
+	}
+
+	return h;
+}
+
+csv_join::~csv_join() {
+	if (map != NULL) {
+		if (munmap(map, map_len) != 0) {
+			perror("munmap csv cache");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+const char *csv_join::find(std::string const &key) const {
+	if (slots == 0) {
+		return NULL;
+	}
+
+	for (size_t i = csv_hash(key.c_str()) & (slots - 1); table[i] != 0; i = (i + 1) & (slots - 1)) {
+		const char *row = rows + table[i] - 1;
+
+		if (strcmp(row, key.c_str()) == 0) {
+			return row + strlen(row) + 1;
+		}
+	}
+
+	return NULL;
+}
+
+bool csv_join_column(const char *&row, int &type, const char *&value) {
+	if (*row == CSV_JOIN_END) {
+		return false;
+	}
+
+	type = *row;
+	value = row + 1;
+	row = value + strlen(value) + 1;
+	return true;
+}
+
+// The start of a cached csv_join, which is followed by the hash table,
+// the null-terminated column names, and the rows
+struct csv_cache_header {
+	char magic[8];
+	long long csv_size;  // to tell whether the CSV has changed since
+	long long csv_mtime;
+	long long csv_mtime_nsec;
+	unsigned long long slots;
+	unsigned long long header_len;
+	unsigned long long rows_len;
+};
+
+#define CSV_CACHE_MAGIC "tcsvjn2"
+
+// The fractional part of the CSV's modification time, so that a CSV that
+// is rewritten within the same second is not matched with a stale cache
+static long long mtime_nsec(struct stat const &st) {
+#ifdef __APPLE__
+	return st.st_mtimespec.tv_nsec;
+#else
+	return st.st_mtim.tv_nsec;
+#endif
+}
+
+static csv_join *read_csv_cache(const char *cache, struct stat const &csv_st) {
+	int fd = open(cache, O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		return NULL;
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		perror(cache);
+		exit(EXIT_FAILURE);
+	}
+
+	if ((size_t) st.st_size < sizeof(struct csv_cache_header)) {
+		close(fd);
+		return NULL;
+	}
+
+	void *map = mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror(cache);
+		exit(EXIT_FAILURE);
+	}
+	if (close(fd) != 0) {
+		perror("close");
+		exit(EXIT_FAILURE);
+	}
+
+	struct csv_cache_header const *h = (struct csv_cache_header const *) map;
+	if (memcmp(h->magic, CSV_CACHE_MAGIC, sizeof(h->magic)) != 0 ||
+	    h->csv_size != (long long) csv_st.st_size ||
+	    h->csv_mtime != (long long) csv_st.st_mtime ||
+	    h->csv_mtime_nsec != mtime_nsec(csv_st) ||
+	    sizeof(struct csv_cache_header) + h->slots * sizeof(unsigned long long) + h->header_len + h->rows_len != (size_t) st.st_size) {
+		munmap(map, st.st_size);
+		return NULL;
+	}
+
+	csv_join *cj = new csv_join;
+	cj->map = map;
+	cj->map_len = st.st_size;
+	cj->slots = h->slots;
+	cj->table = (const unsigned long long *) ((const char *) map + sizeof(struct csv_cache_header));
+
+	const char *names = (const char *) (cj->table + cj->slots);
+	for (const char *cp = names; cp < names + h->header_len; cp += strlen(cp) + 1) {
+		cj->header.push_back(cp);
+	}
+
+	cj->rows = names + h->header_len;
+	madvise(map, st.st_size, MADV_RANDOM);
+	return cj;
+}
+
+static void write_csv_cache(const char *cache, csv_join const *cj, struct stat const &csv_st) {
+	std::string names;
+	for (auto const &name : cj->header) {
+		names.append(name);
+		names.push_back('\0');
+	}
+
+	struct csv_cache_header h;
+	memset(&h, 0, sizeof(h));
+	memcpy(h.magic, CSV_CACHE_MAGIC, sizeof(h.magic));
+	h.csv_size = csv_st.st_size;
+	h.csv_mtime = csv_st.st_mtime;
+	h.csv_mtime_nsec = mtime_nsec(csv_st);
+	h.slots = cj->slots;
+	h.header_len = names.size();
+	h.rows_len = cj->row_storage.size();
+
+	// Written under another name first, so that no other run
+	// can map a cache that is only partly written
+	std::string tmp = std::string(cache) + ".tmp." + std::to_string(getpid());
+	FILE *f = fopen(tmp.c_str(), "wb");
+	if (f == NULL) {
+		perror(tmp.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	if (fwrite(&h, sizeof(h), 1, f) != 1 ||
+	    fwrite(cj->table, sizeof(unsigned long long), cj->slots, f) != cj->slots ||
+	    fwrite(names.c_str(), 1, names.size(), f) != names.size() ||
+	    fwrite(cj->rows, 1, cj->row_storage.size(), f) != cj->row_storage.size()) {
+		perror(tmp.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	if (fclose(f) != 0) {
+		perror(tmp.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	if (rename(tmp.c_str(), cache) != 0) {
+		perror(cache);
+		exit(EXIT_FAILURE);
+	}
+}
+
+csv_join *read_csv_join(const char *fn, const char *cache) {
+	struct stat csv_st;
+	if (stat(fn, &csv_st) != 0) {
+		perror(fn);
+		exit(EXIT_FAILURE);
+	}
+
+	if (cache != NULL) {
+		csv_join *cj = read_csv_cache(cache, csv_st);
+		if (cj != NULL) {
+			return cj;
+		}
+	}
+
 	FILE *f = fopen(fn, "r");
 	if (f == NULL) {
 		perror(fn);
 		exit(EXIT_FAILURE);
 	}
 
+	csv_join *cj = new csv_join;
+	std::vector<unsigned long long> offsets;
+
 	std::string s;
 	if ((s = csv_getline(f)).size() > 0) {
 		std::string err = check_utf8(s);
@@ -79,10 +271,10 @@ void readcsv(const char *fn, std::vector<std::string> &header, std::map<std::str
 			exit(EXIT_FAILURE);
 		}
 
-		header = csv_split(s.c_str());
+		cj->header = csv_split(s.c_str());
 
-		for (size_t i = 0; i < header.size(); i++) {
-			header[i] = csv_dequote(header[i]);
+		for (size_t i = 0; i < cj->header.size(); i++) {
+			cj->header[i] = csv_dequote(cj->header[i]);
 		}
 	}
 	while ((s = csv_getline(f)).size() > 0) {
@@ -93,20 +285,74 @@ void readcsv(const char *fn, std::vector<std::string> &header, std::map<std::str
 		}
 
 		std::vector<std::string> line = csv_split(s.c_str());
-		if (line.size() > 0) {
-			line[0] = csv_dequote(line[0]);
+		if (line.size() == 0 || cj->header.size() == 0) {
+			continue;
 		}
 
-		for (size_t i = 0; i < line.size() && i < header.size(); i++) {
-			// printf("putting %s\n", line[0].c_str());
-			mapping.insert(std::pair<std::string, std::vector<std::string>>(line[0], line));
+		offsets.push_back(cj->row_storage.size());
+
+		std::string key = csv_dequote(line[0]);
+		cj->row_storage.append(key);
+		cj->row_storage.push_back('\0');
+
+		// Work out the types now rather than for each feature that matches
+		for (size_t i = 1; i < line.size() && i < cj->header.size(); i++) {
+			std::string &val = line[i];
+			char type = mvt_string;
+
+			if (val.size() > 0) {
+				if (val[0] == '"') {
+					val = csv_dequote(val);
+				} else if (is_number(val)) {
+					type = mvt_double;
+				}
+			} else {
+				type = mvt_null;
+			}
+
+			cj->row_storage.push_back(type);
+			cj->row_storage.append(val);
+			cj->row_storage.push_back('\0');
 		}
+
+		cj->row_storage.push_back(CSV_JOIN_END);
 	}
 
 	if (fclose(f) != 0) {
 		perror("fclose");
 		exit(EXIT_FAILURE);
 	}
+
+	// Keep the table at most half full so probe sequences stay short
+	cj->slots = 1;
+	while (cj->slots < offsets.size() * 2) {
+		cj->slots *= 2;
+	}
+	cj->table_storage.resize(cj->slots, 0);
+	cj->rows = cj->row_storage.c_str();
+
+	for (size_t r = 0; r < offsets.size(); r++) {
+		const char *key = cj->rows + offsets[r];
+		size_t i;
+
+		for (i = csv_hash(key) & (cj->slots - 1); cj->table_storage[i] != 0; i = (i + 1) & (cj->slots - 1)) {
+			if (strcmp(cj->rows + cj->table_storage[i] - 1, key) == 0) {
+				break;  // the first row with each key wins
+			}
+		}
+
+		if (cj->table_storage[i] == 0) {
+			cj->table_storage[i] = offsets[r] + 1;
+		}
+	}
+
+	cj->table = cj->table_storage.data();
+
+	if (cache != NULL) {
+		write_csv_cache(cache, cj, csv_st);
+	}
+
+	return cj;
 }
 
 // Follow JSON rules for what looks like a number
@@ -9,8 +9,45 @@
 
 std::vector<std::string> csv_split(const char *s);
 std::string csv_dequote(std::string s);
-void readcsv(const char *fn, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping);
 std::string csv_getline(FILE *f);
 bool is_number(std::string const &s);
 
+// Follows the last column of each row of a csv_join
+#define CSV_JOIN_END 0x7F
+
+// A table of attributes to join, read from a CSV file and indexed by its
+// first column. Each row is stored as its key, null-terminated, and then,
+// for each of the other columns, a type byte (mvt_string, or mvt_double
+// for numbers, or mvt_null for empty unquoted columns) followed by the
+// dequoted value, null-terminated. Once read, it is never modified, so
+// all the join threads can share it.
+struct csv_join {
+	std::vector<std::string> header{};
+
+	const char *rows = NULL;
+	const unsigned long long *table = NULL;	 // offset + 1 of each row, or 0 if the slot is empty
+	size_t slots = 0;			 // a power of 2
+
+	// Where rows and table are, whether built in memory or mapped from a cache
+	std::string row_storage{};
+	std::vector<unsigned long long> table_storage{};
+	void *map = NULL;
+	size_t map_len = 0;
+
+	csv_join() = default;
+	csv_join(csv_join const &) = delete;
+	csv_join &operator=(csv_join const &) = delete;
+	~csv_join();
+
+	// The columns after the key of the first row with this key, or NULL
+	const char *find(std::string const &key) const;
+};
+
+// If cache is not NULL, the index is read from there if it was made from
+// the current version of the CSV file, or is written there if not
+csv_join *read_csv_join(const char *fn, const char *cache);
+
+// Steps through the columns of a row, returning false after the last one
+bool csv_join_column(const char *&row, int &type, const char *&value);
+
 #endif
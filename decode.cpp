@@ -14,6 +14,8 @@
 #include <dirent.h>
 #include <sys/stat.h>
 #include <sys/mman.h>
+#include <pthread.h>
+#include <atomic>
 #include <protozero/pbf_reader.hpp>
 #include <sys/stat.h>
 #include "mvt.hpp"
@@ -26,8 +28,9 @@
 int minzoom = 0;
 int maxzoom = 32;
 bool force = false;
+size_t CPUS;
 
-void do_stats(mvt_tile &tile, size_t size, bool compressed, int z, unsigned x, unsigned y, json_writer &state) {
+void do_stats(mvt_tile_summary &tile, size_t size, bool compressed, int z, unsigned x, unsigned y, json_writer &state) {
 	state.json_write_hash();
 
 	state.json_write_string("zoom");
@@ -51,27 +54,16 @@ void do_stats(mvt_tile &tile, size_t size, bool compressed, int z, unsigned x, u
 	for (size_t i = 0; i < tile.layers.size(); i++) {
 		state.json_write_string(tile.layers[i].name);
 
-		size_t points = 0, lines = 0, polygons = 0;
-		for (size_t j = 0; j < tile.layers[i].features.size(); j++) {
-			if (tile.layers[i].features[j].type == mvt_point) {
-				points++;
-			} else if (tile.layers[i].features[j].type == mvt_linestring) {
-				lines++;
-			} else if (tile.layers[i].features[j].type == mvt_polygon) {
-				polygons++;
-			}
-		}
-
 		state.json_write_hash();
 
 		state.json_write_string("points");
-		state.json_write_unsigned(points);
+		state.json_write_unsigned(tile.layers[i].points);
 
 		state.json_write_string("lines");
-		state.json_write_unsigned(lines);
+		state.json_write_unsigned(tile.layers[i].lines);
 
 		state.json_write_string("polygons");
-		state.json_write_unsigned(polygons);
+		state.json_write_unsigned(tile.layers[i].polygons);
 
 		state.json_write_string("extent");
 		state.json_write_signed(tile.layers[i].extent);
@@ -85,12 +77,220 @@ void do_stats(mvt_tile &tile, size_t size, bool compressed, int z, unsigned x, u
 	state.json_write_newline();
 }
 
-void handle(std::string message, int z, unsigned x, unsigned y, std::set<std::string> const &to_decode, bool pipeline, bool stats, json_writer &state) {
-	mvt_tile tile;
-	bool was_compressed;
+// A distribution of sizes or counts, in power-of-two buckets
+struct stats_histogram {
+	unsigned long long min = 0;
+	unsigned long long max = 0;
+	unsigned long long total = 0;
+	size_t count = 0;
+	std::vector<size_t> buckets{};	// by the number of bits in the value
+
+	void add(unsigned long long v) {
+		if (count == 0 || v < min) {
+			min = v;
+		}
+		if (v > max) {
+			max = v;
+		}
+		total += v;
+		count++;
+
+		size_t bits = 0;
+		while (bits < 64 && (v >> bits) != 0) {
+			bits++;
+		}
+		if (buckets.size() <= bits) {
+			buckets.resize(bits + 1);
+		}
+		buckets[bits]++;
+	}
+
+	// Each bucket is labeled with the power of two that its values are below
+	void write(json_writer &state) const {
+		state.json_write_hash();
+
+		state.json_write_string("min");
+		state.json_write_unsigned(min);
+
+		state.json_write_string("max");
+		state.json_write_unsigned(max);
+
+		state.json_write_string("total");
+		state.json_write_unsigned(total);
+
+		state.json_write_string("histogram");
+		state.json_write_hash();
+		for (size_t i = 0; i < buckets.size(); i++) {
+			if (buckets[i] != 0) {
+				state.json_write_string(i < 64 ? std::to_string(1ULL << i) : "18446744073709551616");
+				state.json_write_unsigned(buckets[i]);
+			}
+		}
+		state.json_end_hash();
+
+		state.json_end_hash();
+	}
+};
+
+struct layer_totals {
+	size_t tiles = 0;
+	stats_histogram bytes{};
+	stats_histogram features{};
+	stats_histogram vertices{};
+	stats_histogram keys{};
+	stats_histogram values{};
+};
+
+struct tile_size {
+	unsigned x = 0;
+	unsigned y = 0;
+	size_t bytes = 0;
+};
+
+#define LARGEST_TILES 10
+
+struct zoom_totals {
+	size_t tiles = 0;
+	stats_histogram bytes{};
+	stats_histogram features{};
+	stats_histogram vertices{};
+	std::vector<tile_size> largest{};
+	std::map<std::string, layer_totals> layers{};
+};
+
+// Statistics for --tileset-stats, gathered across all the tiles in a tileset
+struct tileset_totals {
+	std::map<int, zoom_totals> zooms{};
+
+	void add(mvt_tile_summary const &summary, size_t size, int z, unsigned x, unsigned y, std::set<std::string> const &to_decode) {
+		zoom_totals &zt = zooms[z];
+		size_t features = 0, vertices = 0;
+
+		for (auto const &layer : summary.layers) {
+			if (to_decode.size() != 0 && !to_decode.count(layer.name)) {
+				continue;
+			}
+
+			layer_totals &lt = zt.layers[layer.name];
+			lt.tiles++;
+			lt.bytes.add(layer.bytes);
+			lt.features.add(layer.features);
+			lt.vertices.add(layer.vertices);
+			lt.keys.add(layer.keys);
+			lt.values.add(layer.values);
+
+			features += layer.features;
+			vertices += layer.vertices;
+		}
+
+		zt.tiles++;
+		zt.bytes.add(size);
+		zt.features.add(features);
+		zt.vertices.add(vertices);
+
+		if (zt.largest.size() < LARGEST_TILES || size > zt.largest.back().bytes) {
+			tile_size ts;
+			ts.x = x;
+			ts.y = y;
+			ts.bytes = size;
+
+			// Ties keep the tile that came first
+			size_t i = zt.largest.size();
+			while (i > 0 && zt.largest[i - 1].bytes < size) {
+				i--;
+			}
+			zt.largest.insert(zt.largest.begin() + i, ts);
+			if (zt.largest.size() > LARGEST_TILES) {
+				zt.largest.pop_back();
+			}
+		}
+	}
+
+	void write(json_writer &state) const {
+		state.json_write_hash();
+		state.json_write_string("zooms");
+		state.json_write_array();
+		state.json_write_newline();
+
+		bool first = true;
+		for (auto const &zt : zooms) {
+			if (!first) {
+				state.json_comma_newline();
+			}
+			first = false;
+
+			state.json_write_hash();
+
+			state.json_write_string("zoom");
+			state.json_write_signed(zt.first);
+
+			state.json_write_string("tiles");
+			state.json_write_unsigned(zt.second.tiles);
+
+			state.json_write_string("bytes");
+			zt.second.bytes.write(state);
+
+			state.json_write_string("features");
+			zt.second.features.write(state);
 
+			state.json_write_string("vertices");
+			zt.second.vertices.write(state);
+
+			state.json_write_string("largest");
+			state.json_write_array();
+			for (auto const &ts : zt.second.largest) {
+				state.json_write_hash();
+				state.json_write_string("x");
+				state.json_write_unsigned(ts.x);
+				state.json_write_string("y");
+				state.json_write_unsigned(ts.y);
+				state.json_write_string("bytes");
+				state.json_write_unsigned(ts.bytes);
+				state.json_end_hash();
+			}
+			state.json_end_array();
+
+			state.json_write_string("layers");
+			state.json_write_hash();
+			for (auto const &lt : zt.second.layers) {
+				state.json_write_string(lt.first);
+				state.json_write_hash();
+
+				state.json_write_string("tiles");
+				state.json_write_unsigned(lt.second.tiles);
+
+				state.json_write_string("bytes");
+				lt.second.bytes.write(state);
+
+				state.json_write_string("features");
+				lt.second.features.write(state);
+
+				state.json_write_string("vertices");
+				lt.second.vertices.write(state);
+
+				state.json_write_string("keys");
+				lt.second.keys.write(state);
+
+				state.json_write_string("values");
+				lt.second.values.write(state);
+
+				state.json_end_hash();
+			}
+			state.json_end_hash();
+
+			state.json_end_hash();
+			state.json_write_newline();
+		}
+
+		state.json_end_array();
+		state.json_end_hash();
+		state.json_write_newline();
+	}
+};
+
+void summarize(std::string &message, int z, unsigned x, unsigned y, mvt_tile_summary &summary, bool &was_compressed) {
 	try {
-		if (!tile.decode(message, was_compressed)) {
+		if (!summary.summarize(message, was_compressed)) {
 			fprintf(stderr, "Couldn't parse tile %d/%u/%u\n", z, x, y);
 			exit(EXIT_FAILURE);
 		}
@@ -98,12 +298,30 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::set<std::st
 		fprintf(stderr, "PBF decoding error in tile %d/%u/%u\n", z, x, y);
 		exit(EXIT_FAILURE);
 	}
+}
+
+void handle(std::string message, int z, unsigned x, unsigned y, std::set<std::string> const &to_decode, bool pipeline, bool stats, json_writer &state) {
+	bool was_compressed;
 
 	if (stats) {
-		do_stats(tile, message.size(), was_compressed, z, x, y, state);
+		mvt_tile_summary summary;
+		summarize(message, z, x, y, summary, was_compressed);
+		do_stats(summary, message.size(), was_compressed, z, x, y, state);
 		return;
 	}
 
+	mvt_tile tile;
+
+	try {
+		if (!tile.decode(message, was_compressed)) {
+			fprintf(stderr, "Couldn't parse tile %d/%u/%u\n", z, x, y);
+			exit(EXIT_FAILURE);
+		}
+	} catch (std::exception const &e) {
+		fprintf(stderr, "PBF decoding error in tile %d/%u/%u\n", z, x, y);
+		exit(EXIT_FAILURE);
+	}
+
 	if (!pipeline) {
 		state.json_write_hash();
 
@@ -223,7 +441,167 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::set<std::st
 	}
 }
 
-void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> const &to_decode, bool pipeline, bool stats, std::set<std::string> const &exclude_meta) {
+std::string read_tile_file(std::string const &fn) {
+	FILE *f = fopen(fn.c_str(), "rb");
+	if (f == NULL) {
+		perror(fn.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	std::string s;
+	char buf[2000];
+	ssize_t n;
+	while ((n = fread(buf, 1, 2000, f)) > 0) {
+		s.append(std::string(buf, n));
+	}
+	fclose(f);
+
+	return s;
+}
+
+// A tile waiting to be formatted, and then its formatted JSON,
+// which is written out once all the tiles before it have been
+struct decode_job {
+	std::string message = "";
+	std::string path = "";	// if the tile still has to be read from a directory
+	int z = 0;
+	unsigned x = 0;
+	unsigned y = 0;
+
+	std::string out = "";
+	json_write_state after{};
+
+	// for --tileset-stats, instead of the JSON
+	mvt_tile_summary summary{};
+};
+
+struct decode_args {
+	std::vector<decode_job> *jobs = NULL;
+	std::atomic<size_t> *next = NULL;
+	json_write_state const *before = NULL;
+	std::set<std::string> const *to_decode = NULL;
+	bool pipeline = false;
+	bool stats = false;
+	bool summarize = false;
+};
+
+void *run_decode(void *v) {
+	decode_args *a = (decode_args *) v;
+
+	while (true) {
+		size_t i = (*a->next)++;
+		if (i >= a->jobs->size()) {
+			break;
+		}
+
+		decode_job &job = (*a->jobs)[i];
+		if (job.path.size() != 0) {
+			job.message = read_tile_file(job.path);
+		}
+
+		if (a->summarize) {
+			bool was_compressed;
+			summarize(job.message, job.z, job.x, job.y, job.summary, was_compressed);
+			continue;
+		}
+
+		json_writer state(&job.out);
+		state.json_restore(*a->before);
+		handle(job.message, job.z, job.x, job.y, *a->to_decode, a->pipeline, a->stats, state);
+		job.after = state.json_save();
+		state.json_restore(json_write_state());
+	}
+
+	return NULL;
+}
+
+// Format a batch of tiles in parallel and write them out in order.
+//
+// Each tile's JSON depends on where the writer was when it started,
+// which is normally where the tile before it left off plus the comma
+// between tiles. The tiles are formatted assuming that, and any tile
+// whose predecessor turns out to have left the writer somewhere else
+// (as a pipeline tile with no features does) is formatted again in place.
+//
+// For --tileset-stats, the tiles are only summarized, and then added
+// to the totals instead.
+void decode_tiles(std::vector<decode_job> &jobs, bool &started, bool pipeline, bool stats, std::set<std::string> const &to_decode, json_writer &state, tileset_totals *totals) {
+	size_t first = 0;
+
+	if (!started && jobs.size() > 0 && totals == NULL) {
+		if (jobs[0].path.size() != 0) {
+			jobs[0].message = read_tile_file(jobs[0].path);
+		}
+		handle(jobs[0].message, jobs[0].z, jobs[0].x, jobs[0].y, to_decode, pipeline, stats, state);
+		started = true;
+		first = 1;
+	}
+
+	json_write_state before = state.json_save();
+	if (!pipeline || stats) {
+		before.wantnl = true;  // from the json_comma_newline() between tiles
+	}
+
+	std::vector<decode_job> todo;
+	for (size_t i = first; i < jobs.size(); i++) {
+		todo.push_back(std::move(jobs[i]));
+	}
+
+	std::atomic<size_t> next(0);
+	size_t threads = CPUS;
+	if (threads > todo.size()) {
+		threads = todo.size();
+	}
+
+	std::vector<decode_args> args;
+	args.resize(threads);
+	std::vector<pthread_t> pthreads;
+	pthreads.resize(threads);
+
+	for (size_t i = 0; i < threads; i++) {
+		args[i].jobs = &todo;
+		args[i].next = &next;
+		args[i].before = &before;
+		args[i].to_decode = &to_decode;
+		args[i].pipeline = pipeline;
+		args[i].stats = stats;
+		args[i].summarize = totals != NULL;
+
+		if (pthread_create(&pthreads[i], NULL, run_decode, &args[i]) != 0) {
+			perror("pthread_create");
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	for (size_t i = 0; i < threads; i++) {
+		void *retval;
+
+		if (pthread_join(pthreads[i], &retval) != 0) {
+			perror("pthread_join");
+		}
+	}
+
+	for (size_t i = 0; i < todo.size(); i++) {
+		if (totals != NULL) {
+			totals->add(todo[i].summary, todo[i].message.size(), todo[i].z, todo[i].x, todo[i].y, to_decode);
+			continue;
+		}
+
+		if (!pipeline || stats) {
+			state.json_comma_newline();
+		}
+
+		if (state.json_save() == before) {
+			state.json_splice(todo[i].out, todo[i].after);
+		} else {
+			handle(todo[i].message, todo[i].z, todo[i].x, todo[i].y, to_decode, pipeline, stats, state);
+		}
+	}
+
+	jobs.clear();
+}
+
+void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> const &to_decode, bool pipeline, bool stats, std::set<std::string> const &exclude_meta, tileset_totals *totals) {
 	sqlite3 *db = NULL;
 	bool isdir = false;
 	int oz = z;
@@ -285,7 +663,7 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 	if (z < 0) {
 		int within = 0;
 
-		if (!pipeline && !stats) {
+		if (!pipeline && !stats && totals == NULL) {
 			state.json_write_hash();
 
 			state.json_write_string("type");
@@ -333,7 +711,7 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 			state.json_write_newline();
 		}
 
-		if (!pipeline && !stats) {
+		if (!pipeline && !stats && totals == NULL) {
 			state.json_end_hash();
 
 			state.json_write_string("features");
@@ -341,39 +719,28 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 			state.json_write_newline();
 		}
 
+		// Tiles are formatted in batches, so that only a few of them
+		// are in memory at once, but enough to keep every CPU busy
+		std::vector<decode_job> jobs;
+		size_t queued = 0;
+		size_t batch = CPUS * 16;
+		bool started = false;
+
 		if (isdir) {
-			within = 0;
 			for (size_t i = 0; i < tiles.size(); i++) {
-				if (!pipeline && !stats) {
-					if (within) {
-						state.json_comma_newline();
-					}
-					within = 1;
-				}
-				if (stats) {
-					if (within) {
-						state.json_comma_newline();
-					}
-					within = 1;
-				}
-
-				std::string fn = std::string(fname) + "/" + tiles[i].path();
-				FILE *f = fopen(fn.c_str(), "rb");
-				if (f == NULL) {
-					perror(fn.c_str());
-					exit(EXIT_FAILURE);
-				}
-
-				std::string s;
-				char buf[2000];
-				ssize_t n;
-				while ((n = fread(buf, 1, 2000, f)) > 0) {
-					s.append(std::string(buf, n));
+				decode_job job;
+				job.path = std::string(fname) + "/" + tiles[i].path();
+				job.z = tiles[i].z;
+				job.x = tiles[i].x;
+				job.y = tiles[i].y;
+				jobs.push_back(std::move(job));
+
+				if (jobs.size() >= batch) {
+					decode_tiles(jobs, started, pipeline, stats, to_decode, state, totals);
 				}
-				fclose(f);
-
-				handle(s, tiles[i].z, tiles[i].x, tiles[i].y, to_decode, pipeline, stats, state);
 			}
+
+			decode_tiles(jobs, started, pipeline, stats, to_decode, state, totals);
 		} else {
 			const char *sql = "SELECT tile_data, zoom_level, tile_column, tile_row from tiles where zoom_level between ? and ? order by zoom_level, tile_column, tile_row;";
 			sqlite3_stmt *stmt;
@@ -385,21 +752,7 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 			sqlite3_bind_int(stmt, 1, minzoom);
 			sqlite3_bind_int(stmt, 2, maxzoom);
 
-			within = 0;
 			while (sqlite3_step(stmt) == SQLITE_ROW) {
-				if (!pipeline && !stats) {
-					if (within) {
-						state.json_comma_newline();
-					}
-					within = 1;
-				}
-				if (stats) {
-					if (within) {
-						state.json_comma_newline();
-					}
-					within = 1;
-				}
-
 				int len = sqlite3_column_bytes(stmt, 0);
 				int tz = sqlite3_column_int(stmt, 1);
 				int tx = sqlite3_column_int(stmt, 2);
@@ -418,13 +771,25 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 					exit(EXIT_FAILURE);
 				}
 
-				handle(std::string(s, len), tz, tx, ty, to_decode, pipeline, stats, state);
+				decode_job job;
+				job.message = std::string(s, len);
+				job.z = tz;
+				job.x = tx;
+				job.y = ty;
+				jobs.push_back(std::move(job));
+				queued += len;
+
+				if (jobs.size() >= batch || queued >= 64 * 1024 * 1024) {
+					decode_tiles(jobs, started, pipeline, stats, to_decode, state, totals);
+					queued = 0;
+				}
 			}
 
+			decode_tiles(jobs, started, pipeline, stats, to_decode, state, totals);
 			sqlite3_finalize(stmt);
 		}
 
-		if (!pipeline && !stats) {
+		if (!pipeline && !stats && totals == NULL) {
 			state.json_end_array();
 			state.json_end_hash();
 			state.json_write_newline();
@@ -433,6 +798,9 @@ void decode(char *fname, int z, unsigned x, unsigned y, std::set<std::string> co
 			state.json_end_array();
 			state.json_write_newline();
 		}
+		if (totals != NULL) {
+			totals->write(state);
+		}
 		if (pipeline) {
 			state.json_write_newline();
 		}
@@ -493,8 +861,21 @@ int main(int argc, char **argv) {
 	std::set<std::string> to_decode;
 	bool pipeline = false;
 	bool stats = false;
+	bool tileset_stats = false;
 	std::set<std::string> exclude_meta;
 
+	const char *TIPPECANOE_MAX_THREADS = getenv("TIPPECANOE_MAX_THREADS");
+	long threads;
+	if (TIPPECANOE_MAX_THREADS != NULL) {
+		threads = atol(TIPPECANOE_MAX_THREADS);
+	} else {
+		threads = sysconf(_SC_NPROCESSORS_ONLN);
+	}
+	if (threads < 1) {
+		threads = 1;
+	}
+	CPUS = threads;
+
 	struct option long_options[] = {
 		{"projection", required_argument, 0, 's'},
 		{"maximum-zoom", required_argument, 0, 'z'},
@@ -504,6 +885,7 @@ int main(int argc, char **argv) {
 		{"stats", no_argument, 0, 'S'},
 		{"force", no_argument, 0, 'f'},
 		{"exclude-metadata-row", required_argument, 0, 'x'},
+		{"tileset-stats", no_argument, 0, '~'},
 		{0, 0, 0, 0},
 	};
 
@@ -518,11 +900,23 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	while ((i = getopt_long(argc, argv, getopt_str.c_str(), long_options, NULL)) != -1) {
+	int option_index = 0;
+	while ((i = getopt_long(argc, argv, getopt_str.c_str(), long_options, &option_index)) != -1) {
 		switch (i) {
 		case 0:
 			break;
 
+		case '~': {
+			const char *opt = long_options[option_index].name;
+			if (strcmp(opt, "tileset-stats") == 0) {
+				tileset_stats = true;
+			} else {
+				fprintf(stderr, "%s: Unrecognized option --%s\n", argv[0], opt);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+
 		case 's':
 			set_projection_or_exit(optarg);
 			break;
@@ -560,10 +954,20 @@ int main(int argc, char **argv) {
 		}
 	}
 
+	if (tileset_stats && (pipeline || stats)) {
+		fprintf(stderr, "%s: --tileset-stats can't be combined with --stats or --tag-layer-and-zoom\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
 	if (argc == optind + 4) {
-		decode(argv[optind], atoi(argv[optind + 1]), atoi(argv[optind + 2]), atoi(argv[optind + 3]), to_decode, pipeline, stats, exclude_meta);
+		if (tileset_stats) {
+			fprintf(stderr, "%s: --tileset-stats is for a whole tileset, not a single tile\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		decode(argv[optind], atoi(argv[optind + 1]), atoi(argv[optind + 2]), atoi(argv[optind + 3]), to_decode, pipeline, stats, exclude_meta, NULL);
 	} else if (argc == optind + 1) {
-		decode(argv[optind], -1, -1, -1, to_decode, pipeline, stats, exclude_meta);
+		tileset_totals totals;
+		decode(argv[optind], -1, -1, -1, to_decode, pipeline, stats, exclude_meta, tileset_stats ? &totals : NULL);
 	} else {
 		usage(argv);
 	}
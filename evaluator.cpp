@@ -5,7 +5,7 @@
 #include "mvt.hpp"
 #include "evaluator.hpp"
 
-int compare(mvt_value one, json_object *two, bool &fail) {
+static int compare(mvt_value const &one, json_object *two, bool &fail) {
 	if (one.type == mvt_string) {
 		if (two->type != JSON_STRING) {
 			fail = true;
@@ -69,7 +69,22 @@ int compare(mvt_value one, json_object *two, bool &fail) {
 	exit(EXIT_FAILURE);
 }
 
-bool eval(std::map<std::string, mvt_value> const &feature, json_object *f, std::set<std::string> &exclude_attributes) {
+static int filter_slot(compiled_filter *cf, const char *key) {
+	std::string k = key;
+
+	auto f = cf->slots.find(k);
+	if (f != cf->slots.end()) {
+		return f->second;
+	}
+
+	int slot = cf->keys.size();
+	cf->keys.push_back(k);
+	cf->key_offsets.push_back(-1);
+	cf->slots.insert(std::pair<std::string, int>(k, slot));
+	return slot;
+}
+
+static filter_node compile(compiled_filter *cf, json_object *f) {
 	if (f == NULL || f->type != JSON_ARRAY) {
 		fprintf(stderr, "Filter is not an array: %s\n", json_stringify(f));
 		exit(EXIT_FAILURE);
@@ -85,36 +100,34 @@ bool eval(std::map<std::string, mvt_value> const &feature, json_object *f, std::
 		exit(EXIT_FAILURE);
 	}
 
-	if (strcmp(f->array[0]->string, "has") == 0 ||
-	    strcmp(f->array[0]->string, "!has") == 0) {
+	filter_node n;
+	n.expression = f;
+	const char *op = f->array[0]->string;
+
+	if (strcmp(op, "has") == 0 ||
+	    strcmp(op, "!has") == 0) {
 		if (f->length != 2) {
 			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
 			exit(EXIT_FAILURE);
 		}
 
-		if (strcmp(f->array[0]->string, "has") == 0) {
-			if (f->array[1]->type != JSON_STRING) {
-				fprintf(stderr, "\"has\" key is not a string: %s\n", json_stringify(f));
-				exit(EXIT_FAILURE);
-			}
-			return feature.count(std::string(f->array[1]->string)) != 0;
+		if (f->array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"%s\" key is not a string: %s\n", op, json_stringify(f));
+			exit(EXIT_FAILURE);
 		}
 
-		if (strcmp(f->array[0]->string, "!has") == 0) {
-			if (f->array[1]->type != JSON_STRING) {
-				fprintf(stderr, "\"!has\" key is not a string: %s\n", json_stringify(f));
-				exit(EXIT_FAILURE);
-			}
-			return feature.count(std::string(f->array[1]->string)) == 0;
-		}
+		n.op = strcmp(op, "has") == 0 ? FILTER_HAS : FILTER_NOT_HAS;
+		n.slot = filter_slot(cf, f->array[1]->string);
+		n.zoom = strcmp(f->array[1]->string, "$zoom") == 0;
+		return n;
 	}
 
-	if (strcmp(f->array[0]->string, "==") == 0 ||
-	    strcmp(f->array[0]->string, "!=") == 0 ||
-	    strcmp(f->array[0]->string, ">") == 0 ||
-	    strcmp(f->array[0]->string, ">=") == 0 ||
-	    strcmp(f->array[0]->string, "<") == 0 ||
-	    strcmp(f->array[0]->string, "<=") == 0) {
+	if (strcmp(op, "==") == 0 ||
+	    strcmp(op, "!=") == 0 ||
+	    strcmp(op, ">") == 0 ||
+	    strcmp(op, ">=") == 0 ||
+	    strcmp(op, "<") == 0 ||
+	    strcmp(op, "<=") == 0) {
 		if (f->length != 3) {
 			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
 			exit(EXIT_FAILURE);
@@ -124,76 +137,249 @@ bool eval(std::map<std::string, mvt_value> const &feature, json_object *f, std::
 			exit(EXIT_FAILURE);
 		}
 
-		auto ff = feature.find(std::string(f->array[1]->string));
-		if (ff == feature.end()) {
+		if (strcmp(op, "==") == 0) {
+			n.op = FILTER_EQ;
+		} else if (strcmp(op, "!=") == 0) {
+			n.op = FILTER_NE;
+		} else if (strcmp(op, ">") == 0) {
+			n.op = FILTER_GT;
+		} else if (strcmp(op, ">=") == 0) {
+			n.op = FILTER_GE;
+		} else if (strcmp(op, "<") == 0) {
+			n.op = FILTER_LT;
+		} else {
+			n.op = FILTER_LE;
+		}
+
+		n.slot = filter_slot(cf, f->array[1]->string);
+		n.zoom = strcmp(f->array[1]->string, "$zoom") == 0;
+		n.operands.push_back(f->array[2]);
+		return n;
+	}
+
+	if (strcmp(op, "all") == 0 ||
+	    strcmp(op, "any") == 0 ||
+	    strcmp(op, "none") == 0) {
+		if (strcmp(op, "all") == 0) {
+			n.op = FILTER_ALL;
+		} else if (strcmp(op, "any") == 0) {
+			n.op = FILTER_ANY;
+		} else {
+			n.op = FILTER_NONE;
+		}
+
+		for (size_t i = 1; i < f->length; i++) {
+			n.children.push_back(compile(cf, f->array[i]));
+			n.zoom = n.zoom || n.children.back().zoom;
+		}
+		return n;
+	}
+
+	if (strcmp(op, "in") == 0 ||
+	    strcmp(op, "!in") == 0) {
+		if (f->length < 2) {
+			fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+
+		if (f->array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"!has\" key is not a string: %s\n", json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+
+		n.op = strcmp(op, "in") == 0 ? FILTER_IN : FILTER_NOT_IN;
+		n.slot = filter_slot(cf, f->array[1]->string);
+		n.zoom = strcmp(f->array[1]->string, "$zoom") == 0;
+		for (size_t i = 2; i < f->length; i++) {
+			n.operands.push_back(f->array[i]);
+		}
+		return n;
+	}
+
+	if (strcmp(op, "attribute-filter") == 0) {
+		if (f->length != 3) {
+			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+
+		if (f->array[1]->type != JSON_STRING) {
+			fprintf(stderr, "\"attribute-filter\" key is not a string: %s\n", json_stringify(f));
+			exit(EXIT_FAILURE);
+		}
+
+		n.op = FILTER_ATTRIBUTE_FILTER;
+		n.attribute = f->array[1]->string;
+		n.children.push_back(compile(cf, f->array[2]));
+		n.zoom = n.children.back().zoom;
+		return n;
+	}
+
+	fprintf(stderr, "Unknown filter %s\n", json_stringify(f));
+	exit(EXIT_FAILURE);
+}
+
+compiled_filter *compile_filter(json_object *filter) {
+	if (filter == NULL || filter->type != JSON_HASH) {
+		fprintf(stderr, "Error: filter is not a hash: %s\n", json_stringify(filter));
+		exit(EXIT_FAILURE);
+	}
+
+	compiled_filter *cf = new compiled_filter;
+
+	for (size_t i = 0; i < filter->length; i++) {
+		if (filter->keys[i]->type != JSON_STRING) {
+			continue;
+		}
+
+		// Like json_hash_get(), the first of any duplicate keys wins
+		std::string layer = filter->keys[i]->string;
+		if (cf->layers.count(layer) == 0) {
+			cf->layers.insert(std::pair<std::string, filter_node>(layer, compile(cf, filter->values[i])));
+		}
+	}
+
+	auto f = cf->slots.find("$id");
+	if (f != cf->slots.end()) {
+		cf->id_slot = f->second;
+	}
+	f = cf->slots.find("$type");
+	if (f != cf->slots.end()) {
+		cf->type_slot = f->second;
+	}
+	f = cf->slots.find("$zoom");
+	if (f != cf->slots.end()) {
+		cf->zoom_slot = f->second;
+	}
+
+	return cf;
+}
+
+int compiled_filter::slot(std::string const &key) const {
+	auto f = slots.find(key);
+	if (f == slots.end()) {
+		return -1;
+	}
+	return f->second;
+}
+
+int compiled_filter::pool_slot(long long off) const {
+	for (size_t i = 0; i < key_offsets.size(); i++) {
+		if (key_offsets[i] == off) {
+			return i;
+		}
+	}
+	return -1;
+}
+
+void compiled_filter::start(filter_attributes &fa) const {
+	fa.values.assign(keys.size(), NULL);
+	fa.storage.resize(keys.size());
+}
+
+void compiled_filter::finish(filter_attributes &fa, bool has_id, unsigned long long id, int type, int z) const {
+	if (id_slot >= 0 && has_id) {
+		mvt_value v;
+		v.type = mvt_uint;
+		v.numeric_value.uint_value = id;
+
+		fa.set_copy(id_slot, v);
+	}
+
+	if (type_slot >= 0) {
+		mvt_value v;
+		v.type = mvt_string;
+
+		if (type == mvt_point) {
+			v.string_value = "Point";
+		} else if (type == mvt_linestring) {
+			v.string_value = "LineString";
+		} else if (type == mvt_polygon) {
+			v.string_value = "Polygon";
+		}
+
+		fa.set_copy(type_slot, v);
+	}
+
+	if (zoom_slot >= 0) {
+		mvt_value v;
+		v.type = mvt_uint;
+		v.numeric_value.uint_value = z;
+
+		fa.set_copy(zoom_slot, v);
+	}
+}
+
+static bool eval(filter_node const &n, filter_attributes const &fa, std::set<std::string> &exclude_attributes) {
+	switch (n.op) {
+	case FILTER_HAS:
+		return fa.values[n.slot] != NULL;
+
+	case FILTER_NOT_HAS:
+		return fa.values[n.slot] == NULL;
+
+	case FILTER_EQ:
+	case FILTER_NE:
+	case FILTER_GT:
+	case FILTER_GE:
+	case FILTER_LT:
+	case FILTER_LE: {
+		mvt_value const *v = fa.values[n.slot];
+		if (v == NULL) {
 			static bool warned = false;
 			if (!warned) {
-				const char *s = json_stringify(f);
+				const char *s = json_stringify(n.expression);
 				fprintf(stderr, "Warning: attribute not found for comparison: %s\n", s);
 				free((void *) s);
 				warned = true;
 			}
-			if (strcmp(f->array[0]->string, "!=") == 0) {
+			if (n.op == FILTER_NE) {
 				return true;  //  attributes that aren't found are not equal
 			}
 			return false;  // not found: comparison is false
 		}
 
 		bool fail = false;
-		int cmp = compare(ff->second, f->array[2], fail);
+		int cmp = compare(*v, n.operands[0], fail);
 
 		if (fail) {
 			static bool warned = false;
 			if (!warned) {
-				const char *s = json_stringify(f);
+				const char *s = json_stringify(n.expression);
 				fprintf(stderr, "Warning: mismatched type in comparison: %s\n", s);
 				free((void *) s);
 				warned = true;
 			}
-			if (strcmp(f->array[0]->string, "!=") == 0) {
+			if (n.op == FILTER_NE) {
 				return true;  // mismatched types are not equal
 			}
 			return false;
 		}
 
-		if (strcmp(f->array[0]->string, "==") == 0) {
+		switch (n.op) {
+		case FILTER_EQ:
 			return cmp == 0;
-		}
-		if (strcmp(f->array[0]->string, "!=") == 0) {
+		case FILTER_NE:
 			return cmp != 0;
-		}
-		if (strcmp(f->array[0]->string, ">") == 0) {
+		case FILTER_GT:
 			return cmp > 0;
-		}
-		if (strcmp(f->array[0]->string, ">=") == 0) {
+		case FILTER_GE:
 			return cmp >= 0;
-		}
-		if (strcmp(f->array[0]->string, "<") == 0) {
+		case FILTER_LT:
 			return cmp < 0;
-		}
-		if (strcmp(f->array[0]->string, "<=") == 0) {
+		default:
 			return cmp <= 0;
 		}
-
-		fprintf(stderr, "Internal error: can't happen: %s\n", json_stringify(f));
-		exit(EXIT_FAILURE);
 	}
 
-	if (strcmp(f->array[0]->string, "all") == 0 ||
-	    strcmp(f->array[0]->string, "any") == 0 ||
-	    strcmp(f->array[0]->string, "none") == 0) {
-		bool v;
-
-		if (strcmp(f->array[0]->string, "all") == 0) {
-			v = true;
-		} else {
-			v = false;
-		}
+	case FILTER_ALL:
+	case FILTER_ANY:
+	case FILTER_NONE: {
+		bool v = n.op == FILTER_ALL;
 
-		for (size_t i = 1; i < f->length; i++) {
-			bool out = eval(feature, f->array[i], exclude_attributes);
+		for (size_t i = 0; i < n.children.size(); i++) {
+			bool out = eval(n.children[i], fa, exclude_attributes);
 
-			if (strcmp(f->array[0]->string, "all") == 0) {
+			if (n.op == FILTER_ALL) {
 				v = v && out;
 				if (!v) {
 					break;
@@ -206,49 +392,39 @@ bool eval(std::map<std::string, mvt_value> const &feature, json_object *f, std::
 			}
 		}
 
-		if (strcmp(f->array[0]->string, "none") == 0) {
+		if (n.op == FILTER_NONE) {
 			return !v;
 		} else {
 			return v;
 		}
 	}
 
-	if (strcmp(f->array[0]->string, "in") == 0 ||
-	    strcmp(f->array[0]->string, "!in") == 0) {
-		if (f->length < 2) {
-			fprintf(stderr, "Array too small in filter: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-
-		if (f->array[1]->type != JSON_STRING) {
-			fprintf(stderr, "\"!has\" key is not a string: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-
-		auto ff = feature.find(std::string(f->array[1]->string));
-		if (ff == feature.end()) {
+	case FILTER_IN:
+	case FILTER_NOT_IN: {
+		mvt_value const *v = fa.values[n.slot];
+		if (v == NULL) {
 			static bool warned = false;
 			if (!warned) {
-				const char *s = json_stringify(f);
+				const char *s = json_stringify(n.expression);
 				fprintf(stderr, "Warning: attribute not found for comparison: %s\n", s);
 				free((void *) s);
 				warned = true;
 			}
-			if (strcmp(f->array[0]->string, "!in") == 0) {
+			if (n.op == FILTER_NOT_IN) {
 				return true;  // attributes that aren't found are not in
 			}
 			return false;  // not found: comparison is false
 		}
 
 		bool found = false;
-		for (size_t i = 2; i < f->length; i++) {
+		for (size_t i = 0; i < n.operands.size(); i++) {
 			bool fail = false;
-			int cmp = compare(ff->second, f->array[i], fail);
+			int cmp = compare(*v, n.operands[i], fail);
 
 			if (fail) {
 				static bool warned = false;
 				if (!warned) {
-					const char *s = json_stringify(f);
+					const char *s = json_stringify(n.expression);
 					fprintf(stderr, "Warning: mismatched type in comparison: %s\n", s);
 					free((void *) s);
 					warned = true;
@@ -262,58 +438,128 @@ bool eval(std::map<std::string, mvt_value> const &feature, json_object *f, std::
 			}
 		}
 
-		if (strcmp(f->array[0]->string, "in") == 0) {
+		if (n.op == FILTER_IN) {
 			return found;
 		} else {
 			return !found;
 		}
 	}
 
-	if (strcmp(f->array[0]->string, "attribute-filter") == 0) {
-		if (f->length != 3) {
-			fprintf(stderr, "Wrong number of array elements in filter: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-
-		if (f->array[1]->type != JSON_STRING) {
-			fprintf(stderr, "\"attribute-filter\" key is not a string: %s\n", json_stringify(f));
-			exit(EXIT_FAILURE);
-		}
-
-		bool ok = eval(feature, f->array[2], exclude_attributes);
+	case FILTER_ATTRIBUTE_FILTER: {
+		bool ok = eval(n.children[0], fa, exclude_attributes);
 		if (!ok) {
-			exclude_attributes.insert(f->array[1]->string);
+			exclude_attributes.insert(n.attribute);
 		}
 
 		return true;
 	}
+	}
 
-	fprintf(stderr, "Unknown filter %s\n", json_stringify(f));
+	fprintf(stderr, "Internal error: bad filter operation %d\n", n.op);
 	exit(EXIT_FAILURE);
 }
 
-bool evaluate(std::map<std::string, mvt_value> const &feature, std::string const &layer, json_object *filter, std::set<std::string> &exclude_attributes) {
-	if (filter == NULL || filter->type != JSON_HASH) {
-		fprintf(stderr, "Error: filter is not a hash: %s\n", json_stringify(filter));
-		exit(EXIT_FAILURE);
-	}
-
+bool compiled_filter::evaluate(filter_attributes const &fa, std::string const &layer, std::set<std::string> &exclude_attributes) const {
 	bool ok = true;
-	json_object *f;
 
-	f = json_hash_get(filter, layer.c_str());
-	if (ok && f != NULL) {
-		ok = eval(feature, f, exclude_attributes);
+	auto f = layers.find(layer);
+	if (ok && f != layers.end()) {
+		ok = eval(f->second, fa, exclude_attributes);
 	}
 
-	f = json_hash_get(filter, "*");
-	if (ok && f != NULL) {
-		ok = eval(feature, f, exclude_attributes);
+	f = layers.find("*");
+	if (ok && f != layers.end()) {
+		ok = eval(f->second, fa, exclude_attributes);
 	}
 
 	return ok;
 }
 
+bool compiled_filter::uses_zoom(std::string const &layer) const {
+	auto f = layers.find(layer);
+	if (f != layers.end() && f->second.zoom) {
+		return true;
+	}
+
+	f = layers.find("*");
+	if (f != layers.end() && f->second.zoom) {
+		return true;
+	}
+
+	return false;
+}
+
+#define UNZOOMED_FALSE 0
+#define UNZOOMED_TRUE 1
+#define UNZOOMED_UNKNOWN 2
+
+// Like eval(), but with anything that depends on $zoom left undecided
+static int eval_unzoomed(filter_node const &n, filter_attributes const &fa, std::set<std::string> &exclude_attributes) {
+	if (!n.zoom) {
+		return eval(n, fa, exclude_attributes) ? UNZOOMED_TRUE : UNZOOMED_FALSE;
+	}
+
+	switch (n.op) {
+	case FILTER_ALL:
+	case FILTER_ANY:
+	case FILTER_NONE: {
+		// "all" is decided by any false child, "any" and "none" by any true child
+		int decisive = n.op == FILTER_ALL ? UNZOOMED_FALSE : UNZOOMED_TRUE;
+		bool unknown = false;
+
+		for (size_t i = 0; i < n.children.size(); i++) {
+			int out = eval_unzoomed(n.children[i], fa, exclude_attributes);
+
+			if (out == decisive) {
+				if (n.op == FILTER_NONE) {
+					return UNZOOMED_FALSE;
+				}
+				return decisive;
+			}
+			if (out == UNZOOMED_UNKNOWN) {
+				unknown = true;
+			}
+		}
+
+		if (unknown) {
+			return UNZOOMED_UNKNOWN;
+		}
+		if (n.op == FILTER_ALL) {
+			return UNZOOMED_TRUE;
+		}
+		return n.op == FILTER_NONE ? UNZOOMED_TRUE : UNZOOMED_FALSE;
+	}
+
+	case FILTER_ATTRIBUTE_FILTER:
+		// Never rejects the feature, and the attribute waits for the zoom
+		return UNZOOMED_TRUE;
+
+	default:
+		return UNZOOMED_UNKNOWN;
+	}
+}
+
+bool compiled_filter::evaluate_unzoomed(filter_attributes const &fa, std::string const &layer, std::set<std::string> &exclude_attributes) const {
+	std::set<std::string> exclude;
+
+	auto f = layers.find(layer);
+	if (f != layers.end() && eval_unzoomed(f->second, fa, exclude) == UNZOOMED_FALSE) {
+		return false;
+	}
+
+	f = layers.find("*");
+	if (f != layers.end() && eval_unzoomed(f->second, fa, exclude) == UNZOOMED_FALSE) {
+		return false;
+	}
+
+	// Exclusions can only be decided now if nothing else waits for the zoom
+	if (!uses_zoom(layer)) {
+		exclude_attributes.insert(exclude.begin(), exclude.end());
+	}
+
+	return true;
+}
+
 json_object *read_filter(const char *fname) {
 	FILE *fp = fopen(fname, "r");
 	if (fp == NULL) {
@@ -1,13 +1,99 @@
 #ifndef EVALUATOR_HPP
-#define EVALUATOR HPP
+#define EVALUATOR_HPP
 
 #include <map>
 #include <string>
 #include <set>
+#include <vector>
+#include <unordered_map>
 #include "jsonpull/jsonpull.h"
 #include "mvt.hpp"
 
-bool evaluate(std::map<std::string, mvt_value> const &feature, std::string const &layer, json_object *filter, std::set<std::string> &exclude_attributes);
+enum filter_op {
+	FILTER_HAS,
+	FILTER_NOT_HAS,
+	FILTER_EQ,
+	FILTER_NE,
+	FILTER_GT,
+	FILTER_GE,
+	FILTER_LT,
+	FILTER_LE,
+	FILTER_ALL,
+	FILTER_ANY,
+	FILTER_NONE,
+	FILTER_IN,
+	FILTER_NOT_IN,
+	FILTER_ATTRIBUTE_FILTER,
+};
+
+// One operation of a filter expression, with the attribute it tests
+// resolved to a slot in the feature's attribute array
+struct filter_node {
+	int op = 0;
+	int slot = -1;
+	json_object *expression = NULL;	      // the source, for warnings
+	std::vector<json_object *> operands{};  // constants to compare against
+	std::vector<filter_node> children{};
+	std::string attribute = "";  // for attribute-filter
+	bool zoom = false;	     // whether this or any of its children tests $zoom
+};
+
+// The values of the attributes of one feature that a filter refers to,
+// indexed by slot, or NULL for those that the feature doesn't have
+struct filter_attributes {
+	std::vector<mvt_value const *> values{};
+	std::vector<mvt_value> storage{};  // for values that had to be converted
+
+	// As with inserting into a map, the first value for a key wins
+	void set(int slot, mvt_value const *v) {
+		if (slot >= 0 && values[slot] == NULL) {
+			values[slot] = v;
+		}
+	}
+
+	void set_copy(int slot, mvt_value const &v) {
+		if (slot >= 0 && values[slot] == NULL) {
+			storage[slot] = v;
+			values[slot] = &storage[slot];
+		}
+	}
+};
+
+// A feature filter, compiled once so that each feature can be tested
+// without walking the JSON or building a map of all its attributes
+struct compiled_filter {
+	std::map<std::string, filter_node> layers{};  // by layer name, or "*"
+
+	std::vector<std::string> keys{};  // by slot
+	std::unordered_map<std::string, int> slots{};
+
+	// Where each key is in the string pool, or -1, if the caller looks them up
+	std::vector<long long> key_offsets{};
+
+	int id_slot = -1;
+	int type_slot = -1;
+	int zoom_slot = -1;
+
+	int slot(std::string const &key) const;
+	int pool_slot(long long off) const;
+
+	// Clear the attributes for the next feature, and then, after the
+	// feature's own attributes are set, add $id, $type, and $zoom
+	void start(filter_attributes &fa) const;
+	void finish(filter_attributes &fa, bool has_id, unsigned long long id, int type, int z) const;
+
+	bool evaluate(filter_attributes const &fa, std::string const &layer, std::set<std::string> &exclude_attributes) const;
+
+	// Whether the filter for a layer has to wait until the zoom level is known
+	bool uses_zoom(std::string const &layer) const;
+
+	// Without knowing the zoom level, returns false only if the feature
+	// would be rejected at every zoom. If the layer's filter doesn't use
+	// $zoom, also fills in the attributes that it excludes.
+	bool evaluate_unzoomed(filter_attributes const &fa, std::string const &layer, std::set<std::string> &exclude_attributes) const;
+};
+
+compiled_filter *compile_filter(json_object *filter);
 json_object *parse_filter(const char *s);
 json_object *read_filter(const char *fname);
 
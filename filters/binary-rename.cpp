@@ -0,0 +1,40 @@
+// An example of a filter for --binary-filters. It reads feature records
+// from the standard input, moves each feature into the layer named on the
+// command line (or "renamed" if none is given), and writes them back to
+// the standard output. Tile markers from --persistent-filters are copied
+// through, and the output is flushed at the end of each tile.
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string>
+#include "binary_filter.hpp"
+
+int main(int argc, char **argv) {
+	std::string name = "renamed";
+	if (argc > 1) {
+		name = argv[1];
+	}
+
+	filter_reader fr(0);
+	std::string message;
+
+	while (fr.next(message)) {
+		filter_feature ff;
+		decode_filter_feature(message, ff);
+
+		if (ff.marker == 0) {
+			ff.layer = name;
+		}
+
+		write_filter_feature(stdout, ff);
+
+		if (ff.marker == FILTER_TILE_END) {
+			if (fflush(stdout) != 0) {
+				perror("fflush");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+
+	return 0;
+}
@@ -39,67 +39,9 @@
 #include "mvt.hpp"
 #include "geojson-loop.hpp"
 
-int serialize_geojson_feature(struct serialization_state *sst, json_object *geometry, json_object *properties, json_object *id, int layer, json_object *tippecanoe, json_object *feature, std::string layername) {
-	json_object *geometry_type = json_hash_get(geometry, "type");
-	if (geometry_type == NULL) {
-		static int warned = 0;
-		if (!warned) {
-			fprintf(stderr, "%s:%d: null geometry (additional not reported)\n", sst->fname, sst->line);
-			json_context(feature);
-			warned = 1;
-		}
-
-		return 0;
-	}
-
-	if (geometry_type->type != JSON_STRING) {
-		fprintf(stderr, "%s:%d: geometry type is not a string\n", sst->fname, sst->line);
-		json_context(feature);
-		return 0;
-	}
-
-	json_object *coordinates = json_hash_get(geometry, "coordinates");
-	if (coordinates == NULL || coordinates->type != JSON_ARRAY) {
-		fprintf(stderr, "%s:%d: feature without coordinates array\n", sst->fname, sst->line);
-		json_context(feature);
-		return 0;
-	}
-
-	int t;
-	for (t = 0; t < GEOM_TYPES; t++) {
-		if (strcmp(geometry_type->string, geometry_names[t]) == 0) {
-			break;
-		}
-	}
-	if (t >= GEOM_TYPES) {
-		fprintf(stderr, "%s:%d: Can't handle geometry type %s\n", sst->fname, sst->line, geometry_type->string);
-		json_context(feature);
-		return 0;
-	}
-
-	int tippecanoe_minzoom = -1;
-	int tippecanoe_maxzoom = -1;
-	std::string tippecanoe_layername;
-
-	if (tippecanoe != NULL) {
-		json_object *min = json_hash_get(tippecanoe, "minzoom");
-		if (min != NULL && (min->type == JSON_STRING || min->type == JSON_NUMBER)) {
-			tippecanoe_minzoom = integer_zoom(sst->fname, min->string);
-		}
-
-		json_object *max = json_hash_get(tippecanoe, "maxzoom");
-		if (max != NULL && (max->type == JSON_STRING || max->type == JSON_NUMBER)) {
-			tippecanoe_maxzoom = integer_zoom(sst->fname, max->string);
-		}
-
-		json_object *ln = json_hash_get(tippecanoe, "layer");
-		if (ln != NULL && (ln->type == JSON_STRING || ln->type == JSON_NUMBER)) {
-			tippecanoe_layername = std::string(ln->string);
-		}
-	}
-
+// Returns whether the feature's ID can be represented as an unsigned integer
+static bool parse_feature_id(json_object *id, unsigned long long &id_value) {
 	bool has_id = false;
-	unsigned long long id_value = 0;
 	if (id != NULL) {
 		if (id->type == JSON_NUMBER) {
 			if (id->number >= 0) {
@@ -171,6 +113,79 @@ int serialize_geojson_feature(struct serialization_state *sst, json_object *geom
 		}
 	}
 
+	return has_id;
+}
+
+int serialize_geojson_feature(struct serialization_state *sst, json_object *geometry, json_object *properties, json_object *id, int layer, json_object *tippecanoe, json_object *feature, std::string layername) {
+	json_object *geometry_type = json_hash_get(geometry, "type");
+	if (geometry_type == NULL) {
+		// When updating, a feature with an ID and no geometry deletes the feature with that ID
+		struct reader *r = &(*sst->readers)[sst->segment];
+		unsigned long long id_value;
+		if (r->deleted_ids != NULL && id != NULL && parse_feature_id(id, id_value)) {
+			r->deleted_ids->push_back(id_value);
+			return 1;
+		}
+
+		static int warned = 0;
+		if (!warned) {
+			fprintf(stderr, "%s:%d: null geometry (additional not reported)\n", sst->fname, sst->line);
+			json_context(feature);
+			warned = 1;
+		}
+
+		return 0;
+	}
+
+	if (geometry_type->type != JSON_STRING) {
+		fprintf(stderr, "%s:%d: geometry type is not a string\n", sst->fname, sst->line);
+		json_context(feature);
+		return 0;
+	}
+
+	json_object *coordinates = json_hash_get(geometry, "coordinates");
+	if (coordinates == NULL || coordinates->type != JSON_ARRAY) {
+		fprintf(stderr, "%s:%d: feature without coordinates array\n", sst->fname, sst->line);
+		json_context(feature);
+		return 0;
+	}
+
+	int t;
+	for (t = 0; t < GEOM_TYPES; t++) {
+		if (strcmp(geometry_type->string, geometry_names[t]) == 0) {
+			break;
+		}
+	}
+	if (t >= GEOM_TYPES) {
+		fprintf(stderr, "%s:%d: Can't handle geometry type %s\n", sst->fname, sst->line, geometry_type->string);
+		json_context(feature);
+		return 0;
+	}
+
+	int tippecanoe_minzoom = -1;
+	int tippecanoe_maxzoom = -1;
+	std::string tippecanoe_layername;
+
+	if (tippecanoe != NULL) {
+		json_object *min = json_hash_get(tippecanoe, "minzoom");
+		if (min != NULL && (min->type == JSON_STRING || min->type == JSON_NUMBER)) {
+			tippecanoe_minzoom = integer_zoom(sst->fname, min->string);
+		}
+
+		json_object *max = json_hash_get(tippecanoe, "maxzoom");
+		if (max != NULL && (max->type == JSON_STRING || max->type == JSON_NUMBER)) {
+			tippecanoe_maxzoom = integer_zoom(sst->fname, max->string);
+		}
+
+		json_object *ln = json_hash_get(tippecanoe, "layer");
+		if (ln != NULL && (ln->type == JSON_STRING || ln->type == JSON_NUMBER)) {
+			tippecanoe_layername = std::string(ln->string);
+		}
+	}
+
+	unsigned long long id_value = 0;
+	bool has_id = parse_feature_id(id, id_value);
+
 	size_t nprop = 0;
 	if (properties != NULL && properties->type == JSON_HASH) {
 		nprop = properties->length;
@@ -9,6 +9,7 @@
 #include <unistd.h>
 #include <cmath>
 #include <limits.h>
+#include <pthread.h>
 #include <sqlite3.h>
 #include <mapbox/geometry/point.hpp>
 #include <mapbox/geometry/multi_polygon.hpp>
@@ -24,8 +25,9 @@
 static int pnpoly(drawvec &vert, size_t start, size_t nvert, long long testx, long long testy);
 static int clip(double *x0, double *y0, double *x1, double *y1, double xmin, double ymin, double xmax, double ymax);
 
-drawvec decode_geometry(FILE *meta, std::atomic<long long> *geompos, int z, unsigned tx, unsigned ty, long long *bbox, unsigned initial_x, unsigned initial_y) {
-	drawvec out;
+// Replace the contents of "out" with the geometry, keeping its capacity
+void decode_geometry(char **meta, int z, unsigned tx, unsigned ty, long long *bbox, unsigned initial_x, unsigned initial_y, drawvec &out) {
+	out.clear();
 
 	bbox[0] = LLONG_MAX;
 	bbox[1] = LLONG_MAX;
@@ -37,10 +39,7 @@ drawvec decode_geometry(FILE *meta, std::atomic<long long> *geompos, int z, unsi
 	while (1) {
 		draw d;
 
-		if (!deserialize_byte_io(meta, &d.op, geompos)) {
-			fprintf(stderr, "Internal error: Unexpected end of file in geometry\n");
-			exit(EXIT_FAILURE);
-		}
+		deserialize_byte(meta, &d.op);
 		if (d.op == VT_END) {
 			break;
 		}
@@ -48,8 +47,8 @@ drawvec decode_geometry(FILE *meta, std::atomic<long long> *geompos, int z, unsi
 		if (d.op == VT_MOVETO || d.op == VT_LINETO) {
 			long long dx, dy;
 
-			deserialize_long_long_io(meta, &dx, geompos);
-			deserialize_long_long_io(meta, &dy, geompos);
+			deserialize_long_long(meta, &dx);
+			deserialize_long_long(meta, &dy);
 
 			wx += dx * (1 << geometry_scale);
 			wy += dy * (1 << geometry_scale);
@@ -81,8 +80,6 @@ drawvec decode_geometry(FILE *meta, std::atomic<long long> *geompos, int z, unsi
 
 		out.push_back(d);
 	}
-
-	return out;
 }
 
 void to_tile_scale(drawvec &geom, int z, int detail) {
@@ -92,6 +89,24 @@ void to_tile_scale(drawvec &geom, int z, int detail) {
 	}
 }
 
+// Replace the contents of "out" with the spatial index of each vertex of geom,
+// whose coordinates are first scaled up by 2^shift
+void encode_vertex_indices(drawvec const &geom, int shift, std::vector<unsigned long long> &out) {
+	unsigned long long (*encode)(unsigned int, unsigned int) = encode_index;
+	long long scale = 1LL << shift;
+
+	out.resize(geom.size());
+	size_t n = 0;
+
+	for (size_t i = 0; i < geom.size(); i++) {
+		if (geom[i].op == VT_MOVETO || geom[i].op == VT_LINETO) {
+			out[n++] = encode(geom[i].x * scale, geom[i].y * scale);
+		}
+	}
+
+	out.resize(n);
+}
+
 drawvec remove_noop(drawvec geom, int type, int shift) {
 	// first pass: remove empty linetos
 
@@ -709,25 +724,35 @@ static double square_distance_from_line(long long point_x, long long point_y, lo
 	return dx * dx + dy * dy;
 }
 
-// https://github.com/Project-OSRM/osrm-backend/blob/733d1384a40f/Algorithms/DouglasePeucker.cpp
-static void douglas_peucker(drawvec &geom, int start, int n, double e, size_t kept, size_t retain) {
-	e = e * e;
-	std::stack<int> recursion_stack;
+// Find the point between "first" and "second" that is farthest from the line
+// between them, if it is more than sqrt(e) away or if fewer than "retain"
+// points have been kept so far. Returns -1 if there is no such point.
+static int farthest_point(drawvec &geom, int start, int first, int second, double e, size_t kept, size_t retain) {
+	double max_distance = -1;
+	int farthest_element_index = -1;
 
-	{
-		int left_border = 0;
-		int right_border = 1;
-		// Sweep linerarily over array and identify those ranges that need to be checked
-		do {
-			if (geom[start + right_border].necessary) {
-				recursion_stack.push(left_border);
-				recursion_stack.push(right_border);
-				left_border = right_border;
-			}
-			++right_border;
-		} while (right_border < n);
+	// find index idx of element with max_distance
+	int i;
+	for (i = first + 1; i < second; i++) {
+		double temp_dist = square_distance_from_line(geom[start + i].x, geom[start + i].y, geom[start + first].x, geom[start + first].y, geom[start + second].x, geom[start + second].y);
+
+		double distance = std::fabs(temp_dist);
+
+		if ((distance > e || kept < retain) && distance > max_distance) {
+			farthest_element_index = i;
+			max_distance = distance;
+		}
 	}
 
+	return farthest_element_index;
+}
+
+// Simplify each of the stretches on the stack, which run between points
+// that are already being kept. If "rest" is not NULL, stop once "retain"
+// points have been kept and leave the stretches that are still unsimplified
+// in it instead: from then on the order they are simplified in makes no
+// difference, so they can be divided among threads.
+static void douglas_peucker_stretches(drawvec &geom, int start, std::stack<int> &recursion_stack, double e, size_t kept, size_t retain, std::vector<std::pair<int, int>> *rest) {
 	while (!recursion_stack.empty()) {
 		// pop next element
 		int second = recursion_stack.top();
@@ -735,23 +760,14 @@ static void douglas_peucker(drawvec &geom, int start, int n, double e, size_t ke
 		int first = recursion_stack.top();
 		recursion_stack.pop();
 
-		double max_distance = -1;
-		int farthest_element_index = second;
-
-		// find index idx of element with max_distance
-		int i;
-		for (i = first + 1; i < second; i++) {
-			double temp_dist = square_distance_from_line(geom[start + i].x, geom[start + i].y, geom[start + first].x, geom[start + first].y, geom[start + second].x, geom[start + second].y);
-
-			double distance = std::fabs(temp_dist);
-
-			if ((distance > e || kept < retain) && distance > max_distance) {
-				farthest_element_index = i;
-				max_distance = distance;
-			}
+		if (rest != NULL && kept >= retain) {
+			rest->push_back(std::pair<int, int>(first, second));
+			continue;
 		}
 
-		if (max_distance >= 0) {
+		int farthest_element_index = farthest_point(geom, start, first, second, e, kept, retain);
+
+		if (farthest_element_index >= 0) {
 			// mark idx as necessary
 			geom[start + farthest_element_index].necessary = 1;
 			kept++;
@@ -768,6 +784,28 @@ static void douglas_peucker(drawvec &geom, int start, int n, double e, size_t ke
 	}
 }
 
+// https://github.com/Project-OSRM/osrm-backend/blob/733d1384a40f/Algorithms/DouglasePeucker.cpp
+static void douglas_peucker(drawvec &geom, int start, int n, double e, size_t kept, size_t retain, std::vector<std::pair<int, int>> *rest) {
+	e = e * e;
+	std::stack<int> recursion_stack;
+
+	{
+		int left_border = 0;
+		int right_border = 1;
+		// Sweep linerarily over array and identify those ranges that need to be checked
+		do {
+			if (geom[start + right_border].necessary) {
+				recursion_stack.push(left_border);
+				recursion_stack.push(right_border);
+				left_border = right_border;
+			}
+			++right_border;
+		} while (right_border < n);
+	}
+
+	douglas_peucker_stretches(geom, start, recursion_stack, e, kept, retain, rest);
+}
+
 // If any line segment crosses a tile boundary, add a node there
 // that cannot be simplified away, to prevent the edge of any
 // feature from jumping abruptly at the tile boundary.
@@ -802,7 +840,87 @@ drawvec impose_tile_boundaries(drawvec &geom, long long extent) {
 	return out;
 }
 
-drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain, drawvec const &shared_nodes) {
+// Geometries with fewer vertices than this aren't worth simplifying in parallel
+#define SIMPLIFY_THREAD_VERTICES 50000
+
+// Longer stretches than this are only split at their farthest point by the
+// thread that takes them, and the two halves queued for any thread to take
+#define SIMPLIFY_SPLIT_VERTICES 10000
+
+// The stretches of one geometry that are being simplified in a pool
+struct simplify_batch {
+	drawvec *geom = NULL;
+	double e = 0;         // squared
+	size_t pending = 0;  // jobs queued or running, guarded by the pool lock
+};
+
+static void run_simplify_job(simplify_pool *pool, simplify_job const &job) {
+	drawvec &geom = *(job.batch->geom);
+	std::vector<simplify_job> children;
+
+	if (job.second - job.first > SIMPLIFY_SPLIT_VERTICES) {
+		int i = farthest_point(geom, job.start, job.first, job.second, job.batch->e, 0, 0);
+
+		if (i >= 0) {
+			geom[job.start + i].necessary = 1;
+
+			if (1 < i - job.first) {
+				children.push_back(job);
+				children.back().second = i;
+			}
+			if (1 < job.second - i) {
+				children.push_back(job);
+				children.back().first = i;
+			}
+		}
+	} else {
+		std::stack<int> recursion_stack;
+		recursion_stack.push(job.first);
+		recursion_stack.push(job.second);
+		douglas_peucker_stretches(geom, job.start, recursion_stack, job.batch->e, 0, 0, NULL);
+	}
+
+	pthread_mutex_lock(&pool->lock);
+	for (size_t i = 0; i < children.size(); i++) {
+		pool->jobs.push_back(children[i]);
+	}
+	job.batch->pending += children.size();
+	job.batch->pending--;
+	if (children.size() > 0 || job.batch->pending == 0) {
+		pthread_cond_broadcast(&pool->cond);
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+// Run jobs from the pool until the batch is finished, or, if there is no
+// batch, until no thread can add any more jobs
+static void simplify_pool_work(simplify_pool *pool, simplify_batch *batch) {
+	pthread_mutex_lock(&pool->lock);
+	while (batch != NULL ? batch->pending > 0 : (pool->working > 0 || pool->jobs.size() > 0)) {
+		if (pool->jobs.size() > 0) {
+			simplify_job job = pool->jobs.front();
+			pool->jobs.pop_front();
+
+			pthread_mutex_unlock(&pool->lock);
+			run_simplify_job(pool, job);
+			pthread_mutex_lock(&pool->lock);
+		} else {
+			pthread_cond_wait(&pool->cond, &pool->lock);
+		}
+	}
+	pthread_mutex_unlock(&pool->lock);
+}
+
+void simplify_pool_help(simplify_pool *pool) {
+	pthread_mutex_lock(&pool->lock);
+	pool->working--;
+	pthread_cond_broadcast(&pool->cond);
+	pthread_mutex_unlock(&pool->lock);
+
+	simplify_pool_work(pool, NULL);
+}
+
+drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain, drawvec const &shared_nodes, simplify_pool *pool) {
 	int res = 1 << (32 - detail - z);
 	long long area = 1LL << (32 - z);
 
@@ -827,6 +945,16 @@ drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds,
 		geom = impose_tile_boundaries(geom, area);
 	}
 
+	// A large geometry is simplified serially only until the points that
+	// must be retained have been chosen, and the rest is left to the pool
+	double e = res * simplification;
+	bool share = pool != NULL && geom.size() >= SIMPLIFY_THREAD_VERTICES;
+	simplify_batch batch;
+	batch.geom = &geom;
+	batch.e = e * e;
+	std::vector<simplify_job> jobs;
+	std::vector<std::pair<int, int>> rest;
+
 	for (size_t i = 0; i < geom.size(); i++) {
 		if (geom[i].op == VT_MOVETO) {
 			size_t j;
@@ -840,12 +968,38 @@ drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds,
 			geom[j - 1].necessary = 1;
 
 			if (j - i > 1) {
-				douglas_peucker(geom, i, j - i, res * simplification, 2, retain);
+				if (share) {
+					rest.clear();
+					douglas_peucker(geom, i, j - i, e, 2, retain, &rest);
+
+					for (size_t k = 0; k < rest.size(); k++) {
+						simplify_job job;
+						job.batch = &batch;
+						job.start = i;
+						job.first = rest[k].first;
+						job.second = rest[k].second;
+						jobs.push_back(job);
+					}
+				} else {
+					douglas_peucker(geom, i, j - i, e, 2, retain, NULL);
+				}
 			}
 			i = j - 1;
 		}
 	}
 
+	if (jobs.size() > 0) {
+		pthread_mutex_lock(&pool->lock);
+		for (size_t i = 0; i < jobs.size(); i++) {
+			pool->jobs.push_back(jobs[i]);
+		}
+		batch.pending += jobs.size();
+		pthread_cond_broadcast(&pool->cond);
+		pthread_mutex_unlock(&pool->lock);
+
+		simplify_pool_work(pool, &batch);
+	}
+
 	drawvec out;
 	for (size_t i = 0; i < geom.size(); i++) {
 		if (geom[i].necessary) {
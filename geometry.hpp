@@ -2,7 +2,9 @@
 #define GEOMETRY_HPP
 
 #include <vector>
+#include <deque>
 #include <atomic>
+#include <pthread.h>
 #include <sqlite3.h>
 
 #define VT_POINT 1
@@ -56,8 +58,9 @@ struct draw {
 
 typedef std::vector<draw> drawvec;
 
-drawvec decode_geometry(FILE *meta, std::atomic<long long> *geompos, int z, unsigned tx, unsigned ty, long long *bbox, unsigned initial_x, unsigned initial_y);
+void decode_geometry(char **meta, int z, unsigned tx, unsigned ty, long long *bbox, unsigned initial_x, unsigned initial_y, drawvec &out);
 void to_tile_scale(drawvec &geom, int z, int detail);
+void encode_vertex_indices(drawvec const &geom, int shift, std::vector<unsigned long long> &out);
 drawvec remove_noop(drawvec geom, int type, int shift);
 drawvec clip_point(drawvec &geom, int z, long long buffer);
 drawvec clean_or_clip_poly(drawvec &geom, int z, int buffer, bool clip);
@@ -68,7 +71,30 @@ drawvec clip_lines(drawvec &geom, int z, long long buffer);
 drawvec stairstep(drawvec &geom, int z, int detail);
 bool point_within_tile(long long x, long long y, int z);
 int quick_check(long long *bbox, int z, long long buffer);
-drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain, drawvec const &shared_nodes);
+struct simplify_batch;
+
+// A stretch of a line or ring, between two points that are being kept,
+// that is still to be simplified
+struct simplify_job {
+	simplify_batch *batch = NULL;
+	size_t start = 0;  // of the ring
+	int first = 0;
+	int second = 0;
+};
+
+// Lets the threads that are simplifying the features of a tile divide
+// the simplification of any very large geometry among themselves
+struct simplify_pool {
+	pthread_mutex_t lock = PTHREAD_MUTEX_INITIALIZER;
+	pthread_cond_t cond = PTHREAD_COND_INITIALIZER;
+	std::deque<simplify_job> jobs{};
+	size_t working = 0;  // threads that are still simplifying features of their own
+};
+
+// Called by each thread when it has no features of its own left to simplify
+void simplify_pool_help(simplify_pool *pool);
+
+drawvec simplify_lines(drawvec &geom, int z, int detail, bool mark_tile_bounds, double simplification, size_t retain, drawvec const &shared_nodes, simplify_pool *pool);
 drawvec reorder_lines(drawvec &geom);
 drawvec fix_polygon(drawvec &geom);
 std::vector<drawvec> chop_polygon(std::vector<drawvec> &geoms);
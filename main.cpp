@@ -61,6 +61,10 @@
 #include "dirtiles.hpp"
 #include "evaluator.hpp"
 #include "text.hpp"
+#include "plugin.hpp"
+#include "trace.hpp"
+#include "store.hpp"
+#include "checkpoint.hpp"
 
 static int low_detail = 12;
 static int full_detail = -1;
@@ -107,7 +111,7 @@ void checkdisk(std::vector<struct reader> *r) {
 	for (size_t i = 0; i < r->size(); i++) {
 		// Meta, pool, and tree are used once.
 		// Geometry and index will be duplicated during sorting and tiling.
-		used += (*r)[i].metapos + 2 * (*r)[i].geompos + 2 * (*r)[i].indexpos + (*r)[i].poolfile->len + (*r)[i].treefile->len;
+		used += (*r)[i].metapos + 2 * (*r)[i].geompos + 2 * (*r)[i].indexpos + (*r)[i].poolfile->off + (*r)[i].treefile->off;
 	}
 
 	static int warned = 0;
@@ -299,6 +303,33 @@ int calc_feature_minzoom(struct index *ix, struct drop_state *ds, int maxzoom, d
 	return feature_minzoom;
 }
 
+// Map the geometry that goes with an index. It is empty, and not mapped,
+// if the filter rejected every feature in it while reading.
+static char *map_geometry(int fd, off_t size, int advice) {
+	if (size == 0) {
+		return NULL;
+	}
+
+	char *map = (char *) mmap(NULL, size, PROT_READ, MAP_PRIVATE, fd, 0);
+	if (map == MAP_FAILED) {
+		perror("map geom");
+		exit(EXIT_FAILURE);
+	}
+	madvise(map, size, advice);
+	madvise(map, size, MADV_WILLNEED);
+	return map;
+}
+
+static void unmap_geometry(char *map, off_t size) {
+	if (map != NULL) {
+		madvise(map, size, MADV_DONTNEED);
+		if (munmap(map, size) < 0) {
+			perror("unmap geom");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
 static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map, FILE *indexfile, int bytes, char *geom_map, FILE *geom_out, std::atomic<long long> *geompos, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, double gamma, struct drop_state *ds) {
 	struct mergelist *head = NULL;
 
@@ -313,10 +344,12 @@ static void merge(struct mergelist *merges, size_t nmerges, unsigned char *map,
 	while (head != NULL) {
 		struct index ix = *((struct index *) (map + head->start));
 		long long pos = *geompos;
-		fwrite_check(geom_map + ix.start, 1, ix.end - ix.start, geom_out, "merge geometry");
-		*geompos += ix.end - ix.start;
 		int feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
-		serialize_byte(geom_out, feature_minzoom, geompos, "merge geometry");
+		if (ix.end > ix.start) {
+			fwrite_check(geom_map + ix.start, 1, ix.end - ix.start, geom_out, "merge geometry");
+			*geompos += ix.end - ix.start;
+			serialize_byte(geom_out, feature_minzoom, geompos, "merge geometry");
+		}
 
 		// Count this as an 75%-accomplishment, since we already 25%-counted it
 		*progress += (ix.end - ix.start) * 3 / 4;
@@ -365,6 +398,11 @@ void *run_sort(void *v) {
 			end = a->indexpos;
 		}
 
+		trace_scope ts("run_sort", "sort");
+		if (tracing) {
+			ts.args = ssprintf("\"bytes\":%lld", end - start);
+		}
+
 		a->merges[start / a->unit].start = start;
 		a->merges[start / a->unit].end = end;
 		a->merges[start / a->unit].next = NULL;
@@ -400,7 +438,7 @@ void *run_sort(void *v) {
 	return NULL;
 }
 
-void do_read_parallel(char *map, long long len, long long initial_offset, const char *reading, std::vector<struct reader> *readers, std::atomic<long long> *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, int basezoom, int source, std::vector<std::map<std::string, layermap_entry> > *layermaps, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
+void do_read_parallel(char *map, long long len, long long initial_offset, const char *reading, std::vector<struct reader> *readers, std::atomic<long long> *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, int basezoom, int source, std::vector<std::map<std::string, layermap_entry> > *layermaps, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters, compiled_filter *filter) {
 	std::vector<long long> segs(CPUS + 1);
 	segs[0] = 0;
 	segs[CPUS] = len;
@@ -452,6 +490,7 @@ void do_read_parallel(char *map, long long len, long long initial_offset, const
 		sst[i].maxzoom = maxzoom;
 		sst[i].uses_gamma = uses_gamma;
 		sst[i].filters = filters;
+		sst[i].filter = filter;
 		sst[i].layermap = &(*layermaps)[i];
 		sst[i].exclude = exclude;
 		sst[i].include = include;
@@ -602,6 +641,7 @@ struct read_parallel_arg {
 	size_t *dist_count = NULL;
 	bool want_dist = false;
 	bool filters = false;
+	compiled_filter *filter = NULL;
 };
 
 void *run_read_parallel(void *v) {
@@ -623,7 +663,7 @@ void *run_read_parallel(void *v) {
 	}
 	madvise(map, rpa->len, MADV_RANDOM);  // sequential, but from several pointers at once
 
-	do_read_parallel(map, rpa->len, rpa->offset, rpa->reading, rpa->readers, rpa->progress_seq, rpa->exclude, rpa->include, rpa->exclude_all, rpa->basezoom, rpa->source, rpa->layermaps, rpa->initialized, rpa->initial_x, rpa->initial_y, rpa->maxzoom, rpa->layername, rpa->uses_gamma, rpa->attribute_types, rpa->separator, rpa->dist_sum, rpa->dist_count, rpa->want_dist, rpa->filters);
+	do_read_parallel(map, rpa->len, rpa->offset, rpa->reading, rpa->readers, rpa->progress_seq, rpa->exclude, rpa->include, rpa->exclude_all, rpa->basezoom, rpa->source, rpa->layermaps, rpa->initialized, rpa->initial_x, rpa->initial_y, rpa->maxzoom, rpa->layername, rpa->uses_gamma, rpa->attribute_types, rpa->separator, rpa->dist_sum, rpa->dist_count, rpa->want_dist, rpa->filters, rpa->filter);
 
 	madvise(map, rpa->len, MADV_DONTNEED);
 	if (munmap(map, rpa->len) != 0) {
@@ -640,7 +680,7 @@ void *run_read_parallel(void *v) {
 	return NULL;
 }
 
-void start_parsing(int fd, STREAM *fp, long long offset, long long len, std::atomic<int> *is_parsing, pthread_t *parallel_parser, bool &parser_created, const char *reading, std::vector<struct reader> *readers, std::atomic<long long> *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, int basezoom, int source, std::vector<std::map<std::string, layermap_entry> > &layermaps, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters) {
+void start_parsing(int fd, STREAM *fp, long long offset, long long len, std::atomic<int> *is_parsing, pthread_t *parallel_parser, bool &parser_created, const char *reading, std::vector<struct reader> *readers, std::atomic<long long> *progress_seq, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, int basezoom, int source, std::vector<std::map<std::string, layermap_entry> > &layermaps, int *initialized, unsigned *initial_x, unsigned *initial_y, int maxzoom, std::string layername, bool uses_gamma, std::map<std::string, int> const *attribute_types, int separator, double *dist_sum, size_t *dist_count, bool want_dist, bool filters, compiled_filter *filter) {
 	// This has to kick off an intermediate thread to start the parser threads,
 	// so the main thread can get back to reading the next input stage while
 	// the intermediate thread waits for the completion of the parser threads.
@@ -680,6 +720,7 @@ void start_parsing(int fd, STREAM *fp, long long offset, long long len, std::ato
 	rpa->dist_count = dist_count;
 	rpa->want_dist = want_dist;
 	rpa->filters = filters;
+	rpa->filter = filter;
 
 	if (pthread_create(parallel_parser, NULL, run_read_parallel, rpa) != 0) {
 		perror("pthread_create");
@@ -688,7 +729,16 @@ void start_parsing(int fd, STREAM *fp, long long offset, long long len, std::ato
 	parser_created = true;
 }
 
-void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int splits, long long mem, const char *tmpdir, long long *availfiles, FILE *geomfile, FILE *indexfile, std::atomic<long long> *geompos_out, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, int basezoom, double droprate, double gamma, struct drop_state *ds) {
+// Where to find each reader's strings in the merged string pool while splitting
+// the readers' features out for sorting, and where to write their merged metadata.
+struct string_remap {
+	std::vector<pool_remap> *remaps = NULL;
+	std::vector<char *> *metas = NULL;
+	FILE *metafile = NULL;
+	std::atomic<long long> *metapos = NULL;
+};
+
+void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int splits, long long mem, const char *tmpdir, long long *availfiles, FILE *geomfile, FILE *indexfile, std::atomic<long long> *geompos_out, long long *progress, long long *progress_max, long long *progress_reported, int maxzoom, int basezoom, double droprate, double gamma, struct drop_state *ds, struct string_remap *sr) {
 	// Arranged as bits to facilitate subdividing again if a subdivided file is still huge
 	int splitbits = log(splits) / log(2);
 	splits = 1 << splitbits;
@@ -756,21 +806,21 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 			}
 			madvise(indexmap, indexst.st_size, MADV_SEQUENTIAL);
 			madvise(indexmap, indexst.st_size, MADV_WILLNEED);
-			char *geommap = (char *) mmap(NULL, geomst.st_size, PROT_READ, MAP_PRIVATE, geomfds_in[i], 0);
-			if (geommap == MAP_FAILED) {
-				perror("map geom");
-				exit(EXIT_FAILURE);
-			}
-			madvise(geommap, geomst.st_size, MADV_SEQUENTIAL);
-			madvise(geommap, geomst.st_size, MADV_WILLNEED);
+			char *geommap = map_geometry(geomfds_in[i], geomst.st_size, MADV_SEQUENTIAL);
 
 			for (size_t a = 0; a < indexst.st_size / sizeof(struct index); a++) {
 				struct index ix = indexmap[a];
 				unsigned long long which = (ix.ix << prefix) >> (64 - splitbits);
 				long long pos = sub_geompos[which];
 
-				fwrite_check(geommap + ix.start, ix.end - ix.start, 1, geomfiles[which], "geom");
-				sub_geompos[which] += ix.end - ix.start;
+				if (ix.end == ix.start) {
+					// Rejected by the filter while reading, so there is no geometry
+				} else if (sr != NULL) {
+					remap_feature_strings(geommap + ix.start, geommap + ix.end, geomfiles[which], &sub_geompos[which], (*sr->metas)[i], (*sr->remaps)[i], sr->metafile, sr->metapos, "geom");
+				} else {
+					fwrite_check(geommap + ix.start, ix.end - ix.start, 1, geomfiles[which], "geom");
+					sub_geompos[which] += ix.end - ix.start;
+				}
 
 				// Count this as a 25%-accomplishment, since we will copy again
 				*progress += (ix.end - ix.start) / 4;
@@ -790,11 +840,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				perror("unmap index");
 				exit(EXIT_FAILURE);
 			}
-			madvise(geommap, geomst.st_size, MADV_DONTNEED);
-			if (munmap(geommap, geomst.st_size) < 0) {
-				perror("unmap geom");
-				exit(EXIT_FAILURE);
-			}
+			unmap_geometry(geommap, geomst.st_size);
 		}
 
 		if (close(geomfds_in[i]) < 0) {
@@ -898,26 +944,19 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				}
 				madvise(indexmap, indexst.st_size, MADV_RANDOM);  // sequential, but from several pointers at once
 				madvise(indexmap, indexst.st_size, MADV_WILLNEED);
-				char *geommap = (char *) mmap(NULL, geomst.st_size, PROT_READ, MAP_PRIVATE, geomfds[i], 0);
-				if (geommap == MAP_FAILED) {
-					perror("map geom");
-					exit(EXIT_FAILURE);
-				}
-				madvise(geommap, geomst.st_size, MADV_RANDOM);
-				madvise(geommap, geomst.st_size, MADV_WILLNEED);
+				char *geommap = map_geometry(geomfds[i], geomst.st_size, MADV_RANDOM);
 
-				merge(&merges[0], nmerges, (unsigned char *) indexmap, indexfile, bytes, geommap, geomfile, geompos_out, progress, progress_max, progress_reported, maxzoom, gamma, ds);
+				{
+					trace_scope ts("merge", "sort");
+					merge(&merges[0], nmerges, (unsigned char *) indexmap, indexfile, bytes, geommap, geomfile, geompos_out, progress, progress_max, progress_reported, maxzoom, gamma, ds);
+				}
 
 				madvise(indexmap, indexst.st_size, MADV_DONTNEED);
 				if (munmap(indexmap, indexst.st_size) < 0) {
 					perror("unmap index");
 					exit(EXIT_FAILURE);
 				}
-				madvise(geommap, geomst.st_size, MADV_DONTNEED);
-				if (munmap(geommap, geomst.st_size) < 0) {
-					perror("unmap geom");
-					exit(EXIT_FAILURE);
-				}
+				unmap_geometry(geommap, geomst.st_size);
 			} else if (indexst.st_size == sizeof(struct index) || prefix + splitbits >= 64) {
 				struct index *indexmap = (struct index *) mmap(NULL, indexst.st_size, PROT_READ, MAP_PRIVATE, indexfds[i], 0);
 				if (indexmap == MAP_FAILED) {
@@ -927,22 +966,18 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				}
 				madvise(indexmap, indexst.st_size, MADV_SEQUENTIAL);
 				madvise(indexmap, indexst.st_size, MADV_WILLNEED);
-				char *geommap = (char *) mmap(NULL, geomst.st_size, PROT_READ, MAP_PRIVATE, geomfds[i], 0);
-				if (geommap == MAP_FAILED) {
-					perror("map geom");
-					exit(EXIT_FAILURE);
-				}
-				madvise(geommap, geomst.st_size, MADV_RANDOM);
-				madvise(geommap, geomst.st_size, MADV_WILLNEED);
+				char *geommap = map_geometry(geomfds[i], geomst.st_size, MADV_RANDOM);
 
 				for (size_t a = 0; a < indexst.st_size / sizeof(struct index); a++) {
 					struct index ix = indexmap[a];
 					long long pos = *geompos_out;
 
-					fwrite_check(geommap + ix.start, ix.end - ix.start, 1, geomfile, "geom");
-					*geompos_out += ix.end - ix.start;
 					int feature_minzoom = calc_feature_minzoom(&ix, ds, maxzoom, gamma);
-					serialize_byte(geomfile, feature_minzoom, geompos_out, "merge geometry");
+					if (ix.end > ix.start) {
+						fwrite_check(geommap + ix.start, ix.end - ix.start, 1, geomfile, "geom");
+						*geompos_out += ix.end - ix.start;
+						serialize_byte(geomfile, feature_minzoom, geompos_out, "merge geometry");
+					}
 
 					// Count this as an 75%-accomplishment, since we already 25%-counted it
 					*progress += (ix.end - ix.start) * 3 / 4;
@@ -961,11 +996,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 					perror("unmap index");
 					exit(EXIT_FAILURE);
 				}
-				madvise(geommap, geomst.st_size, MADV_DONTNEED);
-				if (munmap(geommap, geomst.st_size) < 0) {
-					perror("unmap geom");
-					exit(EXIT_FAILURE);
-				}
+				unmap_geometry(geommap, geomst.st_size);
 			} else {
 				// We already reported the progress from splitting this radix out
 				// but we need to split it again, which will be credited with more
@@ -974,7 +1005,7 @@ void radix1(int *geomfds_in, int *indexfds_in, int inputs, int prefix, int split
 				// counter backward but will be an honest estimate of the work remaining.
 				*progress_max += geomst.st_size / 4;
 
-				radix1(&geomfds[i], &indexfds[i], 1, prefix + splitbits, *availfiles / 4, mem, tmpdir, availfiles, geomfile, indexfile, geompos_out, progress, progress_max, progress_reported, maxzoom, basezoom, droprate, gamma, ds);
+				radix1(&geomfds[i], &indexfds[i], 1, prefix + splitbits, *availfiles / 4, mem, tmpdir, availfiles, geomfile, indexfile, geompos_out, progress, progress_max, progress_reported, maxzoom, basezoom, droprate, gamma, ds, NULL);
 				already_closed = 1;
 			}
 		}
@@ -1013,7 +1044,7 @@ void prep_drop_states(struct drop_state *ds, int maxzoom, int basezoom, double d
 	}
 }
 
-void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FILE *indexfile, const char *tmpdir, std::atomic<long long> *geompos, int maxzoom, int basezoom, double droprate, double gamma) {
+void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FILE *indexfile, const char *tmpdir, std::atomic<long long> *geompos, int maxzoom, int basezoom, double droprate, double gamma, struct string_remap *sr) {
 	// Run through the index and geometry for each reader,
 	// splitting the contents out by index into as many
 	// sub-files as we can write to simultaneously.
@@ -1023,6 +1054,9 @@ void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FI
 
 	// Then concatenate each of the sub-outputs into a final output.
 
+	// The first pass also translates each reader's string references
+	// into the merged string pool.
+
 	long long mem;
 
 #ifdef __APPLE__
@@ -1051,7 +1085,7 @@ void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FI
 	}
 
 	long long availfiles = MAX_FILES - 2 * nreaders  // each reader has a geom and an index
-			       - 4			 // pool, meta, mbtiles, mbtiles journal
+			       - 5			 // pool, meta (FILE and fd), mbtiles, mbtiles journal
 			       - 4			 // top-level geom and index output, both FILE and fd
 			       - 3;			 // stdin, stdout, stderr
 
@@ -1082,7 +1116,7 @@ void radix(std::vector<struct reader> &readers, int nreaders, FILE *geomfile, FI
 
 	long long progress = 0, progress_max = geom_total, progress_reported = -1;
 	long long availfiles_before = availfiles;
-	radix1(&geomfds[0], &indexfds[0], nreaders, 0, splits, mem, tmpdir, &availfiles, geomfile, indexfile, geompos, &progress, &progress_max, &progress_reported, maxzoom, basezoom, droprate, gamma, &ds[0]);
+	radix1(&geomfds[0], &indexfds[0], nreaders, 0, splits, mem, tmpdir, &availfiles, geomfile, indexfile, geompos, &progress, &progress_max, &progress_reported, maxzoom, basezoom, droprate, gamma, &ds[0], sr);
 
 	if (availfiles - 2 * nreaders != availfiles_before) {
 		fprintf(stderr, "Internal error: miscounted available file descriptors: %lld vs %lld\n", availfiles - 2 * nreaders, availfiles);
@@ -1141,7 +1175,335 @@ void choose_first_zoom(long long *file_bbox, std::vector<struct reader> &readers
 	}
 }
 
-int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, json_object *filter, double droprate, int buffer, const char *tmpdir, double gamma, int read_parallel, int forcetable, const char *attribution, bool uses_gamma, long long *file_bbox, const char *prefilter, const char *postfilter, const char *description, bool guess_maxzoom, std::map<std::string, int> const *attribute_types, const char *pgm, std::map<std::string, attribute_op> const *attribute_accum, std::map<std::string, std::string> const &attribute_descriptions, std::string const &commandline) {
+static void erase_range(sqlite3 *outdb, sqlite3_stmt *stmt, int z, long long x1, long long x2, long long y1, long long y2) {
+	sqlite3_bind_int(stmt, 1, z);
+	sqlite3_bind_int64(stmt, 2, x1);
+	sqlite3_bind_int64(stmt, 3, x2);
+	sqlite3_bind_int64(stmt, 4, (1LL << z) - 1 - y2);  // TMS
+	sqlite3_bind_int64(stmt, 5, (1LL << z) - 1 - y1);
+
+	if (sqlite3_step(stmt) != SQLITE_DONE) {
+		fprintf(stderr, "sqlite3 delete failed: %s\n", sqlite3_errmsg(outdb));
+		exit(EXIT_FAILURE);
+	}
+	sqlite3_reset(stmt);
+}
+
+// Remove the tiles that are about to be made again, so that any that
+// turn out empty this time don't leave the old ones behind.
+// In an mbtiles file, this starts a transaction that the new tiles are
+// written in too, so that none of the old ones are gone until
+// commit_tiles() replaces them all at once.
+static void erase_tiles(sqlite3 *outdb, const char *outdir, tile_mask const &mask, int maxzoom) {
+	if (outdb != NULL) {
+		char *err = NULL;
+		if (sqlite3_exec(outdb, "BEGIN TRANSACTION;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "begin transaction: %s\n", err);
+			exit(EXIT_FAILURE);
+		}
+
+		sqlite3_stmt *stmt;
+		const char *query = "DELETE FROM tiles WHERE zoom_level = ? AND tile_column BETWEEN ? AND ? AND tile_row BETWEEN ? AND ?";
+		if (sqlite3_prepare_v2(outdb, query, -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 delete prep failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_FAILURE);
+		}
+
+		for (auto const &r : mask.roots) {
+			for (int z = std::get<0>(r); z <= maxzoom; z++) {
+				int shift = z - std::get<0>(r);
+				long long x1 = (long long) std::get<1>(r) << shift;
+				long long x2 = (((long long) std::get<1>(r) + 1) << shift) - 1;
+				long long y1 = (long long) std::get<2>(r) << shift;
+				long long y2 = (((long long) std::get<2>(r) + 1) << shift) - 1;
+
+				erase_range(outdb, stmt, z, x1, x2, y1, y2);
+			}
+		}
+
+		for (auto const &t : mask.tiles) {
+			erase_range(outdb, stmt, std::get<0>(t), std::get<1>(t), std::get<1>(t), std::get<2>(t), std::get<2>(t));
+		}
+
+		sqlite3_finalize(stmt);
+	} else {
+		std::vector<zxy> tiles = enumerate_dirtiles(outdir, 0, maxzoom);
+
+		for (auto &t : tiles) {
+			if (mask.write(t.z, t.x, t.y)) {
+				std::string fn = std::string(outdir) + "/" + t.path();
+				if (unlink(fn.c_str()) != 0) {
+					perror(fn.c_str());
+					exit(EXIT_FAILURE);
+				}
+			}
+		}
+	}
+}
+
+static void commit_tiles(sqlite3 *outdb) {
+	if (outdb != NULL) {
+		char *err = NULL;
+		if (sqlite3_exec(outdb, "COMMIT;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "commit: %s\n", err);
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+// The layer tables of the stored features' segments, from their names
+static std::vector<std::map<std::string, layermap_entry>> stored_layermaps(feature_store const &fs) {
+	std::vector<std::map<std::string, layermap_entry>> layermaps(fs.layers.size());
+
+	for (size_t seg = 0; seg < fs.layers.size(); seg++) {
+		for (size_t id = 0; id < fs.layers[seg].size(); id++) {
+			layermaps[seg].insert(std::pair<std::string, layermap_entry>(fs.layers[seg][id], layermap_entry(id)));
+		}
+	}
+
+	return layermaps;
+}
+
+// The position in the spatial order that features are sorted into as they are read
+static unsigned long long feature_order(serial_feature const &sf) {
+	long long midx = (sf.bbox[0] / 2 + sf.bbox[2] / 2) & ((1LL << 32) - 1);
+	long long midy = (sf.bbox[1] / 2 + sf.bbox[3] / 2) & ((1LL << 32) - 1);
+	return encode_index(midx, midy);
+}
+
+// Put the features that were just read, which are changes to the features in the
+// feature store, together with the stored features that they don't replace or delete.
+// The stored features keep their segments, and the new ones are numbered after them.
+// Every tile that a replaced, deleted, or added feature could appear in is added to mask.
+// Returns the file descriptor of the combined features.
+//
+// The stored features keep the minzooms that dropping gave them. A feature that replaces
+// a stored one takes over its minzoom, and an added feature gets the minzoom that its
+// place in the stored sequence gives it, so the rest of the tileset stays as it was.
+static int merge_changes(const char *store_dir, feature_store const &previous, int geomfd, char *meta, unsigned *initial_x, unsigned *initial_y, std::vector<std::vector<unsigned long long>> const &deleted_ids, unsigned iz, unsigned ix, unsigned iy, int buffer, int maxzoom, int basezoom, double droprate, double gamma, tile_mask &mask, const char *tmpdir, const char *fname) {
+	size_t segments = previous.layers.size();
+	std::vector<long long> meta_off(segments + CPUS);
+	std::vector<unsigned> stored_x = previous.initial_x;
+	std::vector<unsigned> stored_y = previous.initial_y;
+
+	long long storedsize;
+	char *stored = store_map(store_dir, "geom", &storedsize);
+
+	struct stat geomst;
+	if (fstat(geomfd, &geomst) != 0) {
+		perror("stat changed geom");
+		exit(EXIT_FAILURE);
+	}
+	char *changes = (char *) mmap(NULL, geomst.st_size, PROT_READ, MAP_PRIVATE, geomfd, 0);
+	if (changes == MAP_FAILED) {
+		perror("mmap changed geom");
+		exit(EXIT_FAILURE);
+	}
+
+	// Skip the first tile of each, which is replaced by the one they share
+	int z;
+	unsigned x, y;
+	char *p = stored;
+	deserialize_int(&p, &z);
+	deserialize_uint(&p, &x);
+	deserialize_uint(&p, &y);
+	std::atomic<long long> spos(p - stored);
+
+	p = changes;
+	deserialize_int(&p, &z);
+	deserialize_uint(&p, &x);
+	deserialize_uint(&p, &y);
+	std::atomic<long long> cpos(p - changes);
+
+	// A stored feature is left out if a changed feature has its ID
+	std::set<unsigned long long> ids;
+	for (auto const &d : deleted_ids) {
+		ids.insert(d.begin(), d.end());
+	}
+	{
+		std::atomic<long long> pos(cpos.load());
+		while (true) {
+			serial_feature sf = deserialize_feature(changes, &pos, meta, &meta_off[0], 0, 0, 0, initial_x, initial_y);
+			if (sf.t < 0) {
+				break;
+			}
+
+			if (sf.has_id) {
+				ids.insert(sf.id);
+			}
+			mask.add_area(sf.bbox, buffer, maxzoom);
+		}
+	}
+
+	// The minzooms of the stored features that are being replaced
+	std::map<unsigned long long, signed char> replaced_minzoom;
+	{
+		std::atomic<long long> pos(spos.load());
+		while (true) {
+			serial_feature sf = deserialize_feature(stored, &pos, meta, &meta_off[0], 0, 0, 0, &stored_x[0], &stored_y[0]);
+			if (sf.t < 0) {
+				break;
+			}
+
+			if (sf.has_id && ids.count(sf.id) > 0) {
+				replaced_minzoom.insert(std::pair<unsigned long long, signed char>(sf.id, sf.feature_minzoom));
+			}
+		}
+	}
+
+	// Every stored feature, including the ones that are removed, keeps its place in the
+	// dropping sequence, and each added feature takes a new place in it
+	std::vector<struct drop_state> ds(maxzoom + 1);
+	prep_drop_states(&ds[0], maxzoom, basezoom, droprate);
+
+	std::string s_geomname = ssprintf("%s%s", tmpdir, "/geom.XXXXXXXX");
+	char *geomname = &s_geomname[0];
+	int outfd = mkstemp_cloexec(geomname);
+	if (outfd < 0) {
+		perror(geomname);
+		exit(EXIT_FAILURE);
+	}
+	FILE *geomfile = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
+	if (geomfile == NULL) {
+		perror(geomname);
+		exit(EXIT_FAILURE);
+	}
+	unlink(geomname);
+
+	std::atomic<long long> geompos(0);
+	serialize_int(geomfile, iz, &geompos, fname);
+	serialize_uint(geomfile, ix, &geompos, fname);
+	serialize_uint(geomfile, iy, &geompos, fname);
+
+	long long kept = 0, removed = 0, added = 0;
+
+	long long sstart = spos, cstart = cpos;
+	serial_feature s = deserialize_feature(stored, &spos, meta, &meta_off[0], 0, 0, 0, &stored_x[0], &stored_y[0]);
+	serial_feature c = deserialize_feature(changes, &cpos, meta, &meta_off[0], 0, 0, 0, initial_x, initial_y);
+
+	while (s.t >= 0 || c.t >= 0) {
+		if (c.t < 0 || (s.t >= 0 && feature_order(s) <= feature_order(c))) {
+			struct index si;
+			si.ix = feature_order(s);
+			si.t = s.t;
+			calc_feature_minzoom(&si, &ds[0], maxzoom, gamma);
+
+			if (s.has_id && ids.count(s.id) > 0) {
+				mask.add_area(s.bbox, buffer, maxzoom);
+				removed++;
+			} else {
+				fwrite_check(stored + sstart, sizeof(char), spos - sstart, geomfile, fname);
+				geompos += spos - sstart;
+				kept++;
+			}
+
+			sstart = spos;
+			s = deserialize_feature(stored, &spos, meta, &meta_off[0], 0, 0, 0, &stored_x[0], &stored_y[0]);
+		} else {
+			int feature_minzoom;
+			auto r = c.has_id ? replaced_minzoom.find(c.id) : replaced_minzoom.end();
+			if (r != replaced_minzoom.end()) {
+				feature_minzoom = r->second;
+			} else {
+				struct index ci;
+				ci.ix = feature_order(c);
+				ci.t = c.t;
+				feature_minzoom = calc_feature_minzoom(&ci, &ds[0], maxzoom, gamma);
+			}
+
+			resegment_feature(changes + cstart, changes + cpos, geomfile, &geompos, c.segment + segments, feature_minzoom, fname);
+			added++;
+
+			cstart = cpos;
+			c = deserialize_feature(changes, &cpos, meta, &meta_off[0], 0, 0, 0, initial_x, initial_y);
+		}
+	}
+
+	serialize_byte(geomfile, -2, &geompos, fname);
+	if (fclose(geomfile) != 0) {
+		perror("fclose geom");
+		exit(EXIT_FAILURE);
+	}
+
+	store_unmap(stored, storedsize);
+	if (munmap(changes, geomst.st_size) != 0) {
+		perror("munmap changed geom");
+	}
+	if (close(geomfd) != 0) {
+		perror("close changed geom");
+	}
+
+	if (!quiet) {
+		fprintf(stderr, "Kept %lld stored features, replaced or deleted %lld, and added %lld\n", kept, removed, added);
+	}
+
+	return outfd;
+}
+
+static void write_tileset_metadata(sqlite3 *outdb, const char *outdir, const char *fname, int minzoom, int maxzoom, unsigned midx, unsigned midy, long long const *file_bbox, std::vector<std::map<std::string, layermap_entry>> const &layermaps, int forcetable, const char *attribution, const char *description, std::map<std::string, std::string> const &attribute_descriptions, std::string const &commandline) {
+	double minlat = 0, minlon = 0, maxlat = 0, maxlon = 0, midlat = 0, midlon = 0;
+
+	tile2lonlat(midx, midy, maxzoom, &minlon, &maxlat);
+	tile2lonlat(midx + 1, midy + 1, maxzoom, &maxlon, &minlat);
+
+	midlat = (maxlat + minlat) / 2;
+	midlon = (maxlon + minlon) / 2;
+
+	tile2lonlat(file_bbox[0], file_bbox[1], 32, &minlon, &maxlat);
+	tile2lonlat(file_bbox[2], file_bbox[3], 32, &maxlon, &minlat);
+
+	if (midlat < minlat) {
+		midlat = minlat;
+	}
+	if (midlat > maxlat) {
+		midlat = maxlat;
+	}
+	if (midlon < minlon) {
+		midlon = minlon;
+	}
+	if (midlon > maxlon) {
+		midlon = maxlon;
+	}
+
+	std::map<std::string, layermap_entry> merged_lm = merge_layermaps(layermaps);
+
+	for (auto ai = merged_lm.begin(); ai != merged_lm.end(); ++ai) {
+		ai->second.minzoom = minzoom;
+		ai->second.maxzoom = maxzoom;
+	}
+
+	{
+		trace_scope ts("metadata", "phase");
+		mbtiles_write_metadata(outdb, outdir, fname, minzoom, maxzoom, minlat, minlon, maxlat, maxlon, midlat, midlon, forcetable, attribution, merged_lm, true, description, !prevent[P_TILE_STATS], attribute_descriptions, "tippecanoe", commandline);
+	}
+}
+
+// After an update, the bounds and the layers and attributes that the metadata
+// describes are those of everything in the feature store, not just the changes
+static void update_tileset_metadata(sqlite3 *outdb, const char *outdir, int minzoom, int maxzoom, long long const *file_bbox, std::map<std::string, layermap_entry> const &layermap, std::map<std::string, std::string> const &attribute_descriptions) {
+	double minlat = 0, minlon = 0, maxlat = 0, maxlon = 0;
+
+	tile2lonlat(file_bbox[0], file_bbox[1], 32, &minlon, &maxlat);
+	tile2lonlat(file_bbox[2], file_bbox[3], 32, &maxlon, &minlat);
+
+	std::map<std::string, layermap_entry> lm = layermap;
+	for (auto ai = lm.begin(); ai != lm.end(); ++ai) {
+		ai->second.minzoom = minzoom;
+		ai->second.maxzoom = maxzoom;
+	}
+
+	{
+		trace_scope ts("metadata", "phase");
+		sqlite3 *db = outdb != NULL ? outdb : dirmeta2tmp(outdir);
+		mbtiles_update_metadata(db, outdir, minlat, minlon, maxlat, maxlon, lm, !prevent[P_TILE_STATS], attribute_descriptions);
+		if (outdb == NULL && sqlite3_close(db) != SQLITE_OK) {
+			fprintf(stderr, "Could not close temp database: %s\n", sqlite3_errmsg(db));
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzoom, int basezoom, double basezoom_marker_width, sqlite3 *outdb, const char *outdir, std::set<std::string> *exclude, std::set<std::string> *include, int exclude_all, compiled_filter *filter, double droprate, int buffer, const char *tmpdir, double gamma, int read_parallel, int forcetable, const char *attribution, bool uses_gamma, long long *file_bbox, const char *prefilter, const char *postfilter, const char *description, bool guess_maxzoom, std::map<std::string, int> const *attribute_types, const char *pgm, std::map<std::string, attribute_op> const *attribute_accum, std::map<std::string, std::string> const &attribute_descriptions, std::string const &commandline, const char *store_dir, feature_store *previous, checkpoint *ck) {
 	int ret = EXIT_SUCCESS;
 
 	std::vector<struct reader> readers;
@@ -1220,11 +1582,6 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		unlink(geomname);
 		unlink(indexname);
 
-		// To distinguish a null value
-		{
-			struct stringpool p;
-			memfile_write(r->treefile, &p, sizeof(struct stringpool));
-		}
 		// Keep metadata file from being completely empty if no attributes
 		serialize_int(r->metafile, 0, &r->metapos, "meta");
 
@@ -1232,6 +1589,14 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		r->file_bbox[2] = r->file_bbox[3] = 0;
 	}
 
+	// When updating, features with no geometry say which ones to delete
+	std::vector<std::vector<unsigned long long>> deleted_ids(CPUS);
+	if (previous != NULL) {
+		for (size_t i = 0; i < CPUS; i++) {
+			readers[i].deleted_ids = &deleted_ids[i];
+		}
+	}
+
 	struct statfs fsstat;
 	if (fstatfs(readers[0].geomfd, &fsstat) != 0) {
 		perror("fstatfs");
@@ -1324,6 +1689,8 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 	double dist_sum = 0;
 	size_t dist_count = 0;
 
+	double read_start = trace_now();
+
 	int files_open_before_reading = open(DEV_NULL, O_RDONLY | O_CLOEXEC);
 	if (files_open_before_reading < 0) {
 		perror("open " DEV_NULL);
@@ -1396,6 +1763,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				sst[i].want_dist = guess_maxzoom;
 				sst[i].maxzoom = maxzoom;
 				sst[i].filters = prefilter != NULL || postfilter != NULL;
+				sst[i].filter = filter;
 				sst[i].uses_gamma = uses_gamma;
 				sst[i].layermap = &layermaps[i];
 				sst[i].exclude = exclude;
@@ -1452,6 +1820,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				sst[i].want_dist = guess_maxzoom;
 				sst[i].maxzoom = maxzoom;
 				sst[i].filters = prefilter != NULL || postfilter != NULL;
+				sst[i].filter = filter;
 				sst[i].uses_gamma = uses_gamma;
 				sst[i].layermap = &layermaps[i];
 				sst[i].exclude = exclude;
@@ -1510,7 +1879,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		}
 
 		if (map != NULL && map != MAP_FAILED && read_parallel_this) {
-			do_read_parallel(map, st.st_size - off, overall_offset, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, basezoom, layer, &layermaps, &initialized[0], &initial_x[0], &initial_y[0], maxzoom, sources[layer].layer, uses_gamma, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+			do_read_parallel(map, st.st_size - off, overall_offset, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, basezoom, layer, &layermaps, &initialized[0], &initial_x[0], &initial_y[0], maxzoom, sources[layer].layer, uses_gamma, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL, filter);
 			overall_offset += st.st_size - off;
 			checkdisk(&readers);
 
@@ -1588,7 +1957,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 							}
 
 							fflush(readfp);
-							start_parsing(readfd, streamfpopen(readfp), initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, basezoom, layer, layermaps, &initialized[0], &initial_x[0], &initial_y[0], maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+							start_parsing(readfd, streamfpopen(readfp), initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, basezoom, layer, layermaps, &initialized[0], &initial_x[0], &initial_y[0], maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL, filter);
 
 							initial_offset += ahead;
 							overall_offset += ahead;
@@ -1625,7 +1994,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				fflush(readfp);
 
 				if (ahead > 0) {
-					start_parsing(readfd, streamfpopen(readfp), initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, basezoom, layer, layermaps, &initialized[0], &initial_x[0], &initial_y[0], maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL);
+					start_parsing(readfd, streamfpopen(readfp), initial_offset, ahead, &is_parsing, &parallel_parser, parser_created, reading.c_str(), &readers, &progress_seq, exclude, include, exclude_all, basezoom, layer, layermaps, &initialized[0], &initial_x[0], &initial_y[0], maxzoom, sources[layer].layer, gamma != 0, attribute_types, read_parallel_this, &dist_sum, &dist_count, guess_maxzoom, prefilter != NULL || postfilter != NULL, filter);
 
 					if (parser_created) {
 						if (pthread_join(parallel_parser, NULL) != 0) {
@@ -1658,6 +2027,7 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				sst.want_dist = guess_maxzoom;
 				sst.maxzoom = maxzoom;
 				sst.filters = prefilter != NULL || postfilter != NULL;
+				sst.filter = filter;
 				sst.uses_gamma = uses_gamma;
 				sst.layermap = &layermaps[0];
 				sst.exclude = exclude;
@@ -1725,9 +2095,10 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		}
 	}
 
-	// Create a combined string pool and a combined metadata file
-	// but keep track of the offsets into it since we still need
-	// segment+offset to find the data.
+	// Create a combined string pool, with each distinct string stored only once
+	// even if several input threads encountered it, and a combined metadata file.
+	// The features are rewritten to refer to these during the first radix sort pass,
+	// so afterwards the segment offsets are all zero.
 
 	// 2 * CPUS: One per input thread, one per tiling thread
 	std::vector<long long> pool_off(2 * CPUS);
@@ -1745,94 +2116,126 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		exit(EXIT_FAILURE);
 	}
 
-	FILE *poolfile = fopen_oflag(poolname, "wb", O_WRONLY | O_CLOEXEC);
+	unlink(poolname);
+
+	std::string s_treename = ssprintf("%s%s", tmpdir, "/tree.XXXXXXXX");
+	char* treename = &s_treename[0];
+
+	int treefd = mkstemp_cloexec(treename);
+	if (treefd < 0) {
+		perror(treename);
+		exit(EXIT_FAILURE);
+	}
+
+	unlink(treename);
+
+	struct memfile *poolfile = memfile_open(poolfd);
 	if (poolfile == NULL) {
-		perror(poolname);
+		perror("open pool");
+		exit(EXIT_FAILURE);
+	}
+	struct memfile *treefile = memfile_open(treefd);
+	if (treefile == NULL) {
+		perror("open tree");
 		exit(EXIT_FAILURE);
 	}
 
-	unlink(poolname);
+	// When updating, the stored features' strings come first, at the same
+	// offsets as before, so the stored features can refer to them unchanged
+	if (previous != NULL) {
+		long long size;
+		char *pool = store_map(store_dir, "pool", &size);
 
-	std::string s_metaname = ssprintf("%s%s", tmpdir, "/meta.XXXXXXXX");
-	char* metaname = &s_metaname[0];
+		for (char *p = pool; p != NULL && p < pool + size; p += strlen(p + 1) + 2) {
+			if (addpool(poolfile, treefile, p + 1, p[0]) != p - pool) {
+				fprintf(stderr, "%s: string pool is out of order\n", store_dir);
+				exit(EXIT_FAILURE);
+			}
+		}
 
-	int metafd = mkstemp_cloexec(metaname);
-	if (metafd < 0) {
-		perror(metaname);
-		exit(EXIT_FAILURE);
+		store_unmap(pool, size);
 	}
 
-	FILE *metafile = fopen_oflag(metaname, "wb", O_WRONLY | O_CLOEXEC);
-	if (metafile == NULL) {
-		perror(metaname);
-		exit(EXIT_FAILURE);
+	std::vector<pool_remap> pool_remaps(CPUS);
+	for (size_t i = 0; i < CPUS; i++) {
+		char *p = readers[i].poolfile->map;
+		char *end = p + readers[i].poolfile->off;
+
+		while (p < end) {
+			long long off = addpool(poolfile, treefile, p + 1, p[0]);
+
+			pool_remaps[i].from.push_back(p - readers[i].poolfile->map);
+			pool_remaps[i].to.push_back(off);
+
+			p += strlen(p + 1) + 2;
+		}
+
+		memfile_close(readers[i].poolfile);
 	}
 
-	unlink(metaname);
+	// Find the attribute names that the feature filter refers to in the
+	// string pool, so features can be matched by pool offset
+	if (filter != NULL) {
+		for (size_t i = 0; i < filter->keys.size(); i++) {
+			filter->key_offsets[i] = findpool(poolfile, treefile, filter->keys[i].c_str(), mvt_string);
+		}
+	}
 
-	std::atomic<long long> metapos(0);
-	std::atomic<long long> poolpos(0);
+	memfile_close(treefile);
 
+	std::vector<char *> unmerged_meta(CPUS);
 	for (size_t i = 0; i < CPUS; i++) {
+		unmerged_meta[i] = NULL;
+
 		if (readers[i].metapos > 0) {
-			void *map = mmap(NULL, readers[i].metapos, PROT_READ, MAP_PRIVATE, readers[i].metafd, 0);
-			if (map == MAP_FAILED) {
+			unmerged_meta[i] = (char *) mmap(NULL, readers[i].metapos, PROT_READ, MAP_PRIVATE, readers[i].metafd, 0);
+			if (unmerged_meta[i] == MAP_FAILED) {
 				perror("mmap unmerged meta");
 				exit(EXIT_FAILURE);
 			}
-			madvise(map, readers[i].metapos, MADV_SEQUENTIAL);
-			madvise(map, readers[i].metapos, MADV_WILLNEED);
-			if (fwrite(map, readers[i].metapos, 1, metafile) != 1) {
-				perror("Reunify meta");
-				exit(EXIT_FAILURE);
-			}
-			madvise(map, readers[i].metapos, MADV_DONTNEED);
-			if (munmap(map, readers[i].metapos) != 0) {
-				perror("unmap unmerged meta");
-			}
+			madvise(unmerged_meta[i], readers[i].metapos, MADV_RANDOM);
 		}
 
-		meta_off[i] = metapos;
-		metapos += readers[i].metapos;
 		if (close(readers[i].metafd) != 0) {
 			perror("close unmerged meta");
 		}
-
-		if (readers[i].poolfile->off > 0) {
-			if (fwrite(readers[i].poolfile->map, readers[i].poolfile->off, 1, poolfile) != 1) {
-				perror("Reunify string pool");
-				exit(EXIT_FAILURE);
-			}
-		}
-
-		pool_off[i] = poolpos;
-		poolpos += readers[i].poolfile->off;
-		memfile_close(readers[i].poolfile);
 	}
 
-	if (fclose(poolfile) != 0) {
-		perror("fclose pool");
+	std::string s_metaname = ssprintf("%s%s", tmpdir, "/meta.XXXXXXXX");
+	char* metaname = &s_metaname[0];
+
+	int metafd = mkstemp_cloexec(metaname);
+	if (metafd < 0) {
+		perror(metaname);
 		exit(EXIT_FAILURE);
 	}
-	if (fclose(metafile) != 0) {
-		perror("fclose meta");
+
+	FILE *metafile = fopen_oflag(metaname, "wb", O_WRONLY | O_CLOEXEC);
+	if (metafile == NULL) {
+		perror(metaname);
 		exit(EXIT_FAILURE);
 	}
 
-	char *meta = (char *) mmap(NULL, metapos, PROT_READ, MAP_PRIVATE, metafd, 0);
-	if (meta == MAP_FAILED) {
-		perror("mmap meta");
-		exit(EXIT_FAILURE);
+	unlink(metaname);
+
+	std::atomic<long long> metapos(0);
+	long long poolpos = poolfile->off;
+
+	if (previous != NULL) {
+		// Likewise the stored features' metadata, which already starts with the placeholder
+		long long size;
+		char *stored_meta = store_map(store_dir, "meta", &size);
+		fwrite_check(stored_meta, sizeof(char), size, metafile, "meta");
+		metapos += size;
+		store_unmap(stored_meta, size);
+	} else {
+		// To distinguish a null metadata position from a real one
+		serialize_int(metafile, 0, &metapos, "meta");
 	}
-	madvise(meta, metapos, MADV_RANDOM);
 
 	char *stringpool = NULL;
 	if (poolpos > 0) {  // Will be 0 if -X was specified
-		stringpool = (char *) mmap(NULL, poolpos, PROT_READ, MAP_PRIVATE, poolfd, 0);
-		if (stringpool == MAP_FAILED) {
-			perror("mmap string pool");
-			exit(EXIT_FAILURE);
-		}
+		stringpool = poolfile->map;
 		madvise(stringpool, poolpos, MADV_RANDOM);
 	}
 
@@ -1876,6 +2279,34 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		iy = justy;
 	}
 
+	if (previous != NULL) {
+		// Tiling has to start from the same tile as before for the tiles to come out
+		// the same, unless some of the changes are outside it
+		unsigned pz = previous->iz, px = previous->ix, py = previous->iy;
+
+		if (file_bbox[0] > file_bbox[2]) {
+			// No features, only deletions
+			iz = pz;
+			ix = px;
+			iy = py;
+		}
+
+		for (; iz > pz; iz--) {
+			ix >>= 1;
+			iy >>= 1;
+		}
+		for (; pz > iz; pz--) {
+			px >>= 1;
+			py >>= 1;
+		}
+		for (; ix != px || iy != py; iz--) {
+			ix >>= 1;
+			iy >>= 1;
+			px >>= 1;
+			py >>= 1;
+		}
+	}
+
 	std::atomic<long long> geompos(0);
 
 	/* initial tile is 0/0/0 */
@@ -1883,7 +2314,42 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 	serialize_uint(geomfile, ix, &geompos, fname);
 	serialize_uint(geomfile, iy, &geompos, fname);
 
-	radix(readers, CPUS, geomfile, indexfile, tmpdir, &geompos, maxzoom, basezoom, droprate, gamma);
+	struct string_remap sr;
+	sr.remaps = &pool_remaps;
+	sr.metas = &unmerged_meta;
+	sr.metafile = metafile;
+	sr.metapos = &metapos;
+
+	// How often the string pools and search trees had to be grown while reading
+	long long remaps, remapped_bytes;
+	memfile_stats(&remaps, &remapped_bytes);
+	trace_span("read", "phase", read_start, ssprintf("\"remaps\":%lld,\"remapped_bytes\":%lld", remaps, remapped_bytes));
+
+	{
+		trace_scope ts("radix", "phase");
+		radix(readers, CPUS, geomfile, indexfile, tmpdir, &geompos, maxzoom, basezoom, droprate, gamma, &sr);
+	}
+
+	for (size_t i = 0; i < CPUS; i++) {
+		if (unmerged_meta[i] != NULL) {
+			madvise(unmerged_meta[i], readers[i].metapos, MADV_DONTNEED);
+			if (munmap(unmerged_meta[i], readers[i].metapos) != 0) {
+				perror("unmap unmerged meta");
+			}
+		}
+	}
+
+	if (fclose(metafile) != 0) {
+		perror("fclose meta");
+		exit(EXIT_FAILURE);
+	}
+
+	char *meta = (char *) mmap(NULL, metapos, PROT_READ, MAP_PRIVATE, metafd, 0);
+	if (meta == MAP_FAILED) {
+		perror("mmap meta");
+		exit(EXIT_FAILURE);
+	}
+	madvise(meta, metapos, MADV_RANDOM);
 
 	/* end of tile */
 	serialize_byte(geomfile, -2, &geompos, fname);
@@ -1914,7 +2380,8 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		fprintf(stderr, "%lld features, %lld bytes of geometry, %lld bytes of separate metadata, %lld bytes of string pool\n", s, geompos_print, metapos_print, poolpos_print);
 	}
 
-	if (indexpos == 0) {
+	// An update can consist only of deletions
+	if (indexpos == 0 && previous == NULL) {
 		fprintf(stderr, "Did not read any valid geometries\n");
 		if (outdb != NULL) {
 			mbtiles_close(outdb, pgm);
@@ -1922,10 +2389,13 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		exit(EXIT_FAILURE);
 	}
 
-	struct index *map = (struct index *) mmap(NULL, indexpos, PROT_READ, MAP_PRIVATE, indexfd, 0);
-	if (map == MAP_FAILED) {
-		perror("mmap index for basezoom");
-		exit(EXIT_FAILURE);
+	struct index *map = NULL;
+	if (indexpos > 0) {
+		map = (struct index *) mmap(NULL, indexpos, PROT_READ, MAP_PRIVATE, indexfd, 0);
+		if (map == MAP_FAILED) {
+			perror("mmap index for basezoom");
+			exit(EXIT_FAILURE);
+		}
 	}
 	madvise(map, indexpos, MADV_SEQUENTIAL);
 	madvise(map, indexpos, MADV_WILLNEED);
@@ -2235,7 +2705,9 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 				fprintf(stderr, "Mismatched index at %lld: %lld vs %lld\n", ip, map[ip].start, map[ip].end);
 			}
 			int feature_minzoom = calc_feature_minzoom(&map[ip], &ds[0], maxzoom, gamma);
-			geom[map[ip].end - 1] = feature_minzoom;
+			if (map[ip].end > map[ip].start) {
+				geom[map[ip].end - 1] = feature_minzoom;
+			}
 		}
 
 		munmap(geom, geomst.st_size);
@@ -2248,6 +2720,20 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		perror("close sorted index");
 	}
 
+	// When updating, only the tiles that the changes reach are made again
+	tile_mask mask;
+	if (previous != NULL) {
+		geomfd = merge_changes(store_dir, *previous, geomfd, meta, &initial_x[0], &initial_y[0], deleted_ids, iz, ix, iy, buffer, maxzoom, basezoom, droprate, gamma, mask, tmpdir, fname);
+
+		// The stored features' segments come before the ones that were just read
+		std::vector<std::map<std::string, layermap_entry>> stored = stored_layermaps(*previous);
+		layermaps.insert(layermaps.begin(), stored.begin(), stored.end());
+		initial_x.insert(initial_x.begin(), previous->initial_x.begin(), previous->initial_x.end());
+		initial_y.insert(initial_y.begin(), previous->initial_y.begin(), previous->initial_y.end());
+		meta_off.resize(meta_off.size() + stored.size());
+		pool_off.resize(pool_off.size() + stored.size());
+	}
+
 	/* Traverse and split the geometries for each zoom level */
 
 	struct stat geomst;
@@ -2267,9 +2753,65 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		size[j] = 0;
 	}
 
+	// Keep the sorted features, so that tiles can be made again later without the input.
+	// They only replace the old store once the tiles have been made from them.
+	feature_store fs;
+	if (store_dir != NULL) {
+		store_features(store_staging(store_dir).c_str(), geomfd, meta, metapos, stringpool, poolpos, &meta_off[0], &initial_x[0], &initial_y[0], fs);
+
+		for (size_t seg = 0; seg < layermaps.size(); seg++) {
+			fs.initial_x.push_back(initial_x[seg]);
+			fs.initial_y.push_back(initial_y[seg]);
+
+			fs.layers.push_back(std::vector<std::string>());
+			for (auto const &lm : layermaps[seg]) {
+				if (lm.second.id >= fs.layers[seg].size()) {
+					fs.layers[seg].resize(lm.second.id + 1);
+				}
+				fs.layers[seg][lm.second.id] = lm.first;
+			}
+		}
+	}
+
+	// Keep what tiling needs to carry on from any zoom level, if it is interrupted
+	if (ck != NULL) {
+		ck->minzoom = minzoom;
+		ck->full_detail = full_detail;
+		ck->low_detail = low_detail;
+		ck->min_detail = min_detail;
+		ck->geometry_scale = geometry_scale;
+		ck->buffer = buffer;
+		ck->gamma = gamma;
+		for (size_t i = 0; i < 4; i++) {
+			ck->file_bbox[i] = file_bbox[i];
+		}
+		ck->commandline = commandline;
+		ck->initial_x = initial_x;
+		ck->initial_y = initial_y;
+		ck->meta_off = meta_off;
+		ck->pool_off = pool_off;
+
+		checkpoint_start(*ck, meta, metapos, stringpool, poolpos);
+	}
+
 	std::atomic<unsigned> midx(0);
 	std::atomic<unsigned> midy(0);
-	int written = traverse_zooms(&fd[0], &size[0], meta, stringpool, &midx, &midy, maxzoom, minzoom, outdb, outdir, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, &meta_off[0], &pool_off[0], &initial_x[0], &initial_y[0], simplification, layermaps, prefilter, postfilter, attribute_accum, filter);
+	std::vector<zoom_state> zooms;
+	if (previous != NULL) {
+		zooms = previous->zooms;
+		erase_tiles(outdb, outdir, mask, maxzoom);
+	}
+	double tile_start = trace_now();
+	int written = traverse_zooms(&fd[0], &size[0], meta, stringpool, &midx, &midy, maxzoom, minzoom, outdb, outdir, buffer, fname, tmpdir, gamma, full_detail, low_detail, min_detail, &meta_off[0], &pool_off[0], &initial_x[0], &initial_y[0], simplification, layermaps, prefilter, postfilter, attribute_accum, filter, zooms, previous != NULL ? &mask : NULL, ck);
+	trace_span("tile", "phase", tile_start, "");
+	stop_filters();
+
+	// An update that didn't get all the way through leaves the tileset and
+	// the feature store as they were, so that it can be tried again
+	if (previous != NULL && maxzoom != written) {
+		fprintf(stderr, "%s: Tiles were only made again through zoom %d, so nothing was updated\n", *av, written);
+		exit(EXIT_FAILURE);
+	}
 
 	if (maxzoom != written) {
 		if (written > minzoom) {
@@ -2282,6 +2824,45 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		}
 	}
 
+	if (store_dir != NULL) {
+		fs.minzoom = minzoom;
+		fs.maxzoom = maxzoom;
+		fs.full_detail = full_detail;
+		fs.low_detail = low_detail;
+		fs.min_detail = min_detail;
+		fs.geometry_scale = geometry_scale;
+		fs.buffer = buffer;
+		fs.basezoom = basezoom;
+		fs.droprate = droprate;
+		fs.zooms = zooms;
+
+		// The metadata describes the stored features along with the ones that were just read
+		std::vector<std::map<std::string, layermap_entry>> described = layermaps;
+		for (size_t i = 0; i < 4; i++) {
+			fs.file_bbox[i] = file_bbox[i];
+		}
+		if (previous != NULL) {
+			described.push_back(previous->layermap);
+			fs.file_bbox[0] = std::min(fs.file_bbox[0], previous->file_bbox[0]);
+			fs.file_bbox[1] = std::min(fs.file_bbox[1], previous->file_bbox[1]);
+			fs.file_bbox[2] = std::max(fs.file_bbox[2], previous->file_bbox[2]);
+			fs.file_bbox[3] = std::max(fs.file_bbox[3], previous->file_bbox[3]);
+		}
+		fs.layermap = merge_layermaps(described);
+
+		store_write_state(store_staging(store_dir).c_str(), fs);
+	}
+
+	// The new tiles and metadata go in before the new store, so that if this is
+	// interrupted in between, updating again from the old store makes the same ones
+	if (previous != NULL) {
+		update_tileset_metadata(outdb, outdir, minzoom, maxzoom, fs.file_bbox, fs.layermap, attribute_descriptions);
+		commit_tiles(outdb);
+	}
+	if (store_dir != NULL) {
+		store_commit(store_dir);
+	}
+
 	madvise(meta, metapos, MADV_DONTNEED);
 	if (munmap(meta, metapos) != 0) {
 		perror("munmap meta");
@@ -2290,49 +2871,229 @@ int read_input(std::vector<source> &sources, char *fname, int maxzoom, int minzo
 		perror("close meta");
 	}
 
-	if (poolpos > 0) {
-		madvise((void *) stringpool, poolpos, MADV_DONTNEED);
-		if (munmap(stringpool, poolpos) != 0) {
-			perror("munmap stringpool");
+	if (memfile_close(poolfile) != 0) {
+		perror("close pool");
+	}
+
+	// The rest of the metadata is still what the tileset was first made with
+	if (previous != NULL) {
+		return ret;
+	}
+
+	write_tileset_metadata(outdb, outdir, fname, minzoom, maxzoom, midx, midy, file_bbox, layermaps, forcetable, attribution, description, attribute_descriptions, commandline);
+
+	// The tileset is complete, so there is nothing left to resume
+	if (ck != NULL) {
+		checkpoint_remove(*ck);
+	}
+
+	return ret;
+}
+
+// Find the attribute names that the feature filter refers to in a string pool
+// that has already been written
+static void find_filter_keys(compiled_filter *filter, char *stringpool, long long poolsize) {
+	if (filter != NULL) {
+		for (size_t i = 0; i < filter->keys.size(); i++) {
+			filter->key_offsets[i] = -1;
+
+			for (char *p = stringpool; p != NULL && p < stringpool + poolsize; p += strlen(p + 1) + 2) {
+				if (p[0] == mvt_string && strcmp(p + 1, filter->keys[i].c_str()) == 0) {
+					filter->key_offsets[i] = p - stringpool;
+					break;
+				}
+			}
 		}
 	}
-	if (close(poolfd) < 0) {
-		perror("close pool");
+}
+
+// Make some of the tiles of an existing tileset again, from the features
+// that --feature-store kept when it was made, instead of from the input
+int regenerate_tiles(const char *store_dir, tile_mask const &mask, char *fname, sqlite3 *outdb, const char *outdir, const char *tmpdir, compiled_filter *filter, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum) {
+	feature_store fs;
+	store_read(store_dir, fs);
+
+	// The zoom levels, detail, and buffer are the ones the tiles were first made with
+	geometry_scale = fs.geometry_scale;
+
+	long long geomsize, metasize, poolsize;
+	char *geom = store_map(store_dir, "geom", &geomsize);
+	char *meta = store_map(store_dir, "meta", &metasize);
+	char *stringpool = store_map(store_dir, "pool", &poolsize);
+
+	// Use the index to pick out only the features that can reach the tiles being made
+
+	std::string s_geomname = ssprintf("%s%s", tmpdir, "/geom.XXXXXXXX");
+	char *geomname = &s_geomname[0];
+	int geomfd = mkstemp_cloexec(geomname);
+	if (geomfd < 0) {
+		perror(geomname);
+		exit(EXIT_FAILURE);
+	}
+	FILE *geomfile = fopen_oflag(geomname, "wb", O_WRONLY | O_CLOEXEC);
+	if (geomfile == NULL) {
+		perror(geomname);
+		exit(EXIT_FAILURE);
 	}
+	unlink(geomname);
 
-	double minlat = 0, minlon = 0, maxlat = 0, maxlon = 0, midlat = 0, midlon = 0;
+	std::atomic<long long> geompos(0);
+	serialize_int(geomfile, fs.iz, &geompos, fname);
+	serialize_uint(geomfile, fs.ix, &geompos, fname);
+	serialize_uint(geomfile, fs.iy, &geompos, fname);
+
+	size_t blocks = 0;
+	for (auto const &b : fs.blocks) {
+		if (mask.touches(b.bbox, fs.buffer)) {
+			fwrite_check(geom + b.start, sizeof(char), b.end - b.start, geomfile, fname);
+			geompos += b.end - b.start;
+			blocks++;
+		}
+	}
 
-	tile2lonlat(midx, midy, maxzoom, &minlon, &maxlat);
-	tile2lonlat(midx + 1, midy + 1, maxzoom, &maxlon, &minlat);
+	serialize_byte(geomfile, -2, &geompos, fname);
+	if (fclose(geomfile) != 0) {
+		perror("fclose geom");
+		exit(EXIT_FAILURE);
+	}
+	store_unmap(geom, geomsize);
 
-	midlat = (maxlat + minlat) / 2;
-	midlon = (maxlon + minlon) / 2;
+	if (!quiet) {
+		fprintf(stderr, "Using %zu of %zu blocks of features from %s\n", blocks, fs.blocks.size(), store_dir);
+	}
 
-	tile2lonlat(file_bbox[0], file_bbox[1], 32, &minlon, &maxlat);
-	tile2lonlat(file_bbox[2], file_bbox[3], 32, &maxlon, &minlat);
+	find_filter_keys(filter, stringpool, poolsize);
 
-	if (midlat < minlat) {
-		midlat = minlat;
+	// One segment per input thread of the original run, plus one per tiling thread now
+	size_t segments = fs.layers.size();
+	std::vector<long long> pool_off(segments + CPUS);
+	std::vector<long long> meta_off(segments + CPUS);
+	std::vector<unsigned> initial_x(segments + CPUS);
+	std::vector<unsigned> initial_y(segments + CPUS);
+	std::vector<std::map<std::string, layermap_entry>> layermaps = stored_layermaps(fs);
+
+	for (size_t seg = 0; seg < segments; seg++) {
+		initial_x[seg] = fs.initial_x[seg];
+		initial_y[seg] = fs.initial_y[seg];
 	}
-	if (midlat > maxlat) {
-		midlat = maxlat;
+
+	erase_tiles(outdb, outdir, mask, fs.maxzoom);
+
+	std::vector<int> fd(TEMP_FILES);
+	std::vector<off_t> size(TEMP_FILES);
+	for (size_t j = 0; j < TEMP_FILES; j++) {
+		fd[j] = -1;
+		size[j] = 0;
 	}
-	if (midlon < minlon) {
-		midlon = minlon;
+	fd[0] = geomfd;
+	size[0] = geompos;
+
+	int maxzoom = fs.maxzoom;
+	std::atomic<unsigned> midx(0);
+	std::atomic<unsigned> midy(0);
+	int written = traverse_zooms(&fd[0], &size[0], meta, stringpool, &midx, &midy, maxzoom, fs.minzoom, outdb, outdir, fs.buffer, fname, tmpdir, 0, fs.full_detail, fs.low_detail, fs.min_detail, &meta_off[0], &pool_off[0], &initial_x[0], &initial_y[0], simplification, layermaps, prefilter, postfilter, attribute_accum, filter, fs.zooms, &mask, NULL);
+	stop_filters();
+
+	store_unmap(meta, metasize);
+	store_unmap(stringpool, poolsize);
+	commit_tiles(outdb);
+
+	if (written != maxzoom) {
+		fprintf(stderr, "\n\n\n*** NOTE TILES ONLY COMPLETE THROUGH ZOOM %d ***\n\n\n", written);
+		return 100;
 	}
-	if (midlon > maxlon) {
-		midlon = maxlon;
+
+	return EXIT_SUCCESS;
+}
+
+// Carry on with a tiling run that was interrupted, from the features that
+// its --checkpoint kept for the zoom level after the last one it finished
+int resume_tiles(checkpoint &ck, char *fname, sqlite3 *outdb, const char *outdir, const char *tmpdir, compiled_filter *filter, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, int forcetable, const char *attribution, const char *description, std::map<std::string, std::string> const &attribute_descriptions) {
+	geometry_scale = ck.geometry_scale;
+
+	long long metasize, poolsize;
+	char *meta = store_map(ck.dir.c_str(), "meta", &metasize);
+	char *stringpool = store_map(ck.dir.c_str(), "pool", &poolsize);
+
+	find_filter_keys(filter, stringpool, poolsize);
+
+	// The segments of the interrupted run, plus one per tiling thread now
+	size_t segments = ck.initial_x.size();
+	std::vector<long long> pool_off = ck.pool_off;
+	std::vector<long long> meta_off = ck.meta_off;
+	std::vector<unsigned> initial_x = ck.initial_x;
+	std::vector<unsigned> initial_y = ck.initial_y;
+	pool_off.resize(segments + CPUS);
+	meta_off.resize(segments + CPUS);
+	initial_x.resize(segments + CPUS);
+	initial_y.resize(segments + CPUS);
+	std::vector<std::map<std::string, layermap_entry>> layermaps = ck.layermaps;
+
+	std::vector<int> fd(TEMP_FILES);
+	std::vector<off_t> size(TEMP_FILES);
+	for (size_t j = 0; j < TEMP_FILES; j++) {
+		std::string shard = checkpoint_shard(ck, ck.zooms.size(), j);
+		fd[j] = open(shard.c_str(), O_RDONLY | O_CLOEXEC);
+		if (fd[j] < 0) {
+			perror(shard.c_str());
+			exit(EXIT_FAILURE);
+		}
+
+		struct stat st;
+		if (fstat(fd[j], &st) != 0) {
+			perror(shard.c_str());
+			exit(EXIT_FAILURE);
+		}
+		size[j] = st.st_size;
 	}
 
-	std::map<std::string, layermap_entry> merged_lm = merge_layermaps(layermaps);
+	// Some tiles of the zoom level that was interrupted may already be
+	// there, and inserting them again would fail
+	int done = ck.zooms.back().z;
+	if (outdb != NULL) {
+		sqlite3_stmt *stmt;
+		if (sqlite3_prepare_v2(outdb, "DELETE FROM tiles WHERE zoom_level > ?", -1, &stmt, NULL) != SQLITE_OK) {
+			fprintf(stderr, "sqlite3 delete prep failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_FAILURE);
+		}
+		sqlite3_bind_int(stmt, 1, done);
+		if (sqlite3_step(stmt) != SQLITE_DONE) {
+			fprintf(stderr, "sqlite3 delete failed: %s\n", sqlite3_errmsg(outdb));
+			exit(EXIT_FAILURE);
+		}
+		sqlite3_finalize(stmt);
+	}
 
-	for (auto ai = merged_lm.begin(); ai != merged_lm.end(); ++ai) {
-		ai->second.minzoom = minzoom;
-		ai->second.maxzoom = maxzoom;
+	if (!quiet) {
+		fprintf(stderr, "Resuming after zoom level %d from %s\n", done, ck.dir.c_str());
+	}
+
+	int maxzoom = ck.maxzoom;
+	std::atomic<unsigned> midx(ck.midx);
+	std::atomic<unsigned> midy(ck.midy);
+	std::vector<zoom_state> zooms = ck.zooms;
+	int written = traverse_zooms(&fd[0], &size[0], meta, stringpool, &midx, &midy, maxzoom, ck.minzoom, outdb, outdir, ck.buffer, fname, tmpdir, ck.gamma, ck.full_detail, ck.low_detail, ck.min_detail, &meta_off[0], &pool_off[0], &initial_x[0], &initial_y[0], simplification, layermaps, prefilter, postfilter, attribute_accum, filter, zooms, NULL, &ck);
+	stop_filters();
+
+	store_unmap(meta, metasize);
+	store_unmap(stringpool, poolsize);
+
+	int ret = EXIT_SUCCESS;
+	if (maxzoom != written) {
+		if (written > ck.minzoom) {
+			fprintf(stderr, "\n\n\n*** NOTE TILES ONLY COMPLETE THROUGH ZOOM %d ***\n\n\n", written);
+			maxzoom = written;
+			ret = 100;
+		} else {
+			fprintf(stderr, "%s: No zoom levels were successfully written\n", *av);
+			exit(EXIT_FAILURE);
+		}
 	}
 
-	mbtiles_write_metadata(outdb, outdir, fname, minzoom, maxzoom, minlat, minlon, maxlat, maxlon, midlat, midlon, forcetable, attribution, merged_lm, true, description, !prevent[P_TILE_STATS], attribute_descriptions, "tippecanoe", commandline);
+	// With the options of the run that was interrupted, not the ones it was resumed with
+	write_tileset_metadata(outdb, outdir, fname, ck.minzoom, maxzoom, midx, midy, ck.file_bbox, layermaps, forcetable, attribution, description, attribute_descriptions, ck.commandline);
 
+	checkpoint_remove(ck);
 	return ret;
 }
 
@@ -2479,6 +3240,11 @@ int main(int argc, char **argv) {
 	std::vector<source> sources;
 	const char *prefilter = NULL;
 	const char *postfilter = NULL;
+	const char *store_dir = NULL;
+	tile_mask regenerate;
+	bool update_tiles = false;
+	const char *checkpoint_dir = NULL;
+	bool resume = false;
 	bool guess_maxzoom = false;
 
 	std::set<std::string> exclude, include;
@@ -2528,6 +3294,7 @@ int main(int argc, char **argv) {
 		{"maximum-zoom", required_argument, 0, 'z'},
 		{"minimum-zoom", required_argument, 0, 'Z'},
 		{"extend-zooms-if-still-dropping", no_argument, &additional[A_EXTEND_ZOOMS], 1},
+		{"overzoom-complete-tiles", no_argument, &additional[A_OVERZOOM_COMPLETE], 1},
 		{"one-tile", required_argument, 0, 'R'},
 
 		{"Tile resolution", 0, 0, 0},
@@ -2588,6 +3355,7 @@ int main(int argc, char **argv) {
 		{"buffer", required_argument, 0, 'b'},
 		{"no-clipping", no_argument, &prevent[P_CLIPPING], 1},
 		{"no-duplication", no_argument, &prevent[P_DUPLICATION], 1},
+		{"pre-clip-children", no_argument, &additional[A_PRE_CLIP_CHILDREN], 1},
 
 		{"Reordering features within each tile", 0, 0, 0},
 		{"preserve-input-order", no_argument, &prevent[P_INPUT_ORDER], 1},
@@ -2609,6 +3377,8 @@ int main(int argc, char **argv) {
 		{"Filtering tile contents", 0, 0, 0},
 		{"prefilter", required_argument, 0, 'C'},
 		{"postfilter", required_argument, 0, 'c'},
+		{"persistent-filters", no_argument, &additional[A_PERSISTENT_FILTERS], 1},
+		{"binary-filters", no_argument, &additional[A_BINARY_FILTERS], 1},
 
 		{"Setting or disabling tile size limits", 0, 0, 0},
 		{"maximum-tile-bytes", required_argument, 0, 'M'},
@@ -2623,11 +3393,19 @@ int main(int argc, char **argv) {
 
 		{"Temporary storage", 0, 0, 0},
 		{"temporary-directory", required_argument, 0, 't'},
+		{"checkpoint", required_argument, 0, '~'},
+		{"resume", no_argument, 0, '~'},
+
+		{"Making tiles again", 0, 0, 0},
+		{"feature-store", required_argument, 0, '~'},
+		{"regenerate-tiles", required_argument, 0, '~'},
+		{"update-tiles", no_argument, 0, '~'},
 
 		{"Progress indicator", 0, 0, 0},
 		{"quiet", no_argument, 0, 'q'},
 		{"no-progress-indicator", no_argument, 0, 'Q'},
 		{"progress-interval", required_argument, 0, 'U'},
+		{"trace", required_argument, 0, '~'},
 		{"version", no_argument, 0, 'v'},
 
 		{"", 0, 0, 0},
@@ -2706,6 +3484,42 @@ int main(int argc, char **argv) {
 				}
 			} else if (strcmp(opt, "use-attribute-for-id") == 0) {
 				attribute_for_id = optarg;
+			} else if (strcmp(opt, "trace") == 0) {
+				trace_open(optarg);
+			} else if (strcmp(opt, "feature-store") == 0) {
+				store_dir = optarg;
+			} else if (strcmp(opt, "update-tiles") == 0) {
+				update_tiles = true;
+			} else if (strcmp(opt, "checkpoint") == 0) {
+				checkpoint_dir = optarg;
+			} else if (strcmp(opt, "resume") == 0) {
+				resume = true;
+			} else if (strcmp(opt, "regenerate-tiles") == 0) {
+				int z;
+				unsigned x, y;
+				double lon1, lat1, lon2, lat2;
+
+				if (sscanf(optarg, "%d:%lf,%lf,%lf,%lf", &z, &lon1, &lat1, &lon2, &lat2) == 5 && z >= 0 && z <= MAX_ZOOM) {
+					long long x1, y1, x2, y2;
+					lonlat2tile(lon1, lat2, z, &x1, &y1);
+					lonlat2tile(lon2, lat1, z, &x2, &y2);
+
+					x1 = std::max(x1, 0LL);
+					y1 = std::max(y1, 0LL);
+					x2 = std::min(x2, (1LL << z) - 1);
+					y2 = std::min(y2, (1LL << z) - 1);
+
+					for (long long xx = x1; xx <= x2; xx++) {
+						for (long long yy = y1; yy <= y2; yy++) {
+							regenerate.add(z, xx, yy);
+						}
+					}
+				} else if (sscanf(optarg, "%d/%u/%u", &z, &x, &y) == 3 && z >= 0 && z <= MAX_ZOOM && x < (1ULL << z) && y < (1ULL << z)) {
+					regenerate.add(z, x, y);
+				} else {
+					fprintf(stderr, "%s: Can't parse --%s=%s as z/x/y or z:minlon,minlat,maxlon,maxlat\n", argv[0], opt, optarg);
+					exit(EXIT_FAILURE);
+				}
 			} else {
 				fprintf(stderr, "%s: Unrecognized option --%s\n", argv[0], opt);
 				exit(EXIT_FAILURE);
@@ -3055,13 +3869,7 @@ int main(int argc, char **argv) {
 		}
 	}
 
-	if (additional[A_HILBERT]) {
-		encode_index = encode_hilbert;
-		decode_index = decode_hilbert;
-	} else {
-		encode_index = encode_quadkey;
-		decode_index = decode_quadkey;
-	}
+	set_index_encoding(additional[A_HILBERT]);
 
 	// Wait until here to project the bounding box, so that the behavior is
 	// the same no matter what order the projection and bounding box are
@@ -3087,6 +3895,50 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	// An update has to make its tiles the way the originals were made
+	feature_store previous;
+	if (update_tiles) {
+		if (store_dir == NULL) {
+			fprintf(stderr, "%s: --update-tiles requires the --feature-store that the tileset was made with\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (regenerate.roots.size() > 0) {
+			fprintf(stderr, "%s: --update-tiles and --regenerate-tiles cannot be used together\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+
+		store_read(store_dir, previous);
+
+		minzoom = previous.minzoom;
+		maxzoom = previous.maxzoom;
+		full_detail = previous.full_detail;
+		low_detail = previous.low_detail;
+		min_detail = previous.min_detail;
+		buffer = previous.buffer;
+		basezoom = previous.basezoom;
+		droprate = previous.droprate;
+		guess_maxzoom = false;
+	}
+
+	// An interrupted run carries on from its checkpoint, if it got as far as making one
+	checkpoint ck;
+	bool resuming = false;
+	if (checkpoint_dir != NULL) {
+		if (store_dir != NULL || update_tiles || regenerate.roots.size() > 0) {
+			fprintf(stderr, "%s: --checkpoint cannot be used with --feature-store, --update-tiles, or --regenerate-tiles\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+
+		if (resume && checkpoint_read(checkpoint_dir, ck)) {
+			resuming = true;
+			TEMP_FILES = ck.shards;
+		}
+		ck.dir = checkpoint_dir;
+	} else if (resume) {
+		fprintf(stderr, "%s: --resume requires the --checkpoint directory to resume from\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
 	if (full_detail <= 0) {
 		full_detail = 12;
 	}
@@ -3136,6 +3988,9 @@ int main(int argc, char **argv) {
 			fprintf(stderr, "Full detail + maxzoom > 32, so you are asking for more detail than is available.\n");
 		}
 	}
+	if (update_tiles) {
+		geometry_scale = previous.geometry_scale;
+	}
 
 	if ((basezoom < 0 || droprate < 0) && (gamma < 0)) {
 		// Can't use randomized (as opposed to evenly distributed) dot dropping
@@ -3154,14 +4009,30 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
-	if (out_mbtiles != NULL) {
-		if (force) {
-			unlink(out_mbtiles);
+	bool regenerating = regenerate.roots.size() > 0;
+	if (regenerating) {
+		if (store_dir == NULL) {
+			fprintf(stderr, "%s: --regenerate-tiles requires the --feature-store that the tileset was made with\n", argv[0]);
+			exit(EXIT_FAILURE);
+		}
+		if (optind < argc || sources.size() > 0) {
+			fprintf(stderr, "%s: --regenerate-tiles reads the features from the feature store, not from input files\n", argv[0]);
+			exit(EXIT_FAILURE);
 		}
+	}
+
+	if (out_mbtiles != NULL) {
+		if (regenerating || update_tiles || resuming) {
+			outdb = mbtiles_reopen(out_mbtiles, argv);
+		} else {
+			if (force) {
+				unlink(out_mbtiles);
+			}
 
-		outdb = mbtiles_open(out_mbtiles, argv, forcetable);
+			outdb = mbtiles_open(out_mbtiles, argv, forcetable);
+		}
 	}
-	if (out_dir != NULL) {
+	if (out_dir != NULL && !regenerating && !update_tiles && !resuming) {
 		check_dir(out_dir, argv, force, forcetable);
 	}
 
@@ -3189,7 +4060,18 @@ int main(int argc, char **argv) {
 
 	long long file_bbox[4] = {UINT_MAX, UINT_MAX, 0, 0};
 
-	ret = read_input(sources, name ? name : out_mbtiles ? out_mbtiles : out_dir, maxzoom, minzoom, basezoom, basezoom_marker_width, outdb, out_dir, &exclude, &include, exclude_all, filter, droprate, buffer, tmpdir, gamma, read_parallel, forcetable, attribution, gamma != 0, file_bbox, prefilter, postfilter, description, guess_maxzoom, &attribute_types, argv[0], &attribute_accum, attribute_descriptions, commandline);
+	compiled_filter *cfilter = NULL;
+	if (filter != NULL) {
+		cfilter = compile_filter(filter);
+	}
+
+	if (regenerating) {
+		ret = regenerate_tiles(store_dir, regenerate, name ? name : out_mbtiles ? out_mbtiles : out_dir, outdb, out_dir, tmpdir, cfilter, prefilter, postfilter, &attribute_accum);
+	} else if (resuming) {
+		ret = resume_tiles(ck, name ? name : out_mbtiles ? out_mbtiles : out_dir, outdb, out_dir, tmpdir, cfilter, prefilter, postfilter, &attribute_accum, forcetable, attribution, description, attribute_descriptions);
+	} else {
+		ret = read_input(sources, name ? name : out_mbtiles ? out_mbtiles : out_dir, maxzoom, minzoom, basezoom, basezoom_marker_width, outdb, out_dir, &exclude, &include, exclude_all, cfilter, droprate, buffer, tmpdir, gamma, read_parallel, forcetable, attribution, gamma != 0, file_bbox, prefilter, postfilter, description, guess_maxzoom, &attribute_types, argv[0], &attribute_accum, attribute_descriptions, commandline, store_dir, update_tiles ? &previous : NULL, checkpoint_dir != NULL ? &ck : NULL);
+	}
 
 	if (outdb != NULL) {
 		mbtiles_close(outdb, argv[0]);
@@ -3206,10 +4088,14 @@ int main(int argc, char **argv) {
 		exit(EXIT_FAILURE);
 	}
 
+	if (cfilter != NULL) {
+		delete cfilter;
+	}
 	if (filter != NULL) {
 		json_free(filter);
 	}
 
+	trace_close();
 	return ret;
 }
 
@@ -11,6 +11,7 @@
 #include <string>
 #include <set>
 #include <map>
+#include <algorithm>
 #include <sys/stat.h>
 #include "mvt.hpp"
 #include "mbtiles.hpp"
@@ -23,14 +24,7 @@ size_t max_tilestats_attributes = 1000;
 size_t max_tilestats_sample_values = 1000;
 size_t max_tilestats_values = 100;
 
-sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
-	sqlite3 *outdb;
-
-	if (sqlite3_open(dbname, &outdb) != SQLITE_OK) {
-		fprintf(stderr, "%s: %s: %s\n", argv[0], dbname, sqlite3_errmsg(outdb));
-		exit(EXIT_FAILURE);
-	}
-
+static void mbtiles_pragmas(sqlite3 *outdb, char **argv) {
 	char *err = NULL;
 	if (sqlite3_exec(outdb, "PRAGMA synchronous=0", NULL, NULL, &err) != SQLITE_OK) {
 		fprintf(stderr, "%s: async: %s\n", argv[0], err);
@@ -44,6 +38,19 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 		fprintf(stderr, "%s: async: %s\n", argv[0], err);
 		exit(EXIT_FAILURE);
 	}
+}
+
+sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
+	sqlite3 *outdb;
+
+	if (sqlite3_open(dbname, &outdb) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], dbname, sqlite3_errmsg(outdb));
+		exit(EXIT_FAILURE);
+	}
+
+	mbtiles_pragmas(outdb, argv);
+
+	char *err = NULL;
 	if (sqlite3_exec(outdb, "CREATE TABLE metadata (name text, value text);", NULL, NULL, &err) != SQLITE_OK) {
 		fprintf(stderr, "%s: Tileset \"%s\" already exists. You can use --force if you want to delete the old tileset.\n", argv[0], dbname);
 		fprintf(stderr, "%s: %s\n", argv[0], err);
@@ -73,6 +80,26 @@ sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable) {
 	return outdb;
 }
 
+sqlite3 *mbtiles_reopen(char *dbname, char **argv) {
+	sqlite3 *outdb;
+
+	if (sqlite3_open_v2(dbname, &outdb, SQLITE_OPEN_READWRITE, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s: %s\n", argv[0], dbname, sqlite3_errmsg(outdb));
+		exit(EXIT_FAILURE);
+	}
+
+	mbtiles_pragmas(outdb, argv);
+
+	sqlite3_stmt *stmt;
+	if (sqlite3_prepare_v2(outdb, "SELECT zoom_level, tile_column, tile_row, tile_data FROM tiles LIMIT 1;", -1, &stmt, NULL) != SQLITE_OK) {
+		fprintf(stderr, "%s: %s is not a tileset: %s\n", argv[0], dbname, sqlite3_errmsg(outdb));
+		exit(EXIT_FAILURE);
+	}
+	sqlite3_finalize(stmt);
+
+	return outdb;
+}
+
 void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size) {
 	sqlite3_stmt *stmt;
 	const char *query = "insert into tiles (zoom_level, tile_column, tile_row, tile_data) values (?, ?, ?, ?)";
@@ -270,6 +297,134 @@ void tilestats(std::map<std::string, layermap_entry> const &layermap1, size_t el
 	state.json_end_hash();
 }
 
+// The vector_layers and tilestats that go in the "json" row of the metadata
+static std::string layer_json(std::map<std::string, layermap_entry> const &layermap, bool do_tilestats, std::map<std::string, std::string> const &attribute_descriptions) {
+	size_t elements = max_tilestats_values;
+	std::string buf;
+
+	{
+		json_writer state(&buf);
+
+		state.json_write_hash();
+		state.nospace = true;
+
+		state.json_write_string("vector_layers");
+		state.json_write_array();
+
+		std::vector<std::string> lnames;
+		for (auto ai = layermap.begin(); ai != layermap.end(); ++ai) {
+			lnames.push_back(ai->first);
+		}
+
+		for (size_t i = 0; i < lnames.size(); i++) {
+			auto fk = layermap.find(lnames[i]);
+			state.json_write_hash();
+
+			state.json_write_string("id");
+			state.json_write_string(lnames[i]);
+
+			state.json_write_string("description");
+			state.json_write_string(fk->second.description);
+
+			state.json_write_string("minzoom");
+			state.json_write_signed(fk->second.minzoom);
+
+			state.json_write_string("maxzoom");
+			state.json_write_signed(fk->second.maxzoom);
+
+			state.json_write_string("fields");
+			state.json_write_hash();
+			state.nospace = true;
+
+			bool first = true;
+			for (auto j = fk->second.file_keys.begin(); j != fk->second.file_keys.end(); ++j) {
+				if (first) {
+					first = false;
+				}
+
+				state.json_write_string(j->first);
+
+				auto f = attribute_descriptions.find(j->first);
+				if (f == attribute_descriptions.end()) {
+					int type = 0;
+					for (auto s : j->second.sample_values) {
+						type |= (1 << s.type);
+					}
+
+					if (type == (1 << mvt_double)) {
+						state.json_write_string("Number");
+					} else if (type == (1 << mvt_bool)) {
+						state.json_write_string("Boolean");
+					} else if (type == (1 << mvt_string)) {
+						state.json_write_string("String");
+					} else {
+						state.json_write_string("Mixed");
+					}
+				} else {
+					state.json_write_string(f->second);
+				}
+			}
+
+			state.nospace = true;
+			state.json_end_hash();
+			state.json_end_hash();
+		}
+
+		state.json_end_array();
+
+		if (do_tilestats && elements > 0) {
+			state.nospace = true;
+			state.json_write_string("tilestats");
+			tilestats(layermap, elements, state);
+		}
+
+		state.nospace = true;
+		state.json_end_hash();
+	}
+
+	return buf;
+}
+
+// Copy the metadata table into metadata.json of a directory of tiles
+static void write_metadata_json(sqlite3 *db, std::string const &metadata) {
+	FILE *fp = fopen(metadata.c_str(), "w");
+	if (fp == NULL) {
+		perror(metadata.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	json_writer state(fp);
+
+	state.json_write_hash();
+	state.json_write_newline();
+
+	sqlite3_stmt *stmt;
+	bool first = true;
+	if (sqlite3_prepare_v2(db, "SELECT name, value from metadata;", -1, &stmt, NULL) == SQLITE_OK) {
+		while (sqlite3_step(stmt) == SQLITE_ROW) {
+			std::string key, value;
+
+			const char *k = (const char *) sqlite3_column_text(stmt, 0);
+			const char *v = (const char *) sqlite3_column_text(stmt, 1);
+			if (k == NULL || v == NULL) {
+				fprintf(stderr, "Corrupt mbtiles file: null metadata\n");
+				exit(EXIT_FAILURE);
+			}
+
+			state.json_comma_newline();
+			state.json_write_string(k);
+			state.json_write_string(v);
+			first = false;
+		}
+		sqlite3_finalize(stmt);
+	}
+
+	state.json_write_newline();
+	state.json_end_hash();
+	state.json_write_newline();
+	fclose(fp);
+}
+
 void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats, std::map<std::string, std::string> const &attribute_descriptions, std::string const &program, std::string const &commandline) {
 	char *sql, *err;
 
@@ -397,88 +552,7 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fnam
 	sqlite3_free(sql);
 
 	if (vector) {
-		size_t elements = max_tilestats_values;
-		std::string buf;
-
-		{
-			json_writer state(&buf);
-
-			state.json_write_hash();
-			state.nospace = true;
-
-			state.json_write_string("vector_layers");
-			state.json_write_array();
-
-			std::vector<std::string> lnames;
-			for (auto ai = layermap.begin(); ai != layermap.end(); ++ai) {
-				lnames.push_back(ai->first);
-			}
-
-			for (size_t i = 0; i < lnames.size(); i++) {
-				auto fk = layermap.find(lnames[i]);
-				state.json_write_hash();
-
-				state.json_write_string("id");
-				state.json_write_string(lnames[i]);
-
-				state.json_write_string("description");
-				state.json_write_string(fk->second.description);
-
-				state.json_write_string("minzoom");
-				state.json_write_signed(fk->second.minzoom);
-
-				state.json_write_string("maxzoom");
-				state.json_write_signed(fk->second.maxzoom);
-
-				state.json_write_string("fields");
-				state.json_write_hash();
-				state.nospace = true;
-
-				bool first = true;
-				for (auto j = fk->second.file_keys.begin(); j != fk->second.file_keys.end(); ++j) {
-					if (first) {
-						first = false;
-					}
-
-					state.json_write_string(j->first);
-
-					auto f = attribute_descriptions.find(j->first);
-					if (f == attribute_descriptions.end()) {
-						int type = 0;
-						for (auto s : j->second.sample_values) {
-							type |= (1 << s.type);
-						}
-
-						if (type == (1 << mvt_double)) {
-							state.json_write_string("Number");
-						} else if (type == (1 << mvt_bool)) {
-							state.json_write_string("Boolean");
-						} else if (type == (1 << mvt_string)) {
-							state.json_write_string("String");
-						} else {
-							state.json_write_string("Mixed");
-						}
-					} else {
-						state.json_write_string(f->second);
-					}
-				}
-
-				state.nospace = true;
-				state.json_end_hash();
-				state.json_end_hash();
-			}
-
-			state.json_end_array();
-
-			if (do_tilestats && elements > 0) {
-				state.nospace = true;
-				state.json_write_string("tilestats");
-				tilestats(layermap, elements, state);
-			}
-
-			state.nospace = true;
-			state.json_end_hash();
-		}
+		std::string buf = layer_json(layermap, do_tilestats, attribute_descriptions);
 
 		sql = sqlite3_mprintf("INSERT INTO metadata (name, value) VALUES ('json', %Q);", buf.c_str());
 		if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
@@ -497,42 +571,7 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fnam
 		if (stat(metadata.c_str(), &st) == 0) {
 			// Leave existing metadata in place with --allow-existing
 		} else {
-			FILE *fp = fopen(metadata.c_str(), "w");
-			if (fp == NULL) {
-				perror(metadata.c_str());
-				exit(EXIT_FAILURE);
-			}
-
-			json_writer state(fp);
-
-			state.json_write_hash();
-			state.json_write_newline();
-
-			sqlite3_stmt *stmt;
-			bool first = true;
-			if (sqlite3_prepare_v2(db, "SELECT name, value from metadata;", -1, &stmt, NULL) == SQLITE_OK) {
-				while (sqlite3_step(stmt) == SQLITE_ROW) {
-					std::string key, value;
-
-					const char *k = (const char *) sqlite3_column_text(stmt, 0);
-					const char *v = (const char *) sqlite3_column_text(stmt, 1);
-					if (k == NULL || v == NULL) {
-						fprintf(stderr, "Corrupt mbtiles file: null metadata\n");
-						exit(EXIT_FAILURE);
-					}
-
-					state.json_comma_newline();
-					state.json_write_string(k);
-					state.json_write_string(v);
-					first = false;
-				}
-				sqlite3_finalize(stmt);
-			}
-
-			state.json_write_newline();
-			state.json_end_hash();
-			state.json_write_newline();
-			fclose(fp);
+			write_metadata_json(db, metadata);
 		}
 	}
 
@@ -544,6 +583,30 @@ void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fnam
 	}
 }
 
+// Replace one row of the metadata table, or add it if it is missing
+static void replace_metadata(sqlite3 *db, const char *name, const char *value) {
+	char *err;
+
+	char *sql = sqlite3_mprintf("DELETE FROM metadata WHERE name = %Q; INSERT INTO metadata (name, value) VALUES (%Q, %Q);", name, name, value);
+	if (sqlite3_exec(db, sql, NULL, NULL, &err) != SQLITE_OK) {
+		fprintf(stderr, "set %s in metadata: %s\n", name, err);
+		exit(EXIT_FAILURE);
+	}
+	sqlite3_free(sql);
+}
+
+void mbtiles_update_metadata(sqlite3 *db, const char *outdir, double minlat, double minlon, double maxlat, double maxlon, std::map<std::string, layermap_entry> const &layermap, bool do_tilestats, std::map<std::string, std::string> const &attribute_descriptions) {
+	char *bounds = sqlite3_mprintf("%f,%f,%f,%f", minlon, minlat, maxlon, maxlat);
+	replace_metadata(db, "bounds", bounds);
+	sqlite3_free(bounds);
+
+	replace_metadata(db, "json", layer_json(layermap, do_tilestats, attribute_descriptions).c_str());
+
+	if (outdir != NULL) {
+		write_metadata_json(db, std::string(outdir) + "/metadata.json");
+	}
+}
+
 void mbtiles_close(sqlite3 *outdb, const char *pgm) {
 	char *err;
 
@@ -600,25 +663,7 @@ std::map<std::string, layermap_entry> merge_layermaps(std::vector<std::map<std::
 				if (fk2 == out_entry->second.file_keys.end()) {
 					out_entry->second.file_keys.insert(std::pair<std::string, type_and_string_stats>(attribname, fk->second));
 				} else {
-					for (auto val : fk->second.sample_values) {
-						auto pt = std::lower_bound(fk2->second.sample_values.begin(), fk2->second.sample_values.end(), val);
-						if (pt == fk2->second.sample_values.end() || *pt != val) {  // not found
-							fk2->second.sample_values.insert(pt, val);
-
-							if (fk2->second.sample_values.size() > max_tilestats_sample_values) {
-								fk2->second.sample_values.pop_back();
-							}
-						}
-					}
-
-					fk2->second.type |= fk->second.type;
-
-					if (fk->second.min < fk2->second.min) {
-						fk2->second.min = fk->second.min;
-					}
-					if (fk->second.max > fk2->second.max) {
-						fk2->second.max = fk->second.max;
-					}
+					fk2->second.merge(fk->second);
 				}
 			}
 
@@ -635,44 +680,116 @@ std::map<std::string, layermap_entry> merge_layermaps(std::vector<std::map<std::
 		}
 	}
 
+	for (auto &layer : out) {
+		for (auto &fk : layer.second.file_keys) {
+			fk.second.flush();
+		}
+	}
+
 	return out;
 }
 
-void add_to_file_keys(std::map<std::string, type_and_string_stats> &file_keys, std::string const &attrib, type_and_string const &val) {
-	if (val.type == mvt_null) {
-		return;
+// Whether a value sorts before a sample value, in the order of type_and_string
+static bool sorts_before(int type, std::string const &string, type_and_string const &o) {
+	int cmp = string.compare(o.string);
+	if (cmp != 0) {
+		return cmp < 0;
 	}
+	return type < o.type;
+}
 
-	auto fka = file_keys.find(attrib);
-	if (fka == file_keys.end()) {
-		file_keys.insert(std::pair<std::string, type_and_string_stats>(attrib, type_and_string_stats()));
-		fka = file_keys.find(attrib);
+void type_and_string_stats::add(int val_type, std::string const &string) {
+	if (val_type == mvt_double) {
+		double d = atof(string.c_str());
+
+		if (d < min) {
+			min = d;
+		}
+		if (d > max) {
+			max = d;
+		}
 	}
 
-	if (fka == file_keys.end()) {
-		fprintf(stderr, "Can't happen (tilestats)\n");
-		exit(EXIT_FAILURE);
+	type |= (1 << val_type);
+
+	// Once the sample is full, anything that doesn't sort before its last
+	// value is either already in it or would be dropped from it
+	if (sample_values.size() >= max_tilestats_sample_values) {
+		if (sample_values.size() == 0 || !sorts_before(val_type, string, sample_values.back())) {
+			return;
+		}
 	}
 
-	if (val.type == mvt_double) {
-		double d = atof(val.string.c_str());
+	type_and_string val;
+	val.type = val_type;
+	val.string = string;
+	pending.push_back(std::move(val));
+
+	if (pending.size() >= max_tilestats_sample_values) {
+		flush();
+	}
+}
 
-		if (d < fka->second.min) {
-			fka->second.min = d;
+void type_and_string_stats::merge(type_and_string_stats const &o) {
+	for (auto const &val : o.sample_values) {
+		add(val.type, val.string);
+	}
+	for (auto const &val : o.pending) {
+		add(val.type, val.string);
+	}
+
+	type |= o.type;
+
+	if (o.min < min) {
+		min = o.min;
+	}
+	if (o.max > max) {
+		max = o.max;
+	}
+}
+
+void type_and_string_stats::flush() {
+	if (pending.size() == 0) {
+		return;
+	}
+
+	std::sort(pending.begin(), pending.end());
+
+	std::vector<type_and_string> out;
+	out.reserve(std::min(sample_values.size() + pending.size(), max_tilestats_sample_values));
+
+	// Merge the two sorted lists, keeping one of each value, until the sample is full
+	size_t i = 0, j = 0;
+	while (out.size() < max_tilestats_sample_values && (i < sample_values.size() || j < pending.size())) {
+		type_and_string *next;
+		if (j >= pending.size() || (i < sample_values.size() && sample_values[i] < pending[j])) {
+			next = &sample_values[i++];
+		} else {
+			next = &pending[j++];
 		}
-		if (d > fka->second.max) {
-			fka->second.max = d;
+
+		if (out.size() == 0 || out.back() != *next) {
+			out.push_back(std::move(*next));
 		}
 	}
 
-	auto pt = std::lower_bound(fka->second.sample_values.begin(), fka->second.sample_values.end(), val);
-	if (pt == fka->second.sample_values.end() || *pt != val) {  // not found
-		fka->second.sample_values.insert(pt, val);
+	sample_values.swap(out);
+	pending.clear();
+}
 
-		if (fka->second.sample_values.size() > max_tilestats_sample_values) {
-			fka->second.sample_values.pop_back();
-		}
+void add_to_file_keys(std::map<std::string, type_and_string_stats> &file_keys, std::string const &attrib, type_and_string const &val) {
+	add_to_file_keys(file_keys, attrib, val.type, val.string);
+}
+
+void add_to_file_keys(std::map<std::string, type_and_string_stats> &file_keys, std::string const &attrib, int type, std::string const &string) {
+	if (type == mvt_null) {
+		return;
+	}
+
+	auto fka = file_keys.find(attrib);
+	if (fka == file_keys.end()) {
+		fka = file_keys.insert(std::pair<std::string, type_and_string_stats>(attrib, type_and_string_stats())).first;
 	}
 
-	fka->second.type |= (1 << val.type);
+	fka->second.add(type, string);
 }
@@ -17,11 +17,20 @@ struct type_and_string {
 	bool operator!=(const type_and_string &o) const;
 };
 
+// A mergeable summary of the values of one attribute: the types and numeric
+// range of all of them, and the max_tilestats_sample_values distinct values
+// that sort first. Values are buffered as they are added and folded into the
+// sample by flush(), which must be called before sample_values is read.
 struct type_and_string_stats {
 	std::vector<type_and_string> sample_values = std::vector<type_and_string>();  // sorted
+	std::vector<type_and_string> pending = std::vector<type_and_string>();	      // not yet sorted into the sample
 	double min = INFINITY;
 	double max = -INFINITY;
 	int type = 0;
+
+	void add(int type, std::string const &string);
+	void merge(type_and_string_stats const &o);
+	void flush();
 };
 
 struct layermap_entry {
@@ -43,15 +52,24 @@ struct layermap_entry {
 
 sqlite3 *mbtiles_open(char *dbname, char **argv, int forcetable);
 
+// Open an existing tileset to replace some of its tiles
+sqlite3 *mbtiles_reopen(char *dbname, char **argv);
+
 void mbtiles_write_tile(sqlite3 *outdb, int z, int tx, int ty, const char *data, int size);
 
 void mbtiles_write_metadata(sqlite3 *outdb, const char *outdir, const char *fname, int minzoom, int maxzoom, double minlat, double minlon, double maxlat, double maxlon, double midlat, double midlon, int forcetable, const char *attribution, std::map<std::string, layermap_entry> const &layermap, bool vector, const char *description, bool do_tilestats, std::map<std::string, std::string> const &attribute_descriptions, std::string const &program, std::string const &commandline);
 
+// Bring the bounds and the layer and attribute descriptions of an existing
+// tileset up to date, leaving the rest of its metadata as it was. For a
+// directory, db is its metadata.json, as read by dirmeta2tmp().
+void mbtiles_update_metadata(sqlite3 *db, const char *outdir, double minlat, double minlon, double maxlat, double maxlon, std::map<std::string, layermap_entry> const &layermap, bool do_tilestats, std::map<std::string, std::string> const &attribute_descriptions);
+
 void mbtiles_close(sqlite3 *outdb, const char *pgm);
 
 std::map<std::string, layermap_entry> merge_layermaps(std::vector<std::map<std::string, layermap_entry> > const &maps);
 std::map<std::string, layermap_entry> merge_layermaps(std::vector<std::map<std::string, layermap_entry> > const &maps, bool trunc);
 
 void add_to_file_keys(std::map<std::string, type_and_string_stats> &file_keys, std::string const &layername, type_and_string const &val);
+void add_to_file_keys(std::map<std::string, type_and_string_stats> &file_keys, std::string const &layername, int type, std::string const &string);
 
 #endif
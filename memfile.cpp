@@ -2,32 +2,75 @@
 #include <string.h>
 #include <unistd.h>
 #include <sys/mman.h>
+#ifdef __linux__
+#include <sys/vfs.h>
+#endif
 #include "memfile.hpp"
 
 #define INCREMENT 131072
 #define INITIAL 256
 
+// Don't more than double the size of a very large file at once,
+// to avoid committing too much disk space that will never be used
+#define MAX_STEP (1LL * 1024 * 1024 * 1024)
+
+#define HUGETLBFS_MAGIC 0x958458f6
+
+std::atomic<long long> memfile_remaps(0);
+std::atomic<long long> memfile_remapped_bytes(0);
+
+static void memfile_advise(struct memfile *file) {
+#ifdef MADV_HUGEPAGE
+	// Only a hint: it is ignored unless the backing store is tmpfs
+	// and transparent huge pages are enabled for it.
+	if (file->len >= 2 * 1024 * 1024) {
+		madvise(file->map, file->len, MADV_HUGEPAGE);
+	}
+#else
+	(void) file;
+#endif
+}
+
 struct memfile *memfile_open(int fd) {
-	if (ftruncate(fd, INITIAL) != 0) {
+	long long granularity = INCREMENT;
+
+#ifdef __linux__
+	// Mappings of hugetlbfs files are always backed by huge pages,
+	// but the file size has to be a multiple of the huge page size.
+	struct statfs fsstat;
+	if (fstatfs(fd, &fsstat) == 0 && (unsigned long) fsstat.f_type == HUGETLBFS_MAGIC) {
+		if (fsstat.f_bsize > granularity) {
+			granularity = fsstat.f_bsize;
+		}
+	}
+#endif
+
+	long long initial = INITIAL;
+	if (granularity > INCREMENT) {
+		initial = granularity;
+	}
+
+	if (ftruncate(fd, initial) != 0) {
 		return NULL;
 	}
 
-	char *map = (char *) mmap(NULL, INITIAL, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	char *map = (char *) mmap(NULL, initial, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
 	if (map == MAP_FAILED) {
 		return NULL;
 	}
 
 	struct memfile *mf = new memfile;
 	if (mf == NULL) {
-		munmap(map, INITIAL);
+		munmap(map, initial);
 		return NULL;
 	}
 
 	mf->fd = fd;
 	mf->map = map;
-	mf->len = INITIAL;
+	mf->len = initial;
 	mf->off = 0;
-	mf->tree = 0;
+	mf->entries = 0;
+	mf->granularity = granularity;
 
 	return mf;
 }
@@ -49,23 +92,52 @@ int memfile_close(struct memfile *file) {
 
 int memfile_write(struct memfile *file, void *s, long long len) {
 	if (file->off + len > file->len) {
-		if (munmap(file->map, file->len) != 0) {
-			return -1;
+		// Grow geometrically so that the total cost of remapping
+		// is linear in the final size of the file
+		long long step = file->len;
+		if (step > MAX_STEP) {
+			step = MAX_STEP;
 		}
 
-		file->len += (len + INCREMENT + 1) / INCREMENT * INCREMENT;
+		long long newlen = file->len + step;
+		if (newlen < file->off + len) {
+			newlen = file->off + len;
+		}
+		newlen = (newlen + file->granularity - 1) / file->granularity * file->granularity;
 
-		if (ftruncate(file->fd, file->len) != 0) {
+		if (ftruncate(file->fd, newlen) != 0) {
 			return -1;
 		}
 
-		file->map = (char *) mmap(NULL, file->len, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+#ifdef MREMAP_MAYMOVE
+		file->map = (char *) mremap(file->map, file->len, newlen, MREMAP_MAYMOVE);
 		if (file->map == MAP_FAILED) {
 			return -1;
 		}
+#else
+		if (munmap(file->map, file->len) != 0) {
+			return -1;
+		}
+
+		file->map = (char *) mmap(NULL, newlen, PROT_READ | PROT_WRITE, MAP_SHARED, file->fd, 0);
+		if (file->map == MAP_FAILED) {
+			return -1;
+		}
+#endif
+
+		file->len = newlen;
+		memfile_advise(file);
+
+		memfile_remaps++;
+		memfile_remapped_bytes += newlen;
 	}
 
 	memcpy(file->map + file->off, s, len);
 	file->off += len;
 	return len;
 }
+
+void memfile_stats(long long *remaps, long long *remapped_bytes) {
+	*remaps = memfile_remaps;
+	*remapped_bytes = memfile_remapped_bytes;
+}
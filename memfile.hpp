@@ -8,7 +8,8 @@ struct memfile {
 	char *map = NULL;
 	std::atomic<long long> len;
 	long long off = 0;
-	unsigned long tree = 0;
+	unsigned long long entries = 0;  // slots in use, if this is a string pool hash table
+	long long granularity = 0;	 // file size is always a multiple of this
 
 	memfile()
 	    : len(0) {
@@ -19,4 +20,8 @@ struct memfile *memfile_open(int fd);
 int memfile_close(struct memfile *file);
 int memfile_write(struct memfile *file, void *s, long long len);
 
+// Number of times any memfile has had to be grown and remapped,
+// and the total size of the mappings that resulted
+void memfile_stats(long long *remaps, long long *remapped_bytes);
+
 #endif
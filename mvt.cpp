@@ -276,11 +276,130 @@ bool mvt_tile::decode(std::string &message, bool &was_compressed) {
 				}
 			}
 
-			for (size_t i = 0; i < layer.keys.size(); i++) {
-				layer.key_map.insert(std::pair<std::string, size_t>(layer.keys[i], i));
-			}
-			for (size_t i = 0; i < layer.values.size(); i++) {
-				layer.value_map.insert(std::pair<mvt_value, size_t>(layer.values[i], i));
+			layer.index_constants();
+			layers.push_back(layer);
+			break;
+		}
+
+		default:
+			reader.skip();
+			break;
+		}
+	}
+
+	return true;
+}
+
+bool mvt_tile_summary::summarize(std::string &message, bool &was_compressed) {
+	layers.clear();
+	std::string src;
+
+	if (is_compressed(message)) {
+		std::string uncompressed;
+		if (decompress(message, uncompressed) == 0) {
+			exit(EXIT_FAILURE);
+		}
+		src = uncompressed;
+		was_compressed = true;
+	} else {
+		src = message;
+		was_compressed = false;
+	}
+
+	protozero::pbf_reader reader(src);
+
+	while (reader.next()) {
+		switch (reader.tag()) {
+		case 3: /* layer */
+		{
+			protozero::data_view layer_data = reader.get_view();
+			protozero::pbf_reader layer_reader(layer_data);
+			mvt_layer_summary layer;
+			layer.bytes = layer_data.size();
+
+			while (layer_reader.next()) {
+				switch (layer_reader.tag()) {
+				case 1: /* name */
+					layer.name = layer_reader.get_string();
+					break;
+
+				case 3: /* key */
+					layer_reader.skip();
+					layer.keys++;
+					break;
+
+				case 4: /* value */
+					layer_reader.skip();
+					layer.values++;
+					break;
+
+				case 5: /* extent */
+					layer.extent = layer_reader.get_uint32();
+					break;
+
+				case 15: /* version */
+					layer.version = layer_reader.get_uint32();
+					break;
+
+				case 2: /* feature */
+				{
+					protozero::pbf_reader feature_reader(layer_reader.get_message());
+
+					// Parameters still to skip, carried across geometry fields
+					// since decode() concatenates them
+					size_t params = 0;
+					size_t vertices = 0;
+
+					while (feature_reader.next()) {
+						switch (feature_reader.tag()) {
+						case 3: /* feature type */
+						{
+							int type = feature_reader.get_enum();
+							if (type == mvt_point) {
+								layer.points++;
+							} else if (type == mvt_linestring) {
+								layer.lines++;
+							} else if (type == mvt_polygon) {
+								layer.polygons++;
+							}
+							break;
+						}
+
+						case 4: /* geometry */
+						{
+							auto pi = feature_reader.get_packed_uint32();
+							for (auto it = pi.first; it != pi.second; ++it) {
+								if (params > 0) {
+									params--;
+									continue;
+								}
+
+								uint32_t op = *it & 7;
+								uint32_t count = *it >> 3;
+								if (op == mvt_moveto || op == mvt_lineto) {
+									vertices += count;
+									params = 2 * (size_t) count;
+								}
+							}
+							break;
+						}
+
+						default:
+							feature_reader.skip();
+							break;
+						}
+					}
+
+					// decode() drops a final point whose coordinates are cut off
+					layer.vertices += vertices - (params + 1) / 2;
+					layer.features++;
+					break;
+				}
+
+				default:
+					layer_reader.skip();
+					break;
+				}
 			}
 
 			layers.push_back(layer);
@@ -491,29 +610,169 @@ std::string mvt_value::toString() {
 }
 
 void mvt_layer::tag(mvt_feature &feature, std::string key, mvt_value value) {
-	size_t ko, vo;
+	feature.tags.push_back(tag_key(key));
+	feature.tags.push_back(tag_value(value));
+}
 
-	std::map<std::string, size_t>::iterator ki = key_map.find(key);
-	std::map<mvt_value, size_t>::iterator vi = value_map.find(value);
+#define FNV_OFFSET 14695981039346656037ULL
+#define FNV_PRIME 1099511628211ULL
 
-	if (ki == key_map.end()) {
-		ko = keys.size();
-		keys.push_back(key);
-		key_map.insert(std::pair<std::string, size_t>(key, ko));
-	} else {
-		ko = ki->second;
+static unsigned long long fnv1a(unsigned long long h, const void *p, size_t len) {
+	const unsigned char *s = (const unsigned char *) p;
+	for (size_t i = 0; i < len; i++) {
+		h ^= s[i];
+		h *= FNV_PRIME;
 	}
+	return h;
+}
 
-	if (vi == value_map.end()) {
-		vo = values.size();
-		values.push_back(value);
-		value_map.insert(std::pair<mvt_value, size_t>(value, vo));
-	} else {
-		vo = vi->second;
+static unsigned long long hash_constant(std::string const &key) {
+	return fnv1a(FNV_OFFSET, key.c_str(), key.size());
+}
+
+// Values that are equal under mvt_value::operator< must hash alike,
+// so zeroes of either sign and all NaNs each hash as one value
+static unsigned long long hash_double(unsigned long long h, double d) {
+	if (d == 0) {
+		d = 0;
+	} else if (d != d) {
+		return fnv1a(h, "NaN", 3);
+	}
+	return fnv1a(h, &d, sizeof(double));
+}
+
+static unsigned long long hash_constant(mvt_value const &v) {
+	unsigned char type = v.type;
+	unsigned long long h = fnv1a(FNV_OFFSET, &type, 1);
+
+	switch (v.type) {
+	case mvt_string:
+		return fnv1a(h, v.string_value.c_str(), v.string_value.size());
+	case mvt_float:
+		return hash_double(h, v.numeric_value.float_value);
+	case mvt_double:
+		return hash_double(h, v.numeric_value.double_value);
+	case mvt_int:
+		return fnv1a(h, &v.numeric_value.int_value, sizeof(long long));
+	case mvt_uint:
+		return fnv1a(h, &v.numeric_value.uint_value, sizeof(unsigned long long));
+	case mvt_sint:
+		return fnv1a(h, &v.numeric_value.sint_value, sizeof(long long));
+	case mvt_bool:
+		return fnv1a(h, &v.numeric_value.bool_value, sizeof(bool));
+	case mvt_null:
+		return fnv1a(h, &v.numeric_value.null_value, sizeof(int));
 	}
 
-	feature.tags.push_back(ko);
-	feature.tags.push_back(vo);
+	return h;
+}
+
+static bool same_constant(std::string const &a, std::string const &b) {
+	return a == b;
+}
+
+// The same equivalence that a std::map<mvt_value> would use,
+// except that a NaN is only the same as another NaN
+static bool same_constant(mvt_value const &a, mvt_value const &b) {
+	if (a.type == b.type) {
+		if (a.type == mvt_float && (a.numeric_value.float_value != a.numeric_value.float_value || b.numeric_value.float_value != b.numeric_value.float_value)) {
+			return a.numeric_value.float_value != a.numeric_value.float_value && b.numeric_value.float_value != b.numeric_value.float_value;
+		}
+		if (a.type == mvt_double && (a.numeric_value.double_value != a.numeric_value.double_value || b.numeric_value.double_value != b.numeric_value.double_value)) {
+			return a.numeric_value.double_value != a.numeric_value.double_value && b.numeric_value.double_value != b.numeric_value.double_value;
+		}
+	}
+	return !(a < b) && !(b < a);
+}
+
+// Finds the slot for a constant in a layer's hash table, either the one
+// that already refers to it or the empty one where it should be added
+template <typename T>
+static mvt_hash_slot &find_constant(std::vector<mvt_hash_slot> &table, std::vector<T> const &items, T const &item, unsigned long long h) {
+	size_t mask = table.size() - 1;
+	for (size_t i = h & mask;; i = (i + 1) & mask) {
+		mvt_hash_slot &slot = table[i];
+		if (slot.index == 0 || (slot.hash == h && same_constant(items[slot.index - 1], item))) {
+			return slot;
+		}
+	}
+}
+
+// Keeps the table no more than half full with room for one more constant
+static void reserve_constants(std::vector<mvt_hash_slot> &table, size_t count) {
+	if ((count + 1) * 2 <= table.size()) {
+		return;
+	}
+
+	size_t size = 16;
+	while ((count + 1) * 2 > size) {
+		size *= 2;
+	}
+
+	std::vector<mvt_hash_slot> old;
+	old.swap(table);
+	table.resize(size);
+
+	size_t mask = size - 1;
+	for (auto const &slot : old) {
+		if (slot.index != 0) {
+			size_t i = slot.hash & mask;
+			while (table[i].index != 0) {
+				i = (i + 1) & mask;
+			}
+			table[i] = slot;
+		}
+	}
+}
+
+template <typename T>
+static size_t intern_constant(std::vector<mvt_hash_slot> &table, std::vector<T> &items, T const &item) {
+	reserve_constants(table, items.size());
+
+	unsigned long long h = hash_constant(item);
+	mvt_hash_slot &slot = find_constant(table, items, item, h);
+
+	if (slot.index == 0) {
+		items.push_back(item);
+		slot.hash = h;
+		slot.index = items.size();
+	}
+
+	return slot.index - 1;
+}
+
+size_t mvt_layer::tag_key(std::string const &key) {
+	return intern_constant(key_table, keys, key);
+}
+
+size_t mvt_layer::tag_value(mvt_value const &value) {
+	return intern_constant(value_table, values, value);
+}
+
+// As with inserting into a map, if a tile repeats a constant,
+// the first copy of it is the one that later tags refer to
+void mvt_layer::index_constants() {
+	key_table.clear();
+	reserve_constants(key_table, keys.size());
+	for (size_t i = 0; i < keys.size(); i++) {
+		unsigned long long h = hash_constant(keys[i]);
+		mvt_hash_slot &slot = find_constant(key_table, keys, keys[i], h);
+		if (slot.index == 0) {
+			slot.hash = h;
+			slot.index = i + 1;
+		}
+	}
+
+	value_table.clear();
+	reserve_constants(value_table, values.size());
+	for (size_t i = 0; i < values.size(); i++) {
+		unsigned long long h = hash_constant(values[i]);
+		mvt_hash_slot &slot = find_constant(value_table, values, values[i], h);
+		if (slot.index == 0) {
+			slot.hash = h;
+			slot.index = i + 1;
+		}
+	}
 }
 
 bool is_integer(const char *s, long long *v) {
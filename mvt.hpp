@@ -90,6 +90,13 @@ struct mvt_value {
 	}
 };
 
+// One slot of a layer's constant hash table: the hash of a key or value,
+// and its index in the layer's keys or values plus one, or 0 if unused
+struct mvt_hash_slot {
+	unsigned long long hash = 0;
+	size_t index = 0;
+};
+
 struct mvt_layer {
 	int version = 0;
 	std::string name = "";
@@ -101,9 +108,17 @@ struct mvt_layer {
 	// Add a key-value pair to a feature, using this layer's constant pool
 	void tag(mvt_feature &feature, std::string key, mvt_value value);
 
-	// For tracking the key-value constants already used in this layer
-	std::map<std::string, size_t> key_map{};
-	std::map<mvt_value, size_t> value_map{};
+	// The index of a key or value in this layer's constant pool, adding it if it isn't there yet
+	size_t tag_key(std::string const &key);
+	size_t tag_value(mvt_value const &value);
+
+	// For tracking the key-value constants already used in this layer:
+	// open-addressed hash tables of positions in keys and values
+	std::vector<mvt_hash_slot> key_table{};
+	std::vector<mvt_hash_slot> value_table{};
+
+	// Index the keys and values that were read in from a tile
+	void index_constants();
 };
 
 struct mvt_tile {
@@ -113,6 +128,31 @@ struct mvt_tile {
 	bool decode(std::string &message, bool &was_compressed);
 };
 
+// What is in one layer of a tile, counted by walking the encoded
+// layer without decoding its geometries or attribute values
+struct mvt_layer_summary {
+	std::string name = "";
+	int version = 0;
+	long long extent = 0;
+	size_t bytes = 0;  // of the encoded layer
+
+	size_t points = 0;
+	size_t lines = 0;
+	size_t polygons = 0;
+	size_t features = 0;  // including those of unknown type
+	size_t vertices = 0;
+
+	size_t keys = 0;
+	size_t values = 0;
+};
+
+struct mvt_tile_summary {
+	std::vector<mvt_layer_summary> layers{};
+
+	// As with mvt_tile::decode, throws if the tile can't be parsed
+	bool summarize(std::string &message, bool &was_compressed);
+};
+
 bool is_compressed(std::string const &data);
 int decompress(std::string const &input, std::string &output);
 int compress(std::string const &input, std::string &output);
@@ -25,6 +25,10 @@
 #define A_GENERATE_IDS ((int) 'i')
 #define A_CONVERT_NUMERIC_IDS ((int) 'I')
 #define A_HILBERT ((int) 'h')
+#define A_PERSISTENT_FILTERS ((int) 'F')
+#define A_BINARY_FILTERS ((int) 'B')
+#define A_PRE_CLIP_CHILDREN ((int) 'k')
+#define A_OVERZOOM_COMPLETE ((int) 'O')
 
 #define P_SIMPLIFY ((int) 's')
 #define P_SIMPLIFY_LOW ((int) 'S')
@@ -29,12 +29,15 @@ extern "C" {
 #include "jsonpull/jsonpull.h"
 }
 
+#include "binary_filter.hpp"
 #include "plugin.hpp"
 #include "write_json.hpp"
 #include "read_json.hpp"
+#include "options.hpp"
 
 struct writer_arg {
 	int write_to;
+	FILE *persistent_fp;
 	std::vector<mvt_layer> *layers;
 	unsigned z;
 	unsigned x;
@@ -42,18 +45,97 @@ struct writer_arg {
 	int extent;
 };
 
+// Persistent filters see each tile's features bracketed by these, so that they know
+// which tile they are working on and so that Tippecanoe knows when they are done.
+static void write_filter_marker(FILE *fp, int marker, unsigned z, unsigned x, unsigned y) {
+	filter_feature ff;
+	ff.marker = marker;
+	ff.z = z;
+	ff.x = x;
+	ff.y = y;
+	write_filter_feature(fp, ff);
+}
+
+void write_filter_tile_start(FILE *fp, unsigned z, unsigned x, unsigned y) {
+	if (additional[A_BINARY_FILTERS]) {
+		write_filter_marker(fp, FILTER_TILE_START, z, x, y);
+	} else {
+		fprintf(fp, "{\"type\":\"TileStart\",\"z\":%u,\"x\":%u,\"y\":%u}\n", z, x, y);
+	}
+}
+
+void write_filter_tile_end(FILE *fp, unsigned z, unsigned x, unsigned y, const char *which) {
+	if (additional[A_BINARY_FILTERS]) {
+		write_filter_marker(fp, FILTER_TILE_END, z, x, y);
+	} else {
+		fprintf(fp, "{\"type\":\"TileEnd\",\"z\":%u,\"x\":%u,\"y\":%u}\n", z, x, y);
+	}
+	if (fflush(fp) != 0) {
+		fprintf(stderr, "Write to %s failed: %s\n", which, strerror(errno));
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Writes the features of a tile to the postfilter as --binary-filters records,
+// converting them from tile coordinates to world coordinates
+static void write_binary_layers(FILE *fp, std::vector<mvt_layer> const &layers, unsigned z, unsigned x, unsigned y) {
+	long long scale = 1LL << (32 - z);
+
+	for (size_t i = 0; i < layers.size(); i++) {
+		mvt_layer const &layer = layers[i];
+		double factor = (double) scale / layer.extent;
+
+		for (size_t f = 0; f < layer.features.size(); f++) {
+			mvt_feature const &feat = layer.features[f];
+
+			filter_feature ff;
+			ff.layer = layer.name;
+			ff.type = feat.type;
+			ff.has_id = feat.has_id;
+			ff.id = feat.id;
+			ff.dropped = feat.dropped;
+
+			for (size_t g = 0; g < feat.geometry.size(); g++) {
+				mvt_geometry const &mg = feat.geometry[g];
+				ff.geometry.push_back(draw(mg.op, std::round(scale * x + mg.x * factor), std::round(scale * y + mg.y * factor)));
+			}
+
+			for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
+				ff.keys.push_back(layer.keys[feat.tags[t]]);
+				ff.values.push_back(mvt_value_to_serial_val(layer.values[feat.tags[t + 1]]));
+			}
+
+			write_filter_feature(fp, ff);
+		}
+	}
+}
+
 void *run_writer(void *a) {
 	writer_arg *wa = (writer_arg *) a;
 
-	FILE *fp = fdopen(wa->write_to, "w");
+	FILE *fp = wa->persistent_fp;
 	if (fp == NULL) {
-		perror("fdopen (pipe writer)");
-		exit(EXIT_FAILURE);
+		fp = fdopen(wa->write_to, "w");
+		if (fp == NULL) {
+			perror("fdopen (pipe writer)");
+			exit(EXIT_FAILURE);
+		}
+	} else {
+		write_filter_tile_start(fp, wa->z, wa->x, wa->y);
 	}
 
-	json_writer state(fp);
-	for (size_t i = 0; i < wa->layers->size(); i++) {
-		layer_to_geojson((*(wa->layers))[i], wa->z, wa->x, wa->y, false, true, false, true, 0, 0, 0, true, state);
+	if (additional[A_BINARY_FILTERS]) {
+		write_binary_layers(fp, *(wa->layers), wa->z, wa->x, wa->y);
+	} else {
+		json_writer state(fp);
+		for (size_t i = 0; i < wa->layers->size(); i++) {
+			layer_to_geojson((*(wa->layers))[i], wa->z, wa->x, wa->y, false, true, false, true, 0, 0, 0, true, state);
+		}
+	}
+
+	if (wa->persistent_fp != NULL) {
+		write_filter_tile_end(fp, wa->z, wa->x, wa->y, "postfilter");
+		return NULL;
 	}
 
 	if (fclose(fp) != 0) {
@@ -83,222 +165,317 @@ static std::vector<mvt_geometry> to_feature(drawvec &geom) {
 	return out;
 }
 
-// Reads from the postfilter
-std::vector<mvt_layer> parse_layers(int fd, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
-	std::map<std::string, mvt_layer> ret;
+// Is this the end-of-tile marker from a persistent filter?
+// Complain if it is for some tile other than the one being worked on.
+static bool is_filter_tile_end(json_object *j, json_object *type, json_pull *jp, int z, unsigned x, unsigned y) {
+	if (strcmp(type->string, "TileEnd") != 0) {
+		return false;
+	}
+
+	json_object *jz = json_hash_get(j, "z");
+	json_object *jx = json_hash_get(j, "x");
+	json_object *jy = json_hash_get(j, "y");
 
-	FILE *f = fdopen(fd, "r");
-	if (f == NULL) {
-		perror("fdopen filter output");
+	if (jz == NULL || jz->type != JSON_NUMBER || jz->number != z ||
+	    jx == NULL || jx->type != JSON_NUMBER || jx->number != x ||
+	    jy == NULL || jy->type != JSON_NUMBER || jy->number != y) {
+		fprintf(stderr, "Filter output:%d: end of tile does not match tile %d/%u/%u\n", jp->line, z, x, y);
+		json_context(j);
 		exit(EXIT_FAILURE);
 	}
-	json_pull *jp = json_begin_file(f);
 
-	while (1) {
-		json_object *j = json_read(jp);
-		if (j == NULL) {
-			if (jp->error != NULL) {
-				fprintf(stderr, "Filter output:%d: %s\n", jp->line, jp->error);
-				if (jp->root != NULL) {
-					json_context(jp->root);
-				}
-				exit(EXIT_FAILURE);
-			}
+	return true;
+}
 
-			json_free(jp->root);
+// Finds the geometry and properties of a GeoJSON feature from a filter,
+// or returns false if the object is not a feature
+static bool json_to_filter_feature(json_object *j, json_pull *jp, filter_feature &ff) {
+	json_object *type = json_hash_get(j, "type");
+	if (type == NULL || type->type != JSON_STRING || strcmp(type->string, "Feature") != 0) {
+		return false;
+	}
+
+	json_object *geometry = json_hash_get(j, "geometry");
+	if (geometry == NULL) {
+		fprintf(stderr, "Filter output:%d: filtered feature with no geometry\n", jp->line);
+		json_context(j);
+		json_free(j);
+		exit(EXIT_FAILURE);
+	}
+
+	json_object *properties = json_hash_get(j, "properties");
+	if (properties == NULL || (properties->type != JSON_HASH && properties->type != JSON_NULL)) {
+		fprintf(stderr, "Filter output:%d: feature without properties hash\n", jp->line);
+		json_context(j);
+		json_free(j);
+		exit(EXIT_FAILURE);
+	}
+
+	json_object *geometry_type = json_hash_get(geometry, "type");
+	if (geometry_type == NULL) {
+		fprintf(stderr, "Filter output:%d: null geometry (additional not reported)\n", jp->line);
+		json_context(j);
+		exit(EXIT_FAILURE);
+	}
+
+	if (geometry_type->type != JSON_STRING) {
+		fprintf(stderr, "Filter output:%d: geometry type is not a string\n", jp->line);
+		json_context(j);
+		exit(EXIT_FAILURE);
+	}
+
+	json_object *coordinates = json_hash_get(geometry, "coordinates");
+	if (coordinates == NULL || coordinates->type != JSON_ARRAY) {
+		fprintf(stderr, "Filter output:%d: feature without coordinates array\n", jp->line);
+		json_context(j);
+		exit(EXIT_FAILURE);
+	}
+
+	int t;
+	for (t = 0; t < GEOM_TYPES; t++) {
+		if (strcmp(geometry_type->string, geometry_names[t]) == 0) {
 			break;
 		}
+	}
+	if (t >= GEOM_TYPES) {
+		fprintf(stderr, "Filter output:%d: Can't handle geometry type %s\n", jp->line, geometry_type->string);
+		json_context(j);
+		exit(EXIT_FAILURE);
+	}
 
-		json_object *type = json_hash_get(j, "type");
-		if (type == NULL || type->type != JSON_STRING) {
-			continue;
-		}
-		if (strcmp(type->string, "Feature") != 0) {
-			continue;
+	ff.layer = "unknown";
+	json_object *tippecanoe = json_hash_get(j, "tippecanoe");
+	if (tippecanoe != NULL) {
+		json_object *layer = json_hash_get(tippecanoe, "layer");
+		if (layer != NULL && layer->type == JSON_STRING) {
+			ff.layer = std::string(layer->string);
 		}
 
-		json_object *geometry = json_hash_get(j, "geometry");
-		if (geometry == NULL) {
-			fprintf(stderr, "Filter output:%d: filtered feature with no geometry\n", jp->line);
-			json_context(j);
-			json_free(j);
-			exit(EXIT_FAILURE);
+		json_object *index = json_hash_get(tippecanoe, "index");
+		if (index != NULL && index->type == JSON_NUMBER) {
+			ff.index = index->number;
 		}
 
-		json_object *properties = json_hash_get(j, "properties");
-		if (properties == NULL || (properties->type != JSON_HASH && properties->type != JSON_NULL)) {
-			fprintf(stderr, "Filter output:%d: feature without properties hash\n", jp->line);
-			json_context(j);
-			json_free(j);
-			exit(EXIT_FAILURE);
+		json_object *sequence = json_hash_get(tippecanoe, "sequence");
+		if (sequence != NULL && sequence->type == JSON_NUMBER) {
+			ff.sequence = sequence->number;
 		}
 
-		json_object *geometry_type = json_hash_get(geometry, "type");
-		if (geometry_type == NULL) {
-			fprintf(stderr, "Filter output:%d: null geometry (additional not reported)\n", jp->line);
-			json_context(j);
-			exit(EXIT_FAILURE);
+		json_object *extent = json_hash_get(tippecanoe, "extent");
+		if (extent != NULL && extent->type == JSON_NUMBER) {
+			ff.extent = extent->number;
 		}
 
-		if (geometry_type->type != JSON_STRING) {
-			fprintf(stderr, "Filter output:%d: geometry type is not a string\n", jp->line);
-			json_context(j);
-			exit(EXIT_FAILURE);
+		json_object *dropped = json_hash_get(tippecanoe, "dropped");
+		if (dropped != NULL && dropped->type == JSON_TRUE) {
+			ff.dropped = true;
 		}
+	}
 
-		json_object *coordinates = json_hash_get(geometry, "coordinates");
-		if (coordinates == NULL || coordinates->type != JSON_ARRAY) {
-			fprintf(stderr, "Filter output:%d: feature without coordinates array\n", jp->line);
-			json_context(j);
-			exit(EXIT_FAILURE);
-		}
+	ff.type = mb_geometry[t];
+	parse_geometry(t, coordinates, ff.geometry, VT_MOVETO, "Filter output", jp->line, j);
 
-		int t;
-		for (t = 0; t < GEOM_TYPES; t++) {
-			if (strcmp(geometry_type->string, geometry_names[t]) == 0) {
-				break;
-			}
-		}
-		if (t >= GEOM_TYPES) {
-			fprintf(stderr, "Filter output:%d: Can't handle geometry type %s\n", jp->line, geometry_type->string);
-			json_context(j);
-			exit(EXIT_FAILURE);
-		}
+	json_object *id = json_hash_get(j, "id");
+	if (id != NULL) {
+		ff.id = atoll(id->string);
+		ff.has_id = true;
+	}
 
-		std::string layername = "unknown";
-		json_object *tippecanoe = json_hash_get(j, "tippecanoe");
-		json_object *layer = NULL;
-		if (tippecanoe != NULL) {
-			layer = json_hash_get(tippecanoe, "layer");
-			if (layer != NULL && layer->type == JSON_STRING) {
-				layername = std::string(layer->string);
-			}
-		}
+	for (size_t i = 0; i < properties->length; i++) {
+		serial_val v;
+		v.type = -1;
 
-		if (ret.count(layername) == 0) {
-			mvt_layer l;
-			l.name = layername;
-			l.version = 2;
-			l.extent = extent;
+		stringify_value(properties->values[i], v.type, v.s, "Filter output", jp->line, j);
 
-			ret.insert(std::pair<std::string, mvt_layer>(layername, l));
-		}
-		auto l = ret.find(layername);
+		ff.keys.push_back(std::string(properties->keys[i]->string));
+		ff.values.push_back(v);
+	}
 
-		drawvec dv;
-		parse_geometry(t, coordinates, dv, VT_MOVETO, "Filter output", jp->line, j);
-		if (mb_geometry[t] == VT_POLYGON) {
-			dv = fix_polygon(dv);
-		}
+	return true;
+}
 
-		// Scale and offset geometry from global to tile
-		for (size_t i = 0; i < dv.size(); i++) {
-			long long scale = 1LL << (32 - z);
-			dv[i].x = std::round((dv[i].x - scale * x) * extent / (double) scale);
-			dv[i].y = std::round((dv[i].y - scale * y) * extent / (double) scale);
-		}
+// Reads the next feature or end-of-tile marker from a filter using --binary-filters.
+// Returns false at the end of the stream.
+static bool read_binary_feature(filter_reader *fr, filter_feature &ff, int z, unsigned x, unsigned y) {
+	std::string message;
+
+	while (fr->next(message)) {
+		decode_filter_feature(message, ff);
 
-		if (mb_geometry[t] == VT_POLYGON) {
-			dv = clean_or_clip_poly(dv, 0, 0, false);
-			if (dv.size() < 3) {
-				dv.clear();
+		if (ff.marker == FILTER_TILE_END) {
+			if (ff.z != (unsigned) z || ff.x != x || ff.y != y) {
+				fprintf(stderr, "Filter output: end of tile %u/%u/%u does not match tile %d/%u/%u\n", ff.z, ff.x, ff.y, z, x, y);
+				exit(EXIT_FAILURE);
 			}
+			return true;
 		}
-		dv = remove_noop(dv, mb_geometry[t], 0);
-		if (mb_geometry[t] == VT_POLYGON) {
-			dv = close_poly(dv);
+		if (ff.marker != 0) {
+			continue;
 		}
 
-		if (dv.size() > 0) {
-			mvt_feature feature;
-			feature.type = mb_geometry[t];
-			feature.geometry = to_feature(dv);
+		if (ff.type != VT_POINT && ff.type != VT_LINE && ff.type != VT_POLYGON) {
+			fprintf(stderr, "Filter output: Can't handle geometry type %d\n", ff.type);
+			exit(EXIT_FAILURE);
+		}
+		if (ff.layer.size() == 0) {
+			ff.layer = "unknown";
+		}
+
+		// Polygon rings are in vector tile winding order, so each outer ring after the first
+		// begins a new polygon, which fix_polygon() expects to be marked by a ClosePath
+		if (ff.type == VT_POLYGON) {
+			drawvec dv;
+			for (size_t i = 0; i < ff.geometry.size(); i++) {
+				if (ff.geometry[i].op == VT_MOVETO) {
+					size_t j;
+					for (j = i + 1; j < ff.geometry.size(); j++) {
+						if (ff.geometry[j].op != VT_LINETO) {
+							break;
+						}
+					}
 
-			json_object *id = json_hash_get(j, "id");
-			if (id != NULL) {
-				feature.id = atoll(id->string);
-				feature.has_id = true;
+					if (dv.size() > 0 && get_area(ff.geometry, i, j) > 0) {
+						dv.push_back(draw(VT_CLOSEPATH, 0, 0));
+					}
+				}
+				dv.push_back(ff.geometry[i]);
 			}
+			ff.geometry = dv;
+		}
 
-			std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
-			if (layermap.count(layername) == 0) {
-				layermap_entry lme = layermap_entry(layermap.size());
-				lme.minzoom = z;
-				lme.maxzoom = z;
+		return true;
+	}
 
-				layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
+	return false;
+}
 
-				if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
-					(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
-					(*layer_unmaps)[tiling_seg][lme.id] = layername;
-				}
-			}
+// Adds a feature from the postfilter to the layer that it belongs to
+static void add_postfiltered_feature(filter_feature &ff, std::map<std::string, mvt_layer> &ret, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
+	std::string &layername = ff.layer;
 
-			auto fk = layermap.find(layername);
-			if (fk == layermap.end()) {
-				fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
-				exit(EXIT_FAILURE);
-			}
-			if (z < fk->second.minzoom) {
-				fk->second.minzoom = z;
-			}
-			if (z > fk->second.maxzoom) {
-				fk->second.maxzoom = z;
-			}
+	if (ret.count(layername) == 0) {
+		mvt_layer l;
+		l.name = layername;
+		l.version = 2;
+		l.extent = extent;
 
-			if (feature.type == mvt_point) {
-				fk->second.points++;
-			} else if (feature.type == mvt_linestring) {
-				fk->second.lines++;
-			} else if (feature.type == mvt_polygon) {
-				fk->second.polygons++;
-			}
+		ret.insert(std::pair<std::string, mvt_layer>(layername, l));
+	}
+	auto l = ret.find(layername);
 
-			for (size_t i = 0; i < properties->length; i++) {
-				int tp = -1;
-				std::string s;
+	drawvec &dv = ff.geometry;
+	if (ff.type == VT_POLYGON) {
+		dv = fix_polygon(dv);
+	}
 
-				stringify_value(properties->values[i], tp, s, "Filter output", jp->line, j);
+	// Scale and offset geometry from global to tile
+	for (size_t i = 0; i < dv.size(); i++) {
+		long long scale = 1LL << (32 - z);
+		dv[i].x = std::round((dv[i].x - scale * x) * extent / (double) scale);
+		dv[i].y = std::round((dv[i].y - scale * y) * extent / (double) scale);
+	}
 
-				// Nulls can be excluded here because this is the postfilter
-				// and it is nearly time to create the vector representation
+	if (ff.type == VT_POLYGON) {
+		dv = clean_or_clip_poly(dv, 0, 0, false);
+		if (dv.size() < 3) {
+			dv.clear();
+		}
+	}
+	dv = remove_noop(dv, ff.type, 0);
+	if (ff.type == VT_POLYGON) {
+		dv = close_poly(dv);
+	}
 
-				if (tp >= 0 && tp != mvt_null) {
-					mvt_value v = stringified_to_mvt_value(tp, s.c_str());
-					l->second.tag(feature, std::string(properties->keys[i]->string), v);
+	if (dv.size() > 0) {
+		mvt_feature feature;
+		feature.type = ff.type;
+		feature.geometry = to_feature(dv);
+		feature.id = ff.id;
+		feature.has_id = ff.has_id;
 
-					type_and_string attrib;
-					attrib.type = tp;
-					attrib.string = s;
+		std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
+		if (layermap.count(layername) == 0) {
+			layermap_entry lme = layermap_entry(layermap.size());
+			lme.minzoom = z;
+			lme.maxzoom = z;
 
-					add_to_file_keys(fk->second.file_keys, std::string(properties->keys[i]->string), attrib);
-				}
+			layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
+
+			if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
+				(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
+				(*layer_unmaps)[tiling_seg][lme.id] = layername;
 			}
+		}
 
-			l->second.features.push_back(feature);
+		auto fk = layermap.find(layername);
+		if (fk == layermap.end()) {
+			fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
+			exit(EXIT_FAILURE);
+		}
+		if (z < fk->second.minzoom) {
+			fk->second.minzoom = z;
+		}
+		if (z > fk->second.maxzoom) {
+			fk->second.maxzoom = z;
 		}
 
-		json_free(j);
-	}
+		if (feature.type == mvt_point) {
+			fk->second.points++;
+		} else if (feature.type == mvt_linestring) {
+			fk->second.lines++;
+		} else if (feature.type == mvt_polygon) {
+			fk->second.polygons++;
+		}
 
-	json_end(jp);
-	if (fclose(f) != 0) {
-		perror("fclose postfilter output");
-		exit(EXIT_FAILURE);
-	}
+		for (size_t i = 0; i < ff.keys.size(); i++) {
+			int tp = ff.values[i].type;
+			std::string &s = ff.values[i].s;
 
-	std::vector<mvt_layer> final;
-	for (auto a : ret) {
-		final.push_back(a.second);
+			// Nulls can be excluded here because this is the postfilter
+			// and it is nearly time to create the vector representation
+
+			if (tp >= 0 && tp != mvt_null) {
+				mvt_value v = stringified_to_mvt_value(tp, s.c_str());
+				l->second.tag(feature, ff.keys[i], v);
+
+				type_and_string attrib;
+				attrib.type = tp;
+				attrib.string = s;
+
+				add_to_file_keys(fk->second.file_keys, ff.keys[i], attrib);
+			}
+		}
+
+		l->second.features.push_back(feature);
 	}
-	return final;
 }
 
-// Reads from the prefilter
-serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool postfilter) {
-	serial_feature sf;
+// Reads from the postfilter, either GeoJSON from jp or, with --binary-filters, records from fr
+std::vector<mvt_layer> parse_layers(json_pull *jp, filter_reader *fr, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent, bool persistent) {
+	std::map<std::string, mvt_layer> ret;
 
 	while (1) {
+		filter_feature ff;
+
+		if (fr != NULL) {
+			if (!read_binary_feature(fr, ff, z, x, y)) {
+				if (persistent) {
+					fprintf(stderr, "Postfilter exited before the end of tile %d/%u/%u\n", z, x, y);
+					exit(EXIT_FAILURE);
+				}
+				break;
+			}
+			if (ff.marker == FILTER_TILE_END) {
+				if (persistent) {
+					break;
+				}
+				continue;
+			}
+
+			add_postfiltered_feature(ff, ret, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+			continue;
+		}
+
 		json_object *j = json_read(jp);
 		if (j == NULL) {
 			if (jp->error != NULL) {
@@ -309,222 +486,227 @@ serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::
 				exit(EXIT_FAILURE);
 			}
 
+			if (persistent) {
+				fprintf(stderr, "Postfilter exited before the end of tile %d/%u/%u\n", z, x, y);
+				exit(EXIT_FAILURE);
+			}
+
 			json_free(jp->root);
-			sf.t = -1;
-			return sf;
+			break;
 		}
 
 		json_object *type = json_hash_get(j, "type");
 		if (type == NULL || type->type != JSON_STRING) {
 			continue;
 		}
-		if (strcmp(type->string, "Feature") != 0) {
-			continue;
-		}
-
-		json_object *geometry = json_hash_get(j, "geometry");
-		if (geometry == NULL) {
-			fprintf(stderr, "Filter output:%d: filtered feature with no geometry\n", jp->line);
-			json_context(j);
+		if (persistent && is_filter_tile_end(j, type, jp, z, x, y)) {
 			json_free(j);
-			exit(EXIT_FAILURE);
+			break;
 		}
 
-		json_object *properties = json_hash_get(j, "properties");
-		if (properties == NULL || (properties->type != JSON_HASH && properties->type != JSON_NULL)) {
-			fprintf(stderr, "Filter output:%d: feature without properties hash\n", jp->line);
-			json_context(j);
-			json_free(j);
-			exit(EXIT_FAILURE);
+		if (!json_to_filter_feature(j, jp, ff)) {
+			continue;
 		}
 
-		json_object *geometry_type = json_hash_get(geometry, "type");
-		if (geometry_type == NULL) {
-			fprintf(stderr, "Filter output:%d: null geometry (additional not reported)\n", jp->line);
-			json_context(j);
-			exit(EXIT_FAILURE);
-		}
+		add_postfiltered_feature(ff, ret, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+		json_free(j);
+	}
 
-		if (geometry_type->type != JSON_STRING) {
-			fprintf(stderr, "Filter output:%d: geometry type is not a string\n", jp->line);
-			json_context(j);
-			exit(EXIT_FAILURE);
-		}
+	std::vector<mvt_layer> final;
+	for (auto a : ret) {
+		final.push_back(a.second);
+	}
+	return final;
+}
 
-		json_object *coordinates = json_hash_get(geometry, "coordinates");
-		if (coordinates == NULL || coordinates->type != JSON_ARRAY) {
-			fprintf(stderr, "Filter output:%d: feature without coordinates array\n", jp->line);
-			json_context(j);
-			exit(EXIT_FAILURE);
-		}
+// Turns a feature from the prefilter back into a serial_feature.
+// Returns false if nothing is left of its geometry.
+static bool prefiltered_feature(filter_feature &ff, serial_feature &sf, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool postfilter) {
+	drawvec &dv = ff.geometry;
+	if (ff.type == VT_POLYGON) {
+		dv = fix_polygon(dv);
+	}
 
-		int t;
-		for (t = 0; t < GEOM_TYPES; t++) {
-			if (strcmp(geometry_type->string, geometry_names[t]) == 0) {
-				break;
-			}
-		}
-		if (t >= GEOM_TYPES) {
-			fprintf(stderr, "Filter output:%d: Can't handle geometry type %s\n", jp->line, geometry_type->string);
-			json_context(j);
-			exit(EXIT_FAILURE);
+	// Scale and offset geometry from global to tile
+	double scale = 1LL << geometry_scale;
+	for (size_t i = 0; i < dv.size(); i++) {
+		unsigned sx = 0, sy = 0;
+		if (z != 0) {
+			sx = x << (32 - z);
+			sy = y << (32 - z);
 		}
+		dv[i].x = std::round(dv[i].x / scale) * scale - sx;
+		dv[i].y = std::round(dv[i].y / scale) * scale - sy;
+	}
 
-		drawvec dv;
-		parse_geometry(t, coordinates, dv, VT_MOVETO, "Filter output", jp->line, j);
-		if (mb_geometry[t] == VT_POLYGON) {
-			dv = fix_polygon(dv);
-		}
+	if (dv.size() == 0) {
+		return false;
+	}
 
-		// Scale and offset geometry from global to tile
-		double scale = 1LL << geometry_scale;
-		for (size_t i = 0; i < dv.size(); i++) {
-			unsigned sx = 0, sy = 0;
-			if (z != 0) {
-				sx = x << (32 - z);
-				sy = y << (32 - z);
+	sf.t = ff.type;
+	sf.segment = tiling_seg;
+	sf.geometry = dv;
+	sf.seq = ff.sequence;
+	sf.index = ff.index;
+	sf.bbox[0] = sf.bbox[1] = LLONG_MAX;
+	sf.bbox[2] = sf.bbox[3] = LLONG_MIN;
+	sf.extent = ff.extent;
+	sf.metapos = 0;
+	sf.has_id = ff.has_id;
+	sf.id = ff.id;
+	sf.dropped = ff.dropped;
+
+	std::string &layername = ff.layer;
+
+	for (size_t i = 0; i < dv.size(); i++) {
+		if (dv[i].op == VT_MOVETO || dv[i].op == VT_LINETO) {
+			if (dv[i].x < sf.bbox[0]) {
+				sf.bbox[0] = dv[i].x;
 			}
-			dv[i].x = std::round(dv[i].x / scale) * scale - sx;
-			dv[i].y = std::round(dv[i].y / scale) * scale - sy;
-		}
-
-		if (dv.size() > 0) {
-			sf.t = mb_geometry[t];
-			sf.segment = tiling_seg;
-			sf.geometry = dv;
-			sf.seq = 0;
-			sf.index = 0;
-			sf.bbox[0] = sf.bbox[1] = LLONG_MAX;
-			sf.bbox[2] = sf.bbox[3] = LLONG_MIN;
-			sf.extent = 0;
-			sf.metapos = 0;
-			sf.has_id = false;
-
-			std::string layername = "unknown";
-			json_object *tippecanoe = json_hash_get(j, "tippecanoe");
-			if (tippecanoe != NULL) {
-				json_object *layer = json_hash_get(tippecanoe, "layer");
-				if (layer != NULL && layer->type == JSON_STRING) {
-					layername = std::string(layer->string);
-				}
+			if (dv[i].y < sf.bbox[1]) {
+				sf.bbox[1] = dv[i].y;
+			}
+			if (dv[i].x > sf.bbox[2]) {
+				sf.bbox[2] = dv[i].x;
+			}
+			if (dv[i].y > sf.bbox[3]) {
+				sf.bbox[3] = dv[i].y;
+			}
+		}
+	}
 
-				json_object *index = json_hash_get(tippecanoe, "index");
-				if (index != NULL && index->type == JSON_NUMBER) {
-					sf.index = index->number;
-				}
+	std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
 
-				json_object *sequence = json_hash_get(tippecanoe, "sequence");
-				if (sequence != NULL && sequence->type == JSON_NUMBER) {
-					sf.seq = sequence->number;
-				}
+	if (layermap.count(layername) == 0) {
+		layermap_entry lme = layermap_entry(layermap.size());
+		lme.minzoom = z;
+		lme.maxzoom = z;
 
-				json_object *extent = json_hash_get(tippecanoe, "extent");
-				if (extent != NULL && extent->type == JSON_NUMBER) {
-					sf.extent = extent->number;
-				}
+		layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
 
-				json_object *dropped = json_hash_get(tippecanoe, "dropped");
-				if (dropped != NULL && dropped->type == JSON_TRUE) {
-					sf.dropped = true;
-				}
-			}
+		if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
+			(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
+			(*layer_unmaps)[tiling_seg][lme.id] = layername;
+		}
+	}
 
-			for (size_t i = 0; i < dv.size(); i++) {
-				if (dv[i].op == VT_MOVETO || dv[i].op == VT_LINETO) {
-					if (dv[i].x < sf.bbox[0]) {
-						sf.bbox[0] = dv[i].x;
-					}
-					if (dv[i].y < sf.bbox[1]) {
-						sf.bbox[1] = dv[i].y;
-					}
-					if (dv[i].x > sf.bbox[2]) {
-						sf.bbox[2] = dv[i].x;
-					}
-					if (dv[i].y > sf.bbox[3]) {
-						sf.bbox[3] = dv[i].y;
-					}
-				}
-			}
+	auto fk = layermap.find(layername);
+	if (fk == layermap.end()) {
+		fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
+		exit(EXIT_FAILURE);
+	}
+	sf.layer = fk->second.id;
 
-			json_object *id = json_hash_get(j, "id");
-			if (id != NULL) {
-				sf.id = atoll(id->string);
-				sf.has_id = true;
-			}
+	if (z < fk->second.minzoom) {
+		fk->second.minzoom = z;
+	}
+	if (z > fk->second.maxzoom) {
+		fk->second.maxzoom = z;
+	}
 
-			std::map<std::string, layermap_entry> &layermap = (*layermaps)[tiling_seg];
+	if (!postfilter) {
+		if (sf.t == mvt_point) {
+			fk->second.points++;
+		} else if (sf.t == mvt_linestring) {
+			fk->second.lines++;
+		} else if (sf.t == mvt_polygon) {
+			fk->second.polygons++;
+		}
+	}
 
-			if (layermap.count(layername) == 0) {
-				layermap_entry lme = layermap_entry(layermap.size());
-				lme.minzoom = z;
-				lme.maxzoom = z;
+	for (size_t i = 0; i < ff.keys.size(); i++) {
+		serial_val &v = ff.values[i];
 
-				layermap.insert(std::pair<std::string, layermap_entry>(layername, lme));
+		// Nulls can be excluded here because the expression evaluation filter
+		// would have already run before prefiltering
 
-				if (lme.id >= (*layer_unmaps)[tiling_seg].size()) {
-					(*layer_unmaps)[tiling_seg].resize(lme.id + 1);
-					(*layer_unmaps)[tiling_seg][lme.id] = layername;
-				}
-			}
+		if (v.type >= 0 && v.type != mvt_null) {
+			sf.full_keys.push_back(ff.keys[i]);
+			sf.full_values.push_back(v);
 
-			auto fk = layermap.find(layername);
-			if (fk == layermap.end()) {
-				fprintf(stderr, "Internal error: layer %s not found\n", layername.c_str());
-				exit(EXIT_FAILURE);
-			}
-			sf.layer = fk->second.id;
-
-			if (z < fk->second.minzoom) {
-				fk->second.minzoom = z;
-			}
-			if (z > fk->second.maxzoom) {
-				fk->second.maxzoom = z;
-			}
+			type_and_string attrib;
+			attrib.string = v.s;
+			attrib.type = v.type;
 
 			if (!postfilter) {
-				if (sf.t == mvt_point) {
-					fk->second.points++;
-				} else if (sf.t == mvt_linestring) {
-					fk->second.lines++;
-				} else if (sf.t == mvt_polygon) {
-					fk->second.polygons++;
-				}
+				add_to_file_keys(fk->second.file_keys, ff.keys[i], attrib);
 			}
+		}
+	}
 
-			for (size_t i = 0; i < properties->length; i++) {
-				serial_val v;
-				v.type = -1;
+	return true;
+}
 
-				stringify_value(properties->values[i], v.type, v.s, "Filter output", jp->line, j);
+// Reads from the prefilter, either GeoJSON from jp or, with --binary-filters, records from fr.
+// Returns a feature with type -1 at the end of the stream, or, if the filter is persistent,
+// -2 at its end-of-tile marker.
+serial_feature parse_feature(json_pull *jp, filter_reader *fr, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool postfilter, bool persistent) {
+	serial_feature sf;
 
-				// Nulls can be excluded here because the expression evaluation filter
-				// would have already run before prefiltering
+	while (1) {
+		filter_feature ff;
 
-				if (v.type >= 0 && v.type != mvt_null) {
-					sf.full_keys.push_back(std::string(properties->keys[i]->string));
-					sf.full_values.push_back(v);
+		if (fr != NULL) {
+			if (!read_binary_feature(fr, ff, z, x, y)) {
+				sf.t = -1;
+				return sf;
+			}
+			if (ff.marker == FILTER_TILE_END) {
+				if (persistent) {
+					sf.t = -2;
+					return sf;
+				}
+				continue;
+			}
 
-					type_and_string attrib;
-					attrib.string = v.s;
-					attrib.type = v.type;
+			if (prefiltered_feature(ff, sf, z, x, y, layermaps, tiling_seg, layer_unmaps, postfilter)) {
+				return sf;
+			}
+			continue;
+		}
 
-					if (!postfilter) {
-						add_to_file_keys(fk->second.file_keys, std::string(properties->keys[i]->string), attrib);
-					}
+		json_object *j = json_read(jp);
+		if (j == NULL) {
+			if (jp->error != NULL) {
+				fprintf(stderr, "Filter output:%d: %s\n", jp->line, jp->error);
+				if (jp->root != NULL) {
+					json_context(jp->root);
 				}
+				exit(EXIT_FAILURE);
 			}
 
+			json_free(jp->root);
+			sf.t = -1;
+			return sf;
+		}
+
+		json_object *type = json_hash_get(j, "type");
+		if (type == NULL || type->type != JSON_STRING) {
+			continue;
+		}
+		if (persistent && is_filter_tile_end(j, type, jp, z, x, y)) {
 			json_free(j);
+			sf.t = -2;
 			return sf;
 		}
 
+		if (!json_to_filter_feature(j, jp, ff)) {
+			continue;
+		}
+
+		bool found = prefiltered_feature(ff, sf, z, x, y, layermaps, tiling_seg, layer_unmaps, postfilter);
 		json_free(j);
+
+		if (found) {
+			return sf;
+		}
 	}
 }
 
 static pthread_mutex_t pipe_lock = PTHREAD_MUTEX_INITIALIZER;
 
-void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y) {
+// Run the filter command with the given arguments (which are NULL for a persistent filter)
+static void spawn_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, const char *z_str, const char *x_str, const char *y_str) {
 #if defined(_WIN32)
 	fprintf(stderr, "Filters do not work on Windows (yet)\n");
 	exit(EXIT_FAILURE);
@@ -550,10 +732,6 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 		exit(EXIT_FAILURE);
 	}
 
-	std::string z_str = std::to_string(z);
-	std::string x_str = std::to_string(x);
-	std::string y_str = std::to_string(y);
-
 	*pid = fork();
 	if (*pid < 0) {
 		perror("fork");
@@ -588,7 +766,7 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 
 		// XXX close other fds?
 
-		if (execlp("sh", "sh", "-c", filter, "sh", z_str.c_str(), x_str.c_str(), y_str.c_str(), NULL) != 0) {
+		if (execlp("sh", "sh", "-c", filter, "sh", z_str, x_str, y_str, NULL) != 0) {
 			perror("exec");
 			exit(EXIT_FAILURE);
 		}
@@ -623,17 +801,151 @@ void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid,
 #endif
 }
 
+void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y) {
+	std::string z_str = std::to_string(z);
+	std::string x_str = std::to_string(x);
+	std::string y_str = std::to_string(y);
+
+	spawn_filter(filter, write_to, read_from, pid, z_str.c_str(), x_str.c_str(), y_str.c_str());
+}
+
+// Persistent filters that are not currently working on a tile, by command,
+// and all the persistent filters that have been started, to stop at the end.
+static pthread_mutex_t coprocess_lock = PTHREAD_MUTEX_INITIALIZER;
+static std::map<std::string, std::vector<filter_coprocess *>> idle_coprocesses;
+static std::vector<filter_coprocess *> all_coprocesses;
+
+// Unlike fread(), which would wait for a full buffer, return whatever
+// the filter has written so far, since it may be waiting for the next tile.
+static ssize_t read_coprocess(json_pull *jp, char *buffer, size_t n) {
+	filter_coprocess *c = (filter_coprocess *) jp->source;
+
+	while (1) {
+		ssize_t ret = read(c->read_from, buffer, n);
+		if (ret < 0 && errno == EINTR) {
+			continue;
+		}
+		return ret;
+	}
+}
+
+filter_coprocess *checkout_filter(const char *filter) {
+	if (pthread_mutex_lock(&coprocess_lock) != 0) {
+		perror("pthread_mutex_lock (coprocess)");
+		exit(EXIT_FAILURE);
+	}
+
+	filter_coprocess *c = NULL;
+	std::vector<filter_coprocess *> &idle = idle_coprocesses[filter];
+	if (idle.size() > 0) {
+		c = idle.back();
+		idle.pop_back();
+	}
+
+	if (pthread_mutex_unlock(&coprocess_lock) != 0) {
+		perror("pthread_mutex_unlock (coprocess)");
+		exit(EXIT_FAILURE);
+	}
+
+	if (c != NULL) {
+		return c;
+	}
+
+	c = new filter_coprocess;
+	c->filter = filter;
+	spawn_filter(filter, &c->write_to, &c->read_from, &c->pid, NULL, NULL, NULL);
+
+	c->write_fp = fdopen(c->write_to, "w");
+	if (c->write_fp == NULL) {
+		perror("fdopen (persistent filter)");
+		exit(EXIT_FAILURE);
+	}
+	if (additional[A_BINARY_FILTERS]) {
+		c->reader = new filter_reader(c->read_from);
+	} else {
+		c->jp = json_begin(read_coprocess, c);
+	}
+
+	if (pthread_mutex_lock(&coprocess_lock) != 0) {
+		perror("pthread_mutex_lock (coprocess)");
+		exit(EXIT_FAILURE);
+	}
+	all_coprocesses.push_back(c);
+	if (pthread_mutex_unlock(&coprocess_lock) != 0) {
+		perror("pthread_mutex_unlock (coprocess)");
+		exit(EXIT_FAILURE);
+	}
+
+	return c;
+}
+
+void checkin_filter(filter_coprocess *c) {
+	if (pthread_mutex_lock(&coprocess_lock) != 0) {
+		perror("pthread_mutex_lock (coprocess)");
+		exit(EXIT_FAILURE);
+	}
+	idle_coprocesses[c->filter].push_back(c);
+	if (pthread_mutex_unlock(&coprocess_lock) != 0) {
+		perror("pthread_mutex_unlock (coprocess)");
+		exit(EXIT_FAILURE);
+	}
+}
+
+void stop_filters() {
+#if !defined(_WIN32)
+	for (auto c : all_coprocesses) {
+		// Closing its input tells the filter there are no more tiles
+		if (fclose(c->write_fp) != 0 && errno != EPIPE) {
+			perror("fclose output to persistent filter");
+			exit(EXIT_FAILURE);
+		}
+
+		if (c->jp != NULL) {
+			json_end(c->jp);
+		}
+		delete c->reader;
+		if (close(c->read_from) != 0) {
+			perror("close input from persistent filter");
+			exit(EXIT_FAILURE);
+		}
+
+		while (1) {
+			int stat_loc;
+			if (waitpid(c->pid, &stat_loc, 0) < 0) {
+				perror("waitpid for persistent filter");
+				exit(EXIT_FAILURE);
+			}
+			if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
+				break;
+			}
+		}
+
+		delete c;
+	}
+
+	all_coprocesses.clear();
+	idle_coprocesses.clear();
+#endif
+}
+
 std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layers, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent) {
 #if defined(_WIN32)
 	fprintf(stderr, "Filters do not work on Windows (yet)\n");
 	exit(EXIT_FAILURE);
 #else
-	int write_to, read_from;
-	pid_t pid;
-	setup_filter(filter, &write_to, &read_from, &pid, z, x, y);
+	int write_to = -1, read_from = -1;
+	pid_t pid = 0;
+	filter_coprocess *c = NULL;
+
+	if (additional[A_PERSISTENT_FILTERS]) {
+		c = checkout_filter(filter);
+	} else {
+		setup_filter(filter, &write_to, &read_from, &pid, z, x, y);
+	}
 
 	writer_arg wa;
 	wa.write_to = write_to;
+	wa.persistent_fp = c != NULL ? c->write_fp : NULL;
 	wa.layers = &layers;
 	wa.z = z;
 	wa.x = x;
@@ -646,16 +958,46 @@ std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer>
 		exit(EXIT_FAILURE);
 	}
 
-	std::vector<mvt_layer> nlayers = parse_layers(read_from, z, x, y, layermaps, tiling_seg, layer_unmaps, extent);
+	std::vector<mvt_layer> nlayers;
 
-	while (1) {
-		int stat_loc;
-		if (waitpid(pid, &stat_loc, 0) < 0) {
-			perror("waitpid for filter\n");
-			exit(EXIT_FAILURE);
+	if (c != NULL) {
+		nlayers = parse_layers(c->jp, c->reader, z, x, y, layermaps, tiling_seg, layer_unmaps, extent, true);
+	} else {
+		if (additional[A_BINARY_FILTERS]) {
+			filter_reader fr(read_from);
+
+			nlayers = parse_layers(NULL, &fr, z, x, y, layermaps, tiling_seg, layer_unmaps, extent, false);
+
+			if (close(read_from) != 0) {
+				perror("close postfilter output");
+				exit(EXIT_FAILURE);
+			}
+		} else {
+			FILE *f = fdopen(read_from, "r");
+			if (f == NULL) {
+				perror("fdopen filter output");
+				exit(EXIT_FAILURE);
+			}
+			json_pull *jp = json_begin_file(f);
+
+			nlayers = parse_layers(jp, NULL, z, x, y, layermaps, tiling_seg, layer_unmaps, extent, false);
+
+			json_end(jp);
+			if (fclose(f) != 0) {
+				perror("fclose postfilter output");
+				exit(EXIT_FAILURE);
+			}
 		}
-		if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
-			break;
+
+		while (1) {
+			int stat_loc;
+			if (waitpid(pid, &stat_loc, 0) < 0) {
+				perror("waitpid for filter\n");
+				exit(EXIT_FAILURE);
+			}
+			if (WIFEXITED(stat_loc) || WIFSIGNALED(stat_loc)) {
+				break;
+			}
 		}
 	}
 
@@ -665,6 +1007,10 @@ std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer>
 		exit(EXIT_FAILURE);
 	}
 
+	if (c != NULL) {
+		checkin_filter(c);
+	}
+
 	return nlayers;
 #endif
 }
@@ -1,3 +1,24 @@
 std::vector<mvt_layer> filter_layers(const char *filter, std::vector<mvt_layer> &layer, unsigned z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent);
 void setup_filter(const char *filter, int *write_to, int *read_from, pid_t *pid, unsigned z, unsigned x, unsigned y);
-serial_feature parse_feature(json_pull *jp, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool filters);
+struct filter_reader;
+
+std::vector<mvt_layer> parse_layers(json_pull *jp, filter_reader *fr, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, int extent, bool persistent);
+serial_feature parse_feature(json_pull *jp, filter_reader *fr, int z, unsigned x, unsigned y, std::vector<std::map<std::string, layermap_entry>> *layermaps, size_t tiling_seg, std::vector<std::vector<std::string>> *layer_unmaps, bool filters, bool persistent);
+
+// A filter command that is started once and then given tile after tile
+// (--persistent-filters) instead of being run separately for each tile
+struct filter_coprocess {
+	std::string filter = "";
+	pid_t pid = 0;
+	int write_to = -1;
+	int read_from = -1;
+	FILE *write_fp = NULL;
+	json_pull *jp = NULL;
+	filter_reader *reader = NULL;  // instead of jp, for --binary-filters
+};
+
+filter_coprocess *checkout_filter(const char *filter);
+void checkin_filter(filter_coprocess *c);
+void stop_filters();
+void write_filter_tile_start(FILE *fp, unsigned z, unsigned x, unsigned y);
+void write_filter_tile_end(FILE *fp, unsigned z, unsigned x, unsigned y, const char *which);
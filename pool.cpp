@@ -1,86 +1,78 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
-#include <limits.h>
-#include <math.h>
+#include <vector>
 #include "memfile.hpp"
 #include "pool.hpp"
 
-int swizzlecmp(const char *a, const char *b) {
-	ssize_t alen = strlen(a);
-	ssize_t blen = strlen(b);
+// Number of slots in a newly created string pool hash table.
+// Must be a power of 2.
+#define POOL_INITIAL_SLOTS 1024
 
-	if (strcmp(a, b) == 0) {
-		return 0;
-	}
+unsigned long long poolhash(const char *s, char type) {
+	// FNV-1a, with the type mixed in so that the string "1"
+	// and the number 1 land in different slots
+	unsigned long long h = 14695981039346656037ULL;
 
-	long long hash1 = 0, hash2 = 0;
-	for (ssize_t i = alen - 1; i >= 0; i--) {
-		hash1 = (hash1 * 37 + a[i]) & INT_MAX;
-	}
-	for (ssize_t i = blen - 1; i >= 0; i--) {
-		hash2 = (hash2 * 37 + b[i]) & INT_MAX;
-	}
+	h ^= (unsigned char) type;
+	h *= 1099511628211ULL;
 
-	int h1 = hash1, h2 = hash2;
-	if (h1 == h2) {
-		return strcmp(a, b);
+	for (; *s != '\0'; s++) {
+		h ^= (unsigned char) *s;
+		h *= 1099511628211ULL;
 	}
 
-	return h1 - h2;
+	return h;
 }
 
-long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
-	unsigned long *sp = &treefile->tree;
-	size_t depth = 0;
+static void grow_pool_table(struct memfile *treefile) {
+	size_t oslots = treefile->off / sizeof(struct stringpool);
+	size_t nslots = oslots == 0 ? POOL_INITIAL_SLOTS : oslots * 2;
+
+	// Reinsert from the stored hashes rather than rehashing the strings,
+	// so the string pool itself doesn't have to be paged back in.
+	std::vector<struct stringpool> table(nslots);
+	struct stringpool *old = (struct stringpool *) treefile->map;
+	for (size_t i = 0; i < oslots; i++) {
+		if (old[i].off != 0) {
+			size_t j;
+			for (j = old[i].hash & (nslots - 1); table[j].off != 0; j = (j + 1) & (nslots - 1)) {
+				;
+			}
+			table[j] = old[i];
+		}
+	}
 
-	// In typical data, traversal depth generally stays under 2.5x
-	size_t max = 3 * log(treefile->off / sizeof(struct stringpool)) / log(2);
-	if (max < 30) {
-		max = 30;
+	treefile->off = 0;
+	if (memfile_write(treefile, &table[0], nslots * sizeof(struct stringpool)) < 0) {
+		perror("memfile write");
+		exit(EXIT_FAILURE);
 	}
+}
 
-	while (*sp != 0) {
-		int cmp = swizzlecmp(s, poolfile->map + ((struct stringpool *) (treefile->map + *sp))->off + 1);
+long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
+	size_t slots = treefile->off / sizeof(struct stringpool);
 
-		if (cmp == 0) {
-			cmp = type - (poolfile->map + ((struct stringpool *) (treefile->map + *sp))->off)[0];
-		}
+	// Keep the table at most half full so probe sequences stay short
+	if ((treefile->entries + 1) * 2 > slots) {
+		grow_pool_table(treefile);
+		slots = treefile->off / sizeof(struct stringpool);
+	}
 
-		if (cmp < 0) {
-			sp = &(((struct stringpool *) (treefile->map + *sp))->left);
-		} else if (cmp > 0) {
-			sp = &(((struct stringpool *) (treefile->map + *sp))->right);
-		} else {
-			return ((struct stringpool *) (treefile->map + *sp))->off;
-		}
+	unsigned long long hash = poolhash(s, type);
+	struct stringpool *table = (struct stringpool *) treefile->map;
 
-		depth++;
-		if (depth > max) {
-			// Search is very deep, so string is probably unique.
-			// Add it to the pool without adding it to the search tree.
+	size_t i;
+	for (i = hash & (slots - 1); table[i].off != 0; i = (i + 1) & (slots - 1)) {
+		if (table[i].hash == hash) {
+			const char *there = poolfile->map + table[i].off - 1;
 
-			long long off = poolfile->off;
-			if (memfile_write(poolfile, &type, 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_FAILURE);
-			}
-			if (memfile_write(poolfile, (void *) s, strlen(s) + 1) < 0) {
-				perror("memfile write");
-				exit(EXIT_FAILURE);
+			if (there[0] == type && strcmp(there + 1, s) == 0) {
+				return table[i].off - 1;
 			}
-			return off;
 		}
 	}
 
-	// *sp is probably in the memory-mapped file, and will move if the file grows.
-	long long ssp;
-	if (sp == &treefile->tree) {
-		ssp = -1;
-	} else {
-		ssp = ((char *) sp) - treefile->map;
-	}
-
 	long long off = poolfile->off;
 	if (memfile_write(poolfile, &type, 1) < 0) {
 		perror("memfile write");
@@ -91,31 +83,32 @@ long long addpool(struct memfile *poolfile, struct memfile *treefile, const char
 		exit(EXIT_FAILURE);
 	}
 
-	if (off >= LONG_MAX || treefile->off >= LONG_MAX) {
-		// Tree or pool is bigger than 2GB
-		static bool warned = false;
-		if (!warned) {
-			fprintf(stderr, "Warning: string pool is very large.\n");
-			warned = true;
-		}
-		return off;
-	}
+	table[i].hash = hash;
+	table[i].off = off + 1;
+	treefile->entries++;
 
-	struct stringpool tsp;
-	tsp.left = 0;
-	tsp.right = 0;
-	tsp.off = off;
+	return off;
+}
 
-	long long p = treefile->off;
-	if (memfile_write(treefile, &tsp, sizeof(struct stringpool)) < 0) {
-		perror("memfile write");
-		exit(EXIT_FAILURE);
+// Like addpool, but returns -1 instead of adding the string if it isn't already there
+long long findpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type) {
+	size_t slots = treefile->off / sizeof(struct stringpool);
+	if (slots == 0) {
+		return -1;
 	}
 
-	if (ssp == -1) {
-		treefile->tree = p;
-	} else {
-		*((long long *) (treefile->map + ssp)) = p;
+	unsigned long long hash = poolhash(s, type);
+	struct stringpool *table = (struct stringpool *) treefile->map;
+
+	for (size_t i = hash & (slots - 1); table[i].off != 0; i = (i + 1) & (slots - 1)) {
+		if (table[i].hash == hash) {
+			const char *there = poolfile->map + table[i].off - 1;
+
+			if (there[0] == type && strcmp(there + 1, s) == 0) {
+				return table[i].off - 1;
+			}
+		}
 	}
-	return off;
+
+	return -1;
 }
@@ -1,12 +1,16 @@
 #ifndef POOL_HPP
 #define POOL_HPP
 
+// One slot of the open-addressed hash table that lives in each reader's treefile.
+// The full hash is kept so the table can grow without rehashing the strings,
+// and the pool offset is stored plus one so that zero-filled slots are empty.
 struct stringpool {
-	unsigned long left = 0;
-	unsigned long right = 0;
-	unsigned long off = 0;
+	unsigned long long hash = 0;
+	unsigned long long off = 0;
 };
 
+unsigned long long poolhash(const char *s, char type);
 long long addpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type);
+long long findpool(struct memfile *poolfile, struct memfile *treefile, const char *s, char type);
 
 #endif
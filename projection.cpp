@@ -3,8 +3,14 @@
 #include <stdlib.h>
 #include <math.h>
 #include <atomic>
+#include <algorithm>
 #include "projection.hpp"
 
+#if defined(__x86_64__) && (defined(__GNUC__) || defined(__clang__))
+#include <immintrin.h>
+#define HAVE_BMI2_DISPATCH
+#endif
+
 unsigned long long (*encode_index)(unsigned int wx, unsigned int wy) = NULL;
 void (*decode_index)(unsigned long long index, unsigned *wx, unsigned *wy) = NULL;
 
@@ -69,6 +75,26 @@ void tile2lonlat(long long x, long long y, int zoom, double *lon, double *lat) {
 	*lat = atan(sinh(M_PI * (1 - 2.0 * y / n))) * 180.0 / M_PI;
 }
 
+// For WGS84, the longitudes are a linear pass that the compiler can
+// vectorize, and only the latitudes need the transcendental functions.
+// Those stay scalar, since vector math libraries round differently.
+void unproject_points(long long const *x, long long const *y, size_t n, int zoom, double *lon, double *lat) {
+	if (projection->unproject != tile2lonlat) {
+		for (size_t i = 0; i < n; i++) {
+			projection->unproject(x[i], y[i], zoom, &lon[i], &lat[i]);
+		}
+		return;
+	}
+
+	unsigned long long scale = 1LL << zoom;
+	for (size_t i = 0; i < n; i++) {
+		lon[i] = 360.0 * x[i] / scale - 180.0;
+	}
+	for (size_t i = 0; i < n; i++) {
+		lat[i] = atan(sinh(M_PI * (1 - 2.0 * y[i] / scale))) * 180.0 / M_PI;
+	}
+}
+
 void epsg3857totile(double ix, double iy, int zoom, long long *x, long long *y) {
 	// Place infinite and NaN coordinates off the edge of the Mercator plane
 
@@ -146,8 +172,66 @@ void hilbert_d2xy(unsigned long long n, unsigned long long d, unsigned *x, unsig
 	}
 }
 
+// The even bits of a 16-bit word, taken from the bits of a byte
+static unsigned short spread_bits[256];
+
+// The Hilbert curve, four bits of x and y at a time. The current orientation,
+// which is some combination of swapping and reflecting x and y, is one of four
+// states. The low byte of each entry is the next eight bits of the index, and
+// the upper bits are the orientation for the following four bits of x and y.
+static unsigned short hilbert_step[4][256];
+
+static struct index_tables {
+	index_tables() {
+		for (unsigned i = 0; i < 256; i++) {
+			unsigned short s = 0;
+			for (unsigned b = 0; b < 8; b++) {
+				s |= ((i >> b) & 1) << (2 * b);
+			}
+			spread_bits[i] = s;
+		}
+
+		for (unsigned state = 0; state < 4; state++) {
+			for (unsigned xy = 0; xy < 256; xy++) {
+				unsigned swap = state & 1;
+				unsigned reflect = (state >> 1) & 1;
+				unsigned d = 0;
+
+				for (int b = 3; b >= 0; b--) {
+					unsigned rx = ((xy >> (4 + b)) & 1) ^ reflect;
+					unsigned ry = ((xy >> b) & 1) ^ reflect;
+					if (swap) {
+						std::swap(rx, ry);
+					}
+
+					d = (d << 2) | ((3 * rx) ^ ry);
+
+					// Same as hilbert_rot()
+					if (ry == 0) {
+						if (rx == 1) {
+							reflect ^= 1;
+						}
+						swap ^= 1;
+					}
+				}
+
+				hilbert_step[state][xy] = d | ((swap | (reflect << 1)) << 8);
+			}
+		}
+	}
+} index_tables_initializer;
+
 unsigned long long encode_hilbert(unsigned int wx, unsigned int wy) {
-	return hilbert_xy2d(1LL << 32, wx, wy);
+	unsigned long long out = 0;
+	unsigned state = 0;
+
+	for (int i = 28; i >= 0; i -= 4) {
+		unsigned short step = hilbert_step[state][(((wx >> i) & 0xF) << 4) | ((wy >> i) & 0xF)];
+		out = (out << 8) | (step & 0xFF);
+		state = step >> 8;
+	}
+
+	return out;
 }
 
 void decode_hilbert(unsigned long long index, unsigned *wx, unsigned *wy) {
@@ -157,13 +241,10 @@ void decode_hilbert(unsigned long long index, unsigned *wx, unsigned *wy) {
 unsigned long long encode_quadkey(unsigned int wx, unsigned int wy) {
 	unsigned long long out = 0;
 
-	int i;
-	for (i = 0; i < 32; i++) {
-		unsigned long long v = ((wx >> (32 - (i + 1))) & 1) << 1;
-		v |= (wy >> (32 - (i + 1))) & 1;
-		v = v << (64 - 2 * (i + 1));
-
-		out |= v;
+	for (int i = 0; i < 4; i++) {
+		unsigned long long x = spread_bits[(wx >> (8 * i)) & 0xFF];
+		unsigned long long y = spread_bits[(wy >> (8 * i)) & 0xFF];
+		out |= ((x << 1) | y) << (16 * i);
 	}
 
 	return out;
@@ -215,3 +296,31 @@ void set_projection_or_exit(const char *optarg) {
 		exit(EXIT_FAILURE);
 	}
 }
+
+#ifdef HAVE_BMI2_DISPATCH
+__attribute__((target("bmi2"))) static unsigned long long encode_quadkey_bmi2(unsigned int wx, unsigned int wy) {
+	return _pdep_u64(wx, 0xAAAAAAAAAAAAAAAAULL) | _pdep_u64(wy, 0x5555555555555555ULL);
+}
+
+__attribute__((target("bmi2"))) static void decode_quadkey_bmi2(unsigned long long index, unsigned *wx, unsigned *wy) {
+	*wx = _pext_u64(index, 0xAAAAAAAAAAAAAAAAULL);
+	*wy = _pext_u64(index, 0x5555555555555555ULL);
+}
+#endif
+
+void set_index_encoding(bool hilbert) {
+	if (hilbert) {
+		encode_index = encode_hilbert;
+		decode_index = decode_hilbert;
+	} else {
+		encode_index = encode_quadkey;
+		decode_index = decode_quadkey;
+
+#ifdef HAVE_BMI2_DISPATCH
+		if (__builtin_cpu_supports("bmi2")) {
+			encode_index = encode_quadkey_bmi2;
+			decode_index = decode_quadkey_bmi2;
+		}
+#endif
+	}
+}
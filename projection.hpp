@@ -1,6 +1,8 @@
 #ifndef PROJECTION_HPP
 #define PROJECTION_HPP
 
+#include <stddef.h>
+
 void lonlat2tile(double lon, double lat, int zoom, long long *x, long long *y);
 void epsg3857totile(double ix, double iy, int zoom, long long *x, long long *y);
 void tile2lonlat(long long x, long long y, int zoom, double *lon, double *lat);
@@ -17,6 +19,10 @@ struct projection {
 extern struct projection *projection;
 extern struct projection projections[];
 
+// Unproject n points with the current projection, giving the same
+// results as projection->unproject would for each of them
+void unproject_points(long long const *x, long long const *y, size_t n, int zoom, double *lon, double *lat);
+
 extern unsigned long long (*encode_index)(unsigned int wx, unsigned int wy);
 extern void (*decode_index)(unsigned long long index, unsigned *wx, unsigned *wy);
 
@@ -26,4 +32,10 @@ void decode_quadkey(unsigned long long index, unsigned *wx, unsigned *wy);
 unsigned long long encode_hilbert(unsigned int wx, unsigned int wy);
 void decode_hilbert(unsigned long long index, unsigned *wx, unsigned *wy);
 
+unsigned long long hilbert_xy2d(unsigned long long n, unsigned x, unsigned y);
+
+// Point encode_index and decode_index at the quadkey or Hilbert implementation,
+// choosing the fastest one that the CPU supports
+void set_index_encoding(bool hilbert);
+
 #endif
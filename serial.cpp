@@ -90,21 +90,29 @@ void deserialize_long_long(char **f, long long *n) {
 }
 
 void deserialize_ulong_long(char **f, unsigned long long *zigzag) {
-	*zigzag = 0;
-	int shift = 0;
+	const unsigned char *p = (const unsigned char *) *f;
 
-	while (1) {
-		if ((**f & 0x80) == 0) {
-			*zigzag |= ((unsigned long long) **f) << shift;
-			*f += 1;
-			shift += 7;
-			break;
-		} else {
-			*zigzag |= ((unsigned long long) (**f & 0x7F)) << shift;
-			*f += 1;
-			shift += 7;
-		}
+	// Most deltas and string pool references fit in a single byte
+	if (p[0] < 0x80) {
+		*zigzag = p[0];
+		*f += 1;
+		return;
 	}
+
+	unsigned long long out = p[0] & 0x7F;
+	int shift = 7;
+	p++;
+
+	while (*p & 0x80) {
+		out |= ((unsigned long long) (*p & 0x7F)) << shift;
+		shift += 7;
+		p++;
+	}
+	out |= ((unsigned long long) *p) << shift;
+	p++;
+
+	*zigzag = out;
+	*f = (char *) p;
 }
 
 void deserialize_uint(char **f, unsigned *n) {
@@ -117,62 +125,6 @@ void deserialize_byte(char **f, signed char *n) {
 	*f += sizeof(signed char);
 }
 
-int deserialize_long_long_io(FILE *f, long long *n, std::atomic<long long> *geompos) {
-	unsigned long long zigzag = 0;
-	int ret = deserialize_ulong_long_io(f, &zigzag, geompos);
-	*n = protozero::decode_zigzag64(zigzag);
-	return ret;
-}
-
-int deserialize_ulong_long_io(FILE *f, unsigned long long *zigzag, std::atomic<long long> *geompos) {
-	*zigzag = 0;
-	int shift = 0;
-
-	while (1) {
-		int c = getc(f);
-		if (c == EOF) {
-			return 0;
-		}
-		(*geompos)++;
-
-		if ((c & 0x80) == 0) {
-			*zigzag |= ((unsigned long long) c) << shift;
-			shift += 7;
-			break;
-		} else {
-			*zigzag |= ((unsigned long long) (c & 0x7F)) << shift;
-			shift += 7;
-		}
-	}
-
-	return 1;
-}
-
-int deserialize_int_io(FILE *f, int *n, std::atomic<long long> *geompos) {
-	long long ll = 0;
-	int ret = deserialize_long_long_io(f, &ll, geompos);
-	*n = ll;
-	return ret;
-}
-
-int deserialize_uint_io(FILE *f, unsigned *n, std::atomic<long long> *geompos) {
-	if (fread(n, sizeof(unsigned), 1, f) != 1) {
-		return 0;
-	}
-	*geompos += sizeof(unsigned);
-	return 1;
-}
-
-int deserialize_byte_io(FILE *f, signed char *n, std::atomic<long long> *geompos) {
-	int c = getc(f);
-	if (c == EOF) {
-		return 0;
-	}
-	*n = c;
-	(*geompos)++;
-	return 1;
-}
-
 static void write_geometry(drawvec const &dv, std::atomic<long long> *fpos, FILE *out, const char *fname, long long wx, long long wy) {
 	for (size_t i = 0; i < dv.size(); i++) {
 		if (dv[i].op == VT_MOVETO || dv[i].op == VT_LINETO) {
@@ -241,19 +193,39 @@ void serialize_feature(FILE *geomfile, serial_feature *sf, std::atomic<long long
 	}
 }
 
-serial_feature deserialize_feature(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y) {
+// Decode the feature at *geompos_in within the mapped geometry shard,
+// and advance *geompos_in past it
+serial_feature deserialize_feature(char *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y) {
 	serial_feature sf;
+	deserialize_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, sf);
+	return sf;
+}
 
-	deserialize_byte_io(geoms, &sf.t, geompos_in);
+void deserialize_feature(char *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, serial_feature &sf) {
+	char *f = geoms + *geompos_in;
+
+	sf.geometry.clear();
+	sf.keys.clear();
+	sf.values.clear();
+	sf.full_keys.clear();
+	sf.full_values.clear();
+	sf.layername.clear();
+	sf.dropped = false;
+	sf.has_tippecanoe_minzoom = false;
+	sf.has_tippecanoe_maxzoom = false;
+	sf.feature_minzoom = 0;
+
+	deserialize_byte(&f, &sf.t);
 	if (sf.t < 0) {
-		return sf;
+		*geompos_in = f - geoms;
+		return;
 	}
 
-	deserialize_long_long_io(geoms, &sf.layer, geompos_in);
+	deserialize_long_long(&f, &sf.layer);
 
 	sf.seq = 0;
 	if (sf.layer & (1 << 5)) {
-		deserialize_long_long_io(geoms, &sf.seq, geompos_in);
+		deserialize_long_long(&f, &sf.seq);
 	}
 
 	sf.tippecanoe_minzoom = -1;
@@ -261,62 +233,207 @@ serial_feature deserialize_feature(FILE *geoms, std::atomic<long long> *geompos_
 	sf.id = 0;
 	sf.has_id = false;
 	if (sf.layer & (1 << 1)) {
-		deserialize_int_io(geoms, &sf.tippecanoe_minzoom, geompos_in);
+		deserialize_int(&f, &sf.tippecanoe_minzoom);
 	}
 	if (sf.layer & (1 << 0)) {
-		deserialize_int_io(geoms, &sf.tippecanoe_maxzoom, geompos_in);
+		deserialize_int(&f, &sf.tippecanoe_maxzoom);
 	}
 	if (sf.layer & (1 << 2)) {
 		sf.has_id = true;
-		deserialize_ulong_long_io(geoms, &sf.id, geompos_in);
+		deserialize_ulong_long(&f, &sf.id);
 	}
 
-	deserialize_int_io(geoms, &sf.segment, geompos_in);
+	deserialize_int(&f, &sf.segment);
 
 	sf.index = 0;
 	sf.extent = 0;
 
-	sf.geometry = decode_geometry(geoms, geompos_in, z, tx, ty, sf.bbox, initial_x[sf.segment], initial_y[sf.segment]);
+	decode_geometry(&f, z, tx, ty, sf.bbox, initial_x[sf.segment], initial_y[sf.segment], sf.geometry);
 	if (sf.layer & (1 << 4)) {
-		deserialize_ulong_long_io(geoms, &sf.index, geompos_in);
+		deserialize_ulong_long(&f, &sf.index);
 	}
 	if (sf.layer & (1 << 3)) {
-		deserialize_long_long_io(geoms, &sf.extent, geompos_in);
+		deserialize_long_long(&f, &sf.extent);
 	}
 
 	sf.layer >>= 6;
 
 	sf.metapos = 0;
-	deserialize_long_long_io(geoms, &sf.metapos, geompos_in);
+	deserialize_long_long(&f, &sf.metapos);
 
+	long long count;
+	char *meta;
 	if (sf.metapos >= 0) {
-		char *meta = metabase + sf.metapos + meta_off[sf.segment];
+		meta = metabase + sf.metapos + meta_off[sf.segment];
+	} else {
+		meta = f;
+	}
+
+	deserialize_long_long(&meta, &count);
+	sf.keys.reserve(count);
+	sf.values.reserve(count);
+
+	for (long long i = 0; i < count; i++) {
+		long long k, v;
+		deserialize_long_long(&meta, &k);
+		deserialize_long_long(&meta, &v);
+		sf.keys.push_back(k);
+		sf.values.push_back(v);
+	}
+
+	if (sf.metapos < 0) {
+		f = meta;
+	}
+
+	deserialize_byte(&f, &sf.feature_minzoom);
+
+	*geompos_in = f - geoms;
+}
+
+long long pool_remap::lookup(long long off) const {
+	auto f = std::lower_bound(from.begin(), from.end(), off);
+	if (f == from.end() || *f != off) {
+		fprintf(stderr, "Internal error: string pool offset %lld not found\n", off);
+		exit(EXIT_FAILURE);
+	}
+	return to[f - from.begin()];
+}
+
+static void skip_varint(char **f) {
+	while ((**f & 0x80) != 0) {
+		*f += 1;
+	}
+	*f += 1;
+}
+
+// Copy a feature, as written by serialize_feature() during reading, from a reader's
+// temporary file to geomfile, translating its string pool references into the merged
+// pool. If its attributes were in the reader's metadata file, they are copied to the
+// merged metadata file and the feature is pointed at the new copy.
+void remap_feature_strings(char *feature, char *end, FILE *geomfile, std::atomic<long long> *geompos, char *metabase, pool_remap const &remap, FILE *metafile, std::atomic<long long> *metapos, const char *fname) {
+	char *f = feature;
+
+	signed char t;
+	deserialize_byte(&f, &t);
+
+	long long layer;
+	deserialize_long_long(&f, &layer);
+
+	if (layer & (1 << 5)) {
+		skip_varint(&f);  // seq
+	}
+	if (layer & (1 << 1)) {
+		skip_varint(&f);  // tippecanoe_minzoom
+	}
+	if (layer & (1 << 0)) {
+		skip_varint(&f);  // tippecanoe_maxzoom
+	}
+	if (layer & (1 << 2)) {
+		skip_varint(&f);  // id
+	}
+	skip_varint(&f);  // segment
+
+	while (1) {
+		signed char op;
+		deserialize_byte(&f, &op);
+		if (op == VT_END) {
+			break;
+		}
+		if (op == VT_MOVETO || op == VT_LINETO) {
+			skip_varint(&f);
+			skip_varint(&f);
+		}
+	}
+
+	if (layer & (1 << 4)) {
+		skip_varint(&f);  // index
+	}
+	if (layer & (1 << 3)) {
+		skip_varint(&f);  // extent
+	}
+
+	// Everything up to the metadata is unchanged
+	fwrite_check(feature, sizeof(char), f - feature, geomfile, fname);
+	*geompos += f - feature;
+
+	long long mpos;
+	deserialize_long_long(&f, &mpos);
+
+	if (mpos >= 0) {
+		char *meta = metabase + mpos;
 		long long count;
 		deserialize_long_long(&meta, &count);
 
+		serialize_long_long(geomfile, *metapos, geompos, fname);
+		serialize_long_long(metafile, count, metapos, fname);
+
 		for (long long i = 0; i < count; i++) {
 			long long k, v;
 			deserialize_long_long(&meta, &k);
 			deserialize_long_long(&meta, &v);
-			sf.keys.push_back(k);
-			sf.values.push_back(v);
+
+			serialize_long_long(metafile, remap.lookup(k), metapos, fname);
+			serialize_long_long(metafile, remap.lookup(v), metapos, fname);
 		}
 	} else {
 		long long count;
-		deserialize_long_long_io(geoms, &count, geompos_in);
+		deserialize_long_long(&f, &count);
+
+		serialize_long_long(geomfile, mpos, geompos, fname);
+		serialize_long_long(geomfile, count, geompos, fname);
 
 		for (long long i = 0; i < count; i++) {
 			long long k, v;
-			deserialize_long_long_io(geoms, &k, geompos_in);
-			deserialize_long_long_io(geoms, &v, geompos_in);
-			sf.keys.push_back(k);
-			sf.values.push_back(v);
+			deserialize_long_long(&f, &k);
+			deserialize_long_long(&f, &v);
+
+			serialize_long_long(geomfile, remap.lookup(k), geompos, fname);
+			serialize_long_long(geomfile, remap.lookup(v), geompos, fname);
 		}
 	}
 
-	deserialize_byte_io(geoms, &sf.feature_minzoom, geompos_in);
+	if (f != end) {
+		fprintf(stderr, "Internal error: feature length mismatch while merging string pools: %lld vs %lld\n", (long long) (f - feature), (long long) (end - feature));
+		exit(EXIT_FAILURE);
+	}
+}
+
+// Copy a feature from a sorted geometry file to geomfile, renumbering the segment
+// that it belongs to, so that features read by different runs can be put together
+void resegment_feature(char *feature, char *end, FILE *geomfile, std::atomic<long long> *geompos, int segment, int feature_minzoom, const char *fname) {
+	char *f = feature;
 
-	return sf;
+	signed char t;
+	deserialize_byte(&f, &t);
+
+	long long layer;
+	deserialize_long_long(&f, &layer);
+
+	if (layer & (1 << 5)) {
+		skip_varint(&f);  // seq
+	}
+	if (layer & (1 << 1)) {
+		skip_varint(&f);  // tippecanoe_minzoom
+	}
+	if (layer & (1 << 0)) {
+		skip_varint(&f);  // tippecanoe_maxzoom
+	}
+	if (layer & (1 << 2)) {
+		skip_varint(&f);  // id
+	}
+
+	fwrite_check(feature, sizeof(char), f - feature, geomfile, fname);
+	*geompos += f - feature;
+
+	skip_varint(&f);  // segment
+	serialize_int(geomfile, segment, geompos, fname);
+
+	// The geometry is relative to the segment's initial position, which the new
+	// segment number has to share, so the rest is unchanged except for the
+	// feature minzoom at the end
+	fwrite_check(f, sizeof(char), end - 1 - f, geomfile, fname);
+	*geompos += end - 1 - f;
+	serialize_byte(geomfile, feature_minzoom, geompos, fname);
 }
 
 static long long scale_geometry(struct serialization_state *sst, long long *bbox, drawvec &geom) {
@@ -462,12 +579,8 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 	}
 
 	if (sst->want_dist) {
-		std::vector<unsigned long long> locs;
-		for (size_t i = 0; i < sf.geometry.size(); i++) {
-			if (sf.geometry[i].op == VT_MOVETO || sf.geometry[i].op == VT_LINETO) {
-				locs.push_back(encode_index(SHIFT_LEFT(sf.geometry[i].x), SHIFT_LEFT(sf.geometry[i].y)));
-			}
-		}
+		std::vector<unsigned long long> &locs = r->vertex_indices;
+		encode_vertex_indices(sf.geometry, geometry_scale, locs);
 		std::sort(locs.begin(), locs.end());
 		size_t n = 0;
 		double sum = 0;
@@ -485,7 +598,6 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 			*(sst->dist_sum) += log(dist_ft) * n;
 			*(sst->dist_count) += n;
 		}
-		locs.clear();
 	}
 
 	bool inline_meta = true;
@@ -641,33 +753,74 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 	}
 
 	if (!sst->filters) {
+		auto fk = sst->layermap->find(sf.layername);
 		for (size_t i = 0; i < sf.full_keys.size(); i++) {
-			type_and_string attrib;
-			attrib.type = sf.full_values[i].type;
-			attrib.string = sf.full_values[i].s;
+			add_to_file_keys(fk->second.file_keys, sf.full_keys[i], sf.full_values[i].type, sf.full_values[i].s);
+		}
+	}
 
-			auto fk = sst->layermap->find(sf.layername);
-			add_to_file_keys(fk->second.file_keys, sf.full_keys[i], attrib);
+	// Like the layer's attributes, the bounds include features that the filter rejects
+	for (size_t i = 0; i < 2; i++) {
+		if (sf.bbox[i] < r->file_bbox[i]) {
+			r->file_bbox[i] = sf.bbox[i];
+		}
+	}
+	for (size_t i = 2; i < 4; i++) {
+		if (sf.bbox[i] > r->file_bbox[i]) {
+			r->file_bbox[i] = sf.bbox[i];
 		}
 	}
 
-	if (inline_meta) {
-		sf.metapos = -1;
+	// Whatever the feature filter can decide without knowing the zoom level
+	// is decided here, so that rejected features are never written out
+	bool rejected = false;
+	if (sst->filter != NULL) {
+		filter_attributes fa;
+		std::set<std::string> exclude_attributes;
+
+		sst->filter->start(fa);
 		for (size_t i = 0; i < sf.full_keys.size(); i++) {
-			sf.keys.push_back(addpool(r->poolfile, r->treefile, sf.full_keys[i].c_str(), mvt_string));
-			sf.values.push_back(addpool(r->poolfile, r->treefile, sf.full_values[i].s.c_str(), sf.full_values[i].type));
+			int slot = sst->filter->slot(sf.full_keys[i]);
+
+			if (slot >= 0) {
+				fa.set_copy(slot, stringified_to_mvt_value(sf.full_values[i].type, sf.full_values[i].s.c_str()));
+			}
 		}
-	} else {
-		sf.metapos = r->metapos;
-		serialize_long_long(r->metafile, sf.full_keys.size(), &r->metapos, sst->fname);
-		for (size_t i = 0; i < sf.full_keys.size(); i++) {
-			serialize_long_long(r->metafile, addpool(r->poolfile, r->treefile, sf.full_keys[i].c_str(), mvt_string), &r->metapos, sst->fname);
-			serialize_long_long(r->metafile, addpool(r->poolfile, r->treefile, sf.full_values[i].s.c_str(), sf.full_values[i].type), &r->metapos, sst->fname);
+		sst->filter->finish(fa, sf.has_id, sf.id, sf.t, 0);
+
+		if (!sst->filter->evaluate_unzoomed(fa, sf.layername, exclude_attributes)) {
+			rejected = true;
+		}
+
+		for (ssize_t i = (ssize_t) sf.full_keys.size() - 1; i >= 0; i--) {
+			if (exclude_attributes.count(sf.full_keys[i]) > 0) {
+				sf.full_keys.erase(sf.full_keys.begin() + i);
+				sf.full_values.erase(sf.full_values.begin() + i);
+			}
 		}
 	}
 
+	// A rejected feature still goes into the index, with no geometry, so that it
+	// takes up its place in the dropping sequence as if it were filtered out later
 	long long geomstart = r->geompos;
-	serialize_feature(r->geomfile, &sf, &r->geompos, sst->fname, SHIFT_RIGHT(*(sst->initial_x)), SHIFT_RIGHT(*(sst->initial_y)), false);
+	if (!rejected) {
+		if (inline_meta) {
+			sf.metapos = -1;
+			for (size_t i = 0; i < sf.full_keys.size(); i++) {
+				sf.keys.push_back(addpool(r->poolfile, r->treefile, sf.full_keys[i].c_str(), mvt_string));
+				sf.values.push_back(addpool(r->poolfile, r->treefile, sf.full_values[i].s.c_str(), sf.full_values[i].type));
+			}
+		} else {
+			sf.metapos = r->metapos;
+			serialize_long_long(r->metafile, sf.full_keys.size(), &r->metapos, sst->fname);
+			for (size_t i = 0; i < sf.full_keys.size(); i++) {
+				serialize_long_long(r->metafile, addpool(r->poolfile, r->treefile, sf.full_keys[i].c_str(), mvt_string), &r->metapos, sst->fname);
+				serialize_long_long(r->metafile, addpool(r->poolfile, r->treefile, sf.full_values[i].s.c_str(), sf.full_values[i].type), &r->metapos, sst->fname);
+			}
+		}
+
+		serialize_feature(r->geomfile, &sf, &r->geompos, sst->fname, SHIFT_RIGHT(*(sst->initial_x)), SHIFT_RIGHT(*(sst->initial_y)), false);
+	}
 
 	struct index index;
 	index.start = geomstart;
@@ -680,17 +833,6 @@ int serialize_feature(struct serialization_state *sst, serial_feature &sf) {
 	fwrite_check(&index, sizeof(struct index), 1, r->indexfile, sst->fname);
 	r->indexpos += sizeof(struct index);
 
-	for (size_t i = 0; i < 2; i++) {
-		if (sf.bbox[i] < r->file_bbox[i]) {
-			r->file_bbox[i] = sf.bbox[i];
-		}
-	}
-	for (size_t i = 2; i < 4; i++) {
-		if (sf.bbox[i] > r->file_bbox[i]) {
-			r->file_bbox[i] = sf.bbox[i];
-		}
-	}
-
 	if (*(sst->progress_seq) % 10000 == 0) {
 		checkdisk(sst->readers);
 		if (!quiet && !quiet_progress && progress_time()) {
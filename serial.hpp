@@ -10,6 +10,7 @@
 #include "geometry.hpp"
 #include "mbtiles.hpp"
 #include "jsonpull/jsonpull.h"
+#include "evaluator.hpp"
 
 size_t fwrite_check(const void *ptr, size_t size, size_t nitems, FILE *stream, const char *fname);
 
@@ -26,12 +27,6 @@ void deserialize_ulong_long(char **f, unsigned long long *n);
 void deserialize_uint(char **f, unsigned *n);
 void deserialize_byte(char **f, signed char *n);
 
-int deserialize_int_io(FILE *f, int *n, std::atomic<long long> *geompos);
-int deserialize_long_long_io(FILE *f, long long *n, std::atomic<long long> *geompos);
-int deserialize_ulong_long_io(FILE *f, unsigned long long *n, std::atomic<long long> *geompos);
-int deserialize_uint_io(FILE *f, unsigned *n, std::atomic<long long> *geompos);
-int deserialize_byte_io(FILE *f, signed char *n, std::atomic<long long> *geompos);
-
 struct serial_val {
 	int type = 0;
 	std::string s = "";
@@ -72,7 +67,25 @@ struct serial_feature {
 };
 
 void serialize_feature(FILE *geomfile, serial_feature *sf, std::atomic<long long> *geompos, const char *fname, long long wx, long long wy, bool include_minzoom);
-serial_feature deserialize_feature(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y);
+
+// Maps one reader segment's string pool offsets to offsets in the merged,
+// deduplicated string pool. Strings are appended to a segment's pool in order,
+// so the "from" offsets are sorted.
+struct pool_remap {
+	std::vector<long long> from{};
+	std::vector<long long> to{};
+
+	long long lookup(long long off) const;
+};
+
+void remap_feature_strings(char *feature, char *end, FILE *geomfile, std::atomic<long long> *geompos, char *metabase, pool_remap const &remap, FILE *metafile, std::atomic<long long> *metapos, const char *fname);
+
+void resegment_feature(char *feature, char *end, FILE *geomfile, std::atomic<long long> *geompos, int segment, int feature_minzoom, const char *fname);
+
+serial_feature deserialize_feature(char *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y);
+
+// The same, but reading into sf, so that its vectors keep their capacity from feature to feature
+void deserialize_feature(char *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, unsigned z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, serial_feature &sf);
 
 struct reader {
 	int metafd = -1;
@@ -98,6 +111,12 @@ struct reader {
 
 	char *geom_map = NULL;
 
+	// Scratch space for serialize_feature(), reused from one feature to the next
+	std::vector<unsigned long long> vertex_indices{};
+
+	// If updating an existing tileset, the IDs of the features to delete
+	std::vector<unsigned long long> *deleted_ids = NULL;
+
 	reader()
 	    : metapos(0), geompos(0), indexpos(0) {
 	}
@@ -130,6 +149,7 @@ struct reader {
 		metast = r.metast;
 
 		geom_map = r.geom_map;
+		deleted_ids = r.deleted_ids;
 	}
 };
 
@@ -155,6 +175,7 @@ struct serialization_state {
 	int basezoom = 0;
 
 	bool filters = false;
+	compiled_filter *filter = NULL;  // -j feature filter, for the parts that don't depend on zoom
 	bool uses_gamma = false;
 
 	std::map<std::string, layermap_entry> *layermap = NULL;
@@ -0,0 +1,566 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include <unistd.h>
+#include <fcntl.h>
+#include <sys/stat.h>
+#include <sys/mman.h>
+#include <atomic>
+#include <string>
+#include <vector>
+#include "store.hpp"
+#include "serial.hpp"
+#include "write_json.hpp"
+#include "jsonpull/jsonpull.h"
+
+// How many bytes of features go into each block of the index
+#define STORE_BLOCK 65536
+
+#define STORE_VERSION 3
+
+static const char *store_files[] = {"state.json", "index", "geom", "meta", "pool"};
+
+// Each file is written under a temporary name and only renamed into place
+// once all of it has been written, so that nothing reads a partial one
+static void finish_file(std::string const &tmpname, std::string const &fname) {
+	if (rename(tmpname.c_str(), fname.c_str()) != 0) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+void store_write(const char *dir, const char *name, const char *data, long long size) {
+	std::string fname = std::string(dir) + "/" + name;
+	std::string tmpname = fname + ".tmp";
+
+	FILE *f = fopen(tmpname.c_str(), "wb");
+	if (f == NULL) {
+		perror(tmpname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	if (size > 0 && fwrite(data, sizeof(char), size, f) != (size_t) size) {
+		perror(tmpname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	if (fclose(f) != 0) {
+		perror(tmpname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	finish_file(tmpname, fname);
+}
+
+void store_features(const char *dir, int geomfd, char *meta, long long metasize, char *stringpool, long long poolsize, long long *meta_off, unsigned *initial_x, unsigned *initial_y, feature_store &fs) {
+	if (mkdir(dir, S_IRWXU | S_IRWXG | S_IRWXO) != 0 && errno != EEXIST) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+
+	store_write(dir, "meta", meta, metasize);
+	store_write(dir, "pool", stringpool, poolsize);
+
+	struct stat geomst;
+	if (fstat(geomfd, &geomst) != 0) {
+		perror("stat sorted geom");
+		exit(EXIT_FAILURE);
+	}
+
+	char *geom = (char *) mmap(NULL, geomst.st_size, PROT_READ, MAP_PRIVATE, geomfd, 0);
+	if (geom == MAP_FAILED) {
+		perror("mmap geom for feature store");
+		exit(EXIT_FAILURE);
+	}
+	madvise(geom, geomst.st_size, MADV_SEQUENTIAL);
+
+	store_write(dir, "geom", geom, geomst.st_size);
+
+	char *p = geom;
+	deserialize_int(&p, &fs.iz);
+	deserialize_uint(&p, &fs.ix);
+	deserialize_uint(&p, &fs.iy);
+
+	std::atomic<long long> geompos(p - geom);
+	fs.blocks.clear();
+
+	store_block block;
+	block.start = geompos;
+
+	while (true) {
+		serial_feature sf = deserialize_feature(geom, &geompos, meta, meta_off, 0, 0, 0, initial_x, initial_y);
+		if (sf.t < 0) {
+			break;
+		}
+
+		if (block.end == 0) {
+			block.index = sf.index;
+		}
+		block.end = geompos;
+
+		for (size_t i = 0; i < 2; i++) {
+			if (sf.bbox[i] < block.bbox[i]) {
+				block.bbox[i] = sf.bbox[i];
+			}
+			if (sf.bbox[i + 2] > block.bbox[i + 2]) {
+				block.bbox[i + 2] = sf.bbox[i + 2];
+			}
+		}
+
+		if (block.end - block.start >= STORE_BLOCK) {
+			fs.blocks.push_back(block);
+			block = store_block();
+			block.start = geompos;
+		}
+	}
+
+	if (block.end != 0) {
+		fs.blocks.push_back(block);
+	}
+
+	madvise(geom, geomst.st_size, MADV_DONTNEED);
+	if (munmap(geom, geomst.st_size) != 0) {
+		perror("munmap geom for feature store");
+		exit(EXIT_FAILURE);
+	}
+
+	store_write(dir, "index", (const char *) fs.blocks.data(), fs.blocks.size() * sizeof(store_block));
+}
+
+static void write_values(json_writer &state, std::vector<type_and_string> const &values) {
+	state.json_write_array();
+	for (auto const &v : values) {
+		state.json_write_array();
+		state.json_write_signed(v.type);
+		state.json_write_string(v.string);
+		state.json_end_array();
+	}
+	state.json_end_array();
+}
+
+void write_layermap(json_writer &state, std::map<std::string, layermap_entry> const &layermap) {
+	state.json_write_hash();
+	for (auto const &lm : layermap) {
+		state.json_write_newline();
+		state.json_write_string(lm.first);
+		state.json_write_hash();
+
+		state.json_write_string("id");
+		state.json_write_unsigned(lm.second.id);
+		state.json_write_string("minzoom");
+		state.json_write_signed(lm.second.minzoom);
+		state.json_write_string("maxzoom");
+		state.json_write_signed(lm.second.maxzoom);
+		state.json_write_string("description");
+		state.json_write_string(lm.second.description);
+		state.json_write_string("points");
+		state.json_write_unsigned(lm.second.points);
+		state.json_write_string("lines");
+		state.json_write_unsigned(lm.second.lines);
+		state.json_write_string("polygons");
+		state.json_write_unsigned(lm.second.polygons);
+		state.json_write_string("retain");
+		state.json_write_unsigned(lm.second.retain);
+
+		state.json_write_string("file_keys");
+		state.json_write_hash();
+		for (auto const &fk : lm.second.file_keys) {
+			state.json_write_newline();
+			state.json_write_string(fk.first);
+			state.json_write_hash();
+
+			state.json_write_string("type");
+			state.json_write_signed(fk.second.type);
+
+			// Left out until there has been a number, since JSON has no infinity
+			if (fk.second.min <= fk.second.max) {
+				state.json_write_string("min");
+				state.json_write_number(fk.second.min);
+				state.json_write_string("max");
+				state.json_write_number(fk.second.max);
+			}
+
+			state.json_write_string("sample_values");
+			write_values(state, fk.second.sample_values);
+			state.json_write_string("pending");
+			write_values(state, fk.second.pending);
+
+			state.json_end_hash();
+		}
+		state.json_end_hash();
+
+		state.json_end_hash();
+	}
+	state.json_end_hash();
+}
+
+void store_write_state(const char *dir, feature_store const &fs) {
+	std::string fname = std::string(dir) + "/state.json";
+	std::string tmpname = fname + ".tmp";
+	FILE *f = fopen(tmpname.c_str(), "w");
+	if (f == NULL) {
+		perror(tmpname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	{
+		json_writer state(f);
+
+		state.json_write_hash();
+
+		state.json_write_string("version");
+		state.json_write_signed(STORE_VERSION);
+		state.json_write_string("minzoom");
+		state.json_write_signed(fs.minzoom);
+		state.json_write_string("maxzoom");
+		state.json_write_signed(fs.maxzoom);
+		state.json_write_string("full_detail");
+		state.json_write_signed(fs.full_detail);
+		state.json_write_string("low_detail");
+		state.json_write_signed(fs.low_detail);
+		state.json_write_string("min_detail");
+		state.json_write_signed(fs.min_detail);
+		state.json_write_string("geometry_scale");
+		state.json_write_signed(fs.geometry_scale);
+		state.json_write_string("buffer");
+		state.json_write_signed(fs.buffer);
+		state.json_write_string("basezoom");
+		state.json_write_signed(fs.basezoom);
+		state.json_write_string("droprate");
+		state.json_write_number(fs.droprate);
+
+		state.json_write_string("first_tile");
+		state.json_write_array();
+		state.json_write_signed(fs.iz);
+		state.json_write_unsigned(fs.ix);
+		state.json_write_unsigned(fs.iy);
+		state.json_end_array();
+
+		state.json_write_newline();
+		state.json_write_string("segments");
+		state.json_write_array();
+		for (size_t i = 0; i < fs.layers.size(); i++) {
+			state.json_write_newline();
+			state.json_write_hash();
+			state.json_write_string("initial_x");
+			state.json_write_unsigned(fs.initial_x[i]);
+			state.json_write_string("initial_y");
+			state.json_write_unsigned(fs.initial_y[i]);
+			state.json_write_string("layers");
+			state.json_write_array();
+			for (auto const &name : fs.layers[i]) {
+				state.json_write_string(name);
+			}
+			state.json_end_array();
+			state.json_end_hash();
+		}
+		state.json_end_array();
+
+		state.json_write_newline();
+		state.json_write_string("file_bbox");
+		state.json_write_array();
+		for (size_t i = 0; i < 4; i++) {
+			state.json_write_signed(fs.file_bbox[i]);
+		}
+		state.json_end_array();
+
+		state.json_write_newline();
+		state.json_write_string("layermap");
+		write_layermap(state, fs.layermap);
+
+		state.json_write_newline();
+		state.json_write_string("zooms");
+		state.json_write_array();
+		for (auto const &zs : fs.zooms) {
+			state.json_write_newline();
+			state.json_write_hash();
+			state.json_write_string("z");
+			state.json_write_signed(zs.z);
+			state.json_write_string("maxzoom");
+			state.json_write_signed(zs.maxzoom);
+			state.json_write_string("child_shards");
+			state.json_write_unsigned(zs.child_shards);
+			state.json_write_string("gamma");
+			state.json_write_number(zs.gamma);
+			state.json_write_string("mingap");
+			state.json_write_unsigned(zs.mingap);
+			state.json_write_string("minextent");
+			state.json_write_signed(zs.minextent);
+			state.json_write_string("fraction");
+			state.json_write_number(zs.fraction);
+			state.json_end_hash();
+		}
+		state.json_end_array();
+
+		state.json_write_newline();
+		state.json_end_hash();
+		state.json_write_newline();
+	}
+
+	if (fclose(f) != 0) {
+		perror(tmpname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	finish_file(tmpname, fname);
+}
+
+static json_object *get(std::string const &fname, json_object *o, const char *key, json_type type) {
+	json_object *v = json_hash_get(o, key);
+	if (v == NULL || v->type != type) {
+		fprintf(stderr, "%s: missing or malformed \"%s\"\n", fname.c_str(), key);
+		exit(EXIT_FAILURE);
+	}
+	return v;
+}
+
+// Numbers are read from their text so that 64-bit values come through exactly
+static long long get_signed(std::string const &fname, json_object *o, const char *key) {
+	return strtoll(get(fname, o, key, JSON_NUMBER)->string, NULL, 10);
+}
+
+static unsigned long long get_unsigned(std::string const &fname, json_object *o, const char *key) {
+	return strtoull(get(fname, o, key, JSON_NUMBER)->string, NULL, 10);
+}
+
+static double get_double(std::string const &fname, json_object *o, const char *key) {
+	return strtod(get(fname, o, key, JSON_NUMBER)->string, NULL);
+}
+
+static void read_values(std::string const &fname, json_object *o, const char *key, std::vector<type_and_string> &values) {
+	json_object *a = get(fname, o, key, JSON_ARRAY);
+	for (size_t i = 0; i < a->length; i++) {
+		json_object *v = a->array[i];
+		if (v->type != JSON_ARRAY || v->length != 2 || v->array[0]->type != JSON_NUMBER || v->array[1]->type != JSON_STRING) {
+			fprintf(stderr, "%s: malformed \"%s\"\n", fname.c_str(), key);
+			exit(EXIT_FAILURE);
+		}
+
+		type_and_string tas;
+		tas.type = strtol(v->array[0]->string, NULL, 10);
+		tas.string = v->array[1]->string;
+		values.push_back(tas);
+	}
+}
+
+std::map<std::string, layermap_entry> read_layermap(std::string const &fname, json_object *o) {
+	std::map<std::string, layermap_entry> layermap;
+
+	if (o->type != JSON_HASH) {
+		fprintf(stderr, "%s: malformed layer table\n", fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	for (size_t i = 0; i < o->length; i++) {
+		json_object *lo = o->values[i];
+		if (lo->type != JSON_HASH) {
+			fprintf(stderr, "%s: malformed layer %s\n", fname.c_str(), o->keys[i]->string);
+			exit(EXIT_FAILURE);
+		}
+
+		layermap_entry le(get_unsigned(fname, lo, "id"));
+		le.minzoom = get_signed(fname, lo, "minzoom");
+		le.maxzoom = get_signed(fname, lo, "maxzoom");
+		le.description = get(fname, lo, "description", JSON_STRING)->string;
+		le.points = get_unsigned(fname, lo, "points");
+		le.lines = get_unsigned(fname, lo, "lines");
+		le.polygons = get_unsigned(fname, lo, "polygons");
+		le.retain = get_unsigned(fname, lo, "retain");
+
+		json_object *file_keys = get(fname, lo, "file_keys", JSON_HASH);
+		for (size_t j = 0; j < file_keys->length; j++) {
+			json_object *fo = file_keys->values[j];
+			if (fo->type != JSON_HASH) {
+				fprintf(stderr, "%s: malformed attribute %s\n", fname.c_str(), file_keys->keys[j]->string);
+				exit(EXIT_FAILURE);
+			}
+
+			type_and_string_stats tss;
+			tss.type = get_signed(fname, fo, "type");
+			if (json_hash_get(fo, "min") != NULL) {
+				tss.min = get_double(fname, fo, "min");
+				tss.max = get_double(fname, fo, "max");
+			}
+			read_values(fname, fo, "sample_values", tss.sample_values);
+			read_values(fname, fo, "pending", tss.pending);
+
+			le.file_keys.insert(std::pair<std::string, type_and_string_stats>(file_keys->keys[j]->string, tss));
+		}
+
+		layermap.insert(std::pair<std::string, layermap_entry>(o->keys[i]->string, le));
+	}
+
+	return layermap;
+}
+
+void store_read(const char *dir, feature_store &fs) {
+	std::string fname = std::string(dir) + "/state.json";
+	FILE *f = fopen(fname.c_str(), "r");
+	if (f == NULL) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	json_pull *jp = json_begin_file(f);
+	json_object *o = json_read_tree(jp);
+	if (o == NULL || o->type != JSON_HASH) {
+		fprintf(stderr, "%s: feature store state parsing error: %s\n", fname.c_str(), jp->error != NULL ? jp->error : "not a JSON object");
+		exit(EXIT_FAILURE);
+	}
+
+	if (get_signed(fname, o, "version") != STORE_VERSION) {
+		fprintf(stderr, "%s: feature store is version %lld, not %d\n", fname.c_str(), get_signed(fname, o, "version"), STORE_VERSION);
+		exit(EXIT_FAILURE);
+	}
+
+	fs.minzoom = get_signed(fname, o, "minzoom");
+	fs.maxzoom = get_signed(fname, o, "maxzoom");
+	fs.full_detail = get_signed(fname, o, "full_detail");
+	fs.low_detail = get_signed(fname, o, "low_detail");
+	fs.min_detail = get_signed(fname, o, "min_detail");
+	fs.geometry_scale = get_signed(fname, o, "geometry_scale");
+	fs.buffer = get_signed(fname, o, "buffer");
+	fs.basezoom = get_signed(fname, o, "basezoom");
+	fs.droprate = get_double(fname, o, "droprate");
+
+	json_object *first = get(fname, o, "first_tile", JSON_ARRAY);
+	if (first->length != 3) {
+		fprintf(stderr, "%s: malformed \"first_tile\"\n", fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+	fs.iz = strtol(first->array[0]->string, NULL, 10);
+	fs.ix = strtoul(first->array[1]->string, NULL, 10);
+	fs.iy = strtoul(first->array[2]->string, NULL, 10);
+
+	json_object *segments = get(fname, o, "segments", JSON_ARRAY);
+	for (size_t i = 0; i < segments->length; i++) {
+		json_object *seg = segments->array[i];
+		fs.initial_x.push_back(get_unsigned(fname, seg, "initial_x"));
+		fs.initial_y.push_back(get_unsigned(fname, seg, "initial_y"));
+
+		json_object *layers = get(fname, seg, "layers", JSON_ARRAY);
+		fs.layers.push_back(std::vector<std::string>());
+		for (size_t j = 0; j < layers->length; j++) {
+			fs.layers.back().push_back(layers->array[j]->string);
+		}
+	}
+
+	json_object *bbox = get(fname, o, "file_bbox", JSON_ARRAY);
+	if (bbox->length != 4) {
+		fprintf(stderr, "%s: malformed \"file_bbox\"\n", fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+	for (size_t i = 0; i < 4; i++) {
+		fs.file_bbox[i] = strtoll(bbox->array[i]->string, NULL, 10);
+	}
+
+	fs.layermap = read_layermap(fname, get(fname, o, "layermap", JSON_HASH));
+
+	json_object *zooms = get(fname, o, "zooms", JSON_ARRAY);
+	for (size_t i = 0; i < zooms->length; i++) {
+		json_object *zo = zooms->array[i];
+		zoom_state zs;
+
+		zs.z = get_signed(fname, zo, "z");
+		zs.maxzoom = get_signed(fname, zo, "maxzoom");
+		zs.child_shards = get_unsigned(fname, zo, "child_shards");
+		zs.gamma = get_double(fname, zo, "gamma");
+		zs.mingap = get_unsigned(fname, zo, "mingap");
+		zs.minextent = get_signed(fname, zo, "minextent");
+		zs.fraction = get_double(fname, zo, "fraction");
+
+		fs.zooms.push_back(zs);
+	}
+
+	json_end(jp);
+	if (fclose(f) != 0) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	long long size;
+	char *index = store_map(dir, "index", &size);
+	fs.blocks.resize(size / sizeof(store_block));
+	if (size > 0) {
+		memcpy(fs.blocks.data(), index, fs.blocks.size() * sizeof(store_block));
+	}
+	store_unmap(index, size);
+}
+
+std::string store_staging(const char *dir) {
+	return std::string(dir) + ".new";
+}
+
+static void remove_store(std::string const &dir) {
+	for (const char *name : store_files) {
+		std::string fname = dir + "/" + name;
+		if (unlink(fname.c_str()) != 0 && errno != ENOENT) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (rmdir(dir.c_str()) != 0 && errno != ENOENT) {
+		perror(dir.c_str());
+		exit(EXIT_FAILURE);
+	}
+}
+
+void store_commit(const char *dir) {
+	std::string staging = store_staging(dir);
+	std::string old = std::string(dir) + ".old";
+
+	// The old store is only moved aside for as long as it takes to
+	// move the new one into its place
+	remove_store(old);
+	if (rename(dir, old.c_str()) != 0 && errno != ENOENT) {
+		perror(dir);
+		exit(EXIT_FAILURE);
+	}
+	if (rename(staging.c_str(), dir) != 0) {
+		perror(staging.c_str());
+		exit(EXIT_FAILURE);
+	}
+	remove_store(old);
+}
+
+char *store_map(const char *dir, const char *name, long long *size) {
+	std::string fname = std::string(dir) + "/" + name;
+
+	int fd = open(fname.c_str(), O_RDONLY | O_CLOEXEC);
+	if (fd < 0) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	struct stat st;
+	if (fstat(fd, &st) != 0) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+	*size = st.st_size;
+
+	char *map = NULL;
+	if (st.st_size > 0) {
+		map = (char *) mmap(NULL, st.st_size, PROT_READ, MAP_PRIVATE, fd, 0);
+		if (map == MAP_FAILED) {
+			perror(fname.c_str());
+			exit(EXIT_FAILURE);
+		}
+	}
+
+	if (close(fd) != 0) {
+		perror(fname.c_str());
+		exit(EXIT_FAILURE);
+	}
+
+	return map;
+}
+
+void store_unmap(char *map, long long size) {
+	if (map != NULL && munmap(map, size) != 0) {
+		perror("munmap feature store");
+		exit(EXIT_FAILURE);
+	}
+}
@@ -0,0 +1,77 @@
+#ifndef STORE_HPP
+#define STORE_HPP
+
+#include <limits.h>
+#include <string>
+#include <vector>
+#include "tile.hpp"
+#include "write_json.hpp"
+
+// A feature store, written by --feature-store, keeps the sorted features,
+// attribute metadata, and string pool from a tiling run, along with what
+// is needed to make any of its tiles again the way that run made them.
+
+// One entry of the sparse index of the sorted features: a run of
+// consecutive features in the file, and the area that they cover
+struct store_block {
+	long long start = 0;  // offsets in the geometry file
+	long long end = 0;
+	unsigned long long index = 0;					    // spatial index of the first feature
+	long long bbox[4] = {LLONG_MAX, LLONG_MAX, LLONG_MIN, LLONG_MIN};  // in world coordinates
+};
+
+struct feature_store {
+	int minzoom = 0;
+	int maxzoom = 0;
+	int full_detail = 0;
+	int low_detail = 0;
+	int min_detail = 0;
+	int geometry_scale = 0;
+	int buffer = 0;
+	int basezoom = 0;
+	double droprate = 0;
+
+	// The tile that tiling starts from
+	int iz = 0;
+	unsigned ix = 0;
+	unsigned iy = 0;
+
+	// For each input segment
+	std::vector<unsigned> initial_x{};
+	std::vector<unsigned> initial_y{};
+	std::vector<std::vector<std::string>> layers{};  // layer names, by id
+
+	// What the tileset metadata describes: the attributes and bounds of
+	// all the features that have ever been added, merged across segments
+	std::map<std::string, layermap_entry> layermap{};
+	long long file_bbox[4] = {UINT_MAX, UINT_MAX, 0, 0};
+
+	std::vector<zoom_state> zooms{};
+	std::vector<store_block> blocks{};
+};
+
+// Copy the sorted features, metadata, and string pool into dir,
+// indexing the features into fs.blocks along the way
+void store_features(const char *dir, int geomfd, char *meta, long long metasize, char *stringpool, long long poolsize, long long *meta_off, unsigned *initial_x, unsigned *initial_y, feature_store &fs);
+
+// Write out everything else about the run, once it is known
+void store_write_state(const char *dir, feature_store const &fs);
+
+void store_read(const char *dir, feature_store &fs);
+
+// The attribute metadata of a layer table, as the feature store and
+// the checkpoint both keep it
+void write_layermap(json_writer &state, std::map<std::string, layermap_entry> const &layermap);
+std::map<std::string, layermap_entry> read_layermap(std::string const &fname, json_object *o);
+
+// A new store is written into store_staging(dir), and store_commit() puts
+// it in place of any old one in dir once the tiles that go with it are made
+std::string store_staging(const char *dir);
+void store_commit(const char *dir);
+
+// Write or map one of the store's files
+void store_write(const char *dir, const char *name, const char *data, long long size);
+char *store_map(const char *dir, const char *name, long long *size);
+void store_unmap(char *map, long long size);
+
+#endif
@@ -70,7 +70,44 @@ void aprintf(std::string *buf, const char *format, ...) {
 	free(tmp);
 }
 
-void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::string, layermap_entry> &layermap, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, int ifmatched, mvt_tile &outtile, json_object *filter) {
+// The stringified form of a tile attribute value, for the tileset's
+// attribute statistics. Returns false for types that aren't copied.
+static bool stringify_value(mvt_value const &val, type_and_string &tas) {
+	std::string &value = tas.string;
+	value.clear();
+
+	if (val.type == mvt_string) {
+		value = val.string_value;
+		tas.type = mvt_string;
+	} else if (val.type == mvt_int) {
+		aprintf(&value, "%lld", (long long) val.numeric_value.int_value);
+		tas.type = mvt_double;
+	} else if (val.type == mvt_double) {
+		aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.double_value).c_str());
+		tas.type = mvt_double;
+	} else if (val.type == mvt_float) {
+		aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.float_value).c_str());
+		tas.type = mvt_double;
+	} else if (val.type == mvt_bool) {
+		aprintf(&value, "%s", val.numeric_value.bool_value ? "true" : "false");
+		tas.type = mvt_bool;
+	} else if (val.type == mvt_sint) {
+		aprintf(&value, "%lld", (long long) val.numeric_value.sint_value);
+		tas.type = mvt_double;
+	} else if (val.type == mvt_uint) {
+		aprintf(&value, "%llu", (long long) val.numeric_value.uint_value);
+		tas.type = mvt_double;
+	} else {
+		return false;
+	}
+
+	return true;
+}
+
+#define REMAP_UNKNOWN -1  // not looked up in the output layer yet
+#define REMAP_SKIP -2	  // excluded key, or value of a type that isn't copied
+
+void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::string, layermap_entry> &layermap, csv_join const *join, std::set<std::string> &exclude, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, int ifmatched, mvt_tile &outtile, compiled_filter *filter) {
 	mvt_tile tile;
 	int features_added = 0;
 	bool was_compressed;
@@ -80,6 +117,11 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 		exit(EXIT_FAILURE);
 	}
 
+	std::map<std::string, size_t> outlayers;
+	for (size_t ol = 0; ol < outtile.layers.size(); ol++) {
+		outlayers.insert(std::pair<std::string, size_t>(outtile.layers[ol].name, ol));
+	}
+
 	for (size_t l = 0; l < tile.layers.size(); l++) {
 		mvt_layer &layer = tile.layers[l];
 
@@ -96,13 +138,12 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 		}
 
 		size_t ol;
-		for (ol = 0; ol < outtile.layers.size(); ol++) {
-			if (tile.layers[l].name == outtile.layers[ol].name) {
-				break;
-			}
-		}
-
-		if (ol == outtile.layers.size()) {
+		auto oli = outlayers.find(layer.name);
+		if (oli != outlayers.end()) {
+			ol = oli->second;
+		} else {
+			ol = outtile.layers.size();
+			outlayers.insert(std::pair<std::string, size_t>(layer.name, ol));
 			outtile.layers.push_back(mvt_layer());
 
 			outtile.layers[ol].name = layer.name;
@@ -127,162 +168,186 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 
 		auto file_keys = layermap.find(layer.name);
 
-		for (size_t f = 0; f < layer.features.size(); f++) {
-			mvt_feature feat = layer.features[f];
-			std::set<std::string> exclude_attributes;
-
-			if (filter != NULL) {
-				std::map<std::string, mvt_value> attributes;
-
-				for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
-					std::string key = layer.keys[feat.tags[t]];
-					mvt_value &val = layer.values[feat.tags[t + 1]];
+		// Which of the filter's attributes each of the layer's keys is
+		std::vector<int> key_slots;
+		filter_attributes attrs;
+		if (filter != NULL) {
+			for (size_t k = 0; k < layer.keys.size(); k++) {
+				key_slots.push_back(filter->slot(layer.keys[k]));
+			}
+		}
 
-					attributes.insert(std::pair<std::string, mvt_value>(key, val));
+		// Unless the layer has the key to join against, its attributes are
+		// copied through unchanged, so each of its keys and values only has
+		// to be found in the output layer once rather than for every feature
+		bool joining = false;
+		if (join != NULL && join->header.size() > 0) {
+			for (size_t k = 0; k < layer.keys.size(); k++) {
+				if (layer.keys[k] == join->header[0]) {
+					joining = true;
+					break;
 				}
+			}
+		}
 
-				if (feat.has_id) {
-					mvt_value v;
-					v.type = mvt_uint;
-					v.numeric_value.uint_value = feat.id;
-
-					attributes.insert(std::pair<std::string, mvt_value>("$id", v));
-				}
+		std::vector<long long> key_remap, value_remap;
+		std::vector<size_t> key_seen;
+		std::vector<type_and_string> value_strings;
+		if (!joining) {
+			if (ifmatched) {
+				continue;  // nothing in this layer can match the CSV
+			}
 
-				mvt_value v;
-				v.type = mvt_string;
+			key_remap.resize(layer.keys.size(), REMAP_UNKNOWN);
+			value_remap.resize(layer.values.size(), REMAP_UNKNOWN);
+			key_seen.resize(layer.keys.size(), 0);
+			value_strings.resize(layer.values.size());
+		}
 
-				if (feat.type == mvt_point) {
-					v.string_value = "Point";
-				} else if (feat.type == mvt_linestring) {
-					v.string_value = "LineString";
-				} else if (feat.type == mvt_polygon) {
-					v.string_value = "Polygon";
-				}
+		for (size_t f = 0; f < layer.features.size(); f++) {
+			mvt_feature &feat = layer.features[f];
+			std::set<std::string> exclude_attributes;
 
-				attributes.insert(std::pair<std::string, mvt_value>("$type", v));
+			if (filter != NULL) {
+				filter->start(attrs);
 
-				mvt_value v2;
-				v2.type = mvt_uint;
-				v2.numeric_value.uint_value = z;
+				for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
+					attrs.set(key_slots[feat.tags[t]], &layer.values[feat.tags[t + 1]]);
+				}
 
-				attributes.insert(std::pair<std::string, mvt_value>("$zoom", v2));
+				filter->finish(attrs, feat.has_id, feat.id, feat.type, z);
 
-				if (!evaluate(attributes, layer.name, filter, exclude_attributes)) {
+				if (!filter->evaluate(attrs, layer.name, exclude_attributes)) {
 					continue;
 				}
 			}
 
 			mvt_feature outfeature;
-			int matched = 0;
 
 			if (feat.has_id) {
 				outfeature.has_id = true;
 				outfeature.id = feat.id;
 			}
 
-			std::map<std::string, std::pair<mvt_value, type_and_string>> attributes;
-			std::vector<std::string> key_order;
-
-			for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
-				const char *key = layer.keys[feat.tags[t]].c_str();
-				mvt_value &val = layer.values[feat.tags[t + 1]];
-				std::string value;
-				int type = -1;
-
-				if (val.type == mvt_string) {
-					value = val.string_value;
-					type = mvt_string;
-				} else if (val.type == mvt_int) {
-					aprintf(&value, "%lld", (long long) val.numeric_value.int_value);
-					type = mvt_double;
-				} else if (val.type == mvt_double) {
-					aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.double_value).c_str());
-					type = mvt_double;
-				} else if (val.type == mvt_float) {
-					aprintf(&value, "%s", milo::dtoa_milo(val.numeric_value.float_value).c_str());
-					type = mvt_double;
-				} else if (val.type == mvt_bool) {
-					aprintf(&value, "%s", val.numeric_value.bool_value ? "true" : "false");
-					type = mvt_bool;
-				} else if (val.type == mvt_sint) {
-					aprintf(&value, "%lld", (long long) val.numeric_value.sint_value);
-					type = mvt_double;
-				} else if (val.type == mvt_uint) {
-					aprintf(&value, "%llu", (long long) val.numeric_value.uint_value);
-					type = mvt_double;
-				} else {
-					continue;
+			if (!joining) {
+				if (file_keys == layermap.end()) {
+					layermap.insert(std::pair<std::string, layermap_entry>(layer.name, layermap_entry(layermap.size())));
+					file_keys = layermap.find(layer.name);
+					file_keys->second.minzoom = z;
+					file_keys->second.maxzoom = z;
 				}
 
-				if (type < 0) {
-					continue;
+				for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
+					unsigned k = feat.tags[t];
+					unsigned v = feat.tags[t + 1];
+
+					// As with a map of the attributes, the first of any duplicate keys wins
+					if (k >= layer.keys.size() || v >= layer.values.size() || key_seen[k] == f + 1) {
+						continue;
+					}
+
+					if (key_remap[k] == REMAP_UNKNOWN && (exclude_all || exclude.count(layer.keys[k]) != 0)) {
+						key_remap[k] = REMAP_SKIP;
+					}
+					if (key_remap[k] == REMAP_SKIP) {
+						continue;
+					}
+					if (exclude_attributes.size() > 0 && exclude_attributes.count(layer.keys[k]) != 0) {
+						continue;
+					}
+
+					if (value_remap[v] == REMAP_UNKNOWN) {
+						if (stringify_value(layer.values[v], value_strings[v])) {
+							value_remap[v] = outlayer.tag_value(layer.values[v]);
+						} else {
+							value_remap[v] = REMAP_SKIP;
+						}
+					}
+					if (value_remap[v] == REMAP_SKIP) {
+						continue;
+					}
+
+					// Only add the key to the output layer once it is really used
+					if (key_remap[k] == REMAP_UNKNOWN) {
+						key_remap[k] = outlayer.tag_key(layer.keys[k]);
+					}
+
+					key_seen[k] = f + 1;
+					outfeature.tags.push_back(key_remap[k]);
+					outfeature.tags.push_back(value_remap[v]);
+					add_to_file_keys(file_keys->second.file_keys, layer.keys[k], value_strings[v]);
 				}
+			} else {
+				int matched = 0;
+				std::map<std::string, std::pair<mvt_value, type_and_string>> attributes;
+				std::vector<std::string> key_order;
 
-				if (!exclude_all && exclude.count(std::string(key)) == 0 && exclude_attributes.count(std::string(key)) == 0) {
+				for (size_t t = 0; t + 1 < feat.tags.size(); t += 2) {
+					const char *key = layer.keys[feat.tags[t]].c_str();
+					mvt_value &val = layer.values[feat.tags[t + 1]];
 					type_and_string tas;
-					tas.type = type;
-					tas.string = value;
 
-					attributes.insert(std::pair<std::string, std::pair<mvt_value, type_and_string>>(key, std::pair<mvt_value, type_and_string>(val, tas)));
-					key_order.push_back(key);
-				}
+					if (!stringify_value(val, tas)) {
+						continue;
+					}
+					std::string &value = tas.string;
 
-				if (header.size() > 0 && strcmp(key, header[0].c_str()) == 0) {
-					std::map<std::string, std::vector<std::string>>::iterator ii = mapping.find(value);
+					if (!exclude_all && exclude.count(std::string(key)) == 0 && exclude_attributes.count(std::string(key)) == 0) {
+						attributes.insert(std::pair<std::string, std::pair<mvt_value, type_and_string>>(key, std::pair<mvt_value, type_and_string>(val, tas)));
+						key_order.push_back(key);
+					}
+
+					if (join != NULL && join->header.size() > 0 && strcmp(key, join->header[0].c_str()) == 0) {
+						const char *row = join->find(value);
 
-					if (ii != mapping.end()) {
-						std::vector<std::string> fields = ii->second;
-						matched = 1;
+						if (row != NULL) {
+							matched = 1;
 
-						for (size_t i = 1; i < fields.size(); i++) {
-							std::string joinkey = header[i];
-							std::string joinval = fields[i];
-							int attr_type = mvt_string;
+							int attr_type;
+							const char *joinval;
+							for (size_t i = 1; csv_join_column(row, attr_type, joinval); i++) {
+								std::string const &joinkey = join->header[i];
 
-							if (joinval.size() > 0) {
-								if (joinval[0] == '"') {
-									joinval = csv_dequote(joinval);
-								} else if (is_number(joinval)) {
-									attr_type = mvt_double;
+								if (attr_type == mvt_null && !pe) {
+									attr_type = mvt_string;  // empty string
 								}
-							} else if (pe) {
-								attr_type = mvt_null;
-							}
 
-							const char *sjoinkey = joinkey.c_str();
+								const char *sjoinkey = joinkey.c_str();
 
-							if (!exclude_all && exclude.count(joinkey) == 0 && exclude_attributes.count(joinkey) == 0 && attr_type != mvt_null) {
-								mvt_value outval;
-								if (attr_type == mvt_string) {
-									outval.type = mvt_string;
-									outval.string_value = joinval;
-								} else {
-									outval.type = mvt_double;
-									outval.numeric_value.double_value = atof(joinval.c_str());
-								}
+								if (!exclude_all && exclude.count(joinkey) == 0 && exclude_attributes.count(joinkey) == 0 && attr_type != mvt_null) {
+									mvt_value outval;
+									if (attr_type == mvt_string) {
+										outval.type = mvt_string;
+										outval.string_value = joinval;
+									} else {
+										outval.type = mvt_double;
+										outval.numeric_value.double_value = atof(joinval);
+									}
 
-								auto fa = attributes.find(sjoinkey);
-								if (fa != attributes.end()) {
-									attributes.erase(fa);
-								}
+									auto fa = attributes.find(sjoinkey);
+									if (fa != attributes.end()) {
+										attributes.erase(fa);
+									}
 
-								type_and_string tas;
-								tas.type = outval.type;
-								tas.string = joinval;
+									type_and_string joined;
+									joined.type = outval.type;
+									joined.string = joinval;
 
-								// Convert from double to int if the joined attribute is an integer
-								outval = stringified_to_mvt_value(outval.type, joinval.c_str());
+									// Convert from double to int if the joined attribute is an integer
+									outval = stringified_to_mvt_value(outval.type, joinval);
 
-								attributes.insert(std::pair<std::string, std::pair<mvt_value, type_and_string>>(joinkey, std::pair<mvt_value, type_and_string>(outval, tas)));
-								key_order.push_back(joinkey);
+									attributes.insert(std::pair<std::string, std::pair<mvt_value, type_and_string>>(joinkey, std::pair<mvt_value, type_and_string>(outval, joined)));
+									key_order.push_back(joinkey);
+								}
 							}
 						}
 					}
 				}
-			}
 
-			if (matched || !ifmatched) {
+				if (!matched && ifmatched) {
+					continue;
+				}
+
 				if (file_keys == layermap.end()) {
 					layermap.insert(std::pair<std::string, layermap_entry>(layer.name, layermap_entry(layermap.size())));
 					file_keys = layermap.find(layer.name);
@@ -300,34 +365,34 @@ void handle(std::string message, int z, unsigned x, unsigned y, std::map<std::st
 						attributes.erase(fa);
 					}
 				}
+			}
 
-				outfeature.type = feat.type;
-				outfeature.geometry = feat.geometry;
+			outfeature.type = feat.type;
+			outfeature.geometry = std::move(feat.geometry);
 
-				if (layer.extent != outlayer.extent) {
-					for (size_t i = 0; i < outfeature.geometry.size(); i++) {
-						outfeature.geometry[i].x = outfeature.geometry[i].x * outlayer.extent / layer.extent;
-						outfeature.geometry[i].y = outfeature.geometry[i].y * outlayer.extent / layer.extent;
-					}
+			if (layer.extent != outlayer.extent) {
+				for (size_t i = 0; i < outfeature.geometry.size(); i++) {
+					outfeature.geometry[i].x = outfeature.geometry[i].x * outlayer.extent / layer.extent;
+					outfeature.geometry[i].y = outfeature.geometry[i].y * outlayer.extent / layer.extent;
 				}
+			}
 
-				features_added++;
-				outlayer.features.push_back(outfeature);
+			features_added++;
+			outlayer.features.push_back(std::move(outfeature));
 
-				if (z < file_keys->second.minzoom) {
-					file_keys->second.minzoom = z;
-				}
-				if (z > file_keys->second.maxzoom) {
-					file_keys->second.maxzoom = z;
-				}
+			if (z < file_keys->second.minzoom) {
+				file_keys->second.minzoom = z;
+			}
+			if (z > file_keys->second.maxzoom) {
+				file_keys->second.maxzoom = z;
+			}
 
-				if (feat.type == mvt_point) {
-					file_keys->second.points++;
-				} else if (feat.type == mvt_linestring) {
-					file_keys->second.lines++;
-				} else if (feat.type == mvt_polygon) {
-					file_keys->second.polygons++;
-				}
+			if (feat.type == mvt_point) {
+				file_keys->second.points++;
+			} else if (feat.type == mvt_linestring) {
+				file_keys->second.lines++;
+			} else if (feat.type == mvt_polygon) {
+				file_keys->second.polygons++;
 			}
 		}
 	}
@@ -474,13 +539,12 @@ struct arg {
 
 	std::map<std::string, layermap_entry> *layermap = NULL;
 
-	std::vector<std::string> *header = NULL;
-	std::map<std::string, std::vector<std::string>> *mapping = NULL;
+	csv_join const *join = NULL;
 	std::set<std::string> *exclude = NULL;
 	std::set<std::string> *keep_layers = NULL;
 	std::set<std::string> *remove_layers = NULL;
 	int ifmatched = 0;
-	json_object *filter = NULL;
+	compiled_filter *filter = NULL;
 };
 
 void *join_worker(void *v) {
@@ -490,7 +554,7 @@ void *join_worker(void *v) {
 		mvt_tile tile;
 
 		for (size_t i = 0; i < ai->second.size(); i++) {
-			handle(ai->second[i], ai->first.z, ai->first.x, ai->first.y, *(a->layermap), *(a->header), *(a->mapping), *(a->exclude), *(a->keep_layers), *(a->remove_layers), a->ifmatched, tile, a->filter);
+			handle(ai->second[i], ai->first.z, ai->first.x, ai->first.y, *(a->layermap), a->join, *(a->exclude), *(a->keep_layers), *(a->remove_layers), a->ifmatched, tile, a->filter);
 		}
 
 		ai->second.clear();
@@ -525,7 +589,7 @@ void *join_worker(void *v) {
 	return NULL;
 }
 
-void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<std::map<std::string, layermap_entry>> &layermaps, sqlite3 *outdb, const char *outdir, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, json_object *filter) {
+void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<std::map<std::string, layermap_entry>> &layermaps, sqlite3 *outdb, const char *outdir, csv_join const *join, std::set<std::string> &exclude, int ifmatched, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, compiled_filter *filter) {
 	pthread_t pthreads[CPUS];
 	std::vector<arg> args;
 
@@ -533,8 +597,7 @@ void handle_tasks(std::map<zxy, std::vector<std::string>> &tasks, std::vector<st
 		args.push_back(arg());
 
 		args[i].layermap = &layermaps[i];
-		args[i].header = &header;
-		args[i].mapping = &mapping;
+		args[i].join = join;
 		args[i].exclude = &exclude;
 		args[i].keep_layers = &keep_layers;
 		args[i].remove_layers = &remove_layers;
@@ -620,7 +683,7 @@ void handle_vector_layers(json_object *vector_layers, std::map<std::string, laye
 	}
 }
 
-void decode(struct reader *readers, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, struct stats *st, std::vector<std::string> &header, std::map<std::string, std::vector<std::string>> &mapping, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, json_object *filter, std::map<std::string, std::string> &attribute_descriptions, std::string &generator_options) {
+void decode(struct reader *readers, std::map<std::string, layermap_entry> &layermap, sqlite3 *outdb, const char *outdir, struct stats *st, csv_join const *join, std::set<std::string> &exclude, int ifmatched, std::string &attribution, std::string &description, std::set<std::string> &keep_layers, std::set<std::string> &remove_layers, std::string &name, compiled_filter *filter, std::map<std::string, std::string> &attribute_descriptions, std::string &generator_options) {
 	std::vector<std::map<std::string, layermap_entry>> layermaps;
 	for (size_t i = 0; i < CPUS; i++) {
 		layermaps.push_back(std::map<std::string, layermap_entry>());
@@ -665,7 +728,7 @@ void decode(struct reader *readers, std::map<std::string, layermap_entry> &layer
 
 		if (readers == NULL || readers->zoom != r->zoom || readers->x != r->x || readers->y != r->y) {
 			if (tasks.size() > 100 * CPUS) {
-				handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, ifmatched, keep_layers, remove_layers, filter);
+				handle_tasks(tasks, layermaps, outdb, outdir, join, exclude, ifmatched, keep_layers, remove_layers, filter);
 				tasks.clear();
 			}
 		}
@@ -714,7 +777,7 @@ void decode(struct reader *readers, std::map<std::string, layermap_entry> &layer
 	st->minlat = min(minlat, st->minlat);
 	st->maxlat = max(maxlat, st->maxlat);
 
-	handle_tasks(tasks, layermaps, outdb, outdir, header, mapping, exclude, ifmatched, keep_layers, remove_layers, filter);
+	handle_tasks(tasks, layermaps, outdb, outdir, join, exclude, ifmatched, keep_layers, remove_layers, filter);
 	layermap = merge_layermaps(layermaps);
 
 	struct reader *next;
@@ -860,6 +923,7 @@ int main(int argc, char **argv) {
 	char *out_dir = NULL;
 	sqlite3 *outdb = NULL;
 	char *csv = NULL;
+	const char *csv_cache = NULL;
 	int force = 0;
 	int ifmatched = 0;
 	json_object *filter = NULL;
@@ -874,8 +938,7 @@ int main(int argc, char **argv) {
 		CPUS = 1;
 	}
 
-	std::vector<std::string> header;
-	std::map<std::string, std::vector<std::string>> mapping;
+	csv_join *join = NULL;
 
 	std::set<std::string> exclude;
 	std::set<std::string> keep_layers;
@@ -903,6 +966,7 @@ int main(int argc, char **argv) {
 		{"feature-filter-file", required_argument, 0, 'J'},
 		{"feature-filter", required_argument, 0, 'j'},
 		{"rename-layer", required_argument, 0, 'R'},
+		{"csv-cache", required_argument, 0, '~'},
 
 		{"no-tile-size-limit", no_argument, &pk, 1},
 		{"no-tile-compression", no_argument, &pC, 1},
@@ -929,7 +993,8 @@ int main(int argc, char **argv) {
 
 	std::string commandline = format_commandline(argc, argv);
 
-	while ((i = getopt_long(argc, argv, getopt_str.c_str(), long_options, NULL)) != -1) {
+	int option_index = 0;
+	while ((i = getopt_long(argc, argv, getopt_str.c_str(), long_options, &option_index)) != -1) {
 		switch (i) {
 		case 0:
 			break;
@@ -1000,7 +1065,6 @@ int main(int argc, char **argv) {
 			}
 
 			csv = optarg;
-			readcsv(csv, header, mapping);
 			break;
 
 		case 'x':
@@ -1035,6 +1099,17 @@ int main(int argc, char **argv) {
 			quiet = true;
 			break;
 
+		case '~': {
+			const char *opt = long_options[option_index].name;
+			if (strcmp(opt, "csv-cache") == 0) {
+				csv_cache = optarg;
+			} else {
+				fprintf(stderr, "%s: Unrecognized option --%s\n", argv[0], opt);
+				exit(EXIT_FAILURE);
+			}
+			break;
+		}
+
 		default:
 			usage(argv);
 		}
@@ -1054,6 +1129,11 @@ int main(int argc, char **argv) {
 		usage(argv);
 	}
 
+	if (csv_cache != NULL && csv == NULL) {
+		fprintf(stderr, "%s: --csv-cache requires -c\n", argv[0]);
+		exit(EXIT_FAILURE);
+	}
+
 	if (minzoom > maxzoom) {
 		fprintf(stderr, "%s: Minimum zoom -Z%d cannot be greater than maxzoom -z%d\n", argv[0], minzoom, maxzoom);
 		exit(EXIT_FAILURE);
@@ -1098,7 +1178,16 @@ int main(int argc, char **argv) {
 	std::map<std::string, std::string> attribute_descriptions;
 	std::string generator_options;
 
-	decode(readers, layermap, outdb, out_dir, &st, header, mapping, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name, filter, attribute_descriptions, generator_options);
+	if (csv != NULL) {
+		join = read_csv_join(csv, csv_cache);
+	}
+
+	compiled_filter *cfilter = NULL;
+	if (filter != NULL) {
+		cfilter = compile_filter(filter);
+	}
+
+	decode(readers, layermap, outdb, out_dir, &st, join, exclude, ifmatched, attribution, description, keep_layers, remove_layers, name, cfilter, attribute_descriptions, generator_options);
 
 	if (set_attribution.size() != 0) {
 		attribution = set_attribution;
@@ -1131,8 +1220,12 @@ int main(int argc, char **argv) {
 	}
 
 	if (filter != NULL) {
+		delete cfilter;
 		json_free(filter);
 	}
+	if (join != NULL) {
+		delete join;
+	}
 
 	return 0;
 }
@@ -9,6 +9,7 @@
 #include <vector>
 #include <map>
 #include <set>
+#include <unordered_map>
 #include <algorithm>
 #include <stdio.h>
 #include <stdlib.h>
@@ -45,7 +46,10 @@ extern "C" {
 #include "jsonpull/jsonpull.h"
 }
 
+#include "binary_filter.hpp"
 #include "plugin.hpp"
+#include "trace.hpp"
+#include "checkpoint.hpp"
 
 #define CMD_BITS 3
 
@@ -189,6 +193,101 @@ int coalindexcmp(const struct coalesce *c1, const struct coalesce *c2) {
 	return cmp;
 }
 
+static unsigned long long coalesce_hash(struct coalesce const &c) {
+	unsigned long long h = 14695981039346656037ULL;
+	auto mix = [&h](unsigned long long v) {
+		h ^= v;
+		h *= 1099511628211ULL;
+	};
+	auto mix_string = [&mix](std::string const &str) {
+		for (size_t i = 0; i < str.size(); i++) {
+			mix((unsigned char) str[i]);
+		}
+		mix(0x100);
+	};
+	auto mix_pooled = [&mix](const char *str) {
+		for (; *str != '\0'; str++) {
+			mix((unsigned char) *str);
+		}
+		mix(0x100);
+	};
+
+	mix(c.type);
+	mix(c.has_id);
+	if (c.has_id) {
+		mix(c.id);
+	}
+
+	// By content rather than offset, since features may come from different segments
+	for (size_t i = 0; i < c.keys.size(); i++) {
+		mix_pooled(c.stringpool + c.keys[i] + 1);
+		mix(c.stringpool[c.values[i]]);
+		mix_pooled(c.stringpool + c.values[i] + 1);
+	}
+
+	for (size_t i = 0; i < c.full_keys.size(); i++) {
+		mix_string(c.full_keys[i]);
+		mix(c.full_values[i].type);
+		mix_string(c.full_values[i].s);
+	}
+
+	return h;
+}
+
+// Put features into the order of coalindexcmp, for --reorder, without a
+// comparison sort of all of them. Features that coalcmp considers equal
+// are grouped by hashing, so only one feature from each group goes through
+// the expensive comparison, and the features within each group are then
+// ordered by their index and geometry as coalindexcmp would.
+static void reorder_features(std::vector<coalesce> &features) {
+	std::vector<std::vector<size_t>> groups;
+	std::unordered_map<unsigned long long, std::vector<size_t>> by_hash;
+
+	for (size_t i = 0; i < features.size(); i++) {
+		std::vector<size_t> &candidates = by_hash[coalesce_hash(features[i])];
+
+		size_t g;
+		for (g = 0; g < candidates.size(); g++) {
+			if (coalcmp(&features[groups[candidates[g]][0]], &features[i]) == 0) {
+				break;
+			}
+		}
+
+		if (g < candidates.size()) {
+			groups[candidates[g]].push_back(i);
+		} else {
+			candidates.push_back(groups.size());
+			groups.push_back(std::vector<size_t>(1, i));
+		}
+	}
+
+	std::vector<size_t> order(groups.size());
+	for (size_t g = 0; g < groups.size(); g++) {
+		order[g] = g;
+	}
+	std::sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+		return coalcmp(&features[groups[a][0]], &features[groups[b][0]]) < 0;
+	});
+
+	std::vector<coalesce> out;
+	out.reserve(features.size());
+	for (size_t g : order) {
+		std::vector<size_t> &members = groups[g];
+		std::sort(members.begin(), members.end(), [&](size_t a, size_t b) {
+			if (features[a].index != features[b].index) {
+				return features[a].index < features[b].index;
+			}
+			return features[a].geom < features[b].geom;
+		});
+
+		for (size_t i : members) {
+			out.push_back(std::move(features[i]));
+		}
+	}
+
+	features.swap(out);
+}
+
 mvt_value retrieve_string(long long off, char *stringpool, int *otype) {
 	int type = stringpool[off];
 	char *s = stringpool + off + 1;
@@ -214,12 +313,16 @@ void decode_meta(std::vector<long long> const &metakeys, std::vector<long long>
 static int metacmp(const std::vector<long long> &keys1, const std::vector<long long> &values1, char *stringpool1, const std::vector<long long> &keys2, const std::vector<long long> &values2, char *stringpool2) {
 	size_t i;
 	for (i = 0; i < keys1.size() && i < keys2.size(); i++) {
-		mvt_value key1 = retrieve_string(keys1[i], stringpool1, NULL);
-		mvt_value key2 = retrieve_string(keys2[i], stringpool2, NULL);
+		// The string pool is deduplicated, so the same offset is the same string
+		if (stringpool1 == stringpool2 && keys1[i] == keys2[i] && values1[i] == values2[i]) {
+			continue;
+		}
 
-		if (key1.string_value < key2.string_value) {
+		// Keys are always strings, so compare them as they are in the pool
+		int kcmp = strcmp(stringpool1 + keys1[i] + 1, stringpool2 + keys2[i] + 1);
+		if (kcmp < 0) {
 			return -1;
-		} else if (key1.string_value > key2.string_value) {
+		} else if (kcmp > 0) {
 			return 1;
 		}
 
@@ -249,7 +352,7 @@ static int metacmp(const std::vector<long long> &keys1, const std::vector<long l
 	}
 }
 
-void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int *within, std::atomic<long long> *geompos, FILE **geomfile, const char *fname, signed char t, int layer, long long metastart, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, long long extent) {
+void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, unsigned tx, unsigned ty, int buffer, int *within, std::atomic<long long> *geompos, FILE **geomfile, const char *fname, signed char t, int layer, long long metastart, signed char feature_minzoom, int child_shards, int max_zoom_increment, long long seq, int tippecanoe_minzoom, int tippecanoe_maxzoom, int segment, unsigned *initial_x, unsigned *initial_y, std::vector<long long> &metakeys, std::vector<long long> &metavals, bool has_id, unsigned long long id, unsigned long long index, long long extent, std::vector<bool> const *children) {
 	if (geom.size() > 0 && (nextzoom <= maxzoom || additional[A_EXTEND_ZOOMS])) {
 		int xo, yo;
 		int span = 1 << (nextzoom - z);
@@ -287,16 +390,56 @@ void rewrite(drawvec &geom, int z, int nextzoom, int maxzoom, long long *bbox, u
 			sy = ty << (32 - z);
 		}
 
+		// With --pre-clip-children, each child gets only the part of the
+		// geometry that it will keep, instead of a copy of all of it
+		bool preclip = additional[A_PRE_CLIP_CHILDREN] && !prevent[P_CLIPPING] && !prevent[P_DUPLICATION];
+
 		drawvec geom2;
-		for (size_t i = 0; i < geom.size(); i++) {
-			geom2.push_back(draw(geom[i].op, SHIFT_RIGHT(geom[i].x + sx), SHIFT_RIGHT(geom[i].y + sy)));
+		if (!preclip) {
+			for (size_t i = 0; i < geom.size(); i++) {
+				geom2.push_back(draw(geom[i].op, SHIFT_RIGHT(geom[i].x + sx), SHIFT_RIGHT(geom[i].y + sy)));
+			}
 		}
 
 		for (xo = bbox2[0]; xo <= bbox2[2]; xo++) {
 			for (yo = bbox2[1]; yo <= bbox2[3]; yo++) {
+				// Only some of the children are wanted if only some tiles are being made
+				if (children != NULL && !(*children)[xo * span + yo]) {
+					continue;
+				}
+
 				unsigned jx = tx * span + xo;
 				unsigned jy = ty * span + yo;
 
+				if (preclip) {
+					// The child's bounds, with its buffer, relative to this tile
+					long long area = 1LL << (32 - nextzoom);
+					long long clip_buffer = buffer * area / 256;
+					long long x1 = xo * area - clip_buffer;
+					long long y1 = yo * area - clip_buffer;
+					long long x2 = (xo + 1) * area + clip_buffer;
+					long long y2 = (yo + 1) * area + clip_buffer;
+
+					drawvec clipped;
+					if (t == VT_LINE) {
+						clipped = clip_lines(geom, x1, y1, x2, y2);
+					} else if (t == VT_POLYGON) {
+						clipped = simple_clip_poly(geom, x1, y1, x2, y2);
+					} else if (t == VT_POINT) {
+						clipped = clip_point(geom, x1, y1, x2, y2);
+					}
+					clipped = remove_noop(clipped, t, 0);
+
+					if (clipped.size() == 0) {
+						continue;
+					}
+
+					geom2.clear();
+					for (size_t i = 0; i < clipped.size(); i++) {
+						geom2.push_back(draw(clipped[i].op, SHIFT_RIGHT(clipped[i].x + sx), SHIFT_RIGHT(clipped[i].y + sy)));
+					}
+				}
+
 				// j is the shard that the child tile's data is being written to.
 				//
 				// Be careful: We can't jump more zoom levels than max_zoom_increment
@@ -388,13 +531,108 @@ struct partial {
 	std::map<std::string, accum_state> attribute_accum_state;
 };
 
+// Containers that write_tile empties and refills for every tile and every
+// retry. Each tiling thread keeps one set for all the tiles it makes,
+// so that they keep their capacity instead of being reallocated each time.
+struct tile_scratch {
+	std::vector<struct partial> partials{};
+	std::vector<unsigned long long> indices{};
+	std::vector<long long> extents{};
+	drawvec shared_nodes{};
+	std::vector<int> within{};
+	std::vector<std::atomic<long long>> geompos{};
+	std::vector<size_t> order{};
+	std::vector<double> costs{};
+	std::vector<bool> children{};  // which of the next zoom's tiles are wanted, if not all
+	std::vector<off_t> shard_start{};  // where each child shard stood before the tile
+
+	// Partials from earlier tiles, emptied but still holding the storage
+	// of their geometries and attributes for new_partial() to reuse
+	std::vector<struct partial> spare_partials{};
+	serial_feature sf{};  // the feature being read
+};
+
+// Spares are only kept up to a limit, and not ones whose geometries have grown
+// large, so that one huge tile doesn't leave its thread holding all of its storage
+#define MAX_SPARE_PARTIALS 4096
+#define MAX_SPARE_GEOMETRY 1024  // draws
+
+// Put the partials aside to be reused
+static void recycle_partials(tile_scratch *scratch) {
+	for (auto &p : scratch->partials) {
+		if (scratch->spare_partials.size() >= MAX_SPARE_PARTIALS) {
+			break;
+		}
+
+		// Only the first geometry is reused
+		if (p.geoms.size() == 0 || p.geoms[0].capacity() > MAX_SPARE_GEOMETRY) {
+			continue;
+		}
+		p.geoms.resize(1);
+
+		scratch->spare_partials.push_back(std::move(p));
+	}
+
+	if (scratch->partials.capacity() > MAX_SPARE_PARTIALS) {
+		std::vector<struct partial>().swap(scratch->partials);
+	} else {
+		scratch->partials.clear();
+	}
+}
+
+// Add an empty partial with one empty geometry, taking the storage
+// of a spare one if there is one
+static partial &new_partial(tile_scratch *scratch) {
+	scratch->partials.emplace_back();
+	partial &p = scratch->partials.back();
+
+	if (scratch->spare_partials.size() > 0) {
+		partial &spare = scratch->spare_partials.back();
+
+		p.geoms.swap(spare.geoms);
+		p.keys.swap(spare.keys);
+		p.values.swap(spare.values);
+		p.full_keys.swap(spare.full_keys);
+		p.full_values.swap(spare.full_values);
+		scratch->spare_partials.pop_back();
+
+		p.keys.clear();
+		p.values.clear();
+		p.full_keys.clear();
+		p.full_values.clear();
+	}
+
+	p.geoms.resize(1);
+	p.geoms[0].clear();
+	return p;
+}
+
 struct partial_arg {
 	std::vector<struct partial> *partials = NULL;
-	int task = 0;
-	int tasks = 0;
+	std::vector<size_t> *order = NULL;  // indices into partials, most expensive first
+	std::atomic<size_t> *next = NULL;   // position in order of the next partial to claim
+	simplify_pool *pool = NULL;  // NULL if this is the tile's only thread
 	drawvec *shared_nodes;
 };
 
+// A rough estimate of how long partial_feature_worker will take on a
+// partial: polygons cost more per vertex than lines because of the
+// cleaning after simplification, and points hardly cost anything.
+static double partial_cost(struct partial const &p) {
+	size_t vertices = 0;
+	for (size_t i = 0; i < p.geoms.size(); i++) {
+		vertices += p.geoms[i].size();
+	}
+
+	if (p.t == VT_POLYGON) {
+		return 1 + 3.0 * vertices;
+	} else if (p.t == VT_LINE) {
+		return 1 + 1.0 * vertices;
+	} else {
+		return 1 + 0.1 * vertices;
+	}
+}
+
 drawvec revive_polygon(drawvec &geom, double area, int z, int detail) {
 	// From area in world coordinates to area in tile coordinates
 	long long divisor = 1LL << (32 - detail - z);
@@ -440,7 +678,11 @@ void *partial_feature_worker(void *v) {
 	struct partial_arg *a = (struct partial_arg *) v;
 	std::vector<struct partial> *partials = a->partials;
 
-	for (size_t i = a->task; i < (*partials).size(); i += a->tasks) {
+	// Claim partials one at a time, so that the threads that finish early
+	// pick up more of the work instead of waiting on a giant feature
+	size_t n;
+	while ((n = (*a->next)++) < a->order->size()) {
+		size_t i = (*a->order)[n];
 		drawvec geom;
 
 		for (size_t j = 0; j < (*partials)[i].geoms.size(); j++) {
@@ -476,7 +718,7 @@ void *partial_feature_worker(void *v) {
 				}
 
 				if (!already_marked) {
-					drawvec ngeom = simplify_lines(geom, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), (*partials)[i].simplification, t == VT_POLYGON ? 4 : 0, *(a->shared_nodes));
+					drawvec ngeom = simplify_lines(geom, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), (*partials)[i].simplification, t == VT_POLYGON ? 4 : 0, *(a->shared_nodes), a->pool);
 
 					if (t != VT_POLYGON || ngeom.size() >= 3) {
 						geom = ngeom;
@@ -524,6 +766,11 @@ void *partial_feature_worker(void *v) {
 		(*partials)[i].geoms = geoms;
 	}
 
+	// Help with any large geometries that the other threads are still simplifying
+	if (a->pool != NULL) {
+		simplify_pool_help(a->pool);
+	}
+
 	return NULL;
 }
 
@@ -910,7 +1157,7 @@ bool find_common_edges(std::vector<partial> &partials, int z, int line_detail, d
 			}
 		}
 		if (!(prevent[P_SIMPLIFY] || (z == maxzoom && prevent[P_SIMPLIFY_LOW]) || (z < maxzoom && additional[A_GRID_LOW_ZOOMS]))) {
-			simplified_arcs[ai->second] = simplify_lines(dv, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), simplification, 4, drawvec());
+			simplified_arcs[ai->second] = simplify_lines(dv, z, line_detail, !(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), simplification, 4, drawvec(), NULL);
 		} else {
 			simplified_arcs[ai->second] = dv;
 		}
@@ -1221,7 +1468,10 @@ struct write_tile_args {
 	bool still_dropping = false;
 	int wrote_zoom = 0;
 	size_t tiling_seg = 0;
-	struct json_object *filter = NULL;
+	compiled_filter *filter = NULL;
+	tile_scratch *scratch = NULL;  // used only by this thread
+	tile_mask const *mask = NULL;  // if only some tiles are being made
+	int extend_from = 0;  // maxzoom before --extend-zooms-if-still-dropping raised it
 };
 
 bool clip_to_tile(serial_feature &sf, int z, long long buffer) {
@@ -1319,11 +1569,60 @@ void remove_attributes(serial_feature &sf, std::set<std::string> const &exclude_
 	}
 }
 
-serial_feature next_feature(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, std::atomic<long long> *along, long long alongminus, int buffer, int *within, bool *first_time, FILE **geomfile, std::atomic<long long> *geompos, std::atomic<double> *oprogress, double todo, const char *fname, int child_shards, struct json_object *filter, const char *stringpool, long long *pool_off, std::vector<std::vector<std::string>> *layer_unmaps) {
+// Where write_tile's time went in making one tile, for --trace
+struct tile_timing {
+	int z = 0;
+	unsigned x = 0;
+	unsigned y = 0;
+	double start = 0;
+	double lap = 0;
+
+	// In microseconds, summed over all attempts at making the tile.
+	// deserialize is reading the features, including clip and rewrite.
+	double deserialize = 0;
+	double clip = 0;
+	double rewrite = 0;  // writing out features for the next zoom
+	double simplify = 0;
+	double coalesce = 0;
+	double encode = 0;
+	double compress = 0;
+
+	size_t attempts = 0;
+	long long size = -1;  // of the tile as written, or -1 if it wasn't
+
+	tile_timing(int z_, unsigned x_, unsigned y_)
+	    : z(z_), x(x_), y(y_) {
+		if (tracing) {
+			start = lap = trace_now();
+		}
+	}
+
+	// Charge the time since the last lap to one of the phases
+	void add(double &phase) {
+		if (tracing) {
+			double now = trace_now();
+			phase += now - lap;
+			lap = now;
+		}
+	}
+
+	~tile_timing() {
+		if (tracing) {
+			std::string name = ssprintf("%d/%u/%u", z, x, y);
+			std::string args = ssprintf("\"z\":%d,\"x\":%u,\"y\":%u,\"deserialize\":%.3f,\"clip\":%.3f,\"rewrite\":%.3f,\"simplify\":%.3f,\"coalesce\":%.3f,\"encode\":%.3f,\"compress\":%.3f,\"retries\":%zu,\"size\":%lld",
+					    z, x, y, deserialize, clip, rewrite, simplify, coalesce, encode, compress, attempts > 0 ? attempts - 1 : 0, size);
+			trace_span(name.c_str(), "tile", start, args);
+		}
+	}
+};
+
+// Read the next feature that this tile needs into sf, writing features out
+// for the next zoom level along the way, or leave sf.t < 0 at the end
+void next_feature(char *geoms, std::atomic<long long> *geompos_in, char *metabase, long long *meta_off, int z, unsigned tx, unsigned ty, unsigned *initial_x, unsigned *initial_y, long long *original_features, long long *unclipped_features, long long *carried_features, int nextzoom, int maxzoom, int minzoom, int max_zoom_increment, size_t pass, size_t passes, std::atomic<long long> *along, long long alongminus, int buffer, int *within, bool *first_time, FILE **geomfile, std::atomic<long long> *geompos, std::atomic<double> *oprogress, double todo, const char *fname, int child_shards, compiled_filter *filter, const char *stringpool, long long *pool_off, std::vector<std::vector<std::string>> *layer_unmaps, tile_timing *timing, std::vector<bool> const *children, serial_feature &sf) {
 	while (1) {
-		serial_feature sf = deserialize_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y);
+		deserialize_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, sf);
 		if (sf.t < 0) {
-			return sf;
+			return;
 		}
 
 		double progress = floor(((((*geompos_in + *along - alongminus) / (double) todo) + (pass - (2 - passes))) / passes + z) / (maxzoom + 1) * 1000) / 10;
@@ -1336,7 +1635,12 @@ serial_feature next_feature(FILE *geoms, std::atomic<long long> *geompos_in, cha
 
 		(*original_features)++;
 
-		if (clip_to_tile(sf, z, buffer)) {
+		double clip_start = tracing ? trace_now() : 0;
+		bool clipped_away = clip_to_tile(sf, z, buffer);
+		if (tracing) {
+			timing->clip += trace_now() - clip_start;
+		}
+		if (clipped_away) {
 			continue;
 		}
 
@@ -1346,7 +1650,15 @@ serial_feature next_feature(FILE *geoms, std::atomic<long long> *geompos_in, cha
 
 		if (*first_time && pass == 1) { /* only write out the next zoom once, even if we retry */
 			if (sf.tippecanoe_maxzoom == -1 || sf.tippecanoe_maxzoom >= nextzoom) {
-				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, within, geompos, geomfile, fname, sf.t, sf.layer, sf.metapos, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.extent);
+				if (sf.geometry.size() > 0) {
+					(*carried_features)++;
+				}
+
+				double rewrite_start = tracing ? trace_now() : 0;
+				rewrite(sf.geometry, z, nextzoom, maxzoom, sf.bbox, tx, ty, buffer, within, geompos, geomfile, fname, sf.t, sf.layer, sf.metapos, sf.feature_minzoom, child_shards, max_zoom_increment, sf.seq, sf.tippecanoe_minzoom, sf.tippecanoe_maxzoom, sf.segment, initial_x, initial_y, sf.keys, sf.values, sf.has_id, sf.id, sf.index, sf.extent, children);
+				if (tracing) {
+					timing->rewrite += trace_now() - rewrite_start;
+				}
 			}
 		}
 
@@ -1361,57 +1673,37 @@ serial_feature next_feature(FILE *geoms, std::atomic<long long> *geompos_in, cha
 			continue;
 		}
 
-		if (filter != NULL) {
-			std::map<std::string, mvt_value> attributes;
+		// Filters that don't depend on the zoom level were already applied while reading
+		if (filter != NULL && filter->uses_zoom((*layer_unmaps)[sf.segment][sf.layer])) {
+			filter_attributes fa;
 			std::string layername = (*layer_unmaps)[sf.segment][sf.layer];
 			std::set<std::string> exclude_attributes;
 
+			filter->start(fa);
+
+			// Only the attributes that the filter refers to need to be converted
 			for (size_t i = 0; i < sf.keys.size(); i++) {
-				std::string key = stringpool + pool_off[sf.segment] + sf.keys[i] + 1;
+				int slot = filter->pool_slot(pool_off[sf.segment] + sf.keys[i]);
 
-				serial_val sv;
-				sv.type = (stringpool + pool_off[sf.segment])[sf.values[i]];
-				sv.s = stringpool + pool_off[sf.segment] + sf.values[i] + 1;
+				if (slot >= 0) {
+					int type = (stringpool + pool_off[sf.segment])[sf.values[i]];
+					const char *s = stringpool + pool_off[sf.segment] + sf.values[i] + 1;
 
-				mvt_value val = stringified_to_mvt_value(sv.type, sv.s.c_str());
-				attributes.insert(std::pair<std::string, mvt_value>(key, val));
+					fa.set_copy(slot, stringified_to_mvt_value(type, s));
+				}
 			}
 
 			for (size_t i = 0; i < sf.full_keys.size(); i++) {
-				std::string key = sf.full_keys[i];
-				mvt_value val = stringified_to_mvt_value(sf.full_values[i].type, sf.full_values[i].s.c_str());
+				int slot = filter->slot(sf.full_keys[i]);
 
-				attributes.insert(std::pair<std::string, mvt_value>(key, val));
-			}
-
-			if (sf.has_id) {
-				mvt_value v;
-				v.type = mvt_uint;
-				v.numeric_value.uint_value = sf.id;
-
-				attributes.insert(std::pair<std::string, mvt_value>("$id", v));
-			}
-
-			mvt_value v;
-			v.type = mvt_string;
-
-			if (sf.t == mvt_point) {
-				v.string_value = "Point";
-			} else if (sf.t == mvt_linestring) {
-				v.string_value = "LineString";
-			} else if (sf.t == mvt_polygon) {
-				v.string_value = "Polygon";
+				if (slot >= 0) {
+					fa.set_copy(slot, stringified_to_mvt_value(sf.full_values[i].type, sf.full_values[i].s.c_str()));
+				}
 			}
 
-			attributes.insert(std::pair<std::string, mvt_value>("$type", v));
-
-			mvt_value v2;
-			v2.type = mvt_uint;
-			v2.numeric_value.uint_value = z;
-
-			attributes.insert(std::pair<std::string, mvt_value>("$zoom", v2));
+			filter->finish(fa, sf.has_id, sf.id, sf.t, z);
 
-			if (!evaluate(attributes, layername, filter, exclude_attributes)) {
+			if (!filter->evaluate(fa, layername, exclude_attributes)) {
 				continue;
 			}
 
@@ -1442,12 +1734,12 @@ serial_feature next_feature(FILE *geoms, std::atomic<long long> *geompos_in, cha
 			}
 		}
 
-		return sf;
+		return;
 	}
 }
 
 struct run_prefilter_args {
-	FILE *geoms = NULL;
+	char *geoms = NULL;
 	std::atomic<long long> *geompos_in = NULL;
 	char *metabase = NULL;
 	long long *meta_off = NULL;
@@ -1458,6 +1750,7 @@ struct run_prefilter_args {
 	unsigned *initial_y = 0;
 	long long *original_features = 0;
 	long long *unclipped_features = 0;
+	long long *carried_features = 0;
 	int nextzoom = 0;
 	int maxzoom = 0;
 	int minzoom = 0;
@@ -1476,22 +1769,68 @@ struct run_prefilter_args {
 	const char *fname = 0;
 	int child_shards = 0;
 	std::vector<std::vector<std::string>> *layer_unmaps = NULL;
+	tile_timing *timing = NULL;
+	std::vector<bool> const *children = NULL;
 	char *stringpool = NULL;
 	long long *pool_off = NULL;
 	FILE *prefilter_fp = NULL;
-	struct json_object *filter = NULL;
+	bool persistent = false;
+	compiled_filter *filter = NULL;
 };
 
 void *run_prefilter(void *v) {
 	run_prefilter_args *rpa = (run_prefilter_args *) v;
 	json_writer state(rpa->prefilter_fp);
 
+	if (rpa->persistent) {
+		write_filter_tile_start(rpa->prefilter_fp, rpa->z, rpa->tx, rpa->ty);
+	}
+
+	serial_feature sf;
 	while (1) {
-		serial_feature sf = next_feature(rpa->geoms, rpa->geompos_in, rpa->metabase, rpa->meta_off, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->passes, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->first_time, rpa->geomfile, rpa->geompos, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards, rpa->filter, rpa->stringpool, rpa->pool_off, rpa->layer_unmaps);
+		next_feature(rpa->geoms, rpa->geompos_in, rpa->metabase, rpa->meta_off, rpa->z, rpa->tx, rpa->ty, rpa->initial_x, rpa->initial_y, rpa->original_features, rpa->unclipped_features, rpa->carried_features, rpa->nextzoom, rpa->maxzoom, rpa->minzoom, rpa->max_zoom_increment, rpa->pass, rpa->passes, rpa->along, rpa->alongminus, rpa->buffer, rpa->within, rpa->first_time, rpa->geomfile, rpa->geompos, rpa->oprogress, rpa->todo, rpa->fname, rpa->child_shards, rpa->filter, rpa->stringpool, rpa->pool_off, rpa->layer_unmaps, rpa->timing, rpa->children, sf);
 		if (sf.t < 0) {
 			break;
 		}
 
+		// Offset from tile coordinates back to world coordinates
+		unsigned sx = 0, sy = 0;
+		if (rpa->z != 0) {
+			sx = rpa->tx << (32 - rpa->z);
+			sy = rpa->ty << (32 - rpa->z);
+		}
+
+		if (additional[A_BINARY_FILTERS]) {
+			filter_feature ff;
+			ff.layer = (*(rpa->layer_unmaps))[sf.segment][sf.layer];
+			ff.type = sf.t;
+			ff.has_id = sf.has_id;
+			ff.id = sf.id;
+			ff.index = sf.index;
+			ff.sequence = sf.seq;
+			ff.extent = sf.extent;
+			ff.dropped = sf.dropped;
+
+			ff.geometry = sf.geometry;
+			for (size_t i = 0; i < ff.geometry.size(); i++) {
+				ff.geometry[i].x += sx;
+				ff.geometry[i].y += sy;
+			}
+
+			char *pool = rpa->stringpool + rpa->pool_off[sf.segment];
+			for (size_t i = 0; i < sf.keys.size(); i++) {
+				serial_val sv;
+				sv.type = pool[sf.values[i]];
+				sv.s = pool + sf.values[i] + 1;
+
+				ff.keys.push_back(pool + sf.keys[i] + 1);
+				ff.values.push_back(sv);
+			}
+
+			write_filter_feature(rpa->prefilter_fp, ff);
+			continue;
+		}
+
 		mvt_layer tmp_layer;
 		tmp_layer.extent = 1LL << 32;
 		tmp_layer.name = (*(rpa->layer_unmaps))[sf.segment][sf.layer];
@@ -1507,12 +1846,6 @@ void *run_prefilter(void *v) {
 		tmp_feature.has_id = sf.has_id;
 		tmp_feature.dropped = sf.dropped;
 
-		// Offset from tile coordinates back to world coordinates
-		unsigned sx = 0, sy = 0;
-		if (rpa->z != 0) {
-			sx = rpa->tx << (32 - rpa->z);
-			sy = rpa->ty << (32 - rpa->z);
-		}
 		for (size_t i = 0; i < tmp_feature.geometry.size(); i++) {
 			tmp_feature.geometry[i].x += sx;
 			tmp_feature.geometry[i].y += sy;
@@ -1524,6 +1857,11 @@ void *run_prefilter(void *v) {
 		layer_to_geojson(tmp_layer, 0, 0, 0, false, true, false, true, sf.index, sf.seq, sf.extent, true, state);
 	}
 
+	if (rpa->persistent) {
+		write_filter_tile_end(rpa->prefilter_fp, rpa->z, rpa->tx, rpa->ty, "prefilter");
+		return NULL;
+	}
+
 	if (fclose(rpa->prefilter_fp) != 0) {
 		if (errno == EPIPE) {
 			static bool warned = false;
@@ -1560,11 +1898,7 @@ void add_tilestats(std::string const &layername, int z, std::vector<std::map<std
 		exit(EXIT_FAILURE);
 	}
 
-	type_and_string attrib;
-	attrib.type = val.type;
-	attrib.string = val.s;
-
-	add_to_file_keys(fk->second.file_keys, key, attrib);
+	add_to_file_keys(fk->second.file_keys, key, val.type, val.s);
 }
 
 void preserve_attribute(attribute_op op, serial_feature &, char *stringpool, long long *pool_off, std::string &key, serial_val &val, partial &p) {
@@ -1716,7 +2050,34 @@ static bool line_is_too_small(drawvec const &geometry, int z, int detail) {
 	return true;
 }
 
-long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *metabase, char *stringpool, int z, unsigned tx, unsigned ty, int detail, int min_detail, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, FILE **geomfile, int minzoom, int maxzoom, double todo, std::atomic<long long> *along, long long alongminus, double gamma, int child_shards, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, std::atomic<int> *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, size_t passes, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, struct json_object *filter, write_tile_args *arg) {
+// Take back out everything that a tile wrote to its child shards
+static void discard_children(FILE **geomfile, int child_shards, std::vector<off_t> const &shard_start) {
+	for (int j = 0; j < child_shards; j++) {
+		off_t end = ftello(geomfile[j]);
+		if (end < 0) {
+			perror("ftello child shard");
+			exit(EXIT_FAILURE);
+		}
+		if (end == shard_start[j]) {
+			continue;
+		}
+
+		if (fflush(geomfile[j]) != 0) {
+			perror("fflush child shard");
+			exit(EXIT_FAILURE);
+		}
+		if (ftruncate(fileno(geomfile[j]), shard_start[j]) != 0) {
+			perror("ftruncate child shard");
+			exit(EXIT_FAILURE);
+		}
+		if (fseeko(geomfile[j], shard_start[j], SEEK_SET) != 0) {
+			perror("fseeko child shard");
+			exit(EXIT_FAILURE);
+		}
+	}
+}
+
+long long write_tile(char *geoms, std::atomic<long long> *geompos_in, char *metabase, char *stringpool, int z, unsigned tx, unsigned ty, int detail, int min_detail, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, FILE **geomfile, int minzoom, int maxzoom, double todo, std::atomic<long long> *along, long long alongminus, double gamma, int child_shards, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, std::atomic<int> *running, double simplification, std::vector<std::map<std::string, layermap_entry>> *layermaps, std::vector<std::vector<std::string>> *layer_unmaps, size_t tiling_seg, size_t pass, size_t passes, unsigned long long mingap, long long minextent, double fraction, const char *prefilter, const char *postfilter, compiled_filter *filter, write_tile_args *arg) {
 	int line_detail;
 	double merge_fraction = 1;
 	double mingap_fraction = 1;
@@ -1745,12 +2106,57 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 		}
 	}
 
+	// If only some tiles are being made, this one may only be on the way
+	// down to them, and only some of its children may need its features
+	bool skip = false;
+	std::vector<bool> *children = NULL;
+	if (arg->mask != NULL) {
+		skip = !arg->mask->write(z, tx, ty);
+
+		int span = 1 << (nextzoom - z);
+		children = &arg->scratch->children;
+		children->resize(span * span);
+		for (int xo = 0; xo < span; xo++) {
+			for (int yo = 0; yo < span; yo++) {
+				(*children)[xo * span + yo] = arg->mask->visit(nextzoom, tx * span + xo, ty * span + yo);
+			}
+		}
+
+		if (skip) {
+			prefilter = NULL;
+			postfilter = NULL;
+		}
+	}
+
 	bool has_polygons = false;
+	tile_timing timing(z, tx, ty);
+
+	// With --overzoom-complete-tiles, beyond the maxzoom that
+	// --extend-zooms-if-still-dropping started from, a tile that turns out
+	// to have everything that its children would have doesn't need them:
+	// the features that it wrote to the child shards are taken back out,
+	// and that part of the map is overzoomed from this tile.
+	// Filters are left out because they may treat the next zoom differently.
+	bool prune = additional[A_EXTEND_ZOOMS] && additional[A_OVERZOOM_COMPLETE] && z >= arg->extend_from && pass == 1 && !skip && prefilter == NULL && postfilter == NULL;
+	std::vector<off_t> &shard_start = arg->scratch->shard_start;
+	if (prune) {
+		shard_start.resize(child_shards);
+		for (int j = 0; j < child_shards; j++) {
+			shard_start[j] = ftello(geomfile[j]);
+			if (shard_start[j] < 0) {
+				perror("ftello child shard");
+				exit(EXIT_FAILURE);
+			}
+		}
+	}
+	long long carried_features = 0;  // written to the child shards
 
 	bool first_time = true;
 	// This only loops if the tile data didn't fit, in which case the detail
 	// goes down and the progress indicator goes backward for the next try.
 	for (line_detail = detail; line_detail >= min_detail || line_detail == detail; line_detail--, oprogress = 0) {
+		timing.attempts++;
+		timing.add(timing.encode);  // the rest of any previous attempt
 		long long count = 0;
 		double accum_area = 0;
 
@@ -1763,28 +2169,31 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 
 		long long original_features = 0;
 		long long unclipped_features = 0;
+		long long kept_features = 0;  // of the ones written to the child shards
 
-		std::vector<struct partial> partials;
+		std::vector<struct partial> &partials = arg->scratch->partials;
 		std::map<std::string, std::vector<coalesce>> layers;
-		std::vector<unsigned long long> indices;
-		std::vector<long long> extents;
+		std::vector<unsigned long long> &indices = arg->scratch->indices;
+		std::vector<long long> &extents = arg->scratch->extents;
 		double coalesced_area = 0;
-		drawvec shared_nodes;
-
-		std::vector<int> within(child_shards);
-		std::vector<std::atomic<long long>> geompos(child_shards);
+		drawvec &shared_nodes = arg->scratch->shared_nodes;
+		recycle_partials(arg->scratch);
+		indices.clear();
+		extents.clear();
+		shared_nodes.clear();
+
+		std::vector<int> &within = arg->scratch->within;
+		std::vector<std::atomic<long long>> &geompos = arg->scratch->geompos;
+		if (geompos.size() != (size_t) child_shards) {
+			std::vector<std::atomic<long long>>(child_shards).swap(geompos);
+		}
+		within.resize(child_shards);
 		for (size_t i = 0; i < (size_t) child_shards; i++) {
 			geompos[i] = 0;
 			within[i] = 0;
 		}
 
-		if (*geompos_in != og) {
-			if (fseek(geoms, og, SEEK_SET) != 0) {
-				perror("fseek geom");
-				exit(EXIT_FAILURE);
-			}
-			*geompos_in = og;
-		}
+		*geompos_in = og;
 
 		int prefilter_write = -1, prefilter_read = -1;
 		pid_t prefilter_pid = 0;
@@ -1793,6 +2202,8 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 		run_prefilter_args rpa;  // here so it stays in scope until joined
 		FILE *prefilter_read_fp = NULL;
 		json_pull *prefilter_jp = NULL;
+		filter_reader *prefilter_reader = NULL;
+		filter_coprocess *prefilter_coprocess = NULL;
 
 		if (z < minzoom) {
 			prefilter = NULL;
@@ -1804,11 +2215,18 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				fprintf(stderr, "Filters not supported on Windows.\n");
 				exit(EXIT_FAILURE);
 #endif
-			setup_filter(prefilter, &prefilter_write, &prefilter_read, &prefilter_pid, z, tx, ty);
-			prefilter_fp = fdopen(prefilter_write, "w");
-			if (prefilter_fp == NULL) {
-				perror("freopen prefilter");
-				exit(EXIT_FAILURE);
+			if (additional[A_PERSISTENT_FILTERS]) {
+				prefilter_coprocess = checkout_filter(prefilter);
+				prefilter_fp = prefilter_coprocess->write_fp;
+				prefilter_jp = prefilter_coprocess->jp;
+				prefilter_reader = prefilter_coprocess->reader;
+			} else {
+				setup_filter(prefilter, &prefilter_write, &prefilter_read, &prefilter_pid, z, tx, ty);
+				prefilter_fp = fdopen(prefilter_write, "w");
+				if (prefilter_fp == NULL) {
+					perror("freopen prefilter");
+					exit(EXIT_FAILURE);
+				}
 			}
 
 			rpa.geoms = geoms;
@@ -1822,6 +2240,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			rpa.initial_y = initial_y;
 			rpa.original_features = &original_features;
 			rpa.unclipped_features = &unclipped_features;
+			rpa.carried_features = &carried_features;
 			rpa.nextzoom = nextzoom;
 			rpa.maxzoom = maxzoom;
 			rpa.minzoom = minzoom;
@@ -1840,7 +2259,10 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			rpa.fname = fname;
 			rpa.child_shards = child_shards;
 			rpa.prefilter_fp = prefilter_fp;
+			rpa.persistent = prefilter_coprocess != NULL;
 			rpa.layer_unmaps = layer_unmaps;
+			rpa.timing = &timing;
+			rpa.children = children;
 			rpa.stringpool = stringpool;
 			rpa.pool_off = pool_off;
 			rpa.filter = filter;
@@ -1850,27 +2272,39 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				exit(EXIT_FAILURE);
 			}
 
-			prefilter_read_fp = fdopen(prefilter_read, "r");
-			if (prefilter_read_fp == NULL) {
-				perror("fdopen prefilter output");
-				exit(EXIT_FAILURE);
+			if (prefilter_coprocess == NULL && additional[A_BINARY_FILTERS]) {
+				prefilter_reader = new filter_reader(prefilter_read);
+			} else if (prefilter_coprocess == NULL) {
+				prefilter_read_fp = fdopen(prefilter_read, "r");
+				if (prefilter_read_fp == NULL) {
+					perror("fdopen prefilter output");
+					exit(EXIT_FAILURE);
+				}
+				prefilter_jp = json_begin_file(prefilter_read_fp);
 			}
-			prefilter_jp = json_begin_file(prefilter_read_fp);
 		}
 
+		serial_feature &sf = arg->scratch->sf;
 		while (1) {
-			serial_feature sf;
 			ssize_t which_partial = -1;
 
 			if (prefilter == NULL) {
-				sf = next_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, &within[0], &first_time, geomfile, &geompos[0], &oprogress, todo, fname, child_shards, filter, stringpool, pool_off, layer_unmaps);
+				next_feature(geoms, geompos_in, metabase, meta_off, z, tx, ty, initial_x, initial_y, &original_features, &unclipped_features, &carried_features, nextzoom, maxzoom, minzoom, max_zoom_increment, pass, passes, along, alongminus, buffer, &within[0], &first_time, geomfile, &geompos[0], &oprogress, todo, fname, child_shards, filter, stringpool, pool_off, layer_unmaps, &timing, children, sf);
 			} else {
-				sf = parse_feature(prefilter_jp, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL);
+				sf = parse_feature(prefilter_jp, prefilter_reader, z, tx, ty, layermaps, tiling_seg, layer_unmaps, postfilter != NULL, prefilter_coprocess != NULL);
+
+				if (sf.t == -1 && prefilter_coprocess != NULL) {
+					fprintf(stderr, "Prefilter exited before the end of tile %d/%u/%u\n", z, tx, ty);
+					exit(EXIT_FAILURE);
+				}
 			}
 
 			if (sf.t < 0) {
 				break;
 			}
+			if (skip) {
+				continue;
+			}
 
 			if (sf.dropped) {
 				if (find_partial(partials, sf, which_partial, layer_unmaps)) {
@@ -1951,7 +2385,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			fraction_accum += fraction;
 			if (fraction_accum < 1 && find_partial(partials, sf, which_partial, layer_unmaps)) {
 				if (additional[A_COALESCE_FRACTION_AS_NEEDED]) {
-					partials[which_partial].geoms.push_back(sf.geometry);
+					partials[which_partial].geoms.push_back(std::move(sf.geometry));
 					coalesced_area += sf.extent;
 				}
 				preserve_attributes(arg->attribute_accum, sf, stringpool, pool_off, partials[which_partial]);
@@ -1973,14 +2407,20 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			}
 
 			if (sf.geometry.size() > 0) {
+				if (!reduced && (sf.tippecanoe_maxzoom == -1 || sf.tippecanoe_maxzoom >= nextzoom)) {
+					kept_features++;
+				}
+
 				if (prevent[P_SIMPLIFY_SHARED_NODES]) {
 					for (auto &g : sf.geometry) {
 						shared_nodes.push_back(g);
 					}
 				}
 
-				partial p;
-				p.geoms.push_back(sf.geometry);
+				// Copied rather than moved, so that both sf and the partial
+				// keep the storage that they already have
+				partial &p = new_partial(arg->scratch);
+				p.geoms[0] = sf.geometry;
 				p.layer = sf.layer;
 				p.t = sf.t;
 				p.segment = sf.segment;
@@ -2001,7 +2441,6 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				p.renamed = -1;
 				p.extent = sf.extent;
 				p.clustered = 0;
-				partials.push_back(p);
 			}
 
 			merge_previndex = sf.index;
@@ -2009,14 +2448,15 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 		}
 
 		{
-			drawvec just_shared_nodes;
+			// Keep only the nodes that appear more than once, compacting in place
 			std::sort(shared_nodes.begin(), shared_nodes.end());
+			size_t shared = 0;
 
 			for (size_t i = 0; i + 1 < shared_nodes.size(); i++) {
 				if (shared_nodes[i] == shared_nodes[i + 1]) {
-					just_shared_nodes.push_back(shared_nodes[i]);
-
 					draw d = shared_nodes[i];
+					shared_nodes[shared++] = d;
+
 					i++;
 					while (i + 1 < shared_nodes.size() && shared_nodes[i + 1] == d) {
 						i++;
@@ -2024,7 +2464,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				}
 			}
 
-			shared_nodes = just_shared_nodes;
+			shared_nodes.resize(shared);
 		}
 
 		for (size_t i = 0; i < partials.size(); i++) {
@@ -2068,12 +2508,27 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 		}
 
 #if !defined(_WIN32)
-		if (prefilter != NULL) {
-			json_end(prefilter_jp);
-			if (fclose(prefilter_read_fp) != 0) {
-				perror("close output from prefilter");
+		if (prefilter_coprocess != NULL) {
+			void *ret;
+			if (pthread_join(prefilter_writer, &ret) != 0) {
+				perror("pthread_join prefilter writer");
 				exit(EXIT_FAILURE);
 			}
+			checkin_filter(prefilter_coprocess);
+		} else if (prefilter != NULL) {
+			if (prefilter_reader != NULL) {
+				delete prefilter_reader;
+				if (close(prefilter_read) != 0) {
+					perror("close output from prefilter");
+					exit(EXIT_FAILURE);
+				}
+			} else {
+				json_end(prefilter_jp);
+				if (fclose(prefilter_read_fp) != 0) {
+					perror("close output from prefilter");
+					exit(EXIT_FAILURE);
+				}
+			}
 			while (1) {
 				int stat_loc;
 				if (waitpid(prefilter_pid, &stat_loc, 0) < 0) {
@@ -2094,6 +2549,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 
 		first_time = false;
 		bool merge_successful = true;
+		timing.add(timing.deserialize);
 
 		if (additional[A_DETECT_SHARED_BORDERS] || (additional[A_MERGE_POLYGONS_AS_NEEDED] && merge_fraction < 1)) {
 			merge_successful = find_common_edges(partials, z, line_detail, simplification, maxzoom, merge_fraction);
@@ -2104,12 +2560,35 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			tasks = 1;
 		}
 
+		std::vector<size_t> &order = arg->scratch->order;
+		order.resize(partials.size());
+		std::atomic<size_t> next(0);
+		if (tasks > 1) {
+			std::vector<double> &costs = arg->scratch->costs;
+			costs.resize(partials.size());
+			for (size_t i = 0; i < partials.size(); i++) {
+				order[i] = i;
+				costs[i] = partial_cost(partials[i]);
+			}
+			std::stable_sort(order.begin(), order.end(), [&](size_t a, size_t b) {
+				return costs[a] > costs[b];
+			});
+		} else {
+			for (size_t i = 0; i < partials.size(); i++) {
+				order[i] = i;
+			}
+		}
+
+		simplify_pool pool;
+		pool.working = tasks;
+
 		std::vector<pthread_t> pthreads(tasks);
 		std::vector<partial_arg> args;
 		args.resize(tasks);
 		for (int i = 0; i < tasks; i++) {
-			args[i].task = i;
-			args[i].tasks = tasks;
+			args[i].order = &order;
+			args[i].next = &next;
+			args[i].pool = tasks > 1 ? &pool : NULL;
 			args[i].partials = &partials;
 			args[i].shared_nodes = &shared_nodes;
 
@@ -2132,6 +2611,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				}
 			}
 		}
+		timing.add(timing.simplify);
 
 		for (size_t i = 0; i < partials.size(); i++) {
 			std::vector<drawvec> &pgeoms = partials[i].geoms;
@@ -2178,7 +2658,7 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			}
 		}
 
-		partials.clear();
+		recycle_partials(arg->scratch);
 
 		int j;
 		for (j = 0; j < child_shards; j++) {
@@ -2188,16 +2668,20 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 			}
 		}
 
+		if (skip) {
+			return 0;
+		}
+
 		for (auto layer_iterator = layers.begin(); layer_iterator != layers.end(); ++layer_iterator) {
 			std::vector<coalesce> &layer_features = layer_iterator->second;
 
 			if (additional[A_REORDER]) {
-				std::sort(layer_features.begin(), layer_features.end());
+				reorder_features(layer_features);
 			}
 
 			std::vector<coalesce> out;
 			if (layer_features.size() > 0) {
-				out.push_back(layer_features[0]);
+				out.push_back(std::move(layer_features[0]));
 			}
 			for (size_t x = 1; x < layer_features.size(); x++) {
 				size_t y = out.size() - 1;
@@ -2214,18 +2698,18 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 					}
 					out[y].coalesced = true;
 				} else {
-					out.push_back(layer_features[x]);
+					out.push_back(std::move(layer_features[x]));
 				}
 			}
 
-			layer_features = out;
+			layer_features.swap(out);
 
 			out.clear();
 			for (size_t x = 0; x < layer_features.size(); x++) {
 				if (layer_features[x].coalesced && layer_features[x].type == VT_LINE) {
 					layer_features[x].geom = remove_noop(layer_features[x].geom, layer_features[x].type, 0);
 					layer_features[x].geom = simplify_lines(layer_features[x].geom, 32, 0,
-										!(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), simplification, layer_features[x].type == VT_POLYGON ? 4 : 0, shared_nodes);
+										!(prevent[P_CLIPPING] || prevent[P_DUPLICATION]), simplification, layer_features[x].type == VT_POLYGON ? 4 : 0, shared_nodes, NULL);
 				}
 
 				if (layer_features[x].type == VT_POLYGON) {
@@ -2237,16 +2721,17 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 				}
 
 				if (layer_features[x].geom.size() > 0) {
-					out.push_back(layer_features[x]);
+					out.push_back(std::move(layer_features[x]));
 				}
 			}
-			layer_features = out;
+			layer_features.swap(out);
 
 			if (prevent[P_INPUT_ORDER]) {
 				std::sort(layer_features.begin(), layer_features.end(), preservecmp);
 			}
 		}
 
+		timing.add(timing.coalesce);
 		mvt_tile tile;
 
 		for (auto layer_iterator = layers.begin(); layer_iterator != layers.end(); ++layer_iterator) {
@@ -2424,12 +2909,14 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 
 			std::string compressed;
 			std::string pbf = tile.encode();
+			timing.add(timing.encode);
 
 			if (!prevent[P_TILE_COMPRESSION]) {
 				compress(pbf, compressed);
 			} else {
 				compressed = pbf;
 			}
+			timing.add(timing.compress);
 
 			if (compressed.size() > max_tile_size && !prevent[P_KILOBYTE_LIMIT]) {
 				if (!quiet) {
@@ -2526,11 +3013,18 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 					} else if (outdir != NULL) {
 						dir_write_tile(outdir, z, tx, ty, compressed);
 					}
+					timing.size = compressed.size();
 
 					if (pthread_mutex_unlock(&db_lock) != 0) {
 						perror("pthread_mutex_unlock");
 						exit(EXIT_FAILURE);
 					}
+
+					// Complete if nothing was dropped, nothing had to be retried,
+					// and the detail was already as high as it goes
+					if (prune && timing.attempts == 1 && detail == arg->full_detail && kept_features == carried_features) {
+						discard_children(geomfile, child_shards, shard_start);
+					}
 				}
 
 				return count;
@@ -2544,6 +3038,110 @@ long long write_tile(FILE *geoms, std::atomic<long long> *geompos_in, char *meta
 	return -1;
 }
 
+void tile_mask::add(int z, unsigned x, unsigned y) {
+	roots.insert(std::make_tuple(z, x, y));
+	root_zooms.insert(z);
+
+	for (int zz = z - 1; zz >= 0; zz--) {
+		ancestors.insert(std::make_tuple(zz, x >> (z - zz), y >> (z - zz)));
+	}
+}
+
+void tile_mask::add_area(long long const *bbox, int buffer, int maxzoom) {
+	std::vector<std::pair<unsigned, unsigned>> prev, cur;
+
+	for (int z = 0; z <= maxzoom; z++) {
+		long long area = 1LL << (32 - z);
+		long long b = area * buffer / 256;
+		long long limit = (1LL << z) - 1;
+
+		cur.clear();
+
+		// Also the feature a world away, which z0 wraps around the date line
+		for (long long shift = -(1LL << 32); shift <= (1LL << 32); shift += 1LL << 32) {
+			if (bbox[2] + shift + b < 0 || bbox[0] + shift - b >= (1LL << 32)) {
+				continue;
+			}
+
+			long long x1 = std::max((bbox[0] + shift - b) / area, 0LL);
+			long long x2 = std::min((bbox[2] + shift + b) / area, limit);
+			long long y1 = std::max((bbox[1] - b) / area, 0LL);
+			long long y2 = std::min((bbox[3] + b) / area, limit);
+
+			for (long long x = x1; x <= x2; x++) {
+				for (long long y = y1; y <= y2; y++) {
+					cur.push_back(std::make_pair(x, y));
+				}
+			}
+		}
+
+		// Once the feature spans more than a few tiles, make everything below
+		// the ones it was in at the zoom level before. Some of those tiles will
+		// come out the same as they were, but that is cheaper than keeping
+		// track of every tile that a large feature covers.
+		if (cur.size() > 4 && z > 0) {
+			for (auto const &t : prev) {
+				add(z - 1, t.first, t.second);
+			}
+			return;
+		}
+
+		for (auto const &t : cur) {
+			tiles.insert(std::make_tuple(z, t.first, t.second));
+		}
+		prev.swap(cur);
+	}
+}
+
+bool tile_mask::write(int z, unsigned x, unsigned y) const {
+	if (tiles.count(std::make_tuple(z, x, y)) > 0) {
+		return true;
+	}
+
+	for (int rz : root_zooms) {
+		if (rz > z) {
+			break;
+		}
+
+		if (roots.count(std::make_tuple(rz, x >> (z - rz), y >> (z - rz))) > 0) {
+			return true;
+		}
+	}
+
+	return false;
+}
+
+bool tile_mask::visit(int z, unsigned x, unsigned y) const {
+	return ancestors.count(std::make_tuple(z, x, y)) > 0 || write(z, x, y);
+}
+
+bool tile_mask::touches(long long const *bbox, int buffer) const {
+	for (auto const &r : roots) {
+		int z = std::get<0>(r);
+		long long area = 1LL << (32 - z);
+		long long b = area * buffer / 256;
+
+		long long x1 = std::get<1>(r) * area - b;
+		long long y1 = std::get<2>(r) * area - b;
+		long long x2 = (std::get<1>(r) + 1) * area + b;
+		long long y2 = (std::get<2>(r) + 1) * area + b;
+
+		if (bbox[1] > y2 || bbox[3] < y1) {
+			continue;
+		}
+
+		// Also try the feature a world away, since z0 wraps copies of
+		// features near the date line around to the other side
+		for (long long shift = -(1LL << 32); shift <= (1LL << 32); shift += 1LL << 32) {
+			if (bbox[0] + shift <= x2 && bbox[2] + shift >= x1) {
+				return true;
+			}
+		}
+	}
+
+	return false;
+}
+
 struct task {
 	int fileno = 0;
 	struct task *next = NULL;
@@ -2566,24 +3164,26 @@ void *run_thread(void *vargs) {
 
 		// printf("%lld of geom_size\n", (long long) geom_size[j]);
 
-		FILE *geom = fdopen(arg->geomfd[j], "rb");
-		if (geom == NULL) {
+		char *geom = (char *) mmap(NULL, arg->geom_size[j], PROT_READ, MAP_PRIVATE, arg->geomfd[j], 0);
+		if (geom == MAP_FAILED) {
 			perror("mmap geom");
 			exit(EXIT_FAILURE);
 		}
+		madvise(geom, arg->geom_size[j], MADV_SEQUENTIAL);
+		madvise(geom, arg->geom_size[j], MADV_WILLNEED);
 
 		std::atomic<long long> geompos(0);
 		long long prevgeom = 0;
 
-		while (1) {
+		while (geompos < arg->geom_size[j]) {
 			int z;
 			unsigned x, y;
 
-			if (!deserialize_int_io(geom, &z, &geompos)) {
-				break;
-			}
-			deserialize_uint_io(geom, &x, &geompos);
-			deserialize_uint_io(geom, &y, &geompos);
+			char *tile = geom + geompos;
+			deserialize_int(&tile, &z);
+			deserialize_uint(&tile, &x);
+			deserialize_uint(&tile, &y);
+			geompos = tile - geom;
 
 			arg->wrote_zoom = z;
 
@@ -2628,33 +3228,52 @@ void *run_thread(void *vargs) {
 			}
 		}
 
+		madvise(geom, arg->geom_size[j], MADV_DONTNEED);
+		if (munmap(geom, arg->geom_size[j]) != 0) {
+			perror("munmap geom");
+			exit(EXIT_FAILURE);
+		}
+
+		// The second pass, if there is one, maps the same file again
 		if (arg->pass == 1) {
-			// Since the fclose() has closed the underlying file descriptor
-			arg->geomfd[j] = -1;
-		} else {
-			int newfd = dup(arg->geomfd[j]);
-			if (newfd < 0) {
-				perror("dup geometry");
-				exit(EXIT_FAILURE);
-			}
-			if (lseek(newfd, 0, SEEK_SET) < 0) {
-				perror("lseek geometry");
+			if (close(arg->geomfd[j]) != 0) {
+				perror("close geom");
 				exit(EXIT_FAILURE);
 			}
-			arg->geomfd[j] = newfd;
+			arg->geomfd[j] = -1;
 		}
+	}
+
+	arg->running--;
+	return NULL;
+}
 
-		if (fclose(geom) != 0) {
-			perror("close geom");
+// With --checkpoint, each zoom level's tiles go into an mbtiles file in a
+// transaction of their own, which is committed with a full sync before the
+// checkpoint says that the zoom level is finished. (A directory of tiles is
+// not synced, so a checkpoint into one only survives the process being
+// killed, not the system crashing.)
+static void begin_checkpointed_tiles(sqlite3 *outdb) {
+	if (outdb != NULL) {
+		char *err = NULL;
+		if (sqlite3_exec(outdb, "PRAGMA synchronous=FULL; BEGIN TRANSACTION;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "begin transaction: %s\n", err);
 			exit(EXIT_FAILURE);
 		}
 	}
+}
 
-	arg->running--;
-	return NULL;
+static void commit_checkpointed_tiles(sqlite3 *outdb) {
+	if (outdb != NULL) {
+		char *err = NULL;
+		if (sqlite3_exec(outdb, "COMMIT;", NULL, NULL, &err) != SQLITE_OK) {
+			fprintf(stderr, "commit: %s\n", err);
+			exit(EXIT_FAILURE);
+		}
+	}
 }
 
-int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, std::atomic<unsigned> *midx, std::atomic<unsigned> *midy, int &maxzoom, int minzoom, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, struct json_object *filter) {
+int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, std::atomic<unsigned> *midx, std::atomic<unsigned> *midy, int &maxzoom, int minzoom, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry>> &layermaps, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, compiled_filter *filter, std::vector<zoom_state> &zooms, tile_mask const *mask, checkpoint *ck) {
 	last_progress = 0;
 
 	// The existing layermaps are one table per input thread.
@@ -2678,16 +3297,53 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		}
 	}
 
-	int i;
-	for (i = 0; i <= maxzoom; i++) {
+	// One set for each tiling thread, kept from zoom to zoom
+	std::vector<tile_scratch> scratch;
+
+	// What maxzoom was before any zooms were added, if this is picking up
+	// from where another run left off
+	int extend_from = maxzoom;
+	if (zooms.size() > 0) {
+		extend_from = zooms.front().maxzoom;
+	}
+
+	// Any passes that are already in zooms were finished before a checkpoint
+	int i = 0;
+	size_t iteration = 0;
+	if (mask == NULL && zooms.size() > 0) {
+		i = zooms.back().z + 1;
+		iteration = zooms.size();
+	}
+
+	for (; i <= maxzoom; i++, iteration++) {
+		if (mask != NULL && iteration >= zooms.size()) {
+			break;
+		}
+
+		trace_scope zoom_trace("zoom", "phase");
+		if (tracing) {
+			zoom_trace.args = ssprintf("\"z\":%d", i);
+		}
+
 		std::atomic<long long> most(0);
 
 		std::vector<FILE*> sub(TEMP_FILES);
 		std::vector<int> subfd(TEMP_FILES);
+		if (ck != NULL) {
+			checkpoint_begin_pass(*ck, iteration + 1);
+			begin_checkpointed_tiles(outdb);
+		}
 		for (size_t j = 0; j < TEMP_FILES; j++) {
-			std::string s_geomname = ssprintf("%s/geom%zu.XXXXXXXX", tmpdir, j);
+			std::string s_geomname;
+			if (ck != NULL) {
+				// Kept, so that the next zoom level can start from them again
+				s_geomname = checkpoint_shard(*ck, iteration + 1, j);
+				subfd[j] = open(s_geomname.c_str(), O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+			} else {
+				s_geomname = ssprintf("%s/geom%zu.XXXXXXXX", tmpdir, j);
+				subfd[j] = mkstemp_cloexec(&s_geomname[0]);
+			}
 			char* geomname = &s_geomname[0];
-			subfd[j] = mkstemp_cloexec(geomname);
 			// printf("%s\n", geomname);
 			if (subfd[j] < 0) {
 				perror(geomname);
@@ -2698,7 +3354,9 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				perror(geomname);
 				exit(EXIT_FAILURE);
 			}
-			unlink(geomname);
+			if (ck == NULL) {
+				unlink(geomname);
+			}
 		}
 
 		size_t useful_threads = 0;
@@ -2735,6 +3393,15 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			threads = 1;
 		}
 
+		// Shard the same way as before when making tiles again, so that
+		// the same zoom levels are skipped on the way down to -Z
+		if (mask != NULL) {
+			threads = TEMP_FILES / zooms[iteration].child_shards;
+			if (threads < 1) {
+				threads = 1;
+			}
+		}
+
 		// Assign temporary files to threads
 
 		std::vector<struct task> tasks;
@@ -2794,8 +3461,40 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 		unsigned long long zoom_mingap = ((1LL << (32 - i)) / 256 * cluster_distance) * ((1LL << (32 - i)) / 256 * cluster_distance);
 		long long zoom_minextent = 0;
 		double zoom_fraction = 1;
+		int zoom_maxzoom = maxzoom;
+
+		// Instead of a first pass to find the dropping thresholds, use the ones
+		// that were found when the tiles were first made
+		if (mask != NULL) {
+			zoom_state const &zs = zooms[iteration];
+
+			start = 1;
+			zoom_gamma = zs.gamma;
+			zoom_mingap = zs.mingap;
+			zoom_minextent = zs.minextent;
+			zoom_fraction = zs.fraction;
+			zoom_maxzoom = zs.maxzoom;
+		}
+
+		zoom_state state;
+
+		if (scratch.size() < threads) {
+			scratch.resize(threads);
+		}
 
 		for (size_t pass = start; pass < 2; pass++) {
+			if (mask == NULL) {
+				zoom_maxzoom = maxzoom;	 // which the first pass may have raised
+			}
+			if (pass == 1) {
+				state.maxzoom = zoom_maxzoom;
+				state.child_shards = TEMP_FILES / threads;
+				state.gamma = zoom_gamma;
+				state.mingap = zoom_mingap;
+				state.minextent = zoom_minextent;
+				state.fraction = zoom_fraction;
+			}
+
 			std::vector<pthread_t> pthreads(threads);
 			std::vector<write_tile_args> args;
 			args.resize(threads);
@@ -2803,6 +3502,7 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			std::atomic<long long> along(0);
 
 			for (size_t thread = 0; thread < threads; thread++) {
+				args[thread].scratch = &scratch[thread];
 				args[thread].metabase = metabase;
 				args[thread].stringpool = stringpool;
 				args[thread].min_detail = min_detail;
@@ -2828,7 +3528,7 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				args[thread].geom_size = geom_size;
 				args[thread].midx = midx;  // locked with var_lock
 				args[thread].midy = midy;  // locked with var_lock
-				args[thread].maxzoom = maxzoom;
+				args[thread].maxzoom = zoom_maxzoom;
 				args[thread].minzoom = minzoom;
 				args[thread].full_detail = full_detail;
 				args[thread].low_detail = low_detail;
@@ -2845,6 +3545,8 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 				args[thread].attribute_accum = attribute_accum;
 				args[thread].filter = filter;
 
+				args[thread].mask = mask;
+				args[thread].extend_from = extend_from;
 				args[thread].tasks = dispatches[thread].tasks;
 				args[thread].running = &running;
 				args[thread].pass = pass;
@@ -2887,7 +3589,7 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 					i = args[thread].wrote_zoom;
 				}
 
-				if (additional[A_EXTEND_ZOOMS] && i == maxzoom && args[thread].still_dropping && maxzoom < MAX_ZOOM) {
+				if (additional[A_EXTEND_ZOOMS] && mask == NULL && i == maxzoom && args[thread].still_dropping && maxzoom < MAX_ZOOM) {
 					maxzoom++;
 				}
 			}
@@ -2916,9 +3618,28 @@ int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpo
 			geom_size[j] = geomst.st_size;
 		}
 
+		if (mask == NULL) {
+			state.z = i;
+			zooms.push_back(state);
+		}
+
+		if (ck != NULL) {
+			commit_checkpointed_tiles(outdb);
+		}
+
 		if (err != INT_MAX) {
 			return err;
 		}
+
+		if (ck != NULL) {
+			ck->maxzoom = maxzoom;
+			ck->midx = *midx;
+			ck->midy = *midy;
+			ck->shards = TEMP_FILES;
+			ck->zooms = zooms;
+			ck->layermaps = layermaps;
+			checkpoint_write(*ck);
+		}
 	}
 
 	for (size_t j = 0; j < TEMP_FILES; j++) {
@@ -6,8 +6,11 @@
 #include <vector>
 #include <atomic>
 #include <map>
+#include <set>
+#include <tuple>
 #include "mbtiles.hpp"
 #include "jsonpull/jsonpull.h"
+#include "evaluator.hpp"
 
 enum attribute_op {
 	op_sum,
@@ -21,7 +24,56 @@ enum attribute_op {
 
 long long write_tile(char **geom, char *metabase, char *stringpool, unsigned *file_bbox, int z, unsigned x, unsigned y, int detail, int min_detail, int basezoom, sqlite3 *outdb, const char *outdir, double droprate, int buffer, const char *fname, FILE **geomfile, int file_minzoom, int file_maxzoom, double todo, char *geomstart, long long along, double gamma, int nlayers);
 
-int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, std::atomic<unsigned> *midx, std::atomic<unsigned> *midy, int &maxzoom, int minzoom, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry> > &layermap, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, struct json_object *filter);
+// The dropping thresholds and sharding that one pass of traverse_zooms()
+// settled on, so that any of its tiles can be made again the same way
+struct zoom_state {
+	int z = 0;	  // of the tiles made
+	int maxzoom = 0;  // as it stood then, which --extend-zooms-if-still-dropping raises
+	size_t child_shards = 0;
+	double gamma = 0;
+	unsigned long long mingap = 0;
+	long long minextent = 0;
+	double fraction = 1;
+};
+
+// The tiles to make when only part of an existing tileset is being made again
+struct tile_mask {
+	// Each of these is made again, along with all of its descendants
+	std::set<std::tuple<int, unsigned, unsigned>> roots{};
+	std::set<int> root_zooms{};
+
+	// Individual tiles that are made again, without their descendants
+	std::set<std::tuple<int, unsigned, unsigned>> tiles{};
+
+	// The tiles above the roots, which are not written but which the
+	// features have to pass through on the way down
+	std::set<std::tuple<int, unsigned, unsigned>> ancestors{};
+
+	void add(int z, unsigned x, unsigned y);
+
+	// Add every tile that a feature with this bounding box, in world
+	// coordinates, could appear in at any zoom level
+	void add_area(long long const *bbox, int buffer, int maxzoom);
+
+	// Is this one of the tiles being made?
+	bool write(int z, unsigned x, unsigned y) const;
+
+	// Is this a tile being made, or one above them?
+	bool visit(int z, unsigned x, unsigned y) const;
+
+	// Can a feature with this bounding box, in world coordinates,
+	// appear in any of the tiles being made?
+	bool touches(long long const *bbox, int buffer) const;
+};
+
+struct checkpoint;
+
+// Make the tiles for every zoom level. Normally zooms receives the state
+// that each pass settled on, and tiling continues after any passes that
+// it already has. If mask is not NULL, only the tiles that it selects are
+// made, each pass using the state recorded in zooms instead. If ck is not
+// NULL, the state of the run is written to it after each pass.
+int traverse_zooms(int *geomfd, off_t *geom_size, char *metabase, char *stringpool, std::atomic<unsigned> *midx, std::atomic<unsigned> *midy, int &maxzoom, int minzoom, sqlite3 *outdb, const char *outdir, int buffer, const char *fname, const char *tmpdir, double gamma, int full_detail, int low_detail, int min_detail, long long *meta_off, long long *pool_off, unsigned *initial_x, unsigned *initial_y, double simplification, std::vector<std::map<std::string, layermap_entry> > &layermap, const char *prefilter, const char *postfilter, std::map<std::string, attribute_op> const *attribute_accum, compiled_filter *filter, std::vector<zoom_state> &zooms, tile_mask const *mask, checkpoint *ck);
 
 int manage_gap(unsigned long long index, unsigned long long *previndex, double scale, double gamma, double *gap);
 
@@ -0,0 +1,133 @@
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <pthread.h>
+#include <atomic>
+#include <string>
+#include "trace.hpp"
+
+// How much a thread buffers before writing its events to the trace file
+#define TRACE_BUFFER 65536
+
+bool tracing = false;
+
+static FILE *trace_fp = NULL;
+static pthread_mutex_t trace_lock = PTHREAD_MUTEX_INITIALIZER;
+static struct timespec trace_start;
+static std::atomic<int> trace_threads(0);
+
+struct trace_buffer {
+	std::string events = "";
+	int tid = 0;
+
+	trace_buffer() {
+		tid = ++trace_threads;
+	}
+
+	~trace_buffer() {
+		flush();
+	}
+
+	void flush() {
+		if (events.size() == 0 || trace_fp == NULL) {
+			return;
+		}
+
+		if (pthread_mutex_lock(&trace_lock) != 0) {
+			perror("pthread_mutex_lock");
+			exit(EXIT_FAILURE);
+		}
+
+		if (fwrite(events.c_str(), sizeof(char), events.size(), trace_fp) != events.size()) {
+			perror("Write trace");
+			exit(EXIT_FAILURE);
+		}
+
+		if (pthread_mutex_unlock(&trace_lock) != 0) {
+			perror("pthread_mutex_unlock");
+			exit(EXIT_FAILURE);
+		}
+
+		events.clear();
+	}
+};
+
+static thread_local trace_buffer buffer;
+
+void trace_open(const char *fname) {
+	trace_fp = fopen(fname, "w");
+	if (trace_fp == NULL) {
+		perror(fname);
+		exit(EXIT_FAILURE);
+	}
+
+	clock_gettime(CLOCK_MONOTONIC, &trace_start);
+	fprintf(trace_fp, "[\n");
+	tracing = true;
+}
+
+void trace_close() {
+	if (trace_fp == NULL) {
+		return;
+	}
+
+	trace_flush();
+
+	// Ends the array without a trailing comma after the last span
+	fprintf(trace_fp, "{\"name\":\"process_name\",\"ph\":\"M\",\"pid\":1,\"args\":{\"name\":\"tippecanoe\"}}\n]\n");
+	if (fclose(trace_fp) != 0) {
+		perror("Close trace");
+		exit(EXIT_FAILURE);
+	}
+
+	trace_fp = NULL;
+	tracing = false;
+}
+
+double trace_now() {
+	struct timespec now;
+	clock_gettime(CLOCK_MONOTONIC, &now);
+
+	return (now.tv_sec - trace_start.tv_sec) * 1e6 + (now.tv_nsec - trace_start.tv_nsec) / 1e3;
+}
+
+void trace_span(const char *name, const char *category, double start, std::string const &args) {
+	if (!tracing) {
+		return;
+	}
+
+	double end = trace_now();
+
+	char tmp[300];
+	snprintf(tmp, sizeof(tmp), "{\"name\":\"%s\",\"cat\":\"%s\",\"ph\":\"X\",\"ts\":%.3f,\"dur\":%.3f,\"pid\":1,\"tid\":%d", name, category, start, end - start, buffer.tid);
+	buffer.events.append(tmp);
+
+	if (args.size() != 0) {
+		buffer.events.append(",\"args\":{");
+		buffer.events.append(args);
+		buffer.events.append("}");
+	}
+	buffer.events.append("},\n");
+
+	if (buffer.events.size() >= TRACE_BUFFER) {
+		buffer.flush();
+	}
+}
+
+void trace_flush() {
+	buffer.flush();
+}
+
+trace_scope::trace_scope(const char *name_, const char *category_)
+    : name(name_), category(category_) {
+	if (tracing) {
+		start = trace_now();
+	}
+}
+
+trace_scope::~trace_scope() {
+	if (tracing) {
+		trace_span(name, category, start, args);
+	}
+}
@@ -0,0 +1,37 @@
+#ifndef TRACE_HPP
+#define TRACE_HPP
+
+#include <string>
+
+// Timings for --trace, written as a Chrome trace event file that can be
+// loaded into chrome://tracing or Perfetto. Each thread buffers its own
+// events and writes them out in batches, and if no trace file was opened
+// recording is only a check of the tracing flag.
+
+extern bool tracing;
+
+void trace_open(const char *fname);
+void trace_close();
+
+// Microseconds since the trace was opened
+double trace_now();
+
+// Record a span of time from start until now. args, if not empty, is the
+// inside of the event's JSON "args" object.
+void trace_span(const char *name, const char *category, double start, std::string const &args);
+
+// Write out the calling thread's buffered events
+void trace_flush();
+
+// A span that lasts for the lifetime of the object
+struct trace_scope {
+	const char *name;
+	const char *category;
+	double start = 0;
+	std::string args = "";
+
+	trace_scope(const char *name, const char *category);
+	~trace_scope();
+};
+
+#endif
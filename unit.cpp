@@ -1,6 +1,11 @@
 #define CATCH_CONFIG_MAIN
 #include "catch/catch.hpp"
 #include "text.hpp"
+#include "projection.hpp"
+#include "mvt.hpp"
+#include "write_json.hpp"
+#include "mbtiles.hpp"
+#include <algorithm>
 
 TEST_CASE("UTF-8 enforcement", "[utf8]") {
 	REQUIRE(check_utf8("") == std::string(""));
@@ -18,3 +23,152 @@ TEST_CASE("UTF-8 truncation", "[trunc]") {
 	REQUIRE(truncate16("0123456789😀😬😁😂😃😄😅😆", 17) == std::string("0123456789😀😬😁"));
 	REQUIRE(truncate16("0123456789あいうえおかきくけこさ", 16) == std::string("0123456789あいうえおか"));
 }
+
+TEST_CASE("Spatial index encoding", "[index]") {
+	unsigned long long seed = 1;
+	for (size_t i = 0; i < 10000; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		unsigned x = seed >> 32;
+		unsigned y = seed;
+
+		REQUIRE(encode_hilbert(x, y) == hilbert_xy2d(1LL << 32, x, y));
+
+		unsigned long long q = encode_quadkey(x, y);
+		unsigned long long expected = 0;
+		for (size_t b = 0; b < 32; b++) {
+			expected |= (unsigned long long) ((x >> b) & 1) << (2 * b + 1);
+			expected |= (unsigned long long) ((y >> b) & 1) << (2 * b);
+		}
+		REQUIRE(q == expected);
+
+		unsigned wx, wy;
+		decode_quadkey(q, &wx, &wy);
+		REQUIRE(wx == x);
+		REQUIRE(wy == y);
+
+		set_index_encoding(false);
+		REQUIRE(encode_index(x, y) == q);
+		decode_index(q, &wx, &wy);
+		REQUIRE(wx == x);
+		REQUIRE(wy == y);
+	}
+}
+
+TEST_CASE("Layer constant interning", "[tag]") {
+	mvt_layer layer;
+
+	for (size_t i = 0; i < 1000; i++) {
+		REQUIRE(layer.tag_key(std::to_string(i)) == i);
+	}
+	for (size_t i = 0; i < 1000; i++) {
+		REQUIRE(layer.tag_key(std::to_string(i)) == i);
+	}
+	REQUIRE(layer.keys.size() == 1000);
+
+	mvt_value s;
+	s.type = mvt_string;
+	s.string_value = "1";
+	mvt_value d;
+	d.type = mvt_double;
+	d.numeric_value.double_value = 1;
+	mvt_value zero;
+	zero.type = mvt_double;
+	zero.numeric_value.double_value = 0;
+	mvt_value negzero = zero;
+	negzero.numeric_value.double_value = -0.0;
+
+	REQUIRE(layer.tag_value(s) == 0);
+	REQUIRE(layer.tag_value(d) == 1);
+	REQUIRE(layer.tag_value(zero) == 2);
+	REQUIRE(layer.tag_value(negzero) == 2);
+	REQUIRE(layer.tag_value(s) == 0);
+
+	// Tiles that repeat a constant refer to its first copy, as with a map
+	mvt_layer decoded;
+	decoded.keys = {"a", "b", "a"};
+	decoded.values = {d, s, d};
+	decoded.index_constants();
+	REQUIRE(decoded.tag_key("a") == 0);
+	REQUIRE(decoded.tag_key("c") == 3);
+	REQUIRE(decoded.tag_value(d) == 0);
+	REQUIRE(decoded.tag_value(zero) == 3);
+}
+
+TEST_CASE("JSON number formatting", "[json]") {
+	std::vector<double> ds = {0, -0.0, 0.0078125, -0.0078125, 0.0000005, 1e-7, -1e-7, 179.9999995, 1e11, 1e13, -1e13, 1.0 / 3};
+	unsigned long long seed = 1;
+	for (size_t i = 0; i < 100000; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+		ds.push_back(((long long) seed >> 11) / (double) (1LL << (seed % 64)));
+		ds.push_back((seed % 400000000) / 1000000.0 - 200 + (seed % 3) * 0.0000005);
+	}
+
+	for (double d : ds) {
+		std::string out;
+		{
+			json_writer state(&out);
+			state.json_write_float(d);
+		}
+
+		char tmp[400];
+		snprintf(tmp, sizeof(tmp), "%f", d);
+		REQUIRE(out == tmp);
+	}
+
+	std::string out;
+	{
+		json_writer state(&out);
+		state.json_write_array();
+		state.json_write_signed(-9223372036854775807LL - 1);
+		state.json_write_unsigned(18446744073709551615ULL);
+		state.json_write_string("a\"b\\c\x01\x1f" "d");
+		state.json_end_array();
+	}
+	REQUIRE(out == "[ -9223372036854775808, 18446744073709551615, \"a\\\"b\\\\c\\u0001\\u001fd\" ]");
+}
+
+TEST_CASE("Tilestats sample values", "[tilestats]") {
+	size_t saved = max_tilestats_sample_values;
+	max_tilestats_sample_values = 50;
+
+	std::vector<std::map<std::string, layermap_entry>> maps(4);
+	std::vector<type_and_string> all;
+	unsigned long long seed = 1;
+	for (size_t i = 0; i < 20000; i++) {
+		seed = seed * 6364136223846793005ULL + 1442695040888963407ULL;
+
+		type_and_string val;
+		val.type = (seed >> 20) % 2 == 0 ? mvt_string : mvt_double;
+		val.string = std::to_string((seed >> 32) % (i + 10));
+		all.push_back(val);
+
+		std::map<std::string, layermap_entry> &lm = maps[i % maps.size()];
+		if (lm.count("layer") == 0) {
+			lm.insert(std::pair<std::string, layermap_entry>("layer", layermap_entry(0)));
+		}
+		auto fk = lm.find("layer");
+		fk->second.points++;
+		add_to_file_keys(fk->second.file_keys, "attr", val);
+	}
+
+	std::sort(all.begin(), all.end());
+	std::vector<type_and_string> expect;
+	for (auto const &val : all) {
+		if (expect.size() < max_tilestats_sample_values && (expect.size() == 0 || expect.back() != val)) {
+			expect.push_back(val);
+		}
+	}
+
+	std::map<std::string, layermap_entry> merged = merge_layermaps(maps);
+	type_and_string_stats const &stats = merged.find("layer")->second.file_keys.find("attr")->second;
+
+	REQUIRE(stats.pending.size() == 0);
+	REQUIRE(stats.sample_values.size() == expect.size());
+	for (size_t i = 0; i < expect.size(); i++) {
+		REQUIRE(!(stats.sample_values[i] != expect[i]));
+	}
+	REQUIRE(stats.type == ((1 << mvt_string) | (1 << mvt_double)));
+	REQUIRE(stats.min == 0);
+
+	max_tilestats_sample_values = saved;
+}
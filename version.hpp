@@ -1,6 +1,6 @@
 #ifndef VERSION_HPP
 #define VERSION_HPP
 
-#define VERSION "v1.35.0"
+#define VERSION "v1.35.25"
 
 #endif
@@ -6,9 +6,12 @@
 #include <stdio.h>
 #include <stdlib.h>
 #include <string.h>
+#include <math.h>
+#include <cmath>
 #include <vector>
 #include <map>
 #include <string>
+#include <atomic>
 #include "projection.hpp"
 #include "geometry.hpp"
 #include "mvt.hpp"
@@ -132,41 +135,146 @@ void json_writer::json_write_string(std::string const &str) {
 	json_adjust();
 
 	addc('"');
-	for (size_t i = 0; i < str.size(); i++) {
-		if (str[i] == '\\' || str[i] == '"') {
-			aprintf("\\%c", str[i]);
-		} else if ((unsigned char) str[i] < ' ') {
-			aprintf("\\u%04x", str[i]);
-		} else {
-			addc(str[i]);
+
+	// Copy runs of characters that don't need escaping all at once
+	const char *cp = str.c_str();
+	size_t len = str.size();
+	size_t start = 0;
+	for (size_t i = 0; i < len; i++) {
+		unsigned char ch = cp[i];
+		if (ch == '\\' || ch == '"' || ch < ' ') {
+			addn(cp + start, i - start);
+			if (ch < ' ') {
+				static const char hex[] = "0123456789abcdef";
+				char tmp[6] = {'\\', 'u', '0', '0', hex[ch >> 4], hex[ch & 0xF]};
+				addn(tmp, 6);
+			} else {
+				char tmp[2] = {'\\', (char) ch};
+				addn(tmp, 2);
+			}
+			start = i + 1;
 		}
 	}
+	addn(cp + start, len - start);
+
 	addc('"');
 }
 
 void json_writer::json_write_number(double d) {
 	json_adjust();
 
-	adds(milo::dtoa_milo(d).c_str());
+	adds(milo::dtoa_milo(d));
+}
+
+// The same as printf("%f", d), but without going through printf for
+// the ordinary case, where d * 1000000 fits easily in 64 bits.
+// The value is exactly m * 2^e, so d * 1000000 is m * 1000000 * 2^e,
+// which is computed exactly and then rounded half to even, as printf does.
+static bool format_fixed6(double d, char *out, size_t *outlen) {
+	if (!(d > -1e12 && d < 1e12)) {
+		return false;  // including NaN
+	}
+
+	bool neg = std::signbit(d);
+	if (neg) {
+		d = -d;
+	}
+
+	int exp;
+	double frac = frexp(d, &exp);
+	unsigned long long mant = (unsigned long long) ldexp(frac, 53);	 // d == mant * 2^(exp - 53)
+	int shift = 53 - exp;
+
+	// Since d < 2^40, shift is at least 13
+	unsigned long long scaled;
+	if (d == 0 || shift >= 128) {
+		scaled = 0;
+	} else {
+		unsigned __int128 product = (unsigned __int128) mant * 1000000ULL;
+		unsigned __int128 whole = product >> shift;
+		unsigned __int128 rest = product - (whole << shift);
+		unsigned __int128 half = (unsigned __int128) 1 << (shift - 1);
+
+		if (rest > half || (rest == half && (whole & 1) != 0)) {
+			whole++;
+		}
+		scaled = (unsigned long long) whole;
+	}
+
+	char digits[32];
+	size_t n = 0;
+	unsigned long long ipart = scaled / 1000000;
+	unsigned long long fpart = scaled % 1000000;
+
+	do {
+		digits[n++] = '0' + ipart % 10;
+		ipart /= 10;
+	} while (ipart != 0);
+
+	size_t o = 0;
+	if (neg) {
+		out[o++] = '-';
+	}
+	while (n > 0) {
+		out[o++] = digits[--n];
+	}
+	out[o++] = '.';
+	for (int i = 5; i >= 0; i--) {
+		out[o + i] = '0' + fpart % 10;
+		fpart /= 10;
+	}
+	o += 6;
+
+	*outlen = o;
+	return true;
 }
 
 // Just to avoid json_writer:: changing expected output format
 void json_writer::json_write_float(double d) {
 	json_adjust();
 
-	aprintf("%f", d);
+	char tmp[48];
+	size_t len;
+	if (format_fixed6(d, tmp, &len)) {
+		addn(tmp, len);
+	} else {
+		aprintf("%f", d);
+	}
+}
+
+static size_t format_unsigned(unsigned long long v, char *out) {
+	char digits[24];
+	size_t n = 0;
+
+	do {
+		digits[n++] = '0' + v % 10;
+		v /= 10;
+	} while (v != 0);
+
+	size_t o = 0;
+	while (n > 0) {
+		out[o++] = digits[--n];
+	}
+	return o;
 }
 
 void json_writer::json_write_unsigned(unsigned long long v) {
 	json_adjust();
 
-	aprintf("%llu", v);
+	char tmp[24];
+	addn(tmp, format_unsigned(v, tmp));
 }
 
 void json_writer::json_write_signed(long long v) {
 	json_adjust();
 
-	aprintf("%lld", v);
+	char tmp[24];
+	if (v < 0) {
+		tmp[0] = '-';
+		addn(tmp, 1 + format_unsigned(-(unsigned long long) v, tmp + 1));
+	} else {
+		addn(tmp, format_unsigned(v, tmp));
+	}
 }
 
 void json_writer::json_write_stringified(std::string const &str) {
@@ -200,6 +308,20 @@ void json_writer::json_comma_newline() {
 	wantnl = true;
 }
 
+json_write_state json_writer::json_save() const {
+	json_write_state st;
+	st.state = state;
+	st.nospace = nospace;
+	st.wantnl = wantnl;
+	return st;
+}
+
+void json_writer::json_restore(json_write_state const &st) {
+	state = st.state;
+	nospace = st.nospace;
+	wantnl = st.wantnl;
+}
+
 void json_writer::aprintf(const char *format, ...) {
 	va_list ap;
 	char *tmp;
@@ -223,14 +345,23 @@ void json_writer::addc(char c) {
 	}
 }
 
-void json_writer::adds(std::string const &str) {
+void json_writer::addn(const char *str, size_t len) {
 	if (f != NULL) {
-		fputs(str.c_str(), f);
+		fwrite(str, sizeof(char), len, f);
 	} else if (s != NULL) {
-		s->append(str);
+		s->append(str, len);
 	}
 }
 
+void json_writer::adds(std::string const &str) {
+	addn(str.c_str(), str.size());
+}
+
+void json_writer::json_splice(std::string const &str, json_write_state const &after) {
+	adds(str);
+	json_restore(after);
+}
+
 struct lonlat {
 	int op;
 	double lon;
@@ -248,6 +379,9 @@ struct lonlat {
 };
 
 void layer_to_geojson(mvt_layer const &layer, unsigned z, unsigned x, unsigned y, bool comma, bool name, bool zoom, bool dropped, unsigned long long index, long long sequence, long long extent, bool complain, json_writer &state) {
+	std::vector<long long> wxs, wys;
+	std::vector<double> lons, lats;
+
 	for (size_t f = 0; f < layer.features.size(); f++) {
 		mvt_feature const &feat = layer.features[f];
 
@@ -353,20 +487,30 @@ void layer_to_geojson(mvt_layer const &layer, unsigned z, unsigned x, unsigned y
 
 		std::vector<lonlat> ops;
 
+		// Gather the world coordinates, to unproject them all at once
+		wxs.clear();
+		wys.clear();
 		for (size_t g = 0; g < feat.geometry.size(); g++) {
 			int op = feat.geometry[g].op;
-			long long px = feat.geometry[g].x;
-			long long py = feat.geometry[g].y;
 
 			if (op == VT_MOVETO || op == VT_LINETO) {
 				long long scale = 1LL << (32 - z);
-				long long wx = scale * x + (scale / layer.extent) * px;
-				long long wy = scale * y + (scale / layer.extent) * py;
+				wxs.push_back(scale * x + (scale / layer.extent) * feat.geometry[g].x);
+				wys.push_back(scale * y + (scale / layer.extent) * feat.geometry[g].y);
+			}
+		}
 
-				double lat, lon;
-				projection->unproject(wx, wy, 32, &lon, &lat);
+		lons.resize(wxs.size());
+		lats.resize(wys.size());
+		unproject_points(wxs.data(), wys.data(), wxs.size(), 32, lons.data(), lats.data());
 
-				ops.push_back(lonlat(op, lon, lat, px, py));
+		size_t p = 0;
+		for (size_t g = 0; g < feat.geometry.size(); g++) {
+			int op = feat.geometry[g].op;
+
+			if (op == VT_MOVETO || op == VT_LINETO) {
+				ops.push_back(lonlat(op, lons[p], lats[p], feat.geometry[g].x, feat.geometry[g].y));
+				p++;
 			} else {
 				ops.push_back(lonlat(op, 0, 0, 0, 0));
 			}
@@ -483,15 +627,13 @@ void layer_to_geojson(mvt_layer const &layer, unsigned z, unsigned x, unsigned y
 
 				if (i + 1 >= ops.size() || ops[i + 1].op == VT_MOVETO) {
 					if (ops[i].op != VT_CLOSEPATH) {
-						static bool warned = false;
+						static std::atomic<bool> warned(false);
 
-						if (!warned) {
+						if (!warned.exchange(true)) {
 							fprintf(stderr, "Ring does not end with closepath (ends with %d)\n", ops[i].op);
 							if (complain) {
 								exit(EXIT_FAILURE);
 							}
-
-							warned = true;
 						}
 					}
 				}
@@ -537,15 +679,13 @@ void layer_to_geojson(mvt_layer const &layer, unsigned z, unsigned x, unsigned y
 			int sstate = 0;
 			for (size_t i = 0; i < rings.size(); i++) {
 				if (i == 0 && areas[i] < 0) {
-					static bool warned = false;
+					static std::atomic<bool> warned(false);
 
-					if (!warned) {
+					if (!warned.exchange(true)) {
 						fprintf(stderr, "Polygon begins with an inner ring\n");
 						if (complain) {
 							exit(EXIT_FAILURE);
 						}
-
-						warned = true;
 					}
 				}
 
@@ -14,6 +14,18 @@ enum json_write_tok {
 	JSON_WRITE_TOP,
 };
 
+// Where a json_writer is in its output, so that a piece of it can be
+// formatted ahead of time into a buffer and then spliced into place
+struct json_write_state {
+	std::vector<json_write_tok> state{};
+	bool nospace = false;
+	bool wantnl = false;
+
+	bool operator==(json_write_state const &o) const {
+		return state == o.state && nospace == o.nospace && wantnl == o.wantnl;
+	}
+};
+
 struct json_writer {
 	std::vector<json_write_tok> state;
 	bool nospace = false;
@@ -53,10 +65,18 @@ struct json_writer {
 	void json_write_newline();
 	void json_comma_newline();
 
+	json_write_state json_save() const;
+	void json_restore(json_write_state const &st);
+
+	// Append JSON that was formatted starting from this writer's state,
+	// and continue from where that left off
+	void json_splice(std::string const &str, json_write_state const &after);
+
        private:
 	void json_adjust();
 	void aprintf(const char *format, ...);
 	void addc(char c);
+	void addn(const char *str, size_t len);
 	void adds(std::string const &s);
 };
 